@@ -41,8 +41,10 @@ typedef unsigned short INODE_REFERENCE;
 // Value used as an index when it does not refer to a block
 #define UNALLOCATED_BLOCK USHRT_MAX
 
-// Number of inode blocks on the virtual disk
+// Number of inode blocks on the virtual disk (see BLOCK_SIZE in vdisk.h)
+#ifndef N_INODE_BLOCKS
 #define N_INODE_BLOCKS 8
+#endif
 
 // The block on the virtual disk containing the root directory
 #define ROOT_DIRECTORY_BLOCK (N_INODE_BLOCKS + 1)
@@ -110,8 +112,35 @@ typedef struct master_block_s
   // 8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
   // Block 0 (the master block) is byte 0, bit 0
   unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
+
+  // Number of blocks in use by this disk (see zresize); blocks past it are
+  // marked allocated.  0 (disks formatted before zresize) means N_BLOCKS_IN_DISK
+  BLOCK_REFERENCE n_blocks;
+
+  // Number of inodes in use by this disk, which grows and shrinks with it;
+  // inodes past it are marked allocated.  0 means N_INODES
+  INODE_REFERENCE n_inodes;
 } MASTER_BLOCK;
 
+// Geometry a disk was formatted with.  It is kept in the last bytes of the
+// master block, clear of the bitmaps however large the disk, so any build
+// with the same block size finds it and one with another block size reads
+// bitmap or inode bytes there (see oufs_check_geometry()).  Disks formatted
+// before it was recorded have zeros there.
+#define OUFS_GEOMETRY_OFFSET (BLOCK_SIZE - sizeof(OUFS_GEOMETRY))
+#define OUFS_GEOMETRY_MAGIC 0x554f
+
+typedef struct oufs_geometry_s
+{
+  // OUFS_GEOMETRY_MAGIC
+  unsigned short magic;
+  unsigned short block_size;
+  unsigned short disk_blocks;
+  unsigned short inode_blocks;
+} OUFS_GEOMETRY;
+
+#define OUFS_MASTER_GEOMETRY(master) ((OUFS_GEOMETRY *) ((unsigned char *) (master) + OUFS_GEOMETRY_OFFSET))
+
 /**********************************************************************/
 // Single directory element
 typedef struct directory_entry_s
@@ -145,6 +174,21 @@ typedef union block_u
   DIRECTORY_BLOCK directory;
 } BLOCK;
 
+/**********************************************************************/
+// Layout checks: a geometry chosen at build time must still pack every
+// block type into a block
+_Static_assert(sizeof(BLOCK) == BLOCK_SIZE, "a block type does not fit in BLOCK_SIZE");
+_Static_assert(BLOCK_SIZE % sizeof(DIRECTORY_ENTRY) == 0, "directory entries must fill a block");
+_Static_assert(DIRECTORY_ENTRIES_PER_BLOCK >= 2, "a directory block must hold . and ..");
+_Static_assert(INODES_PER_BLOCK >= 1, "a block must hold an inode");
+_Static_assert(N_INODES % 8 == 0, "the inode table must fill whole bytes of its bitmap");
+_Static_assert(N_BLOCKS_IN_DISK % 8 == 0, "the disk must fill whole bytes of the block bitmap");
+_Static_assert(ROOT_DIRECTORY_BLOCK < N_BLOCKS_IN_DISK, "no room for the root directory");
+_Static_assert(sizeof(MASTER_BLOCK) <= OUFS_GEOMETRY_OFFSET, "the bitmaps overlap the geometry record");
+_Static_assert(OUFS_GEOMETRY_OFFSET + sizeof(OUFS_GEOMETRY) <= BLOCK_SIZE, "no room for the geometry record");
+_Static_assert(N_INODES < UNALLOCATED_INODE, "too many inodes for an INODE_REFERENCE");
+_Static_assert(N_BLOCKS_IN_DISK < UNALLOCATED_BLOCK, "too many blocks for a BLOCK_REFERENCE");
+
 
 /**********************************************************************/
 // Representing files (project 4!)
@@ -154,6 +198,16 @@ typedef struct oufile_s
   INODE_REFERENCE inode_reference;
   char mode;
   int offset;
+
+  // Delayed allocation (oufs_file.c): the whole file is held here while it
+  // is open for writing, and only gets blocks when it is flushed
+  unsigned char *buffer;
+  // Length of the file including unflushed data
+  int size;
+  // Bytes before this offset are already on the disk
+  int flushed;
+  // The on-disk copy is out of date
+  int dirty;
 } OUFILE;
 
 
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include "oufs_lib.h"
+
+/*
+ * Block group allocator.
+ *
+ * The disk is split into N_BLOCK_GROUPS groups.  Each group owns a slice
+ * of the block allocation table and a range of inodes.  Its free counters
+ * are counted from its slice of the master block when needed: the tables
+ * are a few bytes long, and a second copy of the counts would be one more
+ * thing to keep consistent.
+ *
+ * A file's inode and blocks are taken from its parent directory's group.
+ * A new directory stays in its parent's group while that group has room
+ * for its children; otherwise it goes to the emptiest group, so that
+ * directories spread across the disk as it fills.
+ */
+
+#define debug 0
+
+_Static_assert(BLOCKS_PER_GROUP % 8 == 0, "a group must own whole bytes of the block table");
+_Static_assert(BLOCKS_PER_GROUP * N_BLOCK_GROUPS == N_BLOCKS_IN_DISK, "groups must cover the disk");
+
+/**
+ * Describe a block group
+ *
+ * @param master The master block
+ * @param g Group number
+ * @param group Filled in with the group's ranges and free counters
+ */
+void oufs_block_group(MASTER_BLOCK *master, int g, OUFS_BLOCK_GROUP *group)
+{
+  group->first_block = g * BLOCKS_PER_GROUP;
+  group->first_inode = g * INODES_PER_GROUP;
+  group->n_inodes = (g == N_BLOCK_GROUPS - 1) ? N_INODES - group->first_inode : INODES_PER_GROUP;
+
+  group->free_blocks = 0;
+  for(int i = group->first_block / 8; i < (group->first_block + BLOCKS_PER_GROUP) / 8; ++i)
+    group->free_blocks += 8 - __builtin_popcount(master->block_allocated_flag[i]);
+
+  group->free_inodes = 0;
+  for(int i = group->first_inode; i < group->first_inode + group->n_inodes; ++i)
+    group->free_inodes += !(master->inode_allocated_flag[i >> 3] & (1 << (i & 7)));
+}
+
+/**
+ * Block group holding an inode
+ */
+int oufs_inode_group(INODE_REFERENCE i)
+{
+  int g = i / INODES_PER_GROUP;
+  return(g < N_BLOCK_GROUPS ? g : N_BLOCK_GROUPS - 1);
+}
+
+/**
+ * Choose the group for a new inode
+ *
+ * @return The group number; -1 if no inode is free
+ */
+static int oufs_choose_group(MASTER_BLOCK *master, INODE_REFERENCE parent, char type)
+{
+  OUFS_BLOCK_GROUP groups[N_BLOCK_GROUPS];
+  int total_free_inodes = 0;
+  for(int g = 0; g < N_BLOCK_GROUPS; ++g){
+    oufs_block_group(master, g, &groups[g]);
+    total_free_inodes += groups[g].free_inodes;
+  }
+  if(total_free_inodes == 0)
+    return(-1);
+
+  int home = oufs_inode_group(parent);
+  OUFS_BLOCK_GROUP *h = &groups[home];
+  if(type == IT_DIRECTORY){
+    // Room for the directory's children: keep it near its parent
+    if(h->free_inodes >= h->n_inodes / 2 && h->free_blocks >= BLOCKS_PER_GROUP / 2)
+      return(home);
+
+    // Otherwise the group with the most free blocks, among those with at
+    // least an average share of free inodes
+    int best = -1;
+    for(int g = 0; g < N_BLOCK_GROUPS; ++g){
+      if(groups[g].free_inodes == 0 || groups[g].free_inodes * N_BLOCK_GROUPS < total_free_inodes)
+        continue;
+      if(best < 0 || groups[g].free_blocks > groups[best].free_blocks)
+        best = g;
+    }
+    if(best >= 0)
+      return(best);
+  }
+
+  // Files (and directories when nothing stands out): the parent's group,
+  // then the following ones
+  for(int n = 0; n < N_BLOCK_GROUPS; ++n){
+    int g = (home + n) % N_BLOCK_GROUPS;
+    if(groups[g].free_inodes > 0 && groups[g].free_blocks > 0)
+      return(g);
+  }
+  for(int g = 0; g < N_BLOCK_GROUPS; ++g){
+    if(groups[g].free_inodes > 0)
+      return(g);
+  }
+  return(-1);
+}
+
+/**
+ * Allocate an inode for a new file or directory, and set its bit in the
+ * inode allocation table
+ *
+ * @param master The master block (the caller writes it back)
+ * @param parent Directory the new inode will be entered in
+ * @param type IT_DIRECTORY or IT_FILE
+ * @return The inode reference; UNALLOCATED_INODE if none is free
+ */
+INODE_REFERENCE oufs_allocate_inode_near(MASTER_BLOCK *master, INODE_REFERENCE parent, char type)
+{
+  int g = oufs_choose_group(master, parent, type);
+  if(g < 0)
+    return(UNALLOCATED_INODE);
+
+  OUFS_BLOCK_GROUP group;
+  oufs_block_group(master, g, &group);
+  for(int i = group.first_inode; i < group.first_inode + group.n_inodes; ++i){
+    if(!(master->inode_allocated_flag[i >> 3] & (1 << (i & 7)))){
+      master->inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+      if(debug)
+        fprintf(stderr, "Allocating inode=%d (group %d)\n", i, g);
+      return(i);
+    }
+  }
+  return(UNALLOCATED_INODE);
+}
+
+/**
+ * Allocate a run of consecutive blocks for an inode, and set their bits
+ * in the block allocation table.  The run is taken from the inode's group
+ * if possible, otherwise from the groups after it.
+ *
+ * @param master The master block (the caller writes it back)
+ * @param owner Inode the blocks are for
+ * @param count Number of blocks (at least 1)
+ * @return The first block of the run; UNALLOCATED_BLOCK if no run is long enough
+ */
+BLOCK_REFERENCE oufs_allocate_blocks_near(MASTER_BLOCK *master, INODE_REFERENCE owner, int count)
+{
+  int home = oufs_inode_group(owner);
+  for(int n = 0; n < N_BLOCK_GROUPS; ++n){
+    int first_block = ((home + n) % N_BLOCK_GROUPS) * BLOCKS_PER_GROUP;
+    // A run must start inside this group but may continue into the next
+    int start = -1;
+    for(int b = first_block > ROOT_DIRECTORY_BLOCK ? first_block : ROOT_DIRECTORY_BLOCK; b < N_BLOCKS_IN_DISK; ++b){
+      if(master->block_allocated_flag[b >> 3] & (1 << (b & 7))){
+        start = -1;
+        continue;
+      }
+      if(start < 0){
+        if(b >= first_block + BLOCKS_PER_GROUP)
+          break;
+        start = b;
+      }
+      if(b - start + 1 < count)
+        continue;
+
+      for(int r = start; r <= b; ++r)
+        master->block_allocated_flag[r >> 3] |= (1 << (r & 7));
+      if(debug)
+        fprintf(stderr, "Allocating blocks=%d-%d for inode %d\n", start, b, owner);
+      return(start);
+    }
+  }
+  return(UNALLOCATED_BLOCK);
+}
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib.h"
+
+/*
+ * Files, with delayed allocation.
+ *
+ * A file opened for writing is held in memory: writes only copy bytes into
+ * its buffer.  Blocks are chosen when the file is flushed (by oufs_fflush()
+ * or oufs_fclose()), once its final length is known, so the whole file gets
+ * one contiguous run however small the writes were.  The flush updates the
+ * allocation table once and commits data, inode and master block in one
+ * transaction.
+ *
+ * Several threads may use different OUFILEs at once (see oufs_lock.c for
+ * the locks); one OUFILE belongs to one thread at a time.
+ */
+
+#define debug 0
+
+// Largest file: every block of an inode
+#define MAX_FILE_SIZE (BLOCKS_PER_INODE * BLOCK_SIZE)
+
+/**
+ * Add an empty file to a directory locked by the caller
+ *
+ * @param parent Directory to create it in
+ * @param name Name of the file
+ * @return The new inode reference; UNALLOCATED_INODE on error
+ */
+static INODE_REFERENCE oufs_add_file(INODE_REFERENCE parent, char *name)
+{
+  INODE parentInode;
+  oufs_read_inode_by_reference(parent, &parentInode);
+  if(parentInode.type != IT_DIRECTORY){
+    fprintf(stderr, "ERROR: parent does not exist\n");
+    return(UNALLOCATED_INODE);
+  }
+
+  BLOCK_REFERENCE entryBlockReference;
+  int entry;
+  if(oufs_find_free_directory_entry(parent, &entryBlockReference, &entry) != 0){
+    fprintf(stderr, "ERROR: Block full\n");
+    return(UNALLOCATED_INODE);
+  }
+
+  if(vdisk_begin_transaction() != 0)
+    return(UNALLOCATED_INODE);
+  oufs_lock_block(MASTER_BLOCK_REFERENCE);
+  BLOCK masterBlock;
+  vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  INODE_REFERENCE i = oufs_allocate_inode_near(&masterBlock.master, parent, IT_FILE);
+  if(i != UNALLOCATED_INODE)
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  oufs_unlock_block(MASTER_BLOCK_REFERENCE);
+  if(i == UNALLOCATED_INODE){
+    vdisk_abort_transaction();
+    fprintf(stderr, "ERROR: no free inodes\n");
+    return(UNALLOCATED_INODE);
+  }
+
+  //No blocks until the first flush
+  INODE inode;
+  inode.type = IT_FILE;
+  inode.n_references = 1;
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+    inode.data[k] = UNALLOCATED_BLOCK;
+  inode.size = 0;
+  oufs_write_inode_by_reference(i, &inode);
+
+  BLOCK block;
+  vdisk_read_block(entryBlockReference, &block);
+  memset(block.directory.entry[entry].name, 0, FILE_NAME_SIZE);
+  memcpy(block.directory.entry[entry].name, name, MIN(strlen(name), FILE_NAME_SIZE));
+  block.directory.entry[entry].inode_reference = i;
+  vdisk_write_block(entryBlockReference, &block);
+
+  ++parentInode.size;
+  oufs_write_inode_by_reference(parent, &parentInode);
+
+  if(vdisk_commit_transaction() != 0)
+    return(UNALLOCATED_INODE);
+  return(i);
+}
+
+/**
+ * Create an empty file, unless another thread has just created it
+ *
+ * @param parent Directory to create it in
+ * @param name Name of the file
+ * @return The file's inode reference; UNALLOCATED_INODE on error
+ */
+static INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *name)
+{
+  oufs_lock_inode(parent, 1);
+  INODE_REFERENCE i = oufs_find_directory_entry(parent, name, NULL, NULL);
+  if(i == UNALLOCATED_INODE)
+    i = oufs_add_file(parent, name);
+  oufs_unlock_inode(parent);
+  return(i);
+}
+
+/**
+ * Open a file
+ *
+ * @param cwd Current working directory
+ * @param path Path of the file
+ * @param mode "r" (read), "w" (create or truncate) or "a" (create or append)
+ * @return The open file; NULL on error
+ */
+static OUFILE* oufs_fopen_untraced(char *cwd, char *path, char *mode);
+
+OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
+{
+  int outer = oufs_trace_begin(OUFS_OP_FOPEN);
+  OUFILE* ret = oufs_fopen_untraced(cwd, path, mode);
+  oufs_trace_end(outer);
+  return(ret);
+}
+
+static OUFILE* oufs_fopen_untraced(char *cwd, char *path, char *mode)
+{
+  if(mode == NULL || (mode[0] != 'r' && mode[0] != 'w' && mode[0] != 'a')){
+    fprintf(stderr, "ERROR: bad mode\n");
+    return(NULL);
+  }
+
+  INODE_REFERENCE parent, child;
+  char name[FILE_NAME_SIZE + 1];
+  if(oufs_find_file(cwd, path, &parent, &child, name) != 0 || name[0] == 0){
+    fprintf(stderr, "ERROR: parent does not exist\n");
+    return(NULL);
+  }
+
+  if(child == UNALLOCATED_INODE){
+    if(mode[0] == 'r'){
+      fprintf(stderr, "ERROR: file does not exist\n");
+      return(NULL);
+    }
+    if(strlen(name) >= FILE_NAME_SIZE){
+      fprintf(stderr, "ERROR: Name too long\n");
+      return(NULL);
+    }
+    child = oufs_create_file(parent, name);
+    if(child == UNALLOCATED_INODE)
+      return(NULL);
+  }
+
+  INODE inode;
+  oufs_read_inode_by_reference(child, &inode);
+  if(inode.type != IT_FILE){
+    fprintf(stderr, "ERROR: not a file\n");
+    return(NULL);
+  }
+
+  OUFILE *fp = malloc(sizeof(OUFILE));
+  if(fp == NULL)
+    return(NULL);
+  fp->inode_reference = child;
+  fp->mode = mode[0];
+  fp->offset = 0;
+  fp->buffer = NULL;
+  fp->size = MIN(inode.size, MAX_FILE_SIZE);
+  fp->flushed = fp->size;
+  fp->dirty = 0;
+
+  if(fp->mode != 'r'){
+    fp->buffer = malloc(MAX_FILE_SIZE);
+    if(fp->buffer == NULL){
+      free(fp);
+      return(NULL);
+    }
+    if(fp->mode == 'w'){
+      //Truncated now, released at the first flush
+      fp->size = 0;
+      fp->flushed = 0;
+      fp->dirty = 1;
+    }else{
+      //Appending: keep the existing contents, in case the file has to move
+      oufs_lock_inode(child, 0);
+      oufs_read_inode_by_reference(child, &inode);
+      fp->size = MIN(inode.size, MAX_FILE_SIZE);
+      fp->flushed = fp->size;
+      for(int k = 0; k * BLOCK_SIZE < fp->size; ++k){
+        BLOCK block;
+        vdisk_read_block(inode.data[k], &block);
+        memcpy(fp->buffer + k * BLOCK_SIZE, block.data.data, MIN(BLOCK_SIZE, fp->size - k * BLOCK_SIZE));
+      }
+      oufs_unlock_inode(child);
+      fp->offset = fp->size;
+    }
+  }
+  return(fp);
+}
+
+/**
+ * Append bytes to a file opened with "w" or "a".  Nothing is allocated
+ * until the file is flushed.
+ *
+ * @return Number of bytes written (less than len when the file is full); -1 on
+ * error, including a negative len
+ */
+int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len)
+{
+  if(fp == NULL || fp->mode == 'r' || len < 0)
+    return(-1);
+  int n = MIN(len, MAX_FILE_SIZE - fp->size);
+  memcpy(fp->buffer + fp->size, buf, n);
+  fp->size += n;
+  fp->offset = fp->size;
+  if(n > 0)
+    fp->dirty = 1;
+  return(n);
+}
+
+/**
+ * Read bytes from a file opened with "r"
+ *
+ * @return Number of bytes read (0 at the end of the file); -1 on error,
+ * including a block that cannot be read
+ */
+static int oufs_fread_untraced(OUFILE *fp, unsigned char * buf, int len);
+
+int oufs_fread(OUFILE *fp, unsigned char * buf, int len)
+{
+  int outer = oufs_trace_begin(OUFS_OP_FREAD);
+  int ret = oufs_fread_untraced(fp, buf, len);
+  oufs_trace_end(outer);
+  return(ret);
+}
+
+static int oufs_fread_untraced(OUFILE *fp, unsigned char * buf, int len)
+{
+  if(fp == NULL || fp->mode != 'r' || len < 0)
+    return(-1);
+
+  INODE inode;
+  oufs_lock_inode(fp->inode_reference, 0);
+  oufs_read_inode_by_reference(fp->inode_reference, &inode);
+  int done = 0;
+  while(done < len && fp->offset < fp->size){
+    BLOCK block;
+    int k = fp->offset / BLOCK_SIZE;
+    int in_block = fp->offset % BLOCK_SIZE;
+    int n = MIN(MIN(len - done, BLOCK_SIZE - in_block), fp->size - fp->offset);
+    if(inode.data[k] == UNALLOCATED_BLOCK)
+      memset(block.data.data, 0, BLOCK_SIZE);
+    else if(vdisk_read_block(inode.data[k], &block) != 0){
+      // Damaged data (e.g. a checksum mismatch) is never handed out
+      oufs_unlock_inode(fp->inode_reference);
+      return(-1);
+    }
+    memcpy(buf + done, block.data.data + in_block, n);
+    done += n;
+    fp->offset += n;
+  }
+  oufs_unlock_inode(fp->inode_reference);
+  return(done);
+}
+
+/**
+ * Give the buffered data of a file its blocks and write it out
+ *
+ * The file keeps its run when the run is contiguous and can grow into the
+ * free blocks after it; then only blocks holding new bytes are written.
+ * Otherwise the old blocks are released and the whole file is written to
+ * one new run of the final length.
+ *
+ * @return 0 on success; -1 on error
+ */
+static int oufs_fflush_untraced(OUFILE *fp);
+
+int oufs_fflush(OUFILE *fp)
+{
+  int outer = oufs_trace_begin(OUFS_OP_FFLUSH);
+  int ret = oufs_fflush_untraced(fp);
+  oufs_trace_end(outer);
+  return(ret);
+}
+
+static int oufs_fflush_untraced(OUFILE *fp)
+{
+  if(fp == NULL || fp->mode == 'r' || !fp->dirty)
+    return(0);
+
+  oufs_lock_inode(fp->inode_reference, 1);
+  INODE inode;
+  oufs_read_inode_by_reference(fp->inode_reference, &inode);
+
+  int n_old = 0;
+  int contiguous = 1;
+  for(int k = 0; k < BLOCKS_PER_INODE && inode.data[k] != UNALLOCATED_BLOCK; ++k){
+    if(k > 0 && inode.data[k] != inode.data[k - 1] + 1)
+      contiguous = 0;
+    ++n_old;
+  }
+  int n_new = (fp->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+  if(vdisk_begin_transaction() != 0){
+    oufs_unlock_inode(fp->inode_reference);
+    return(-1);
+  }
+
+  //The allocation tables are shared with every other thread: one
+  //read-modify-write of the master block
+  oufs_lock_block(MASTER_BLOCK_REFERENCE);
+  BLOCK masterBlock;
+  vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  MASTER_BLOCK *master = &masterBlock.master;
+
+  int in_place = n_old > 0 && contiguous;
+  for(int k = n_old; in_place && k < n_new; ++k){
+    int b = inode.data[0] + k;
+    if(b >= N_BLOCKS_IN_DISK || (master->block_allocated_flag[b >> 3] & (1 << (b & 7))))
+      in_place = 0;
+  }
+
+  int first_write;
+  if(in_place){
+    //Grow (or shrink) the existing run
+    for(int k = n_old; k < n_new; ++k){
+      int b = inode.data[0] + k;
+      master->block_allocated_flag[b >> 3] |= (1 << (b & 7));
+      inode.data[k] = b;
+    }
+    for(int k = n_new; k < n_old; ++k){
+      master->block_allocated_flag[inode.data[k] >> 3] &= ~(1 << (inode.data[k] & 7));
+      inode.data[k] = UNALLOCATED_BLOCK;
+    }
+    first_write = fp->flushed / BLOCK_SIZE;
+  }
+  else{
+    //Move the whole file to one new run
+    for(int k = 0; k < n_old; ++k){
+      master->block_allocated_flag[inode.data[k] >> 3] &= ~(1 << (inode.data[k] & 7));
+      inode.data[k] = UNALLOCATED_BLOCK;
+    }
+    if(n_new > 0){
+      BLOCK_REFERENCE first = oufs_allocate_blocks_near(master, fp->inode_reference, n_new);
+      if(first == UNALLOCATED_BLOCK){
+        oufs_unlock_block(MASTER_BLOCK_REFERENCE);
+        vdisk_abort_transaction();
+        oufs_unlock_inode(fp->inode_reference);
+        fprintf(stderr, "ERROR: no run of %d free blocks\n", n_new);
+        return(-1);
+      }
+      for(int k = 0; k < n_new; ++k)
+        inode.data[k] = first + k;
+    }
+    first_write = 0;
+  }
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  oufs_unlock_block(MASTER_BLOCK_REFERENCE);
+  inode.size = fp->size;
+
+  if(debug)
+    fprintf(stderr, "Flushing inode %d: %d blocks from %d, writing from block %d\n",
+            fp->inode_reference, n_new, inode.data[0], first_write);
+
+  for(int k = first_write; k < n_new; ++k){
+    BLOCK block;
+    memset(&block, 0, sizeof(block));
+    memcpy(block.data.data, fp->buffer + k * BLOCK_SIZE, MIN(BLOCK_SIZE, fp->size - k * BLOCK_SIZE));
+    vdisk_write_block(inode.data[k], &block);
+  }
+  oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  int ret = vdisk_commit_transaction();
+  oufs_unlock_inode(fp->inode_reference);
+  if(ret != 0)
+    return(-1);
+
+  fp->flushed = fp->size;
+  fp->dirty = 0;
+  return(0);
+}
+
+/**
+ * Flush and close a file
+ */
+void oufs_fclose(OUFILE *fp)
+{
+  if(fp == NULL)
+    return;
+  oufs_fflush(fp);
+  free(fp->buffer);
+  free(fp);
+}
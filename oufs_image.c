@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+#include "oufs_image.h"
+
+/**
+ * Load every block of the open disk.  The disk stays locked against other
+ * processes until it is closed, so the image stays current.
+ *
+ * @param image Image to fill
+ * @return 0 on success; <0 on error
+ */
+int oufs_image_load(OUFS_IMAGE *image)
+{
+  if(vdisk_lock_disk() != 0)
+    return(-1);
+  memset(image->dirty, 0, sizeof(image->dirty));
+  for(int first = 0; first < N_BLOCKS_IN_DISK; first += OUFS_IMAGE_READ_BLOCKS){
+    int count = MIN(OUFS_IMAGE_READ_BLOCKS, N_BLOCKS_IN_DISK - first);
+    int ret = vdisk_read_blocks(first, count, &image->block[first]);
+    if(ret != 0)
+      return(ret);
+  }
+  if(oufs_check_geometry(&image->block[MASTER_BLOCK_REFERENCE].master) != 0)
+    return(-1);
+  for(int b = 1; b <= N_INODE_BLOCKS; ++b)
+    vdisk_set_block_class(b, VDISK_CLASS_INODE);
+  for(int i = 0; i < N_INODES; ++i)
+    oufs_classify_blocks(oufs_image_inode(image, i));
+  return(0);
+}
+
+/**
+ * Write the changed blocks back to the disk in one transaction
+ *
+ * @param image Image to write
+ * @return 0 on success; <0 on error
+ */
+int oufs_image_write(OUFS_IMAGE *image)
+{
+  if(vdisk_begin_transaction() != 0)
+    return(-1);
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b){
+    if(image->dirty[b] && vdisk_write_block(b, &image->block[b]) != 0){
+      vdisk_abort_transaction();
+      return(-1);
+    }
+  }
+  int ret = vdisk_commit_transaction();
+  if(ret == 0)
+    memset(image->dirty, 0, sizeof(image->dirty));
+  return(ret);
+}
+
+/**
+ * Inode i inside the image
+ */
+INODE *oufs_image_inode(OUFS_IMAGE *image, INODE_REFERENCE i)
+{
+  return(&image->block[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK]);
+}
+
+/**
+ * Mark the block holding inode i as changed
+ */
+void oufs_image_inode_changed(OUFS_IMAGE *image, INODE_REFERENCE i)
+{
+  image->dirty[i / INODES_PER_BLOCK + 1] = 1;
+}
+
+/**
+ * Find an entry of a directory
+ *
+ * @return The inode reference of the entry; UNALLOCATED_INODE if it does not exist
+ */
+INODE_REFERENCE oufs_image_lookup(OUFS_IMAGE *image, INODE_REFERENCE directory, char *name)
+{
+  INODE *inode = oufs_image_inode(image, directory);
+  if(inode->type != IT_DIRECTORY)
+    return(UNALLOCATED_INODE);
+
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    BLOCK_REFERENCE b = inode->data[k];
+    if(b == UNALLOCATED_BLOCK || b >= N_BLOCKS_IN_DISK)
+      continue;
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+      DIRECTORY_ENTRY *entry = &image->block[b].directory.entry[j];
+      if(entry->inode_reference != UNALLOCATED_INODE && !strncmp(entry->name, name, FILE_NAME_SIZE))
+        return(entry->inode_reference);
+    }
+  }
+  return(UNALLOCATED_INODE);
+}
+
+/**
+ * Resolve a path
+ *
+ * @param cwd Current working directory
+ * @param path Absolute path, or path relative to cwd
+ * @return The inode reference; UNALLOCATED_INODE if the path does not exist
+ */
+INODE_REFERENCE oufs_image_resolve(OUFS_IMAGE *image, char *cwd, char *path)
+{
+  char fullPath[2 * MAX_PATH_LENGTH + 2];
+  if(path[0] == '/')
+    snprintf(fullPath, sizeof(fullPath), "%s", path);
+  else
+    snprintf(fullPath, sizeof(fullPath), "%s/%s", cwd, path);
+
+  INODE_REFERENCE i = 0;
+  char *save;
+  for(char *token = strtok_r(fullPath, "/", &save); token != NULL; token = strtok_r(NULL, "/", &save)){
+    i = oufs_image_lookup(image, i, token);
+    if(i == UNALLOCATED_INODE || i >= N_INODES)
+      return(UNALLOCATED_INODE);
+  }
+  return(i);
+}
+
+/**
+ * Allocate a new inode, in the block group chosen for it (oufs_alloc.c)
+ *
+ * @param parent Directory the new inode will be entered in
+ * @param type IT_DIRECTORY or IT_FILE
+ * @return The inode reference; UNALLOCATED_INODE if none is free
+ */
+INODE_REFERENCE oufs_image_allocate_inode(OUFS_IMAGE *image, INODE_REFERENCE parent, char type)
+{
+  MASTER_BLOCK *master = &image->block[MASTER_BLOCK_REFERENCE].master;
+  for(;;){
+    INODE_REFERENCE i = oufs_allocate_inode_near(master, parent, type);
+    if(i == UNALLOCATED_INODE)
+      return(UNALLOCATED_INODE);
+    image->dirty[MASTER_BLOCK_REFERENCE] = 1;
+
+    // An inode in use but marked free keeps the bit it now has
+    INODE *inode = oufs_image_inode(image, i);
+    if(inode->type == IT_DIRECTORY || inode->type == IT_FILE)
+      continue;
+
+    inode->type = type;
+    inode->n_references = 1;
+    inode->size = 0;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+      inode->data[k] = UNALLOCATED_BLOCK;
+    oufs_image_inode_changed(image, i);
+    return(i);
+  }
+}
+
+/**
+ * Allocate a run of consecutive blocks near an inode.  The blocks are
+ * cleared.
+ *
+ * @param owner Inode the blocks are for
+ * @param count Number of blocks (at least 1)
+ * @return The first block of the run; UNALLOCATED_BLOCK if no run is long enough
+ */
+BLOCK_REFERENCE oufs_image_allocate_blocks(OUFS_IMAGE *image, INODE_REFERENCE owner, int count)
+{
+  MASTER_BLOCK *master = &image->block[MASTER_BLOCK_REFERENCE].master;
+  BLOCK_REFERENCE first = oufs_allocate_blocks_near(master, owner, count);
+  if(first == UNALLOCATED_BLOCK)
+    return(UNALLOCATED_BLOCK);
+
+  for(int r = first; r < first + count; ++r){
+    memset(&image->block[r], 0, sizeof(BLOCK));
+    image->dirty[r] = 1;
+  }
+  image->dirty[MASTER_BLOCK_REFERENCE] = 1;
+  return(first);
+}
+
+/**
+ * Add an entry to a directory, giving the directory another block if its
+ * blocks are full
+ *
+ * @return 0 on success; -1 if the directory or the disk is full
+ */
+int oufs_image_add_entry(OUFS_IMAGE *image, INODE_REFERENCE directory, char *name, INODE_REFERENCE child)
+{
+  INODE *inode = oufs_image_inode(image, directory);
+  DIRECTORY_ENTRY *free_entry = NULL;
+  int free_slot = -1;
+  for(int k = 0; k < BLOCKS_PER_INODE && free_entry == NULL; ++k){
+    BLOCK_REFERENCE b = inode->data[k];
+    if(b == UNALLOCATED_BLOCK){
+      if(free_slot < 0)
+        free_slot = k;
+      continue;
+    }
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+      if(image->block[b].directory.entry[j].inode_reference == UNALLOCATED_INODE){
+        free_entry = &image->block[b].directory.entry[j];
+        image->dirty[b] = 1;
+        break;
+      }
+    }
+  }
+
+  if(free_entry == NULL){
+    if(free_slot < 0)
+      return(-1);
+    BLOCK_REFERENCE b = oufs_image_allocate_blocks(image, directory, 1);
+    if(b == UNALLOCATED_BLOCK)
+      return(-1);
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+      oufs_clean_directory_entry(&image->block[b].directory.entry[j]);
+    inode->data[free_slot] = b;
+    free_entry = &image->block[b].directory.entry[0];
+  }
+
+  memset(free_entry->name, 0, FILE_NAME_SIZE);
+  memcpy(free_entry->name, name, MIN(strlen(name), FILE_NAME_SIZE));
+  free_entry->inode_reference = child;
+  ++inode->size;
+  oufs_image_inode_changed(image, directory);
+  return(0);
+}
+
+/**
+ * Create an empty directory
+ *
+ * @param parent Directory to create it in
+ * @param name Name of the new directory
+ * @return The new inode reference; UNALLOCATED_INODE if the disk or parent is full
+ */
+INODE_REFERENCE oufs_image_mkdir(OUFS_IMAGE *image, INODE_REFERENCE parent, char *name)
+{
+  INODE_REFERENCE i = oufs_image_allocate_inode(image, parent, IT_DIRECTORY);
+  if(i == UNALLOCATED_INODE)
+    return(UNALLOCATED_INODE);
+  BLOCK_REFERENCE b = oufs_image_allocate_blocks(image, i, 1);
+  if(b == UNALLOCATED_BLOCK || oufs_image_add_entry(image, parent, name, i) != 0)
+    return(UNALLOCATED_INODE);
+
+  oufs_clean_directory_block(i, parent, &image->block[b]);
+  INODE *inode = oufs_image_inode(image, i);
+  inode->data[0] = b;
+  inode->size = 2;
+  return(i);
+}
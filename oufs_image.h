@@ -0,0 +1,32 @@
+#ifndef OUFS_IMAGE_H
+#define OUFS_IMAGE_H
+
+/*
+ * In-memory copy of a whole disk, for tools that walk or rebuild large
+ * parts of the tree.  The disk is loaded with a few large reads, changed
+ * in memory, and the changed blocks are written back in one transaction.
+ */
+
+#include "oufs_lib.h"
+
+// Blocks loaded per read
+#define OUFS_IMAGE_READ_BLOCKS 64
+
+typedef struct oufs_image_s
+{
+  BLOCK block[N_BLOCKS_IN_DISK];
+  unsigned char dirty[N_BLOCKS_IN_DISK];
+} OUFS_IMAGE;
+
+int oufs_image_load(OUFS_IMAGE *image);
+int oufs_image_write(OUFS_IMAGE *image);
+INODE *oufs_image_inode(OUFS_IMAGE *image, INODE_REFERENCE i);
+void oufs_image_inode_changed(OUFS_IMAGE *image, INODE_REFERENCE i);
+INODE_REFERENCE oufs_image_lookup(OUFS_IMAGE *image, INODE_REFERENCE directory, char *name);
+INODE_REFERENCE oufs_image_resolve(OUFS_IMAGE *image, char *cwd, char *path);
+INODE_REFERENCE oufs_image_allocate_inode(OUFS_IMAGE *image, INODE_REFERENCE parent, char type);
+BLOCK_REFERENCE oufs_image_allocate_blocks(OUFS_IMAGE *image, INODE_REFERENCE owner, int count);
+int oufs_image_add_entry(OUFS_IMAGE *image, INODE_REFERENCE directory, char *name, INODE_REFERENCE child);
+INODE_REFERENCE oufs_image_mkdir(OUFS_IMAGE *image, INODE_REFERENCE parent, char *name);
+
+#endif
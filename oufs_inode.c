@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "oufs_lib.h"
+
+/*
+ * In-memory inode table.
+ *
+ * oufs_mount() reads the master block and every inode block with one
+ * sequential read (the master block goes to vdisk's block cache, the
+ * inode blocks here).  Inode reads are then copies out of this table and
+ * inode writes copies into it, instead of a block read (and write) each.
+ *
+ * Each table block remembers the vdisk_block_version() it was read at, and
+ * is read again from vdisk once that changes: another process wrote the
+ * block, a transaction was discarded, the disk was closed.  A disk opened
+ * without oufs_mount() fills the table a block at a time as inodes are
+ * read.
+ *
+ * An inode write changes the table block and writes it into the vdisk
+ * transaction, so only the inode blocks that changed reach the journal at
+ * commit, and an abort takes them back out of the table too.  A write that
+ * changes nothing writes nothing.  Inodes are only written inside
+ * transactions, which keep other processes from writing the disk, so the
+ * version read after a write is that of the write.
+ *
+ * Locks: a table block's lock is held for a copy in or out, or to read or
+ * write the block through vdisk; see oufs_lock.c.
+ */
+
+#define debug 0
+
+static BLOCK table[N_INODE_BLOCKS];
+static unsigned long table_version[N_INODE_BLOCKS];
+static int table_valid[N_INODE_BLOCKS];
+static pthread_rwlock_t table_lock[N_INODE_BLOCKS] = { [0 ... N_INODE_BLOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER };
+
+/**
+ * Is a table block the same as the disk's?  Called with its lock held.
+ *
+ * @param k Table block (inode block k + 1)
+ */
+static int oufs_table_current(int k)
+{
+  return(table_valid[k] && table_version[k] == vdisk_block_version(k + 1));
+}
+
+/**
+ * Read a table block from vdisk if it is out of date.  Called with its
+ * lock held for writing.
+ *
+ * @return 0 on success; -1 on error
+ */
+static int oufs_table_refresh(int k)
+{
+  if(oufs_table_current(k))
+    return(0);
+  if(debug)
+    fprintf(stderr, "Reloading inode block %d\n", k + 1);
+
+  // The version is taken first: a change meanwhile leaves it out of date
+  unsigned long version = vdisk_block_version(k + 1);
+  BLOCK b;
+  vdisk_set_block_class(k + 1, VDISK_CLASS_INODE);
+  if(vdisk_read_block(k + 1, &b) != 0){
+    table_valid[k] = 0;
+    return(-1);
+  }
+  table[k] = b;
+  table_version[k] = version;
+  table_valid[k] = 1;
+  return(0);
+}
+
+/**
+ * Open a disk and load its master block and inode table
+ *
+ * @param disk_name Virtual disk (see vdisk_disk_open())
+ * @return 0 on success; -1 on error
+ */
+int oufs_mount(char *disk_name)
+{
+  if(vdisk_disk_open(disk_name) != 0)
+    return(-1);
+
+  for(int k = 0; k < N_INODE_BLOCKS; ++k)
+    pthread_rwlock_wrlock(&table_lock[k]);
+  unsigned long versions[N_INODE_BLOCKS];
+  for(int k = 0; k < N_INODE_BLOCKS; ++k)
+    versions[k] = vdisk_block_version(k + 1);
+
+  vdisk_set_block_class(MASTER_BLOCK_REFERENCE, VDISK_CLASS_MASTER);
+  for(int k = 0; k < N_INODE_BLOCKS; ++k)
+    vdisk_set_block_class(k + 1, VDISK_CLASS_INODE);
+  BLOCK blocks[N_INODE_BLOCKS + 1];
+  int ret = vdisk_preload_blocks(MASTER_BLOCK_REFERENCE, N_INODE_BLOCKS + 1, blocks);
+  for(int k = 0; k < N_INODE_BLOCKS; ++k){
+    table[k] = blocks[k + 1];
+    table_version[k] = versions[k];
+    table_valid[k] = (ret == 0);
+  }
+
+  for(int k = N_INODE_BLOCKS - 1; k >= 0; --k)
+    pthread_rwlock_unlock(&table_lock[k]);
+  if(ret != 0){
+    fprintf(stderr, "ERROR: unable to read the inode table\n");
+    vdisk_disk_close();
+    return(-1);
+  }
+  if(oufs_check_geometry(&blocks[MASTER_BLOCK_REFERENCE].master) != 0){
+    vdisk_disk_close();
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ * Close a disk opened with oufs_mount()
+ *
+ * @return 0 on success; -1 on error
+ */
+int oufs_unmount()
+{
+  // Closing changes every block's version: the table is reloaded next time
+  return(vdisk_disk_close() == 0 ? 0 : -1);
+}
+
+/**
+ * Copy an inode out of the table
+ *
+ * @param i Inode reference
+ * @param inode Filled in with the inode
+ * @return 0 on success; -1 on error
+ */
+int oufs_table_read_inode(INODE_REFERENCE i, INODE *inode)
+{
+  if(i >= N_INODES)
+    return(-1);
+  int k = i / INODES_PER_BLOCK;
+  int element = i % INODES_PER_BLOCK;
+
+  pthread_rwlock_rdlock(&table_lock[k]);
+  if(oufs_table_current(k)){
+    *inode = table[k].inodes.inode[element];
+    pthread_rwlock_unlock(&table_lock[k]);
+    return(0);
+  }
+  pthread_rwlock_unlock(&table_lock[k]);
+
+  pthread_rwlock_wrlock(&table_lock[k]);
+  int ret = oufs_table_refresh(k);
+  if(ret == 0)
+    *inode = table[k].inodes.inode[element];
+  pthread_rwlock_unlock(&table_lock[k]);
+  return(ret);
+}
+
+/**
+ * Change an inode in the table and write its block into the transaction
+ *
+ * @param i Inode reference
+ * @param inode The new inode
+ * @return 0 on success; -1 on error
+ */
+int oufs_table_write_inode(INODE_REFERENCE i, INODE *inode)
+{
+  if(i >= N_INODES)
+    return(-1);
+  int k = i / INODES_PER_BLOCK;
+  int element = i % INODES_PER_BLOCK;
+
+  pthread_rwlock_wrlock(&table_lock[k]);
+  if(oufs_table_refresh(k) != 0){
+    pthread_rwlock_unlock(&table_lock[k]);
+    return(-1);
+  }
+  if(!memcmp(&table[k].inodes.inode[element], inode, sizeof(INODE))){
+    pthread_rwlock_unlock(&table_lock[k]);
+    return(0);
+  }
+
+  table[k].inodes.inode[element] = *inode;
+  int ret = vdisk_write_block(k + 1, &table[k]);
+  if(ret == 0)
+    table_version[k] = vdisk_block_version(k + 1);
+  else
+    table_valid[k] = 0;
+  pthread_rwlock_unlock(&table_lock[k]);
+  return(ret == 0 ? 0 : -1);
+}
@@ -4,22 +4,104 @@
 
 #define MAX_PATH_LENGTH 200
 
+// Block groups (oufs_alloc.c)
+#define N_BLOCK_GROUPS 4
+#define BLOCKS_PER_GROUP (N_BLOCKS_IN_DISK / N_BLOCK_GROUPS)
+#define INODES_PER_GROUP (N_INODES / N_BLOCK_GROUPS)
+
+typedef struct oufs_block_group_s
+{
+  int first_block;
+  int first_inode;
+  int n_inodes;
+  int free_blocks;
+  int free_inodes;
+} OUFS_BLOCK_GROUP;
+
+// Operations named in vdisk's block access trace (oufs_trace_begin())
+#define OUFS_OP_MKDIR 1
+#define OUFS_OP_RMDIR 2
+#define OUFS_OP_LIST 3
+#define OUFS_OP_LOOKUP 4
+#define OUFS_OP_RENAME 5
+#define OUFS_OP_FOPEN 6
+#define OUFS_OP_FREAD 7
+#define OUFS_OP_FFLUSH 8
+#define OUFS_N_OPS 9
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name);
+int oufs_trace_begin(int op);
+void oufs_trace_end(int outer);
 
 // PROJECT 3
 int oufs_format_disk(char  *virtual_disk_name);
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
+void oufs_classify_blocks(INODE *inode);
 int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
 int oufs_mkdir(char *cwd, char *path);
 int oufs_list(char *cwd, char *path);
 int oufs_rmdir(char *cwd, char *path);
+int oufs_rename(char *cwd, char *src, char *dst);
 
 // Helper functions in oufs_lib_support.c
 void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BLOCK *block);
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry);
 BLOCK_REFERENCE oufs_allocate_new_block();
+int oufs_disk_blocks(MASTER_BLOCK *master);
+int oufs_disk_inodes(MASTER_BLOCK *master);
+int oufs_inodes_for_blocks(int n_blocks);
+void oufs_set_disk_size(MASTER_BLOCK *master, int n_blocks, int n_inodes);
+void oufs_set_geometry(MASTER_BLOCK *master);
+int oufs_check_geometry(MASTER_BLOCK *master);
+
+// Block group allocator in oufs_alloc.c
+void oufs_block_group(MASTER_BLOCK *master, int g, OUFS_BLOCK_GROUP *group);
+int oufs_inode_group(INODE_REFERENCE i);
+INODE_REFERENCE oufs_allocate_inode_near(MASTER_BLOCK *master, INODE_REFERENCE parent, char type);
+BLOCK_REFERENCE oufs_allocate_blocks_near(MASTER_BLOCK *master, INODE_REFERENCE owner, int count);
+
+// In-memory inode table in oufs_inode.c
+int oufs_mount(char *disk_name);
+int oufs_unmount();
+int oufs_table_read_inode(INODE_REFERENCE i, INODE *inode);
+int oufs_table_write_inode(INODE_REFERENCE i, INODE *inode);
+
+// Directory block scans in oufs_scan.c: bit j of a mask is entry j
+typedef unsigned long long OUFS_ENTRY_MASK;
+OUFS_ENTRY_MASK oufs_scan_name(DIRECTORY_BLOCK *block, char *name);
+OUFS_ENTRY_MASK oufs_scan_inode(DIRECTORY_BLOCK *block, INODE_REFERENCE i);
+
+// Parallel tree walk in oufs_walk.c
+#define OUFS_WALK_MAX_THREADS 16
+
+typedef struct oufs_walk_entry_s
+{
+  // Absolute path and last element
+  char path[MAX_PATH_LENGTH];
+  char name[FILE_NAME_SIZE + 1];
+  INODE_REFERENCE inode_reference;
+  INODE inode;
+  // Directory holding the entry (UNALLOCATED_INODE for the start)
+  INODE_REFERENCE parent;
+  // 0 for the start, 1 for its entries, ...
+  int depth;
+} OUFS_WALK_ENTRY;
+
+typedef void (*OUFS_WALK_VISIT)(OUFS_WALK_ENTRY *entry, void *arg);
+
+int oufs_walk(char *cwd, char *path, int n_threads, OUFS_WALK_VISIT visit, void *arg);
+
+// Locking for threads in oufs_lock.c (lock order documented there)
+void oufs_lock_inode(INODE_REFERENCE i, int exclusive);
+void oufs_unlock_inode(INODE_REFERENCE i);
+void oufs_lock_inodes(INODE_REFERENCE *inodes, int n);
+void oufs_unlock_inodes(INODE_REFERENCE *inodes, int n);
+void oufs_lock_block(BLOCK_REFERENCE b);
+void oufs_unlock_block(BLOCK_REFERENCE b);
+void oufs_lock_rename();
+void oufs_unlock_rename();
 
 // Helper functions to be provided
 int oufs_find_open_bit(unsigned char value);
@@ -28,6 +110,9 @@ int oufs_find_open_bit(unsigned char value);
 int get_inode_reference_from_path(char* path);
 int get_inode_reference_from_path_helper(INODE_REFERENCE parentInodeReference, char* name);
 int comparator(const void* p, const void* q);
+INODE_REFERENCE oufs_find_directory_entry(INODE_REFERENCE directory, char *name,
+                                          BLOCK_REFERENCE *block_ref, int *entry);
+int oufs_find_free_directory_entry(INODE_REFERENCE directory, BLOCK_REFERENCE *block_ref, int *entry);
 
 
 // PROJECT 4 ONLY
@@ -35,6 +120,7 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
 void oufs_fclose(OUFILE *fp);
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
 int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
+int oufs_fflush(OUFILE *fp);
 int oufs_remove(char *cwd, char *path);
 int oufs_link(char *cwd, char *path_src, char *path_dst);
 
@@ -4,6 +4,8 @@
 
 #define debug 0
 
+static int oufs_adjust_inode_size(INODE_REFERENCE i, int n);
+
 /**
  * Read the ZPWD and ZDISK environment variables & copy their values into cwd and disk_name.
  * If these environment variables are not set, then reasonable defaults are given.
@@ -35,6 +37,29 @@ void oufs_get_environment(char *cwd, char *disk_name)
 
 }
 
+/**
+ * Mark the start of an operation in vdisk's block access trace.  Nested
+ * operations (a lookup inside oufs_fopen()) count as part of the outer one.
+ *
+ * @param op OUFS_OP_*
+ * @return The operation in progress before, for oufs_trace_end()
+ */
+int oufs_trace_begin(int op)
+{
+  int outer = vdisk_trace_context(op);
+  if(outer != 0)
+    vdisk_trace_context(outer);
+  return(outer);
+}
+
+/**
+ * Mark the end of an operation started with oufs_trace_begin()
+ */
+void oufs_trace_end(int outer)
+{
+  vdisk_trace_context(outer);
+}
+
 /**
  * Configure a directory entry so that it has no name and no inode
  *
@@ -42,7 +67,7 @@ void oufs_get_environment(char *cwd, char *disk_name)
  */
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry)
 {
-  entry->name[0] = 0;  // No name
+  memset(entry->name, 0, FILE_NAME_SIZE);  // No name
   entry->inode_reference = UNALLOCATED_INODE;
 }
 
@@ -84,6 +109,128 @@ void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BL
 
 }
 
+/**
+ * Number of blocks in use by a disk
+ *
+ * @param master The disk's master block
+ * @return The block count set by zresize, or N_BLOCKS_IN_DISK
+ */
+int oufs_disk_blocks(MASTER_BLOCK *master)
+{
+  if(master->n_blocks == 0 || master->n_blocks > N_BLOCKS_IN_DISK)
+    return(N_BLOCKS_IN_DISK);
+  return(master->n_blocks);
+}
+
+/**
+ * Number of inodes in use by a disk
+ *
+ * @param master The disk's master block
+ * @return The inode count set by zformat -size or zresize, or N_INODES
+ */
+int oufs_disk_inodes(MASTER_BLOCK *master)
+{
+  if(master->n_inodes == 0 || master->n_inodes > N_INODES)
+    return(N_INODES);
+  return(master->n_inodes);
+}
+
+/**
+ * Inodes a disk of n_blocks blocks gets: the full table's share of the
+ * largest disk, rounded up
+ *
+ * @param n_blocks Number of blocks of the disk
+ * @return Number of inodes, at least 1
+ */
+int oufs_inodes_for_blocks(int n_blocks)
+{
+  int n_inodes = (N_INODES * n_blocks + N_BLOCKS_IN_DISK - 1) / N_BLOCKS_IN_DISK;
+  return(n_inodes < 1 ? 1 : n_inodes);
+}
+
+/**
+ * Change the size of a disk in its master block.  Blocks and inodes past
+ * the new ends are marked allocated, so nothing allocates them; those
+ * between the old and new ends of a grown disk are released.  The caller
+ * moves anything in use past a new end first.
+ *
+ * @param master The disk's master block (the caller writes it back)
+ * @param n_blocks New number of blocks, up to N_BLOCKS_IN_DISK
+ * @param n_inodes New number of inodes, up to N_INODES
+ */
+void oufs_set_disk_size(MASTER_BLOCK *master, int n_blocks, int n_inodes)
+{
+  int old_blocks = oufs_disk_blocks(master);
+  int old_inodes = oufs_disk_inodes(master);
+  for(int b = MIN(old_blocks, n_blocks); b < N_BLOCKS_IN_DISK; ++b){
+    if(b >= n_blocks)
+      master->block_allocated_flag[b >> 3] |= (1 << (b & 7));
+    else if(b >= old_blocks)
+      master->block_allocated_flag[b >> 3] &= ~(1 << (b & 7));
+  }
+  for(int i = MIN(old_inodes, n_inodes); i < N_INODES; ++i){
+    if(i >= n_inodes)
+      master->inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+    else if(i >= old_inodes)
+      master->inode_allocated_flag[i >> 3] &= ~(1 << (i & 7));
+  }
+  master->n_blocks = n_blocks;
+  master->n_inodes = n_inodes;
+}
+
+/**
+ * Record the geometry of this build in a new disk's master block
+ *
+ * @param master The disk's master block (in a whole BLOCK)
+ */
+void oufs_set_geometry(MASTER_BLOCK *master)
+{
+  OUFS_GEOMETRY *geometry = OUFS_MASTER_GEOMETRY(master);
+  geometry->magic = OUFS_GEOMETRY_MAGIC;
+  geometry->block_size = BLOCK_SIZE;
+  geometry->disk_blocks = N_BLOCKS_IN_DISK;
+  geometry->inode_blocks = N_INODE_BLOCKS;
+}
+
+/**
+ * Check that a disk was formatted with the geometry of this build
+ *
+ * @param master The disk's master block (in a whole BLOCK)
+ * @return 0 if it was (or the disk predates the record); -1 if not
+ */
+int oufs_check_geometry(MASTER_BLOCK *master)
+{
+  OUFS_GEOMETRY *geometry = OUFS_MASTER_GEOMETRY(master);
+  if(geometry->magic == 0 && geometry->block_size == 0 && geometry->disk_blocks == 0
+     && geometry->inode_blocks == 0){
+    // No record: a disk formatted before it, or one with larger blocks
+    // whose inode table this build reads instead.  Only the first has the
+    // master, inode table and root directory blocks allocated
+    for(int b = 0; b <= ROOT_DIRECTORY_BLOCK; ++b){
+      if(!(master->block_allocated_flag[b >> 3] & (1 << (b & 7)))){
+        fprintf(stderr, "ERROR: the disk is not a disk of %d blocks of %d bytes and %d inode blocks; it was\n"
+                "  formatted by a build with another GEOMETRY (or not formatted)\n",
+                N_BLOCKS_IN_DISK, BLOCK_SIZE, N_INODE_BLOCKS);
+        return(-1);
+      }
+    }
+    return(0);
+  }
+  if(geometry->magic != OUFS_GEOMETRY_MAGIC){
+    fprintf(stderr, "ERROR: the disk has no geometry record where a build with %d-byte blocks keeps it; it was\n"
+            "  formatted by a build with another BLOCK_SIZE\n", BLOCK_SIZE);
+    return(-1);
+  }
+  if(geometry->block_size == BLOCK_SIZE && geometry->disk_blocks == N_BLOCKS_IN_DISK
+     && geometry->inode_blocks == N_INODE_BLOCKS)
+    return(0);
+  fprintf(stderr, "ERROR: the disk has %d blocks of %d bytes and %d inode blocks, this build %d of %d and %d; it needs\n"
+          "  make GEOMETRY=\"-DBLOCK_SIZE=%d -DN_BLOCKS_IN_DISK=%d -DN_INODE_BLOCKS=%d\"\n",
+          geometry->disk_blocks, geometry->block_size, geometry->inode_blocks, N_BLOCKS_IN_DISK, BLOCK_SIZE, N_INODE_BLOCKS,
+          geometry->block_size, geometry->disk_blocks, geometry->inode_blocks);
+  return(-1);
+}
+
 /**
  * Allocate a new data block
  *
@@ -160,20 +307,52 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
   if(debug)
     fprintf(stderr, "Fetching inode %d\n", i);
 
-  // Find the address of the inode block and the inode within the block
-  BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-  int element = (i % INODES_PER_BLOCK);
-
-  BLOCK b;
-  if(vdisk_read_block(block, &b) == 0) {
-    // Successfully loaded the block: copy just this inode
-    *inode = b.inodes.inode[element];
+  // Copied out of the in-memory inode table (oufs_inode.c)
+  if(oufs_table_read_inode(i, inode) == 0) {
+    oufs_classify_blocks(inode);
     return(0);
   }
   // Error case
   return(-1);
 }
 
+/**
+ * Tell vdisk's I/O statistics what an inode's blocks hold
+ *
+ * @param inode Inode
+ */
+void oufs_classify_blocks(INODE *inode)
+{
+  vdisk_set_block_class(MASTER_BLOCK_REFERENCE, VDISK_CLASS_MASTER);
+  if(inode->type != IT_DIRECTORY && inode->type != IT_FILE)
+    return;
+  int block_class = inode->type == IT_DIRECTORY ? VDISK_CLASS_DIRECTORY : VDISK_CLASS_DATA;
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+    if(inode->data[k] != UNALLOCATED_BLOCK)
+      vdisk_set_block_class(inode->data[k], block_class);
+  }
+}
+
+/**
+ *  Given an inode reference, write the inode to the virtual disk.
+ *
+ *  @param i Inode reference (index into the inode list)
+ *  @param inode Pointer to the inode memory structure to be written
+ *  @return 0 = successfully stored the inode
+ *         -1 = an error has occurred
+ *
+ */
+int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+{
+  if(debug)
+    fprintf(stderr, "Storing inode %d\n", i);
+
+  // The table block holds other inodes, which other threads may be
+  // writing: oufs_inode.c locks it
+  oufs_classify_blocks(inode);
+  return(oufs_table_write_inode(i, inode));
+}
+
 // WIll need to come back and complete
 int oufs_find_open_bit(unsigned char value){
   int bit = -1;
@@ -187,11 +366,20 @@ int oufs_find_open_bit(unsigned char value){
 }
 
 //Creats a new directory in the virtual file system
-int oufs_mkdir(char* cwd, char* path){
+static int oufs_mkdir_untraced(char* cwd, char* path);
+
+int oufs_mkdir(char* cwd, char* path) {
+  int outer = oufs_trace_begin(OUFS_OP_MKDIR);
+  int ret = oufs_mkdir_untraced(cwd, path);
+  oufs_trace_end(outer);
+  return ret;
+}
+
+static int oufs_mkdir_untraced(char* cwd, char* path){
 
   //Opens the target to create the new directory's absolute path
   //If the path supplied is an absolute path, just that is used
-  char fullPath[strlen(cwd) + strlen(path)];
+  char fullPath[strlen(cwd) + strlen(path) + 1];
   fullPath[0] = '\0';
   if(path[0] == '/'){
     strcat(fullPath, path);
@@ -202,18 +390,20 @@ int oufs_mkdir(char* cwd, char* path){
   }
 
   //Gets the parent of the new directory's path by calling dirname on fullPath
-  char dirnamePath[strlen(fullPath)];
+  char dirnamePath[strlen(fullPath) + 1];
   strncpy(dirnamePath, fullPath, strlen(fullPath));
   dirnamePath[strlen(fullPath)] = '\0';
-  strncpy(dirnamePath, dirname(dirnamePath), strlen(dirnamePath));
-  dirnamePath[strlen(dirnamePath)] = '\0';
+  //dirname() may return a pointer into dirnamePath: the copy can overlap
+  char *parentName = dirname(dirnamePath);
+  memmove(dirnamePath, parentName, strlen(parentName) + 1);
 
   //Gets the name of new directory by calling basename on fullPath
-  char basenamePath[strlen(fullPath)];
+  char basenamePath[strlen(fullPath) + 1];
   strncpy(basenamePath, fullPath, strlen(fullPath));
   basenamePath[strlen(fullPath)] = '\0';
-  strncpy(basenamePath, basename(basenamePath), strlen(basenamePath));
-  basenamePath[strlen(basename(basenamePath))] = '\0';
+  //basename() returns a pointer into basenamePath: the copy overlaps
+  char *newName = basename(basenamePath);
+  memmove(basenamePath, newName, strlen(newName) + 1);
 
   //If the directory already exists, throw an error
   if(get_inode_reference_from_path(fullPath) != -1){
@@ -228,104 +418,106 @@ int oufs_mkdir(char* cwd, char* path){
     return -1;
   }
 
-  //Open the parent inode and increment the size
-  int parentInodeBlockReference = parentInodeReference / INODES_PER_BLOCK + 1; //Gets what block the inode is in
-  int parentInodeBlockIndex = parentInodeReference % INODES_PER_BLOCK; //Gets where in the block the inode is
-  BLOCK parentBlock;
-  vdisk_read_block(parentInodeBlockReference, &parentBlock); //Open block
-  if(parentBlock.inodes.inode[parentInodeBlockIndex].size > 15){
-    fprintf(stderr, "ERROR: Block full\n");
+  //Another thread may have changed the parent since it was looked up:
+  //check again once it is locked
+  oufs_lock_inode(parentInodeReference, 1);
+  INODE parentInode;
+  oufs_read_inode_by_reference(parentInodeReference, &parentInode);
+  if(parentInode.type != IT_DIRECTORY){
+    oufs_unlock_inode(parentInodeReference);
+    fprintf(stderr, "ERROR: parent does not exist\n");
     return -1;
   }
-  ++parentBlock.inodes.inode[parentInodeBlockIndex].size; //Increments the block's size
-  vdisk_write_block(parentInodeBlockReference, &parentBlock); //Writes the block back to the disk
-
+  if(oufs_find_directory_entry(parentInodeReference, basenamePath, NULL, NULL) != UNALLOCATED_INODE){
+    oufs_unlock_inode(parentInodeReference);
+    fprintf(stderr, "ERROR: Directory already exists\n");
+    return -1;
+  }
+  //The first free entry in any of the parent's blocks
   BLOCK_REFERENCE parentDataBlockReference;
-  INODE parentInode;
-  oufs_read_inode_by_reference(parentInodeReference, &parentInode);
-  for(int i = 0; i < BLOCKS_PER_INODE; ++i){
-      if(parentInode.data[i] != UNALLOCATED_BLOCK){
-        BLOCK_REFERENCE parentDataBlockRef = parentInode.data[i];
-        BLOCK parentDataBlock;
-        vdisk_read_block(parentDataBlockRef, &parentDataBlock);
-        for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
-          if(parentDataBlock.directory.entry[j].inode_reference == UNALLOCATED_INODE){
-              parentDataBlockReference = parentDataBlockRef;
-              break;
-          }
-        }
-      }
+  int parentEntry;
+  if(oufs_find_free_directory_entry(parentInodeReference, &parentDataBlockReference, &parentEntry) != 0){
+    oufs_unlock_inode(parentInodeReference);
+    fprintf(stderr, "ERROR: Block full\n");
+    return -1;
   }
 
-  //Gets the location of the next available inode
-  INODE_REFERENCE newInodeInodeReference = -1;
-  for(int i = 0; i < N_INODES; ++i){
-    INODE inode;
-    oufs_read_inode_by_reference(i, &inode);
-    if(inode.size == 0){
-      newInodeInodeReference = i;
-      break;
-    }
+  //All the blocks below are written together
+  if(vdisk_begin_transaction() != 0){
+    oufs_unlock_inode(parentInodeReference);
+    return -1;
   }
 
-  //Gets the byte and bit of the new location so can assign values later
-  int byte = newInodeInodeReference / INODES_PER_BLOCK + 1;
-  int bit = newInodeInodeReference % INODES_PER_BLOCK;
-
-  //Byte corresponds to the BLOCK_REFERENCE
-  BLOCK_REFERENCE newInodeInodeBlockReference = byte;
-  //Allocates a new block for this information and returns the location of that block
-  BLOCK_REFERENCE newInodeDataBlockReference = oufs_allocate_new_block();
+  //Picks the new directory's inode and first block from the block groups
+  oufs_lock_block(MASTER_BLOCK_REFERENCE);
+  BLOCK masterBlock;
+  vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  INODE_REFERENCE newInodeInodeReference = oufs_allocate_inode_near(&masterBlock.master, parentInodeReference, IT_DIRECTORY);
+  BLOCK_REFERENCE newInodeDataBlockReference = UNALLOCATED_BLOCK;
+  if(newInodeInodeReference != UNALLOCATED_INODE)
+    newInodeDataBlockReference = oufs_allocate_blocks_near(&masterBlock.master, newInodeInodeReference, 1);
+  if(newInodeDataBlockReference != UNALLOCATED_BLOCK){
+    //Writes the allocation tables with the new inode and block marked as allocated
+    vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  }
+  oufs_unlock_block(MASTER_BLOCK_REFERENCE);
+  if(newInodeDataBlockReference == UNALLOCATED_BLOCK){
+    vdisk_abort_transaction();
+    oufs_unlock_inode(parentInodeReference);
+    fprintf(stderr, newInodeInodeReference == UNALLOCATED_INODE ? "ERROR: no free inodes\n" : "ERROR: no free blocks\n");
+    return -1;
+  }
 
-  //Opens a new block at the location referenced above
-  BLOCK newInodeBlock;
-  vdisk_read_block(newInodeInodeBlockReference, &newInodeBlock);
+  //Increment the parent's size
+  ++parentInode.size;
+  oufs_write_inode_by_reference(parentInodeReference, &parentInode);
 
-  //Fills in the inode information in the new block
-  newInodeBlock.inodes.inode[bit].type = IT_DIRECTORY;
-  newInodeBlock.inodes.inode[bit].n_references = 1;
-  newInodeBlock.inodes.inode[bit].data[0] = newInodeDataBlockReference;
+  //Fills in the new inode
+  INODE newInode;
+  newInode.type = IT_DIRECTORY;
+  newInode.n_references = 1;
+  newInode.data[0] = newInodeDataBlockReference;
   for(int i = 1; i < BLOCKS_PER_INODE; ++i){
-      newInodeBlock.inodes.inode[bit].data[i] = UNALLOCATED_BLOCK;
+      newInode.data[i] = UNALLOCATED_BLOCK;
   }
-  newInodeBlock.inodes.inode[bit].size = 2;
+  newInode.size = 2;
+  oufs_write_inode_by_reference(newInodeInodeReference, &newInode);
 
   BLOCK parentDataBlock;
   vdisk_read_block(parentDataBlockReference, &parentDataBlock);
 
-  //Adds the new directory to the parent inode's data block
-  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i){
-    if(parentDataBlock.directory.entry[i].inode_reference == UNALLOCATED_INODE){ //Finds first available directory
-      strncpy(parentDataBlock.directory.entry[i].name, basenamePath, strlen(basenamePath)); // Writes name
-      parentDataBlock.directory.entry[i].inode_reference = newInodeInodeReference; //and inode reference
-      break;
-    }
-  }
+  //Adds the new directory to the free entry found above
+  strncpy(parentDataBlock.directory.entry[parentEntry].name, basenamePath, FILE_NAME_SIZE); // Writes name
+  parentDataBlock.directory.entry[parentEntry].inode_reference = newInodeInodeReference; //and inode reference
 
   //Creates a brand new empty directory data block
   BLOCK newInodeDataBlock;
   oufs_clean_directory_block(newInodeInodeReference, parentInodeReference, &newInodeDataBlock);
 
-  //Writes all changed blocks back to disk
-  vdisk_write_block(newInodeInodeBlockReference, &newInodeBlock);
+  //Writes the changed directory blocks back to disk
   vdisk_write_block(parentDataBlockReference, &parentDataBlock);
   vdisk_write_block(newInodeDataBlockReference, &newInodeDataBlock);
 
-  //Opens master block to change allocation table to mark new inode as allocated
-  BLOCK masterBlock;
-  vdisk_read_block(0, &masterBlock);
-  masterBlock.master.inode_allocated_flag[byte - 1] |= (1 << (bit));
-  vdisk_write_block(0, &masterBlock);
-
-  return 0;
+  int ret = vdisk_commit_transaction();
+  oufs_unlock_inode(parentInodeReference);
+  return ret == 0 ? 0 : -1;
 }
 
 //Removes a specified *empty directory from the virtual disk
-int oufs_rmdir(char *cwd, char *path){
+static int oufs_rmdir_untraced(char *cwd, char *path);
+
+int oufs_rmdir(char *cwd, char *path) {
+  int outer = oufs_trace_begin(OUFS_OP_RMDIR);
+  int ret = oufs_rmdir_untraced(cwd, path);
+  oufs_trace_end(outer);
+  return ret;
+}
+
+static int oufs_rmdir_untraced(char *cwd, char *path){
 
   //Creates the absolute path to the directory to be removed
   //If the path supplied is an absolute path, just that is used
-  char fullPath[strlen(cwd) + strlen(path)];
+  char fullPath[strlen(cwd) + strlen(path) + 1];
   fullPath[0] = '\0';
   if(path[0] == '/'){
     strcat(fullPath, path);
@@ -345,110 +537,132 @@ int oufs_rmdir(char *cwd, char *path){
   int inodeToRemoveReference = get_inode_reference_from_path(fullPath);
   if(inodeToRemoveReference == -1){
     fprintf(stderr, "Path does not exist\n");
+    return 0;
   }
-  else{
-    //Open the inode
-    INODE inodeToRemove;
-    oufs_read_inode_by_reference(inodeToRemoveReference, &inodeToRemove);
-
-    //If the directory is not empty, throw error
-    if(inodeToRemove.size > 2){
-      fprintf(stderr, "ERROR: Directory not empty\n");
-      return -1;
-    }
 
-    //Get parent inode reference
-    int parentInodeReference;
-    for(int i = 0; i < BLOCKS_PER_INODE; ++i){
-      if(inodeToRemove.data[i] != UNALLOCATED_BLOCK){ //Step through available blocks referenced in data
-        int ref = inodeToRemove.data[i];
-        BLOCK block;
-        vdisk_read_block(ref, &block); //Open allocated block
-        for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){ //Step through entries in the block
-          if(!strcmp(block.directory.entry[j].name, "..")){ //If the entry's name is '..' (meaning parent)...
-            parentInodeReference = block.directory.entry[j].inode_reference; // Store the parent inode reference
-
-            //Mark the inode and the inode's data block as unallocated in the master block allocation tables
-            BLOCK masterBlock;
-            vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
-            masterBlock.master.block_allocated_flag[ref / 8] &= ~(1  << (ref % 8));
-            masterBlock.master.inode_allocated_flag[inodeToRemoveReference / 8] &= ~(1 << (inodeToRemoveReference % 8));
-            vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
-            break;
-          }
-        }
-      }
-    }
+  //Get parent inode reference from the '..' entry
+  oufs_lock_inode(inodeToRemoveReference, 0);
+  int parentInodeReference = oufs_find_directory_entry(inodeToRemoveReference, "..", NULL, NULL);
+  oufs_unlock_inode(inodeToRemoveReference);
+  if(parentInodeReference == UNALLOCATED_INODE){
+    fprintf(stderr, "Path does not exist\n");
+    return 0;
+  }
 
-    //Get the parent inode location information
-    int parentInodeBlockReference = parentInodeReference / INODES_PER_BLOCK + 1;
-    int parentInodeBlockIndex = parentInodeReference % INODES_PER_BLOCK;
-
-    //Open the parent block
-    BLOCK parentBlock;
-    vdisk_read_block(parentInodeBlockReference, &parentBlock);
-
-    for(int i = 0; i < BLOCKS_PER_INODE; ++i){ //Step through all blocks in the inode
-      int ref = parentBlock.inodes.inode[parentInodeBlockIndex].data[i];
-      if(ref != UNALLOCATED_BLOCK){ //If the block has data in it
-        BLOCK block;
-        vdisk_read_block(ref, &block);
-        for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){ //Step through the directory entries in the block
-          int inodeRef = block.directory.entry[j].inode_reference;
-          if(inodeRef == inodeToRemoveReference){ //if the inode referenced by a directory entry is the inode being removed...
-            memset(block.directory.entry[j].name, 0, strlen(block.directory.entry[j].name)); //Empty the name in the data block
-            block.directory.entry[j].inode_reference = UNALLOCATED_INODE; //Mark the inode as unallocated
-            vdisk_write_block(ref, &block); //Write the block back to the disk
-            parentBlock.inodes.inode[parentInodeBlockReference].data[ref] = UNALLOCATED_BLOCK;
-          }
-        }
+  //Lock both, then check that another thread did not move or remove the directory meanwhile
+  INODE_REFERENCE locked[2] = {parentInodeReference, inodeToRemoveReference};
+  oufs_lock_inodes(locked, 2);
+  INODE inodeToRemove;
+  oufs_read_inode_by_reference(inodeToRemoveReference, &inodeToRemove);
+  BLOCK_REFERENCE entryBlockReference;
+  int entry = -1;
+  if(inodeToRemove.type != IT_DIRECTORY
+     || oufs_find_directory_entry(inodeToRemoveReference, "..", NULL, NULL) != parentInodeReference){
+    oufs_unlock_inodes(locked, 2);
+    fprintf(stderr, "Path does not exist\n");
+    return 0;
+  }
+  for(int i = 0; i < BLOCKS_PER_INODE && entry < 0; ++i){ //Find the parent's entry for the directory
+    INODE parentInode;
+    oufs_read_inode_by_reference(parentInodeReference, &parentInode);
+    int ref = parentInode.data[i];
+    if(ref != UNALLOCATED_BLOCK){
+      BLOCK block;
+      vdisk_read_block(ref, &block);
+      OUFS_ENTRY_MASK match = oufs_scan_inode(&block.directory, inodeToRemoveReference);
+      if(match){
+        entryBlockReference = ref;
+        entry = __builtin_ctzll(match);
       }
     }
-    //Decrement the parent inode's size
-    --parentBlock.inodes.inode[parentInodeBlockIndex].size;
-    vdisk_write_block(parentInodeBlockReference, &parentBlock); //Write that block back
+  }
+  if(entry < 0){
+    oufs_unlock_inodes(locked, 2);
+    fprintf(stderr, "Path does not exist\n");
+    return 0;
+  }
 
-    //Get the location information of the inode being removed
-    int inodeBlockReference = inodeToRemoveReference / INODES_PER_BLOCK + 1;
-    int index = inodeToRemoveReference % INODES_PER_BLOCK;
+  //If the directory is not empty, throw error
+  if(inodeToRemove.size > 2){
+    oufs_unlock_inodes(locked, 2);
+    fprintf(stderr, "ERROR: Directory not empty\n");
+    return -1;
+  }
 
-    //Open the block containing the inode
-    BLOCK inodeBlock;
-    vdisk_read_block(inodeBlockReference, &inodeBlock);
+  //All the blocks below are written together
+  if(vdisk_begin_transaction() != 0){
+    oufs_unlock_inodes(locked, 2);
+    return -1;
+  }
 
-    for(int i = 0; i < BLOCKS_PER_INODE; ++i){
-      int dirBlockRef = 0;
+  //Empty the removed directory's blocks and inode while they are still
+  //allocated: once released, another thread in the transaction may reuse them
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i){
+    int dirBlockRef = inodeToRemove.data[i];
+    if(dirBlockRef != UNALLOCATED_BLOCK){
       BLOCK dirBlock;
-      dirBlockRef = inodeBlock.inodes.inode[index].data[i];
-      if(dirBlockRef != UNALLOCATED_BLOCK){
-        vdisk_read_block(dirBlockRef, &dirBlock);
-        for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
-            memset(dirBlock.directory.entry[j].name, 0, strlen(dirBlock.directory.entry[j].name)); //Empty the name in the data block
-            dirBlock.directory.entry[j].inode_reference = 0;
-        }
-        vdisk_write_block(dirBlockRef, &dirBlock);
+      vdisk_read_block(dirBlockRef, &dirBlock);
+      for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+          memset(dirBlock.directory.entry[j].name, 0, strlen(dirBlock.directory.entry[j].name)); //Empty the name in the data block
+          dirBlock.directory.entry[j].inode_reference = 0;
       }
+      vdisk_write_block(dirBlockRef, &dirBlock);
     }
+  }
 
-    //Go to that specific inode and 0 everything out
-    inodeBlock.inodes.inode[index].type = 0;
-    inodeBlock.inodes.inode[index].n_references = 0;
-    for(int i = 0; i < BLOCKS_PER_INODE; ++i){
-      inodeBlock.inodes.inode[index].data[i] = 0;
-    }
-    inodeBlock.inodes.inode[index].size = 0;
+  //Remember its blocks, then go to that specific inode and 0 everything out
+  BLOCK_REFERENCE dataBlocks[BLOCKS_PER_INODE];
+  memcpy(dataBlocks, inodeToRemove.data, sizeof(dataBlocks));
+  inodeToRemove.type = 0;
+  inodeToRemove.n_references = 0;
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i){
+    inodeToRemove.data[i] = 0;
+  }
+  inodeToRemove.size = 0;
+  oufs_write_inode_by_reference(inodeToRemoveReference, &inodeToRemove);
 
-    //Write the block that contains the removed inode back to the disk
-    vdisk_write_block(inodeBlockReference, &inodeBlock);
+  //Mark the inode and the inode's data blocks as unallocated in the master block allocation tables
+  oufs_lock_block(MASTER_BLOCK_REFERENCE);
+  BLOCK masterBlock;
+  vdisk_read_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i){
+    int ref = dataBlocks[i];
+    if(ref != UNALLOCATED_BLOCK){
+      masterBlock.master.block_allocated_flag[ref / 8] &= ~(1  << (ref % 8));
+    }
   }
+  masterBlock.master.inode_allocated_flag[inodeToRemoveReference / 8] &= ~(1 << (inodeToRemoveReference % 8));
+  vdisk_write_block(MASTER_BLOCK_REFERENCE, &masterBlock);
+  oufs_unlock_block(MASTER_BLOCK_REFERENCE);
 
-  return 0;
+  //Remove the entry from the parent
+  BLOCK block;
+  vdisk_read_block(entryBlockReference, &block);
+  memset(block.directory.entry[entry].name, 0, strlen(block.directory.entry[entry].name)); //Empty the name in the data block
+  block.directory.entry[entry].inode_reference = UNALLOCATED_INODE; //Mark the inode as unallocated
+  vdisk_write_block(entryBlockReference, &block); //Write the block back to the disk
+
+  //Decrement the parent inode's size
+  oufs_adjust_inode_size(parentInodeReference, -1);
+
+  int ret = vdisk_commit_transaction();
+  oufs_unlock_inodes(locked, 2);
+  return ret == 0 ? 0 : -1;
 }
 
 // Lists the files and directories inside a specific directory
-int oufs_list(char *cwd, char *path){
+static int oufs_list_untraced(char *cwd, char *path);
+
+int oufs_list(char *cwd, char *path) {
+  int outer = oufs_trace_begin(OUFS_OP_LIST);
+  int ret = oufs_list_untraced(cwd, path);
+  oufs_trace_end(outer);
+  return ret;
+}
+
+static int oufs_list_untraced(char *cwd, char *path){
   //Creates the full path to the target (directory whose children are listed)
-  char fullPath[strlen(cwd) + strlen(path)];
+  char fullPath[strlen(cwd) + strlen(path) + 1];
   fullPath[0] = '\0';
   if(path[0] == '/'){
     strcat(fullPath, path);
@@ -458,6 +672,11 @@ int oufs_list(char *cwd, char *path){
     strcat(fullPath, path);
   }
 
+  //The lookup below takes the path apart: keep the name of the target
+  char targetName[strlen(fullPath) + 1];
+  strcpy(targetName, fullPath);
+  char *baseName = basename(targetName);
+
   //Gets the inode reference from the path, opens the inode, and stores in 'inode'
   INODE inode;
   int inodeReference = get_inode_reference_from_path(fullPath);//Gets inode reference from path
@@ -466,34 +685,56 @@ int oufs_list(char *cwd, char *path){
     return -1;
   }
   else{
+    oufs_lock_inode(inodeReference, 0);//No entries change while they are read
     oufs_read_inode_by_reference(inodeReference, &inode);//Opens inode
   }
 
-  //Stores directory names from inode in array
-  char* dirNames[DIRECTORY_ENTRIES_PER_BLOCK];
-  //Initialize the array
-  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i){
-    dirNames[i] = "";
+  //A file is listed by itself; its data is not directory entries
+  if(inode.type != IT_DIRECTORY){
+    oufs_unlock_inode(inodeReference);
+    if(inode.type != IT_FILE){
+      fprintf(stderr, "ERROR: Directory does not exist\n");
+      return -1;
+    }
+    printf("%s\n", baseName);
+    fflush(stdout);
+    return 0;
   }
+
+  //Stores directory names from every block of the inode in array.  The
+  //byte after each name's terminator holds the type of its inode.
+  static __thread char names[BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK][FILE_NAME_SIZE + 2];
+  char* dirNames[BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK];
+  int nNames = 0;
   for(int i = 0; i < BLOCKS_PER_INODE; ++i){ //Step through each block in the inode
     BLOCK block;
     if(inode.data[i] != UNALLOCATED_BLOCK){ //If the block in the inode points to a valid data block
       vdisk_read_block(inode.data[i], &block); //Open the block
-      for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){//Step through the block
-        if(block.directory.entry[j].inode_reference != UNALLOCATED_INODE){//If the block contains valid directories
-          dirNames[j] = block.directory.entry[j].name; //Store the directory name in the array
+      //Step through the entries in use
+      OUFS_ENTRY_MASK used = ~oufs_scan_inode(&block.directory, UNALLOCATED_INODE);
+      for(int j = 0; j < (int) DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+        if((used >> j) & 1){
+          //Copy the name out of the block, which the next one replaces
+          memcpy(names[nNames], block.directory.entry[j].name, FILE_NAME_SIZE);
+          names[nNames][FILE_NAME_SIZE] = '\0';
+          INODE child;
+          if(oufs_read_inode_by_reference(block.directory.entry[j].inode_reference, &child) != 0)
+            child.type = IT_NONE;
+          names[nNames][FILE_NAME_SIZE + 1] = child.type;
+          dirNames[nNames] = names[nNames];
+          ++nNames;
         }
       }
     }
   }
-
-  //Sorts the directory names in alphabetical order and prints out
-  qsort(dirNames, DIRECTORY_ENTRIES_PER_BLOCK, sizeof(char*), comparator);
-  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i){
-    if(strcmp(dirNames[i], "")){//If the name is not empty
-      printf("%s/\n", dirNames[i]);//Print it out
-      fflush(stdout);
-    }
+  oufs_unlock_inode(inodeReference);
+
+  //Sorts the directory names in alphabetical order and prints out;
+  //only directories get a '/'
+  qsort(dirNames, nNames, sizeof(char*), comparator);
+  for(int i = 0; i < nNames; ++i){
+    printf("%s%s\n", dirNames[i], dirNames[i][FILE_NAME_SIZE + 1] == IT_DIRECTORY ? "/" : "");//Print it out
+    fflush(stdout);
   }
   return 0;
 }
@@ -501,13 +742,17 @@ int oufs_list(char *cwd, char *path){
 int get_inode_reference_from_path(char* path){
 
     int currentInodeReference = 0;
-    char* token = strtok(path, "/");
+    char* save;
+    char* token = strtok_r(path, "/", &save);
     while(token != NULL){
-        currentInodeReference = get_inode_reference_from_path_helper(currentInodeReference, token);
+        oufs_lock_inode(currentInodeReference, 0);
+        int next = get_inode_reference_from_path_helper(currentInodeReference, token);
+        oufs_unlock_inode(currentInodeReference);
+        currentInodeReference = next;
         if(currentInodeReference == -1){
           return -1;
         }
-        token = strtok(NULL, "/");
+        token = strtok_r(NULL, "/", &save);
     }
     return currentInodeReference;
 }
@@ -526,19 +771,318 @@ int get_inode_reference_from_path_helper(INODE_REFERENCE parentInodeReference, c
       BLOCK_REFERENCE currentBlockRef = inode.data[i];
       BLOCK dirBlock;
       vdisk_read_block(currentBlockRef, &dirBlock);
-      for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
-        if(dirBlock.directory.entry[j].inode_reference != UNALLOCATED_INODE){
-          if(!strncmp(dirBlock.directory.entry[j].name, name, strlen(name))){
-              returner = dirBlock.directory.entry[j].inode_reference;
-              break;
-          }
-        }
+      OUFS_ENTRY_MASK match = oufs_scan_name(&dirBlock.directory, name); //All the block's entries at once
+      if(match){
+        returner = dirBlock.directory.entry[__builtin_ctzll(match)].inode_reference;
       }
     }
   }
   return returner;
 }
 
+/**
+ * Find the directory entry with the given name inside a directory
+ *
+ * @param directory Inode reference of the directory to search
+ * @param name Name of the entry
+ * @param block_ref If not NULL, set to the directory block holding the entry
+ * @param entry If not NULL, set to the index of the entry within that block
+ * @return The inode reference of the entry; UNALLOCATED_INODE if it does not exist
+ */
+INODE_REFERENCE oufs_find_directory_entry(INODE_REFERENCE directory, char *name,
+                                          BLOCK_REFERENCE *block_ref, int *entry)
+{
+  INODE inode;
+  if(oufs_read_inode_by_reference(directory, &inode) != 0 || inode.type != IT_DIRECTORY)
+    return(UNALLOCATED_INODE);
+
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i){
+    if(inode.data[i] != UNALLOCATED_BLOCK){
+      BLOCK dirBlock;
+      vdisk_read_block(inode.data[i], &dirBlock);
+      OUFS_ENTRY_MASK match = oufs_scan_name(&dirBlock.directory, name);
+      if(match){
+        int j = __builtin_ctzll(match);
+        if(block_ref != NULL)
+          *block_ref = inode.data[i];
+        if(entry != NULL)
+          *entry = j;
+        return(dirBlock.directory.entry[j].inode_reference);
+      }
+    }
+  }
+  return(UNALLOCATED_INODE);
+}
+
+/**
+ * Find the first free directory entry inside a directory
+ *
+ * @param directory Inode reference of the directory to search
+ * @param block_ref Set to the directory block holding the free entry
+ * @param entry Set to the index of the free entry within that block
+ * @return 0 if a free entry was found; -1 if the directory is full
+ */
+int oufs_find_free_directory_entry(INODE_REFERENCE directory, BLOCK_REFERENCE *block_ref, int *entry)
+{
+  INODE inode;
+  if(oufs_read_inode_by_reference(directory, &inode) != 0)
+    return(-1);
+
+  for(int i = 0; i < BLOCKS_PER_INODE; ++i){
+    if(inode.data[i] != UNALLOCATED_BLOCK){
+      BLOCK dirBlock;
+      vdisk_read_block(inode.data[i], &dirBlock);
+      OUFS_ENTRY_MASK free_entries = oufs_scan_inode(&dirBlock.directory, UNALLOCATED_INODE);
+      if(free_entries){
+        *block_ref = inode.data[i];
+        *entry = __builtin_ctzll(free_entries);
+        return(0);
+      }
+    }
+  }
+  return(-1);
+}
+
+/**
+ * Resolve a path to its parent directory and the named child
+ *
+ * @param cwd Current working directory
+ * @param path Absolute path, or path relative to cwd
+ * @param parent Set to the inode of the directory containing the last path element
+ * @param child Set to the inode of the last path element; UNALLOCATED_INODE if it does not exist
+ * @param local_name Set to the last path element (at least FILE_NAME_SIZE+1 bytes); empty for "/"
+ * @return 0 if the parent directory exists; -1 otherwise
+ */
+static int oufs_find_file_untraced(char *cwd, char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
+
+int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
+{
+  int outer = oufs_trace_begin(OUFS_OP_LOOKUP);
+  int ret = oufs_find_file_untraced(cwd, path, parent, child, local_name);
+  oufs_trace_end(outer);
+  return(ret);
+}
+
+static int oufs_find_file_untraced(char *cwd, char *path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
+{
+  // Build the absolute path in a private buffer: strtok_r modifies it
+  char fullPath[2 * MAX_PATH_LENGTH + 2];
+  if(path[0] == '/')
+    snprintf(fullPath, sizeof(fullPath), "%s", path);
+  else
+    snprintf(fullPath, sizeof(fullPath), "%s/%s", cwd, path);
+
+  // Start at the root directory: it is its own parent
+  *parent = 0;
+  *child = 0;
+  local_name[0] = 0;
+
+  char *save;
+  char *token = strtok_r(fullPath, "/", &save);
+  while(token != NULL){
+    // Every element but the last must be an existing directory
+    if(*child == UNALLOCATED_INODE)
+      return(-1);
+    *parent = *child;
+    strncpy(local_name, token, FILE_NAME_SIZE);
+    local_name[FILE_NAME_SIZE] = 0;
+    oufs_lock_inode(*parent, 0);
+    *child = oufs_find_directory_entry(*parent, token, NULL, NULL);
+    oufs_unlock_inode(*parent);
+    token = strtok_r(NULL, "/", &save);
+  }
+  return(0);
+}
+
+/**
+ * Check whether a directory lies inside the tree rooted at another
+ *
+ * @param ancestor Root of the tree
+ * @param directory Directory to check
+ * @return 1 if directory is ancestor or one of its descendants; 0 otherwise
+ */
+static int oufs_is_descendant(INODE_REFERENCE ancestor, INODE_REFERENCE directory)
+{
+  // Follow the .. entries up to the root
+  for(int depth = 0; depth < N_INODES; ++depth){
+    if(directory == ancestor)
+      return(1);
+    if(directory == 0)
+      return(0);
+    directory = oufs_find_directory_entry(directory, "..", NULL, NULL);
+    if(directory == UNALLOCATED_INODE)
+      return(0);
+  }
+  return(0);
+}
+
+/**
+ * Add n to the size of an inode
+ */
+static int oufs_adjust_inode_size(INODE_REFERENCE i, int n)
+{
+  INODE inode;
+  if(oufs_read_inode_by_reference(i, &inode) != 0)
+    return(-1);
+  inode.size += n;
+  return(oufs_write_inode_by_reference(i, &inode));
+}
+
+/**
+ * Move a file or directory to a new parent and/or name
+ *
+ * Only the source and destination directory blocks, the inodes of the two
+ * parents and (for a directory) the block holding its .. entry are
+ * rewritten.  All of them are committed in one transaction.
+ *
+ * If dst names an existing directory, src is moved into it under its
+ * current name.
+ *
+ * @param cwd Current working directory
+ * @param src Path of the entry to move
+ * @param dst New path of the entry
+ * @return 0 on success; -1 on error
+ */
+static int oufs_rename_unlocked(char *cwd, char *src, char *dst);
+
+int oufs_rename(char *cwd, char *src, char *dst)
+{
+  //Renames are made one at a time (see oufs_lock.c)
+  int outer = oufs_trace_begin(OUFS_OP_RENAME);
+  oufs_lock_rename();
+  int ret = oufs_rename_unlocked(cwd, src, dst);
+  oufs_unlock_rename();
+  oufs_trace_end(outer);
+  return ret;
+}
+
+static int oufs_rename_unlocked(char *cwd, char *src, char *dst)
+{
+  INODE_REFERENCE srcParent, srcInodeReference;
+  char srcName[FILE_NAME_SIZE + 1];
+  if(oufs_find_file(cwd, src, &srcParent, &srcInodeReference, srcName) != 0
+     || srcInodeReference == UNALLOCATED_INODE){
+    fprintf(stderr, "ERROR: Source does not exist\n");
+    return -1;
+  }
+  if(srcInodeReference == 0 || !strcmp(srcName, ".") || !strcmp(srcName, "..")){
+    fprintf(stderr, "ERROR: cannot move %s\n", srcInodeReference == 0 ? "root directory" : srcName);
+    return -1;
+  }
+
+  INODE_REFERENCE dstParent, dstInodeReference;
+  char dstName[FILE_NAME_SIZE + 1];
+  if(oufs_find_file(cwd, dst, &dstParent, &dstInodeReference, dstName) != 0){
+    fprintf(stderr, "ERROR: parent does not exist\n");
+    return -1;
+  }
+
+  //Moving into an existing directory keeps the source name
+  if(dstInodeReference != UNALLOCATED_INODE){
+    INODE dstInode;
+    oufs_read_inode_by_reference(dstInodeReference, &dstInode);
+    if(dstInode.type != IT_DIRECTORY){
+      fprintf(stderr, "ERROR: Destination already exists\n");
+      return -1;
+    }
+    dstParent = dstInodeReference;
+    strncpy(dstName, srcName, FILE_NAME_SIZE + 1);
+    if(oufs_find_directory_entry(dstParent, dstName, NULL, NULL) != UNALLOCATED_INODE){
+      fprintf(stderr, "ERROR: Destination already exists\n");
+      return -1;
+    }
+  }
+  if(strlen(dstName) >= FILE_NAME_SIZE){
+    fprintf(stderr, "ERROR: Name too long\n");
+    return -1;
+  }
+
+  //A directory cannot be moved inside itself
+  if(oufs_is_descendant(srcInodeReference, dstParent)){
+    fprintf(stderr, "ERROR: cannot move a directory inside itself\n");
+    return -1;
+  }
+
+  //Lock the directories changed, then check that mkdir, rmdir or a new
+  //file in another thread did not change what was looked up
+  INODE_REFERENCE locked[3] = {srcParent, dstParent, srcInodeReference};
+  oufs_lock_inodes(locked, 3);
+  BLOCK_REFERENCE srcBlockReference;
+  int srcEntry;
+  if(oufs_find_directory_entry(srcParent, srcName, &srcBlockReference, &srcEntry) != srcInodeReference){
+    oufs_unlock_inodes(locked, 3);
+    fprintf(stderr, "ERROR: Source does not exist\n");
+    return -1;
+  }
+  INODE dstParentInode;
+  oufs_read_inode_by_reference(dstParent, &dstParentInode);
+  if(dstParentInode.type != IT_DIRECTORY){
+    oufs_unlock_inodes(locked, 3);
+    fprintf(stderr, "ERROR: parent does not exist\n");
+    return -1;
+  }
+  if(!(srcParent == dstParent && !strncmp(srcName, dstName, FILE_NAME_SIZE))
+     && oufs_find_directory_entry(dstParent, dstName, NULL, NULL) != UNALLOCATED_INODE){
+    oufs_unlock_inodes(locked, 3);
+    fprintf(stderr, "ERROR: Destination already exists\n");
+    return -1;
+  }
+
+  if(vdisk_begin_transaction() != 0){
+    oufs_unlock_inodes(locked, 3);
+    return -1;
+  }
+
+  BLOCK block;
+  if(srcParent == dstParent){
+    //Same directory: only the name changes
+    vdisk_read_block(srcBlockReference, &block);
+    strncpy(block.directory.entry[srcEntry].name, dstName, FILE_NAME_SIZE);
+    vdisk_write_block(srcBlockReference, &block);
+  }
+  else{
+    BLOCK_REFERENCE dstBlockReference;
+    int dstEntry;
+    if(oufs_find_free_directory_entry(dstParent, &dstBlockReference, &dstEntry) != 0){
+      fprintf(stderr, "ERROR: Block full\n");
+      vdisk_abort_transaction();
+      oufs_unlock_inodes(locked, 3);
+      return -1;
+    }
+
+    //Remove the entry from the source directory
+    vdisk_read_block(srcBlockReference, &block);
+    oufs_clean_directory_entry(&block.directory.entry[srcEntry]);
+    vdisk_write_block(srcBlockReference, &block);
+
+    //Add it to the destination directory
+    vdisk_read_block(dstBlockReference, &block);
+    strncpy(block.directory.entry[dstEntry].name, dstName, FILE_NAME_SIZE);
+    block.directory.entry[dstEntry].inode_reference = srcInodeReference;
+    vdisk_write_block(dstBlockReference, &block);
+
+    //A moved directory gets a new parent
+    BLOCK_REFERENCE dotdotBlockReference;
+    int dotdotEntry;
+    if(oufs_find_directory_entry(srcInodeReference, "..", &dotdotBlockReference, &dotdotEntry) != UNALLOCATED_INODE){
+      vdisk_read_block(dotdotBlockReference, &block);
+      block.directory.entry[dotdotEntry].inode_reference = dstParent;
+      vdisk_write_block(dotdotBlockReference, &block);
+    }
+
+    oufs_adjust_inode_size(srcParent, -1);
+    oufs_adjust_inode_size(dstParent, 1);
+  }
+
+  int ret = vdisk_commit_transaction();
+  oufs_unlock_inodes(locked, 3);
+  if(ret != 0){
+    fprintf(stderr, "ERROR: unable to commit rename\n");
+    return -1;
+  }
+  return 0;
+}
+
 // https://stackoverflow.com/questions/43099269/qsort-function-in-c-used-to-compare-an-array-of-strings
 //Sorts an array in alphabetical order
 int comparator(const void* p, const void* q){
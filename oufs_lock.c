@@ -0,0 +1,158 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include "oufs_lib.h"
+
+/*
+ * Locks that make the library (oufs_lib_support.c, oufs_file.c) safe to
+ * call from several threads on one open disk, and from several processes
+ * with the same disk open.  The whole-disk image tools (oufs_image.c) lock
+ * the whole disk instead.
+ *
+ * A thread only waits for a lock that comes later in this list than every
+ * lock it holds:
+ *
+ *  1. The rename lock.  oufs_rename() takes it first, so that the tree
+ *     cannot change shape while it checks that a directory is not being
+ *     moved inside itself.  Also a vdisk slot, for other processes.
+ *  2. Inode locks, one reader/writer lock per inode.  An operation locks
+ *     the directories whose entries it changes and the files whose data it
+ *     reads or writes.  Several are taken in increasing inode order
+ *     (oufs_lock_inodes()).  Path lookups lock one directory at a time
+ *     while reading it, before the operation takes its own inode locks, so
+ *     the operation checks again what it looked up once it holds them.
+ *     The first thread of the process to lock an inode also locks the
+ *     inode's slot in vdisk, against other processes; the last to unlock
+ *     it releases the slot.
+ *  3. The vdisk transaction.  Joined after the inode locks; no inode lock
+ *     is taken inside it, since committing may wait for the other threads
+ *     in the same transaction.  A process with a transaction in progress
+ *     holds vdisk's writer lock, which keeps the other processes' writes
+ *     out until its transactions are on the disk.
+ *  4. Block locks, for read-modify-write of the blocks that inodes share:
+ *     the master block (allocation tables), and the blocks of the
+ *     in-memory inode table (oufs_inode.c, which takes its own locks).
+ *     Held for one read-modify-write only, never two at once.  Writes made
+ *     inside the transaction are seen by every thread at once (vdisk.c),
+ *     so they need not be held until the commit.  Only taken inside a
+ *     transaction, so other processes are already kept out.
+ *  5. vdisk's own locks.
+ */
+
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t inode_lock[N_INODES] = { [0 ... N_INODES - 1] = PTHREAD_RWLOCK_INITIALIZER };
+static pthread_mutex_t block_lock[N_INODE_BLOCKS + 1] = { [0 ... N_INODE_BLOCKS] = PTHREAD_MUTEX_INITIALIZER };
+
+// Threads of this process holding each inode lock, and the slots locked
+// in vdisk: inode i uses slot i, the rename lock the one after them
+static int inode_holders[N_INODES];
+static pthread_mutex_t holders_lock[N_INODES] = { [0 ... N_INODES - 1] = PTHREAD_MUTEX_INITIALIZER };
+#define RENAME_SLOT N_INODES
+
+_Static_assert(RENAME_SLOT < VDISK_N_LOCK_SLOTS, "vdisk needs a lock slot per inode");
+
+/**
+ * Lock an inode
+ *
+ * @param i Inode reference (references past the inode table are ignored)
+ * @param exclusive 1 to change the inode or its blocks; 0 to read them
+ */
+void oufs_lock_inode(INODE_REFERENCE i, int exclusive)
+{
+  if(i >= N_INODES)
+    return;
+  if(exclusive)
+    pthread_rwlock_wrlock(&inode_lock[i]);
+  else
+    pthread_rwlock_rdlock(&inode_lock[i]);
+
+  //An exclusive lock is only granted with no other holder in the process
+  pthread_mutex_lock(&holders_lock[i]);
+  if(inode_holders[i]++ == 0)
+    vdisk_lock_slot(i, exclusive);
+  pthread_mutex_unlock(&holders_lock[i]);
+}
+
+/**
+ * Release an inode locked by oufs_lock_inode()
+ */
+void oufs_unlock_inode(INODE_REFERENCE i)
+{
+  if(i >= N_INODES)
+    return;
+  pthread_mutex_lock(&holders_lock[i]);
+  if(--inode_holders[i] == 0)
+    vdisk_unlock_slot(i);
+  pthread_mutex_unlock(&holders_lock[i]);
+  pthread_rwlock_unlock(&inode_lock[i]);
+}
+
+static int oufs_compare_inodes(const void *p, const void *q)
+{
+  return(*(INODE_REFERENCE *) p - *(INODE_REFERENCE *) q);
+}
+
+/**
+ * Lock several inodes exclusively, in increasing order.  The list is
+ * sorted in place; repeated and unallocated references are locked once
+ * or not at all.
+ *
+ * @param inodes Inode references
+ * @param n Number of references
+ */
+void oufs_lock_inodes(INODE_REFERENCE *inodes, int n)
+{
+  qsort(inodes, n, sizeof(INODE_REFERENCE), oufs_compare_inodes);
+  for(int k = 0; k < n; ++k){
+    if(k == 0 || inodes[k] != inodes[k - 1])
+      oufs_lock_inode(inodes[k], 1);
+  }
+}
+
+/**
+ * Release inodes locked by oufs_lock_inodes()
+ */
+void oufs_unlock_inodes(INODE_REFERENCE *inodes, int n)
+{
+  for(int k = n - 1; k >= 0; --k){
+    if(k == 0 || inodes[k] != inodes[k - 1])
+      oufs_unlock_inode(inodes[k]);
+  }
+}
+
+/**
+ * Lock the master block or an inode table block for a read-modify-write
+ *
+ * @param b MASTER_BLOCK_REFERENCE or an inode table block
+ */
+void oufs_lock_block(BLOCK_REFERENCE b)
+{
+  if(b <= N_INODE_BLOCKS)
+    pthread_mutex_lock(&block_lock[b]);
+}
+
+/**
+ * Release a block locked by oufs_lock_block()
+ */
+void oufs_unlock_block(BLOCK_REFERENCE b)
+{
+  if(b <= N_INODE_BLOCKS)
+    pthread_mutex_unlock(&block_lock[b]);
+}
+
+/**
+ * Take the rename lock (see above)
+ */
+void oufs_lock_rename()
+{
+  pthread_mutex_lock(&rename_lock);
+  vdisk_lock_slot(RENAME_SLOT, 1);
+}
+
+/**
+ * Release the rename lock
+ */
+void oufs_unlock_rename()
+{
+  vdisk_unlock_slot(RENAME_SLOT);
+  pthread_mutex_unlock(&rename_lock);
+}
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "oufs_lib.h"
+/*
+ * Directory block scans.
+ *
+ * A scan compares every entry of a directory block with a key and returns
+ * a mask with bit j set for each entry j that matches.  A DIRECTORY_ENTRY
+ * is 16 bytes, the name followed by the inode reference, so an entry is
+ * one SSE2 vector and two entries one AVX2 vector: each is compared with
+ * the key in one instruction, and which bytes must match is checked on the
+ * resulting byte mask.  AVX2 is used when the CPU has it, SSE2 otherwise
+ * (every x86-64 CPU has it), and plain loops on other CPUs.  The choice is
+ * made once, on first use; ZSCAN=soft, sse2 or avx2 asks for one (the best
+ * the CPU has, if not that), so that each can be tested.
+ */
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+_Static_assert(DIRECTORY_ENTRIES_PER_BLOCK <= 64, "a scan mask has a bit per entry");
+
+// Vector scans need an entry to be exactly the name and the reference
+#define SCAN_VECTOR (sizeof(DIRECTORY_ENTRY) == 16 && offsetof(DIRECTORY_ENTRY, inode_reference) == FILE_NAME_SIZE)
+
+// Bits of an entry's byte mask: the inode reference, and the name bytes
+#define SCAN_INODE_BITS 0xc000
+
+// The block geometry as ints, for loop bounds
+#define SCAN_ENTRIES ((int) DIRECTORY_ENTRIES_PER_BLOCK)
+#define SCAN_NAME_SIZE ((int) FILE_NAME_SIZE)
+
+/**
+ * A scan key: the bytes an entry must have, and a byte mask (one bit per
+ * byte of an entry) of those that must match
+ */
+typedef struct scan_key_s
+{
+  DIRECTORY_ENTRY entry;
+  unsigned int bytes;
+  // The entry must not be free (name scans)
+  int in_use;
+} SCAN_KEY;
+
+static OUFS_ENTRY_MASK (*scan_block)(DIRECTORY_BLOCK *block, SCAN_KEY *key) = NULL;
+
+/**
+ * Compare each entry with the key, a byte at a time
+ */
+static OUFS_ENTRY_MASK scan_block_soft(DIRECTORY_BLOCK *block, SCAN_KEY *key)
+{
+  OUFS_ENTRY_MASK mask = 0;
+  for(int j = 0; j < SCAN_ENTRIES; ++j){
+    DIRECTORY_ENTRY *entry = &block->entry[j];
+    int match = key->in_use ? entry->inode_reference != UNALLOCATED_INODE
+      : entry->inode_reference == key->entry.inode_reference;
+    for(int b = 0; b < SCAN_NAME_SIZE && match; ++b){
+      if((key->bytes >> b) & 1)
+        match = entry->name[b] == key->entry.name[b];
+    }
+    mask |= (OUFS_ENTRY_MASK) match << j;
+  }
+  return(mask);
+}
+
+#if defined(__x86_64__)
+/**
+ * Turn an entry's byte mask (bit b set if byte b matched the key) into a
+ * match
+ */
+static inline int scan_match(unsigned int bits, SCAN_KEY *key)
+{
+  if(key->in_use)
+    return((bits & key->bytes) == key->bytes && (bits & SCAN_INODE_BITS) != SCAN_INODE_BITS);
+  return((bits & key->bytes) == key->bytes);
+}
+
+/**
+ * Compare each entry with the key, an entry per SSE2 instruction
+ */
+static OUFS_ENTRY_MASK scan_block_sse2(DIRECTORY_BLOCK *block, SCAN_KEY *key)
+{
+  __m128i k = _mm_loadu_si128((__m128i *) &key->entry);
+  OUFS_ENTRY_MASK mask = 0;
+  for(int j = 0; j < SCAN_ENTRIES; ++j){
+    __m128i e = _mm_loadu_si128((__m128i *) &block->entry[j]);
+    unsigned int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(e, k));
+    mask |= (OUFS_ENTRY_MASK) scan_match(bits, key) << j;
+  }
+  return(mask);
+}
+
+/**
+ * Compare each entry with the key, two entries per AVX2 instruction
+ */
+__attribute__((target("avx2")))
+static OUFS_ENTRY_MASK scan_block_avx2(DIRECTORY_BLOCK *block, SCAN_KEY *key)
+{
+  __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) &key->entry));
+  OUFS_ENTRY_MASK mask = 0;
+  int j = 0;
+  for(; j + 1 < SCAN_ENTRIES; j += 2){
+    __m256i e = _mm256_loadu_si256((__m256i *) &block->entry[j]);
+    unsigned int bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(e, k));
+    mask |= (OUFS_ENTRY_MASK) scan_match(bits & 0xffff, key) << j;
+    mask |= (OUFS_ENTRY_MASK) scan_match(bits >> 16, key) << (j + 1);
+  }
+  if(j < SCAN_ENTRIES){
+    __m128i e = _mm_loadu_si128((__m128i *) &block->entry[j]);
+    unsigned int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(e, _mm256_castsi256_si128(k)));
+    mask |= (OUFS_ENTRY_MASK) scan_match(bits, key) << j;
+  }
+  return(mask);
+}
+#endif
+
+/**
+ * Pick the implementation
+ */
+static void scan_init()
+{
+  scan_block = scan_block_soft;
+#if defined(__x86_64__)
+  char *wanted = getenv("ZSCAN");
+  if(SCAN_VECTOR && (wanted == NULL || strcmp(wanted, "soft") != 0)) {
+    int avx2 = __builtin_cpu_supports("avx2") && (wanted == NULL || strcmp(wanted, "sse2") != 0);
+    scan_block = avx2 ? scan_block_avx2 : scan_block_sse2;
+  }
+#endif
+}
+
+static OUFS_ENTRY_MASK scan(DIRECTORY_BLOCK *block, SCAN_KEY *key)
+{
+  // Racing first calls pick the same implementation
+  if(scan_block == NULL)
+    scan_init();
+  return(scan_block(block, key));
+}
+
+/**
+ * Find the entries of a directory block that are in use and named name
+ * (compared as strncmp(..., FILE_NAME_SIZE) would)
+ *
+ * @param block Directory block
+ * @param name Name to look for
+ * @return Bit j set for each matching entry j
+ */
+OUFS_ENTRY_MASK oufs_scan_name(DIRECTORY_BLOCK *block, char *name)
+{
+  SCAN_KEY key;
+  memset(&key, 0, sizeof(key));
+  // The name's bytes and its terminating zero, if it has room for one
+  int length = (int) strlen(name) + 1;
+  if(length > SCAN_NAME_SIZE)
+    length = SCAN_NAME_SIZE;
+  memcpy(key.entry.name, name, length);
+  key.entry.inode_reference = UNALLOCATED_INODE;
+  key.bytes = (1u << length) - 1;
+  key.in_use = 1;
+  return(scan(block, &key));
+}
+
+/**
+ * Find the entries of a directory block that refer to an inode
+ *
+ * @param block Directory block
+ * @param i Inode reference; UNALLOCATED_INODE finds the free entries
+ * @return Bit j set for each matching entry j
+ */
+OUFS_ENTRY_MASK oufs_scan_inode(DIRECTORY_BLOCK *block, INODE_REFERENCE i)
+{
+  SCAN_KEY key;
+  memset(&key, 0, sizeof(key));
+  key.entry.inode_reference = i;
+  key.bytes = SCAN_INODE_BITS;
+  return(scan(block, &key));
+}
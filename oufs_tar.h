@@ -0,0 +1,85 @@
+#ifndef OUFS_TAR_H
+#define OUFS_TAR_H
+
+/*
+ * POSIX ustar archive headers, shared by zexport and zimport.
+ */
+
+#include <stddef.h>
+
+#define TAR_BLOCK_SIZE 512
+
+#define TAR_TYPE_FILE '0'
+#define TAR_TYPE_DIRECTORY '5'
+
+typedef struct tar_header_s
+{
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} TAR_HEADER;
+
+/**
+ * Parse an octal header field: optional leading spaces, octal digits, then
+ * a NUL or space (or the end of the field)
+ *
+ * @return 0 on success; -1 if the field holds no number or anything else
+ */
+static inline int tar_octal(const char *field, size_t len, unsigned long *value)
+{
+  size_t i = 0;
+  while(i < len && field[i] == ' ')
+    ++i;
+  size_t first = i;
+  *value = 0;
+  for(; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+    *value = *value * 8 + (field[i] - '0');
+  if(i == first || (i < len && field[i] != 0 && field[i] != ' '))
+    return -1;
+  return 0;
+}
+
+/**
+ * Whether a record is all zeros, as the two that end an archive
+ */
+static inline int tar_is_end(const TAR_HEADER *header)
+{
+  const unsigned char *p = (const unsigned char *) header;
+  for(int i = 0; i < TAR_BLOCK_SIZE; ++i){
+    if(p[i] != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * Checksum of a header: the byte sum with the checksum field as spaces
+ */
+static inline unsigned int tar_checksum(const TAR_HEADER *header)
+{
+  const unsigned char *p = (const unsigned char *) header;
+  unsigned int sum = 0;
+  for(int i = 0; i < TAR_BLOCK_SIZE; ++i){
+    if(i >= (int) offsetof(TAR_HEADER, checksum) && i < (int) (offsetof(TAR_HEADER, checksum) + sizeof(header->checksum)))
+      sum += ' ';
+    else
+      sum += p[i];
+  }
+  return sum;
+}
+
+#endif
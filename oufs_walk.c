@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include "oufs_lib.h"
+
+/*
+ * Parallel tree walk (zfind, zdu).
+ *
+ * oufs_walk() visits every file and directory under a directory with a
+ * pool of threads.  Each thread keeps a deque of the directories it has
+ * still to expand: it pushes the subdirectories it finds and pops them
+ * from the same end, depth first, and a thread with nothing left steals
+ * from the other end of another thread's deque, which holds the
+ * directories nearest the top of the tree (the most work per steal).
+ *
+ * Inodes come from the inode table (oufs_inode.c), which oufs_mount()
+ * fills with one read.  Directory blocks are read into a table of the
+ * walk's own, so each is read once: when a directory is expanded, the
+ * blocks of its subdirectories are read ahead of the threads that will
+ * expand them, each run of neighbouring blocks (which the block group
+ * allocator makes common) with one read.
+ *
+ * The tree is not locked for the walk: a directory that changes meanwhile
+ * may be seen as it was before or after the change.
+ */
+
+#define debug 0
+
+// States of a directory block in the walk's table
+#define WALK_BLOCK_UNREAD 0
+#define WALK_BLOCK_READING 1
+#define WALK_BLOCK_READ 2
+#define WALK_BLOCK_FAILED 3
+
+// A directory to expand
+typedef struct walk_task_s
+{
+  INODE_REFERENCE inode_reference;
+  int depth;
+  char path[MAX_PATH_LENGTH];
+} WALK_TASK;
+
+// Directories queued by one thread.  The owner pushes and pops at the
+// bottom, thieves take from the top.  Each directory is queued at most
+// once (see queued below), so no deque ever takes more than N_INODES.
+typedef struct walk_deque_s
+{
+  pthread_mutex_t mutex;
+  int top;
+  int bottom;
+  WALK_TASK tasks[N_INODES];
+} WALK_DEQUE;
+
+typedef struct walk_s
+{
+  OUFS_WALK_VISIT visit;
+  void *arg;
+  int n_threads;
+  WALK_DEQUE deques[OUFS_WALK_MAX_THREADS];
+
+  // Directories queued or being expanded; the walk is over at 0
+  int pending;
+  int failed;
+  // Directories already queued (a damaged tree may link one twice)
+  unsigned char queued[N_INODES];
+
+  // Directory blocks, each read once
+  pthread_mutex_t block_mutex;
+  pthread_cond_t block_done;
+  unsigned char block_state[N_BLOCKS_IN_DISK];
+  BLOCK blocks[N_BLOCKS_IN_DISK];
+} WALK;
+
+typedef struct walk_thread_s
+{
+  WALK *walk;
+  int self;
+} WALK_THREAD;
+
+static int compare_block_references(const void *p, const void *q)
+{
+  return(*(const BLOCK_REFERENCE *) p - *(const BLOCK_REFERENCE *) q);
+}
+
+/**
+ * Read directory blocks that no thread has read or is reading, one read
+ * per run of consecutive blocks
+ *
+ * @param refs Blocks (UNALLOCATED_BLOCK entries are skipped)
+ * @param n Number of refs
+ */
+static void walk_read_ahead(WALK *walk, BLOCK_REFERENCE *refs, int n)
+{
+  BLOCK_REFERENCE claimed[n > 0 ? n : 1];
+  int n_claimed = 0;
+  pthread_mutex_lock(&walk->block_mutex);
+  for(int i = 0; i < n; ++i){
+    if(refs[i] < N_BLOCKS_IN_DISK && walk->block_state[refs[i]] == WALK_BLOCK_UNREAD){
+      walk->block_state[refs[i]] = WALK_BLOCK_READING;
+      claimed[n_claimed++] = refs[i];
+    }
+  }
+  pthread_mutex_unlock(&walk->block_mutex);
+  if(n_claimed == 0)
+    return;
+
+  qsort(claimed, n_claimed, sizeof(BLOCK_REFERENCE), compare_block_references);
+  for(int i = 0; i < n_claimed; ){
+    int length = 1;
+    while(i + length < n_claimed && claimed[i + length] == claimed[i] + length)
+      ++length;
+    if(debug)
+      fprintf(stderr, "Reading directory blocks %d-%d\n", claimed[i], claimed[i] + length - 1);
+    int ret = vdisk_read_blocks(claimed[i], length, &walk->blocks[claimed[i]]);
+
+    pthread_mutex_lock(&walk->block_mutex);
+    for(int k = 0; k < length; ++k)
+      walk->block_state[claimed[i + k]] = ret == 0 ? WALK_BLOCK_READ : WALK_BLOCK_FAILED;
+    pthread_cond_broadcast(&walk->block_done);
+    pthread_mutex_unlock(&walk->block_mutex);
+    i += length;
+  }
+}
+
+/**
+ * A directory block from the walk's table, read now if no thread has
+ * read it ahead
+ *
+ * @return The block; NULL on error
+ */
+static BLOCK *walk_get_block(WALK *walk, BLOCK_REFERENCE b)
+{
+  if(b >= N_BLOCKS_IN_DISK)
+    return(NULL);
+  walk_read_ahead(walk, &b, 1);
+
+  pthread_mutex_lock(&walk->block_mutex);
+  while(walk->block_state[b] == WALK_BLOCK_READING)
+    pthread_cond_wait(&walk->block_done, &walk->block_mutex);
+  int state = walk->block_state[b];
+  pthread_mutex_unlock(&walk->block_mutex);
+  return(state == WALK_BLOCK_READ ? &walk->blocks[b] : NULL);
+}
+
+/**
+ * Queue a directory on a thread's deque
+ */
+static void walk_push(WALK *walk, int self, WALK_TASK *task)
+{
+  WALK_DEQUE *deque = &walk->deques[self];
+  __atomic_add_fetch(&walk->pending, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&deque->mutex);
+  deque->tasks[deque->bottom++] = *task;
+  pthread_mutex_unlock(&deque->mutex);
+}
+
+/**
+ * Take the directory queued last on the thread's own deque
+ *
+ * @return 1 if a directory was taken; 0 if the deque is empty
+ */
+static int walk_pop(WALK *walk, int self, WALK_TASK *task)
+{
+  WALK_DEQUE *deque = &walk->deques[self];
+  int found = 0;
+  pthread_mutex_lock(&deque->mutex);
+  if(deque->bottom > deque->top){
+    *task = deque->tasks[--deque->bottom];
+    found = 1;
+  }
+  pthread_mutex_unlock(&deque->mutex);
+  return(found);
+}
+
+/**
+ * Take the directory queued first on another thread's deque
+ *
+ * @return 1 if a directory was taken; 0 if every other deque is empty
+ */
+static int walk_steal(WALK *walk, int self, WALK_TASK *task)
+{
+  for(int k = 1; k < walk->n_threads; ++k){
+    WALK_DEQUE *deque = &walk->deques[(self + k) % walk->n_threads];
+    int found = 0;
+    pthread_mutex_lock(&deque->mutex);
+    if(deque->bottom > deque->top){
+      *task = deque->tasks[deque->top++];
+      found = 1;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    if(found)
+      return(1);
+  }
+  return(0);
+}
+
+/**
+ * Visit the entries of a directory, queue its subdirectories and read
+ * their blocks ahead
+ */
+static void walk_expand(WALK *walk, int self, WALK_TASK *task)
+{
+  INODE directory;
+  if(oufs_read_inode_by_reference(task->inode_reference, &directory) != 0){
+    walk->failed = 1;
+    return;
+  }
+  walk_read_ahead(walk, directory.data, BLOCKS_PER_INODE);
+
+  WALK_TASK children[N_INODES];
+  BLOCK_REFERENCE child_blocks[N_INODES * BLOCKS_PER_INODE];
+  int n_children = 0, n_child_blocks = 0;
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    if(directory.data[k] == UNALLOCATED_BLOCK)
+      continue;
+    BLOCK *block = walk_get_block(walk, directory.data[k]);
+    if(block == NULL){
+      walk->failed = 1;
+      continue;
+    }
+    OUFS_ENTRY_MASK all = (DIRECTORY_ENTRIES_PER_BLOCK == 64) ? ~0ULL : (1ULL << DIRECTORY_ENTRIES_PER_BLOCK) - 1;
+    OUFS_ENTRY_MASK used = ~oufs_scan_inode(&block->directory, UNALLOCATED_INODE) & all;
+    for(; used != 0; used &= used - 1){
+      DIRECTORY_ENTRY *dirent = &block->directory.entry[__builtin_ctzll(used)];
+      if(!strcmp(dirent->name, ".") || !strcmp(dirent->name, ".."))
+        continue;
+
+      OUFS_WALK_ENTRY entry;
+      strncpy(entry.name, dirent->name, FILE_NAME_SIZE);
+      entry.name[FILE_NAME_SIZE] = 0;
+      // A path that does not fit is reported, and its subtree not walked
+      int length = snprintf(entry.path, sizeof(entry.path), "%s%s%s", task->path, strcmp(task->path, "/") ? "/" : "", entry.name);
+      if(length < 0 || length >= (int) sizeof(entry.path)){
+        fprintf(stderr, "oufs_walk(): path too long: %s/%s\n", task->path, entry.name);
+        walk->failed = 1;
+        continue;
+      }
+      entry.inode_reference = dirent->inode_reference;
+      entry.parent = task->inode_reference;
+      entry.depth = task->depth + 1;
+      if(oufs_read_inode_by_reference(entry.inode_reference, &entry.inode) != 0){
+        walk->failed = 1;
+        continue;
+      }
+      walk->visit(&entry, walk->arg);
+
+      if(entry.inode.type == IT_DIRECTORY && entry.inode_reference < N_INODES
+         && !__atomic_exchange_n(&walk->queued[entry.inode_reference], 1, __ATOMIC_ACQ_REL)){
+        children[n_children].inode_reference = entry.inode_reference;
+        children[n_children].depth = entry.depth;
+        strcpy(children[n_children].path, entry.path);
+        ++n_children;
+        for(int b = 0; b < BLOCKS_PER_INODE; ++b){
+          if(entry.inode.data[b] != UNALLOCATED_BLOCK)
+            child_blocks[n_child_blocks++] = entry.inode.data[b];
+        }
+      }
+    }
+  }
+
+  // The subdirectories' blocks are read before they are handed out, so
+  // the threads that take them find the blocks there
+  walk_read_ahead(walk, child_blocks, n_child_blocks);
+  for(int c = 0; c < n_children; ++c)
+    walk_push(walk, self, &children[c]);
+}
+
+static void *walk_worker(void *arg)
+{
+  WALK_THREAD *thread = arg;
+  WALK *walk = thread->walk;
+  WALK_TASK task;
+  while(__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0){
+    if(walk_pop(walk, thread->self, &task) || walk_steal(walk, thread->self, &task)){
+      walk_expand(walk, thread->self, &task);
+      // Its subdirectories are queued by now: pending only reaches 0 at the end
+      __atomic_sub_fetch(&walk->pending, 1, __ATOMIC_RELEASE);
+    }
+    else
+      sched_yield();
+  }
+  return(NULL);
+}
+
+/**
+ * Visit a file or directory and, for a directory, everything under it.
+ * visit() is called once for each directory entry (a file with several
+ * links is visited once per link), from several threads at once, in no
+ * particular order; the start itself is visited first.
+ *
+ * @param cwd Current working directory
+ * @param path Where to start (relative to cwd, or absolute)
+ * @param n_threads Threads to walk with (1 to OUFS_WALK_MAX_THREADS)
+ * @param visit Called for each file and directory
+ * @param arg Passed to visit()
+ * @return 0 on success; -1 on error
+ */
+int oufs_walk(char *cwd, char *path, int n_threads, OUFS_WALK_VISIT visit, void *arg)
+{
+  INODE_REFERENCE parent, child;
+  char local_name[FILE_NAME_SIZE + 1];
+  if(oufs_find_file(cwd, path, &parent, &child, local_name) != 0 || child == UNALLOCATED_INODE){
+    fprintf(stderr, "ERROR: Path does not exist\n");
+    return(-1);
+  }
+
+  OUFS_WALK_ENTRY start;
+  memset(&start, 0, sizeof(start));
+  if(oufs_read_inode_by_reference(child, &start.inode) != 0)
+    return(-1);
+
+  // The start's path, absolute and without empty elements
+  char full_path[2 * MAX_PATH_LENGTH + 2];
+  if(path[0] == '/')
+    snprintf(full_path, sizeof(full_path), "%s", path);
+  else
+    snprintf(full_path, sizeof(full_path), "%s/%s", cwd, path);
+  char *save;
+  for(char *token = strtok_r(full_path, "/", &save); token != NULL; token = strtok_r(NULL, "/", &save)){
+    strncat(start.path, "/", sizeof(start.path) - strlen(start.path) - 1);
+    strncat(start.path, token, sizeof(start.path) - strlen(start.path) - 1);
+  }
+  if(start.path[0] == 0)
+    strcpy(start.path, "/");
+  strcpy(start.name, local_name[0] ? local_name : "/");
+  start.inode_reference = child;
+  start.parent = UNALLOCATED_INODE;
+  start.depth = 0;
+  visit(&start, arg);
+  if(start.inode.type != IT_DIRECTORY)
+    return(0);
+
+  if(n_threads < 1)
+    n_threads = 1;
+  if(n_threads > OUFS_WALK_MAX_THREADS)
+    n_threads = OUFS_WALK_MAX_THREADS;
+  WALK *walk = calloc(1, sizeof(WALK));
+  if(walk == NULL){
+    fprintf(stderr, "ERROR: out of memory\n");
+    return(-1);
+  }
+  walk->visit = visit;
+  walk->arg = arg;
+  walk->n_threads = n_threads;
+  pthread_mutex_init(&walk->block_mutex, NULL);
+  pthread_cond_init(&walk->block_done, NULL);
+  for(int t = 0; t < n_threads; ++t)
+    pthread_mutex_init(&walk->deques[t].mutex, NULL);
+
+  WALK_TASK root;
+  walk->queued[child] = 1;
+  root.inode_reference = child;
+  root.depth = 0;
+  strcpy(root.path, start.path);
+  walk_push(walk, 0, &root);
+
+  // The calling thread is thread 0
+  pthread_t threads[OUFS_WALK_MAX_THREADS];
+  WALK_THREAD args[OUFS_WALK_MAX_THREADS];
+  for(int t = 0; t < n_threads; ++t){
+    args[t].walk = walk;
+    args[t].self = t;
+  }
+  for(int t = 1; t < n_threads; ++t)
+    pthread_create(&threads[t], NULL, walk_worker, &args[t]);
+  walk_worker(&args[0]);
+  for(int t = 1; t < n_threads; ++t)
+    pthread_join(threads[t], NULL);
+
+  int ret = walk->failed ? -1 : 0;
+  if(ret != 0)
+    fprintf(stderr, "ERROR: unable to read part of the tree\n");
+  for(int t = 0; t < n_threads; ++t)
+    pthread_mutex_destroy(&walk->deques[t].mutex);
+  pthread_mutex_destroy(&walk->block_mutex);
+  pthread_cond_destroy(&walk->block_done);
+  free(walk);
+  return(ret);
+}
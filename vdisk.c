@@ -1,9 +1,64 @@
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "vdisk.h"
+#include "vdisk_store.h"
+#include "vdisk_cache.h"
+#include "vdisk_stripe.h"
+#include "vdisk_stats.h"
+#include "vdisk_trace.h"
 /*
  * Virtual disk implementation.
  *
- * The disk is implemented on top of a file.  Access provided by this
- * library is on a block-by-block basis
+ * The disk is implemented on top of a file (or several, striped:
+ * vdisk_stripe.c).  Access provided by this library is on a
+ * block-by-block basis.  With ZDIRECT=1 a plain image is accessed with
+ * O_DIRECT, so that the block cache is the only copy kept in memory.
+ *
+ * Threads: once the disk is open, blocks may be read and written, and
+ * transactions used, from any number of threads (opening and closing the
+ * disk are not).  Transactions are shared (group commit):
+ * vdisk_begin_transaction() joins the running transaction, or opens one.
+ * Blocks written inside a transaction are seen by every thread at once.
+ * Transactions are written in the order they were opened, one at a time.
+ * While one is being written the next one stays open and collects threads;
+ * once it is the oldest and a thread has committed, it closes to newcomers
+ * and is written when its last thread commits, so one journal write and
+ * fsync covers them all.  Newcomers open the next one once no thread is
+ * left in the closed one (which must not build on newer blocks).  Threads that commit
+ * earlier wait for that write.
+ * A thread that aborts after writing discards the whole transaction, and a
+ * transaction that fails discards the newer ones, which may have built on
+ * it.
+ *
+ * Locks, in the order they are taken: transaction_mutex (who is in which
+ * transaction), transaction_lock (the blocks of the live transactions),
+ * io_mutex, then the block cache's set locks (vdisk_cache.c).  A
+ * transaction is written without any of the first two, so that other
+ * threads keep going meanwhile.
+ *
+ * Processes: several processes may open the same disk.  They coordinate
+ * through "<disk>.lock", a small file next to the disk:
+ *  - fcntl() locks on its bytes.  Byte 0 is the writer lock: a process
+ *    holds it while any transaction of its own is in progress (and around
+ *    writes outside transactions), so only one process at a time changes
+ *    the disk, the journal included.  The bytes after it are lock slots
+ *    for the file system above (vdisk_lock_slot()).  fcntl() locks belong
+ *    to the process, so each slot is taken once for all of its threads.
+ *  - A shared mapping of the file holding a generation number per block,
+ *    bumped whenever the block is written.  Each process keeps its own
+ *    block cache; a cached block is used only while its generation is
+ *    unchanged, so a process re-reads just the blocks others wrote.  A
+ *    block store's tables are read again once another process has
+ *    released the writer lock.
+ *  - A block store rewrites chunks before the tables that find them, so
+ *    the byte after the slots is locked for writing from a process's
+ *    first change to the store until it has flushed the tables and
+ *    bumped the generation, and for reading while another process reads
+ *    tables and chunks.
+ * Without the lock file (e.g. a read-only directory) the disk works as
+ * before, for one process.
  */
 
 // Debug flag
@@ -14,9 +69,376 @@
 
 int vdisk_fd = 0;
 
+// Name of the open virtual disk (used to locate its journal); the first
+// file of a striped disk
+static char vdisk_name[VDISK_NAME_LENGTH];
+
+// A snapshot is mounted: nothing may be written or journaled
+static int vdisk_read_only = 0;
+
+// Pending transaction: block writes are held here until commit
+typedef struct journal_entry_s
+{
+  BLOCK_REFERENCE block_ref;
+  unsigned char data[BLOCK_SIZE];
+} JOURNAL_ENTRY;
+
+typedef struct journal_header_s
+{
+  unsigned int magic;
+  unsigned int n_entries;
+  unsigned int checksum;
+} JOURNAL_HEADER;
+
+#define JOURNAL_MAGIC 0x4a53554f  // "OUSJ"
+
+typedef struct transaction_s
+{
+  // Taken from the pool until its result has been collected
+  int in_use;
+  // No more threads may join; being written
+  int closed;
+  int writing;
+  // Threads inside it, and threads that left it and wait for its result
+  int users;
+  int waiters;
+  // A thread aborted after writing, or an older transaction failed
+  int failed;
+  // Written (or discarded), with this result
+  int done;
+  int result;
+  int n_entries;
+  JOURNAL_ENTRY entries[MAX_TRANSACTION_BLOCKS];
+} TRANSACTION;
+
+// Transactions that can be in progress at once
+#define N_TRANSACTIONS 4
+
+// When block checksums are checked
+static int verify_mode = VDISK_VERIFY_UNCACHED;
+
+static pthread_mutex_t transaction_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t transaction_changed = PTHREAD_COND_INITIALIZER;
+static pthread_rwlock_t transaction_lock = PTHREAD_RWLOCK_INITIALIZER;
+static TRANSACTION transactions[N_TRANSACTIONS];
+// Transactions not yet written, oldest first; readers find blocks here
+static TRANSACTION *live[N_TRANSACTIONS];
+static int n_live = 0;
+// The transaction threads join, or NULL
+static TRANSACTION *running = NULL;
+
+// This thread's transaction, and whether it wrote to it
+static __thread TRANSACTION *thread_transaction = NULL;
+static __thread int thread_wrote = 0;
+
+// Serializes access to the disk file and the block store, and the filling
+// of the block cache from them
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared with the other processes that have the disk open
+typedef struct vdisk_shared_s
+{
+  // Bumped each time a process releases the writer lock
+  unsigned int generation;
+  // Bumped each time a block is written
+  unsigned int block_generation[N_BLOCKS_IN_DISK];
+  // I/O statistics of the processes that have closed the disk
+  VDISK_STATS stats;
+} VDISK_SHARED;
+
+// Lock file and its mapping; -1 and NULL without one
+static int lock_fd = -1;
+static VDISK_SHARED *shared = NULL;
+// Shared generation whose changes this process has caught up with
+static unsigned int seen_generation = 0;
+
+// This process's changes to each block (vdisk_block_version()), and to
+// all of them at once (open, close, resize)
+static unsigned int block_changes[N_BLOCKS_IN_DISK];
+static unsigned int all_changes = 0;
+
+// Byte of the lock file locked for writing, and the first lock slot
+#define WRITER_LOCK 0
+#define FIRST_LOCK_SLOT 1
+
+// Byte after the slots: locked for writing while a process changes a
+// block store's chunks and tables, for reading while another reads them
+#define STORE_LOCK (FIRST_LOCK_SLOT + VDISK_N_LOCK_SLOTS)
+
+// This process holds STORE_LOCK for writing.  Guarded by io_mutex
+static int store_updating = 0;
+
+// Transactions and other writers of this process that need the writer
+// lock, and whether vdisk_lock_disk() holds every lock
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int writer_holds = 0;
+static int disk_locked = 0;
+
+// Another process has replaced the disk file since it was opened
+// (vdisk_convert_disk()): writes to the old one would be lost, so the
+// writer lock is refused
+static int disk_replaced = 0;
+
+static int vdisk_raw_write_block(BLOCK_REFERENCE block_ref, void *block);
+static int vdisk_raw_write_entries(JOURNAL_ENTRY *entries, int n_entries);
+static int vdisk_backend_read_block(BLOCK_REFERENCE block_ref, void *block);
+static int vdisk_read_range(BLOCK_REFERENCE first, int count, void *blocks, int keep);
+static int vdisk_recover_journal();
+static int vdisk_write_transaction(TRANSACTION *t);
+static int vdisk_hold_writer();
+static void vdisk_release_writer();
+
+/**
+ * Lock, or unlock, a range of bytes of the lock file for this process
+ *
+ * @param offset First byte
+ * @param length Number of bytes
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_lock_bytes(off_t offset, off_t length, short type)
+{
+  if(lock_fd < 0)
+    return(0);
+
+  struct flock lock;
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = offset;
+  lock.l_len = length;
+  while(fcntl(lock_fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &lock) != 0) {
+    if(errno == EINTR)
+      continue;
+    // The kernel counts all the threads of a process as one owner, so it
+    // may see a deadlock that the lock order rules out: try again
+    if(errno == EDEADLK) {
+      usleep(1000);
+      continue;
+    }
+    fprintf(stderr, "vdisk: unable to lock %s.lock\n", vdisk_name);
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ * Open (creating it if needed) and map the lock file of the open disk
+ */
+static void vdisk_open_shared()
+{
+  char lock_name[VDISK_NAME_LENGTH + 8];
+  snprintf(lock_name, sizeof(lock_name), "%s.lock", vdisk_name);
+  lock_fd = open(lock_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(lock_fd < 0)
+    return;
+
+  // Grown with zeros; two processes doing so at once agree
+  struct stat st;
+  if(fstat(lock_fd, &st) != 0
+     || (st.st_size < (off_t) sizeof(VDISK_SHARED) && ftruncate(lock_fd, sizeof(VDISK_SHARED)) != 0)
+     || (shared = mmap(NULL, sizeof(VDISK_SHARED), PROT_READ | PROT_WRITE, MAP_SHARED, lock_fd, 0)) == MAP_FAILED) {
+    shared = NULL;
+    close(lock_fd);
+    lock_fd = -1;
+    return;
+  }
+  seen_generation = __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Release the lock file (and with it every lock of this process)
+ */
+static void vdisk_close_shared()
+{
+  store_updating = 0;
+  if(shared != NULL)
+    munmap(shared, sizeof(VDISK_SHARED));
+  if(lock_fd >= 0)
+    close(lock_fd);
+  shared = NULL;
+  lock_fd = -1;
+  writer_holds = 0;
+  disk_locked = 0;
+}
+
+/**
+ * Current generation of a block (0 without a lock file)
+ */
+static unsigned int vdisk_block_generation(BLOCK_REFERENCE block_ref)
+{
+  return(shared == NULL ? 0 : __atomic_load_n(&shared->block_generation[block_ref], __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Record that a block is being written.  Called with io_mutex held.
+ *
+ * @return The block's new generation
+ */
+static unsigned int vdisk_block_written(BLOCK_REFERENCE block_ref)
+{
+  __atomic_add_fetch(&block_changes[block_ref], 1, __ATOMIC_RELEASE);
+  return(shared == NULL ? 0 : __atomic_add_fetch(&shared->block_generation[block_ref], 1, __ATOMIC_RELEASE));
+}
+
+/**
+ * Version of a block's contents, as vdisk_read_block() would return them.
+ * It changes whenever they may have: a write by this process (in a
+ * transaction or not) or another, a transaction discarded, the disk closed
+ * or resized.  Lets the layer above keep its own copies of blocks: one
+ * taken after reading the version is current while the version is the same.
+ *
+ * @param block_ref Block
+ * @return An opaque version number
+ */
+unsigned long vdisk_block_version(BLOCK_REFERENCE block_ref)
+{
+  if(block_ref >= N_BLOCKS_IN_DISK)
+    return(0);
+  unsigned int changes = __atomic_load_n(&block_changes[block_ref], __ATOMIC_ACQUIRE) + vdisk_block_generation(block_ref);
+  return(((unsigned long) __atomic_load_n(&all_changes, __ATOMIC_ACQUIRE) << 32) | changes);
+}
+
+/**
+ * Read a block store's tables again if another process has changed the
+ * disk since this one last looked.  Called with io_mutex held.
+ */
+static void vdisk_catch_up()
+{
+  if(shared == NULL)
+    return;
+  unsigned int generation = __atomic_load_n(&shared->generation, __ATOMIC_ACQUIRE);
+  if(generation == seen_generation)
+    return;
+
+  // Another process may have replaced the file (vdisk_convert_disk())
+  struct stat named, opened;
+  if(!disk_replaced && stat(vdisk_name, &named) == 0 && fstat(vdisk_fd, &opened) == 0
+     && (named.st_dev != opened.st_dev || named.st_ino != opened.st_ino)) {
+    fprintf(stderr, "vdisk: %s was replaced by another process; open it again\n", vdisk_name);
+    disk_replaced = 1;
+  }
+  if(vdisk_store_is_open() && vdisk_store_reload() != 0)
+    fprintf(stderr, "vdisk: unable to reload the block store\n");
+  seen_generation = generation;
+}
+
+/**
+ * Keep other processes from changing the block store until
+ * vdisk_store_read_done(): chunks are rewritten before the tables that
+ * find them are, so tables and chunks are read together.  Called with
+ * io_mutex held.
+ *
+ * @return 1 if the store lock was taken; 0 if not needed
+ */
+static int vdisk_store_read_begin()
+{
+  // This process's own tables are current while it changes the store
+  // (and locking for reading would give up its lock)
+  if(shared == NULL || !vdisk_store_is_open() || store_updating)
+    return(0);
+  return(vdisk_lock_bytes(STORE_LOCK, 1, F_RDLCK) == 0);
+}
+
+/**
+ * Release the store lock taken by vdisk_store_read_begin()
+ */
+static void vdisk_store_read_done(int locked)
+{
+  if(locked)
+    vdisk_lock_bytes(STORE_LOCK, 1, F_UNLCK);
+}
+
+/**
+ * Keep other processes from reading the block store until this process's
+ * changes are flushed and announced (vdisk_store_update_done()).  Called
+ * with io_mutex and the writer lock held.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_store_update_begin()
+{
+  if(shared == NULL || store_updating)
+    return(0);
+  if(vdisk_lock_bytes(STORE_LOCK, 1, F_WRLCK) != 0)
+    return(-1);
+  store_updating = 1;
+  return(0);
+}
+
+/**
+ * Let other processes read the block store again, once the generation has
+ * been bumped.  Called with io_mutex held.
+ */
+static void vdisk_store_update_done()
+{
+  if(store_updating) {
+    vdisk_lock_bytes(STORE_LOCK, 1, F_UNLCK);
+    store_updating = 0;
+  }
+}
+
+/**
+ * Create (or truncate) the file holding a virtual disk and open it
+ *
+ * @param virtual_disk_name Name of the file to contain the virtual disk
+ * @param features VDISK_FEATURE_* flags; 0 for a plain disk image
+ * @return 0 on success; < 0 on error
+ *
+ */
+int vdisk_disk_create(char *virtual_disk_name, int features)
+{
+  // Refused before any file is opened, so nothing is truncated
+  if(features != 0 && strchr(virtual_disk_name, ',') != NULL) {
+    fprintf(stderr, "A striped virtual disk cannot be a block store (%s)\n", virtual_disk_name);
+    return(-1);
+  }
+
+  // The old contents go only once every file has opened
+  int fd = vdisk_stripe_open(virtual_disk_name, O_RDWR | O_CREAT);
+  if(fd < 0) {
+    fprintf(stderr, "Unable to create virtual disk (%s)\n", virtual_disk_name);
+    return(-1);
+  };
+  if(vdisk_stripe_truncate(0) != 0) {
+    fprintf(stderr, "Unable to truncate virtual disk (%s)\n", virtual_disk_name);
+    vdisk_stripe_close();
+    return(-1);
+  }
+
+  // A journal left by the previous contents no longer applies
+  char journal_name[VDISK_NAME_LENGTH + 8];
+  snprintf(journal_name, sizeof(journal_name), "%.*s.journal",
+	   (int) strcspn(virtual_disk_name, ","), virtual_disk_name);
+  unlink(journal_name);
+
+  if(features != 0 && vdisk_store_create(fd, N_BLOCKS_IN_DISK, features) != 0) {
+    vdisk_stripe_close();
+    return(-1);
+  }
+  vdisk_stripe_close();
+
+  if(vdisk_disk_open(virtual_disk_name) != 0)
+    return(-1);
+
+  // Blocks other processes have cached belong to the old contents
+  if(vdisk_hold_writer() == 0) {
+    pthread_mutex_lock(&io_mutex);
+    for(int b = 0; b < N_BLOCKS_IN_DISK; ++b)
+      vdisk_block_written(b);
+    pthread_mutex_unlock(&io_mutex);
+    vdisk_release_writer();
+  }
+  return(0);
+}
+
 /**
  * Open the virtual disk
  *
+ * A name of the form "disk@snapshot" mounts a snapshot of a block store
+ * (read-only).  A name of the form "file0,file1,...[:width]" stripes a
+ * plain image over the files (vdisk_stripe.c).
+ *
  * @param virtual_disk_name Name of the file containing the virtual disk
  * @return 0 on success; < 0 on error
  *
@@ -28,9 +450,16 @@ int vdisk_disk_open(char *virtual_disk_name)
     return(-1);
   };
 
-  // Open file
-  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  // Split off a snapshot name
+  strncpy(vdisk_name, virtual_disk_name, VDISK_NAME_LENGTH - 1);
+  vdisk_name[VDISK_NAME_LENGTH - 1] = 0;
+  char *snapshot_name = strrchr(vdisk_name, '@');
+  if(snapshot_name != NULL)
+    *snapshot_name++ = 0;
+
+  // Open the file(s); the journal and lock file go next to the first
+  int fd = vdisk_stripe_open(vdisk_name, snapshot_name == NULL ? O_RDWR | O_CREAT : O_RDWR);
+  vdisk_name[strcspn(vdisk_name, ",")] = 0;
 
   // Check code
   if(fd <= 0) {
@@ -38,11 +467,146 @@ int vdisk_disk_open(char *virtual_disk_name)
     return(-1);
   };
 
+  // Before the store tables are read, so that later changes by other
+  // processes are noticed
+  vdisk_open_shared();
+
+  // Block store or plain image?
+  if(vdisk_stripe_count() == 1 && vdisk_store_probe(fd)) {
+    if(vdisk_store_open(fd) != 0) {
+      vdisk_close_shared();
+      vdisk_stripe_close();
+      return(-1);
+    }
+  }else if(snapshot_name != NULL) {
+    fprintf(stderr, "Virtual disk (%s) has no snapshots\n", vdisk_name);
+    vdisk_close_shared();
+    vdisk_stripe_close();
+    return(-1);
+  }
+
+  // ZDIRECT=1: a plain image bypasses the kernel's page cache
+  char *direct = getenv("ZDIRECT");
+  if(direct != NULL && strcmp(direct, "0") != 0 && !vdisk_store_is_open() && vdisk_stripe_direct() != 0)
+    fprintf(stderr, "vdisk: O_DIRECT not supported for (%s); using the page cache\n", vdisk_name);
+
   // Remember the fd in the global variable
   vdisk_fd = fd;
+  vdisk_stats_open();
+  vdisk_trace_open();
+
+  // Checksum policy
+  char *verify = getenv("ZVERIFY");
+  if(verify != NULL) {
+    if(!strcmp(verify, "all"))
+      vdisk_set_verify_mode(VDISK_VERIFY_ALL);
+    else if(!strcmp(verify, "none"))
+      vdisk_set_verify_mode(VDISK_VERIFY_NONE);
+    else
+      vdisk_set_verify_mode(VDISK_VERIFY_UNCACHED);
+  }
+
+  // Finish any transaction that was committed but not fully applied.  The
+  // journal belongs to the live disk: a snapshot mount leaves it alone
+  if(snapshot_name == NULL && vdisk_recover_journal() != 0) {
+    fprintf(stderr, "Unable to recover journal for virtual disk (%s)\n", virtual_disk_name);
+    vdisk_store_close();
+    vdisk_close_shared();
+    vdisk_stripe_close();
+    vdisk_trace_close();
+    vdisk_fd = 0;
+    return(-1);
+  }
+
+  if(snapshot_name != NULL && vdisk_store_mount_snapshot(snapshot_name) != 0) {
+    vdisk_store_close();
+    vdisk_close_shared();
+    vdisk_stripe_close();
+    vdisk_trace_close();
+    vdisk_fd = 0;
+    return(-1);
+  }
+  vdisk_read_only = snapshot_name != NULL;
   return(0);
 };
 
+/**
+ * Blocks requested since the disk was opened.  Blocks written inside a
+ * transaction count once per vdisk_write_block() call, not when the
+ * transaction is written.
+ *
+ * @param reads Set to the blocks read
+ * @param writes Set to the blocks written
+ */
+void vdisk_io_counts(unsigned long *reads, unsigned long *writes)
+{
+  VDISK_STATS stats;
+  vdisk_stats_get(&stats, 0);
+  *reads = *writes = 0;
+  for(int c = 0; c < VDISK_N_CLASSES; ++c) {
+    *reads += stats.reads[c];
+    *writes += stats.writes[c];
+  }
+}
+
+/**
+ * I/O statistics
+ *
+ * @param stats Filled with the counts of this process since the disk was
+ *        opened (or last reset), plus, with all_processes, those of every
+ *        process that has closed the disk since the lock file was created
+ * @param all_processes See above
+ */
+void vdisk_stats_get(VDISK_STATS *stats, int all_processes)
+{
+  if(all_processes && shared != NULL)
+    memcpy(stats, &shared->stats, sizeof(VDISK_STATS));
+  else
+    memset(stats, 0, sizeof(VDISK_STATS));
+  vdisk_stats_merge(stats);
+}
+
+/**
+ * Zero the I/O statistics of this process, and with all_processes the
+ * totals kept in the lock file
+ */
+void vdisk_stats_reset(int all_processes)
+{
+  vdisk_stats_clear();
+  if(all_processes && shared != NULL)
+    memset(&shared->stats, 0, sizeof(VDISK_STATS));
+}
+
+/**
+ * Choose when block checksums are checked
+ *
+ * @param mode VDISK_VERIFY_NONE, VDISK_VERIFY_UNCACHED or VDISK_VERIFY_ALL
+ */
+void vdisk_set_verify_mode(int mode)
+{
+  verify_mode = mode;
+}
+
+/**
+ * Container features of the open disk
+ *
+ * @return VDISK_FEATURE_* flags; 0 for a plain disk image
+ */
+int vdisk_disk_features()
+{
+  return(vdisk_store_features());
+}
+
+/**
+ * Number of files holding the open disk
+ *
+ * @return 1 for one file; more for a disk striped over several
+ */
+int vdisk_disk_stripes()
+{
+  return(vdisk_stripe_count());
+}
+
 /**
  * Close the virtual disk
  *
@@ -56,11 +620,43 @@ int vdisk_disk_close()
     exit(-1);
   };
 
-  // Close the file
-  close(vdisk_fd);
+  // An unfinished transaction never reaches the disk
+  if(thread_transaction) {
+    fprintf(stderr, "vdisk_disk_close(): discarding uncommitted transaction\n");
+    vdisk_abort_transaction();
+  }
+
+  // Write back the block store tables
+  if(vdisk_store_is_open()) {
+    vdisk_store_flush();
+    vdisk_store_close();
+  }
+
+  // Other processes catch up with what the disk lock covered
+  if(disk_locked && shared != NULL)
+    __atomic_add_fetch(&shared->generation, 1, __ATOMIC_RELEASE);
+
+  // This process's I/O joins the disk's totals; ZSTATS=1 prints it
+  char *print_stats = getenv("ZSTATS");
+  if(print_stats != NULL && strcmp(print_stats, "0") != 0) {
+    VDISK_STATS stats;
+    vdisk_stats_get(&stats, 0);
+    vdisk_stats_print(stderr, &stats);
+  }
+  if(shared != NULL)
+    vdisk_stats_merge(&shared->stats);
+  vdisk_close_shared();
+  vdisk_trace_close();
+
+  // Close the file(s)
+  vdisk_stripe_close();
+  vdisk_cache_invalidate();
+  __atomic_add_fetch(&all_changes, 1, __ATOMIC_RELEASE);
 
   // Mark as closed
   vdisk_fd = 0;
+  vdisk_read_only = 0;
+  disk_replaced = 0;
   return(0);
 }
 
@@ -88,31 +684,243 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
     fprintf(stderr, "vdisk_read_block(): bad block_ref(%d)\n", block_ref);
     return(-2);
   }
+  vdisk_stats_request(block_ref, 1, 0);
+  vdisk_trace(VDISK_TRACE_READ, block_ref, 1);
 
-  // Lsek to the correct point in the file
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return(-3);
+  // A block written by the open transaction is read back from memory
+  if(__atomic_load_n(&n_live, __ATOMIC_ACQUIRE)) {
+    int found = 0;
+    pthread_rwlock_rdlock(&transaction_lock);
+    for(int k = n_live - 1; k >= 0 && !found; --k) {
+      TRANSACTION *t = live[k];
+      for(int i = 0; i < t->n_entries && !found; ++i) {
+        if(t->entries[i].block_ref == block_ref) {
+          memcpy(block, t->entries[i].data, BLOCK_SIZE);
+          found = 1;
+        }
+      }
+    }
+    pthread_rwlock_unlock(&transaction_lock);
+    if(found) {
+      vdisk_stats_read_from(VDISK_READ_TRANSACTION, 1);
+      return(0);
+    }
+  }
+
+  // Recently used blocks are served from memory, unless another process
+  // has written them since
+  if(vdisk_cache_lookup(block_ref, block, verify_mode == VDISK_VERIFY_ALL, vdisk_block_generation(block_ref))) {
+    vdisk_stats_read_from(VDISK_READ_CACHE, 1);
+    return(0);
+  }
+  vdisk_stats_read_from(VDISK_READ_FILE, 1);
+
+  // Filled under io_mutex, so a concurrent write cannot be overtaken by
+  // the older copy read here.  The generation is taken before reading (and
+  // before catching up): a write by another process meanwhile leaves the
+  // copy out of date.
+  pthread_mutex_lock(&io_mutex);
+  unsigned int generation = vdisk_block_generation(block_ref);
+  int store_locked = vdisk_store_read_begin();
+  vdisk_catch_up();
+  int ret = vdisk_backend_read_block(block_ref, block);
+  vdisk_store_read_done(store_locked);
+  if(ret == 0)
+    vdisk_cache_insert(block_ref, block, generation);
+  pthread_mutex_unlock(&io_mutex);
+  return(ret);
+}
+
+/**
+ *  Read a block from the disk file
+ *
+ * @param block_ref Index of the block that is to be loaded
+ * @param block Pointer to the buffer that the read block will be placed into
+ * @return 0 on success; <0 on error
+ *
+ */
+static int vdisk_backend_read_block(BLOCK_REFERENCE block_ref, void *block)
+{
+  unsigned long start = vdisk_stats_now();
+  if(vdisk_store_is_open()) {
+    int ret = vdisk_store_read_block(block_ref, block, verify_mode != VDISK_VERIFY_NONE);
+    if(ret == 0) {
+      vdisk_stats_file_io(block_ref, 1, 0, start);
+      vdisk_trace(VDISK_TRACE_FILE_READ, block_ref, 1);
+    }
+    return(ret);
   }
 
-  // Read the block
-  if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+  // Read the block; a disk shrunk by vdisk_resize() reads as zeros past
+  // its end
+  if(vdisk_stripe_read(block_ref, 1, block) != 0) {
     fprintf(stderr, "vdisk_read_block(): read failed\n");
     return(-4);
   }
 
   // Success
+  vdisk_stats_file_io(block_ref, 1, 0, start);
+  vdisk_trace(VDISK_TRACE_FILE_READ, block_ref, 1);
   return(0);
 }
 
+/**
+ *  Read a range of consecutive blocks
+ *
+ *  A plain disk image is read with a single large read (one per file of
+ *  a striped disk, in parallel) that bypasses the block cache; a block
+ *  store is read block by block.
+ *
+ * @param first First block to read
+ * @param count Number of blocks
+ * @param blocks Buffer of count * BLOCK_SIZE bytes
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_read_blocks(BLOCK_REFERENCE first, int count, void *blocks)
+{
+  return(vdisk_read_range(first, count, blocks, 0));
+}
+
+/**
+ *  Read a range of consecutive blocks as vdisk_read_blocks() does, and
+ *  keep them in the block cache: for a few blocks that will be used again
+ *  soon, such as the file system's metadata when it is mounted.
+ *
+ * @param first First block to read
+ * @param count Number of blocks
+ * @param blocks Buffer of count * BLOCK_SIZE bytes
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_preload_blocks(BLOCK_REFERENCE first, int count, void *blocks)
+{
+  return(vdisk_read_range(first, count, blocks, 1));
+}
+
+/**
+ *  Read a range of consecutive blocks
+ *
+ * @param keep 1 to put the blocks in the cache
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_read_range(BLOCK_REFERENCE first, int count, void *blocks, int keep)
+{
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_read_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(count < 0 || first + count > N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_read_blocks(): bad range (%d, %d)\n", first, count);
+    return(-2);
+  }
+
+  if(__atomic_load_n(&n_live, __ATOMIC_ACQUIRE) || vdisk_store_is_open()) {
+    for(int i = 0; i < count; ++i) {
+      int ret = vdisk_read_block(first + i, (unsigned char *) blocks + i * BLOCK_SIZE);
+      if(ret != 0)
+	return(ret);
+    }
+    return(0);
+  }
+
+  vdisk_stats_request(first, count, 0);
+  vdisk_trace(VDISK_TRACE_READ, first, count);
+  vdisk_stats_read_from(VDISK_READ_FILE, count);
+
+  // Cached copies are filled as in vdisk_read_block()
+  unsigned int generations[count > 0 ? count : 1];
+  if(keep) {
+    pthread_mutex_lock(&io_mutex);
+    vdisk_catch_up();
+    for(int i = 0; i < count; ++i)
+      generations[i] = vdisk_block_generation(first + i);
+  }
+  int ret = 0;
+  unsigned long start = vdisk_stats_now();
+  if(vdisk_stripe_read(first, count, blocks) != 0) {
+    fprintf(stderr, "vdisk_read_blocks(): read failed\n");
+    ret = -4;
+  }else {
+    vdisk_stats_file_io(first, count, 0, start);
+    vdisk_trace(VDISK_TRACE_FILE_READ, first, count);
+  }
+  if(keep) {
+    for(int i = 0; i < count && ret == 0; ++i)
+      vdisk_cache_insert(first + i, (unsigned char *) blocks + i * BLOCK_SIZE, generations[i]);
+    pthread_mutex_unlock(&io_mutex);
+  }
+  return(ret);
+}
+
 /**
  *  Write a disk block to the virtual disk
  *
+ *  If a transaction is open, the write is held in memory until the
+ *  transaction is committed.
+ *
  * @param block_ref Index to the block to be written
  * @param block Memory in which the block is currently stored
  *
  */
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
+{
+  if(vdisk_read_only) {
+    fprintf(stderr, "vdisk_write_block(): snapshot is read-only\n");
+    return(-6);
+  }
+  vdisk_stats_request(block_ref, 1, 1);
+  vdisk_trace(VDISK_TRACE_WRITE, block_ref, 1);
+  if(!thread_transaction) {
+    if(vdisk_hold_writer() != 0)
+      return(-1);
+    int ret = vdisk_raw_write_block(block_ref, block);
+    vdisk_release_writer();
+    return(ret);
+  }
+
+  if(block_ref >= N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_write_block(): bad block_ref(%d)\n", block_ref);
+    return(-2);
+  }
+
+  TRANSACTION *t = thread_transaction;
+  pthread_rwlock_wrlock(&transaction_lock);
+  thread_wrote = 1;
+
+  // Overwrite an earlier copy of the block within this transaction
+  for(int i = 0; i < t->n_entries; ++i) {
+    if(t->entries[i].block_ref == block_ref) {
+      memcpy(t->entries[i].data, block, BLOCK_SIZE);
+      __atomic_add_fetch(&block_changes[block_ref], 1, __ATOMIC_RELEASE);
+      pthread_rwlock_unlock(&transaction_lock);
+      return(0);
+    }
+  }
+
+  // Cannot happen: every block fits once
+  if(t->n_entries >= MAX_TRANSACTION_BLOCKS) {
+    pthread_rwlock_unlock(&transaction_lock);
+    fprintf(stderr, "vdisk_write_block(): transaction too large\n");
+    return(-5);
+  }
+  t->entries[t->n_entries].block_ref = block_ref;
+  memcpy(t->entries[t->n_entries].data, block, BLOCK_SIZE);
+  ++t->n_entries;
+  __atomic_add_fetch(&block_changes[block_ref], 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&transaction_lock);
+  return(0);
+}
+
+/**
+ *  Write a disk block directly to the virtual disk file
+ *
+ * @param block_ref Index to the block to be written
+ * @param block Memory in which the block is currently stored
+ *
+ */
+static int vdisk_raw_write_block(BLOCK_REFERENCE block_ref, void *block)
 {
   if(debug)
     fprintf(stderr, "##Writing block %d\n", block_ref);
@@ -129,18 +937,734 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Move to the beginning of the block
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return(-3);
+  pthread_mutex_lock(&io_mutex);
+  unsigned long start = vdisk_stats_now();
+  if(vdisk_store_is_open()) {
+    int ret = vdisk_store_update_begin();
+    if(ret == 0)
+      ret = vdisk_store_write_block(block_ref, block);
+    if(ret == 0) {
+      vdisk_stats_file_io(block_ref, 1, 1, start);
+      vdisk_trace(VDISK_TRACE_FILE_WRITE, block_ref, 1);
+      vdisk_cache_insert(block_ref, block, vdisk_block_written(block_ref));
+    }
+    pthread_mutex_unlock(&io_mutex);
+    return(ret);
   }
 
-  // Read the block
-  if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_write_block(): read failed\n");
+  // Write the block at its place in the file
+  if(vdisk_stripe_write(block_ref, 1, block) != 0) {
+    pthread_mutex_unlock(&io_mutex);
+    fprintf(stderr, "vdisk_write_block(): write failed\n");
     return(-4);
   }
+  vdisk_stats_file_io(block_ref, 1, 1, start);
+  vdisk_trace(VDISK_TRACE_FILE_WRITE, block_ref, 1);
+
+  // Keep the cached copy current
+  vdisk_cache_insert(block_ref, block, vdisk_block_written(block_ref));
+  pthread_mutex_unlock(&io_mutex);
 
   // Success
   return(0);
 }
+
+/**
+ *  Write the blocks of a transaction to a plain image, in block order:
+ *  each run of consecutive blocks with one write (one per file of a
+ *  striped disk)
+ *
+ * @param entries The blocks; left in their order, since readers may be
+ *        searching them
+ * @param n_entries Number of blocks
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_raw_write_entries(JOURNAL_ENTRY *entries, int n_entries)
+{
+  JOURNAL_ENTRY *by_block[N_BLOCKS_IN_DISK];
+  memset(by_block, 0, sizeof(by_block));
+  for(int i = 0; i < n_entries; ++i) {
+    if(entries[i].block_ref >= N_BLOCKS_IN_DISK) {
+      fprintf(stderr, "vdisk_write_block(): bad block_ref(%d)\n", entries[i].block_ref);
+      return(-2);
+    }
+    by_block[entries[i].block_ref] = &entries[i];
+  }
+
+  int ret = 0;
+  pthread_mutex_lock(&io_mutex);
+  for(int first = 0; first < N_BLOCKS_IN_DISK && ret == 0; ++first) {
+    if(by_block[first] == NULL)
+      continue;
+    void *run[N_BLOCKS_IN_DISK];
+    int count = 0;
+    while(first + count < N_BLOCKS_IN_DISK && by_block[first + count] != NULL) {
+      run[count] = by_block[first + count]->data;
+      ++count;
+    }
+
+    unsigned long start = vdisk_stats_now();
+    if(vdisk_stripe_write_list(first, count, run) != 0) {
+      fprintf(stderr, "vdisk_write_block(): write failed\n");
+      ret = -4;
+    }else {
+      vdisk_stats_file_io(first, count, 1, start);
+      vdisk_trace(VDISK_TRACE_FILE_WRITE, first, count);
+    }
+    // Keep the cached copies current (see vdisk_write_blocks())
+    for(int i = 0; i < count; ++i) {
+      unsigned int generation = vdisk_block_written(first + i);
+      if(ret == 0)
+	vdisk_cache_insert(first + i, run[i], generation);
+    }
+    first += count;
+  }
+  pthread_mutex_unlock(&io_mutex);
+  return(ret);
+}
+
+/**
+ *  Write a range of consecutive blocks
+ *
+ *  A plain disk image outside a transaction is written with a single large
+ *  write (one per file of a striped disk, in parallel); otherwise the
+ *  blocks are written one by one.
+ *
+ * @param first First block to write
+ * @param count Number of blocks
+ * @param blocks Buffer of count * BLOCK_SIZE bytes
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_write_blocks(BLOCK_REFERENCE first, int count, void *blocks)
+{
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_write_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(count < 0 || first + count > N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_write_blocks(): bad range (%d, %d)\n", first, count);
+    return(-2);
+  }
+
+  if(thread_transaction || vdisk_store_is_open()) {
+    for(int i = 0; i < count; ++i) {
+      int ret = vdisk_write_block(first + i, (unsigned char *) blocks + i * BLOCK_SIZE);
+      if(ret != 0)
+	return(ret);
+    }
+    return(0);
+  }
+
+  vdisk_stats_request(first, count, 1);
+  vdisk_trace(VDISK_TRACE_WRITE, first, count);
+  if(vdisk_hold_writer() != 0)
+    return(-1);
+  pthread_mutex_lock(&io_mutex);
+  int ret = 0;
+  unsigned long start = vdisk_stats_now();
+  if(vdisk_stripe_write(first, count, blocks) != 0) {
+    fprintf(stderr, "vdisk_write_blocks(): write failed\n");
+    ret = -4;
+  }else {
+    vdisk_stats_file_io(first, count, 1, start);
+    vdisk_trace(VDISK_TRACE_FILE_WRITE, first, count);
+  }
+
+  // Keep the cached copies current.  A failed write may have changed
+  // part of the range, so the blocks count as written either way.
+  for(int i = 0; i < count; ++i) {
+    unsigned int generation = vdisk_block_written(first + i);
+    if(ret == 0)
+      vdisk_cache_insert(first + i, (unsigned char *) blocks + i * BLOCK_SIZE, generation);
+  }
+  pthread_mutex_unlock(&io_mutex);
+  vdisk_release_writer();
+  return(ret);
+}
+
+/**
+ * Change the number of blocks stored for the disk
+ *
+ * Block numbers stay limited to N_BLOCKS_IN_DISK; blocks past the new end
+ * read as zeros.  A plain image's file(s) are truncated or extended; a block
+ * store drops the chunks of the blocks past the end.  The caller must have
+ * moved any data out of those blocks first.
+ *
+ * @param n_blocks New number of blocks
+ * @return 0 on success; <0 on error
+ */
+int vdisk_resize(int n_blocks)
+{
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_resize(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(n_blocks < 1 || n_blocks > N_BLOCKS_IN_DISK || thread_transaction) {
+    fprintf(stderr, "vdisk_resize(): bad size (%d)\n", n_blocks);
+    return(-2);
+  }
+
+  if(vdisk_hold_writer() != 0)
+    return(-1);
+
+  int ret = 0;
+  if(vdisk_store_is_open()) {
+    // All-zero blocks are unmapped
+    unsigned char zero[BLOCK_SIZE];
+    memset(zero, 0, sizeof(zero));
+    for(int b = n_blocks; b < N_BLOCKS_IN_DISK && ret == 0; ++b)
+      ret = vdisk_raw_write_block(b, zero);
+    if(ret == 0) {
+      pthread_mutex_lock(&io_mutex);
+      ret = vdisk_store_flush();
+      pthread_mutex_unlock(&io_mutex);
+    }
+    vdisk_release_writer();
+    return(ret);
+  }
+
+  pthread_mutex_lock(&io_mutex);
+  if(vdisk_stripe_truncate(n_blocks) != 0 || vdisk_stripe_sync() != 0) {
+    fprintf(stderr, "vdisk_resize(): resize failed\n");
+    ret = -4;
+  }
+  // Blocks past the new end now read as zeros
+  for(int b = n_blocks; b < N_BLOCKS_IN_DISK; ++b)
+    vdisk_block_written(b);
+  vdisk_cache_invalidate();
+  __atomic_add_fetch(&all_changes, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&io_mutex);
+  vdisk_release_writer();
+  return(ret);
+}
+
+/**
+ * Rewrite the open plain disk image as a block store
+ *
+ * The store is built in "<disk>.convert" and renamed over the image, all
+ * under the disk lock (vdisk_lock_disk()), so no other process writes the
+ * image meanwhile; processes that still have the old image open are told
+ * to open it again when they next write (disk_replaced).  The disk is
+ * closed afterwards, and must be opened again to use the store.
+ *
+ * @param features VDISK_FEATURE_* flags of the store
+ * @return 0 on success; <0 on error (the image is left as it was)
+ */
+int vdisk_convert_disk(int features)
+{
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_convert_disk(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(features == 0 || vdisk_store_is_open() || vdisk_stripe_count() > 1 || vdisk_read_only || thread_transaction) {
+    fprintf(stderr, "vdisk_convert_disk(): %s is not a plain disk image in one file\n", vdisk_name);
+    vdisk_disk_close();
+    return(-1);
+  }
+
+  static unsigned char blocks[N_BLOCKS_IN_DISK][BLOCK_SIZE];
+  if(vdisk_lock_disk() != 0 || vdisk_read_blocks(0, N_BLOCKS_IN_DISK, blocks) != 0) {
+    vdisk_disk_close();
+    return(-1);
+  }
+
+  char store_name[VDISK_NAME_LENGTH + 8];
+  snprintf(store_name, sizeof(store_name), "%s.convert", vdisk_name);
+  int fd = open(store_name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0) {
+    fprintf(stderr, "vdisk_convert_disk(): unable to create %s\n", store_name);
+    vdisk_disk_close();
+    return(-2);
+  }
+
+  // The new store's tables are only this function's for now
+  pthread_mutex_lock(&io_mutex);
+  int ret = vdisk_store_create(fd, N_BLOCKS_IN_DISK, features);
+  if(ret == 0 && (ret = vdisk_store_open(fd)) == 0) {
+    for(int b = 0; b < N_BLOCKS_IN_DISK && ret == 0; ++b)
+      ret = vdisk_store_write_block(b, blocks[b]);
+    if(ret == 0)
+      ret = vdisk_store_flush();
+    vdisk_store_close();
+  }
+  pthread_mutex_unlock(&io_mutex);
+  close(fd);
+
+  if(ret == 0 && rename(store_name, vdisk_name) != 0) {
+    fprintf(stderr, "vdisk_convert_disk(): unable to replace %s\n", vdisk_name);
+    ret = -3;
+  }
+  if(ret != 0)
+    unlink(store_name);
+
+  // Other processes catch up with (or are told about) the new file
+  vdisk_disk_close();
+  return(ret);
+}
+
+/**
+ * Start a transaction: all following block writes are applied to the disk
+ * together by vdisk_commit_transaction(), or not at all.  If another
+ * thread has a transaction running, this thread joins it.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_begin_transaction()
+{
+  if(thread_transaction) {
+    fprintf(stderr, "vdisk_begin_transaction(): transaction already open\n");
+    return(-1);
+  }
+  if(vdisk_read_only) {
+    fprintf(stderr, "vdisk_begin_transaction(): snapshot is read-only\n");
+    return(-6);
+  }
+
+  pthread_mutex_lock(&transaction_mutex);
+  while(running == NULL) {
+    TRANSACTION *t = NULL;
+    for(int i = 0; i < N_TRANSACTIONS && t == NULL; ++i) {
+      if(!transactions[i].in_use)
+	t = &transactions[i];
+    }
+    // Threads still in the closed transaction may read blocks: they must
+    // not see (and write back into it) what a newer transaction changed,
+    // since the closed one is written first
+    if(t == NULL || (n_live > 0 && live[n_live - 1]->users > 0)) {
+      // Every transaction is still being written or waited for
+      pthread_cond_wait(&transaction_changed, &transaction_mutex);
+      continue;
+    }
+    // Other processes wait until this process has no transaction left
+    if(vdisk_hold_writer() != 0) {
+      pthread_mutex_unlock(&transaction_mutex);
+      return(-1);
+    }
+    t->in_use = 1;
+    t->closed = 0;
+    t->writing = 0;
+    t->users = 0;
+    t->waiters = 0;
+    t->failed = 0;
+    t->done = 0;
+    t->n_entries = 0;
+    pthread_rwlock_wrlock(&transaction_lock);
+    live[n_live] = t;
+    __atomic_store_n(&n_live, n_live + 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&transaction_lock);
+    running = t;
+  }
+  ++running->users;
+  thread_transaction = running;
+  thread_wrote = 0;
+  pthread_mutex_unlock(&transaction_mutex);
+  vdisk_trace(VDISK_TRACE_BEGIN, 0, 1);
+  return(0);
+}
+
+/**
+ * Close a transaction to newcomers.  Called with transaction_mutex held.
+ */
+static void vdisk_close_transaction(TRANSACTION *t)
+{
+  t->closed = 1;
+  if(running == t)
+    running = NULL;
+}
+
+/**
+ * Write (or discard) the oldest transaction once no thread is in it.
+ * Called with transaction_mutex held; it is released while the disk is
+ * written.
+ */
+static void vdisk_end_transaction(TRANSACTION *t)
+{
+  vdisk_close_transaction(t);
+  t->writing = 1;
+  // Threads waiting to open the next transaction may go on
+  pthread_cond_broadcast(&transaction_changed);
+
+  int result = -1;
+  if(!t->failed) {
+    // Nobody changes its blocks any more: they are written without locks,
+    // while other threads go on
+    pthread_mutex_unlock(&transaction_mutex);
+    result = vdisk_write_transaction(t);
+    pthread_mutex_lock(&transaction_mutex);
+  }
+
+  pthread_rwlock_wrlock(&transaction_lock);
+  for(int k = 1; k < n_live; ++k) {
+    live[k - 1] = live[k];
+    // Newer transactions may have read its blocks
+    if(result != 0)
+      live[k - 1]->failed = 1;
+  }
+  __atomic_store_n(&n_live, n_live - 1, __ATOMIC_RELEASE);
+  // Its blocks read as before again
+  if(result != 0) {
+    for(int i = 0; i < t->n_entries; ++i)
+      __atomic_add_fetch(&block_changes[t->entries[i].block_ref], 1, __ATOMIC_RELEASE);
+  }
+  pthread_rwlock_unlock(&transaction_lock);
+  vdisk_release_writer();
+
+  t->done = 1;
+  t->result = result;
+  if(t->waiters == 0)
+    t->in_use = 0;
+  pthread_cond_broadcast(&transaction_changed);
+
+  // A transaction every thread aborted has nobody to write it
+  if(n_live > 0 && live[0]->users == 0 && live[0]->waiters == 0 && !live[0]->writing)
+    vdisk_end_transaction(live[0]);
+}
+
+/**
+ * Drop every block write made since vdisk_begin_transaction().  If other
+ * threads are in the transaction and this one wrote to it, their writes
+ * are dropped too.
+ */
+void vdisk_abort_transaction()
+{
+  TRANSACTION *t = thread_transaction;
+  if(t == NULL)
+    return;
+  thread_transaction = NULL;
+  vdisk_trace(VDISK_TRACE_ABORT, 0, 1);
+
+  pthread_mutex_lock(&transaction_mutex);
+  if(thread_wrote)
+    t->failed = 1;
+  if(--t->users == 0 && live[0] == t && !t->writing)
+    vdisk_end_transaction(t);
+  pthread_mutex_unlock(&transaction_mutex);
+}
+
+/**
+ * Checksum over the journal entries
+ */
+static unsigned int vdisk_journal_checksum(JOURNAL_ENTRY *entries, int n_entries)
+{
+  return(vdisk_crc32c(entries, n_entries * sizeof(JOURNAL_ENTRY)));
+}
+
+/**
+ * Build the file name of the journal for the open disk
+ */
+static void vdisk_journal_name(char *journal_name)
+{
+  snprintf(journal_name, VDISK_NAME_LENGTH + 8, "%s.journal", vdisk_name);
+}
+
+/**
+ * Apply journal entries to the disk file and make them durable
+ */
+static int vdisk_apply_entries(JOURNAL_ENTRY *entries, int n_entries)
+{
+  if(vdisk_store_is_open()) {
+    for(int i = 0; i < n_entries; ++i) {
+      if(vdisk_raw_write_block(entries[i].block_ref, entries[i].data) != 0)
+	return(-1);
+    }
+  }else if(vdisk_raw_write_entries(entries, n_entries) != 0) {
+    return(-1);
+  }
+  pthread_mutex_lock(&io_mutex);
+  int ret = 0;
+  unsigned long start = vdisk_stats_now();
+  if(vdisk_store_is_open()) {
+    ret = vdisk_store_flush();
+    // A block written to new chunks is only found through the tables just
+    // flushed: other processes catch up with them, and what they read
+    // through their older tables meanwhile is out of date
+    if(shared != NULL)
+      seen_generation = __atomic_add_fetch(&shared->generation, 1, __ATOMIC_RELEASE);
+    vdisk_store_update_done();
+    for(int i = 0; i < n_entries; ++i)
+      vdisk_cache_insert(entries[i].block_ref, entries[i].data, vdisk_block_written(entries[i].block_ref));
+  }else if(vdisk_stripe_sync() != 0) {
+    fprintf(stderr, "vdisk: fsync failed\n");
+    ret = -1;
+  }
+  vdisk_stats_sync(start);
+  vdisk_trace(VDISK_TRACE_SYNC, 0, 1);
+  pthread_mutex_unlock(&io_mutex);
+  return(ret);
+}
+
+/**
+ * Commit the open transaction.
+ *
+ * The modified blocks are first written to a journal file next to the disk.
+ * Once the journal is durable the blocks are written in place and the
+ * journal is removed.  A crash before the journal is complete leaves the
+ * disk untouched; a crash afterwards is repaired by the next
+ * vdisk_disk_open().
+ *
+ * This waits until the transaction is written: after the older ones, and
+ * once the other threads in it have committed.
+ *
+ * @return 0 on success; <0 on error (the transaction is discarded)
+ */
+int vdisk_commit_transaction()
+{
+  TRANSACTION *t = thread_transaction;
+  if(t == NULL) {
+    fprintf(stderr, "vdisk_commit_transaction(): no transaction open\n");
+    return(-1);
+  }
+  thread_transaction = NULL;
+  vdisk_trace(VDISK_TRACE_COMMIT, 0, 1);
+
+  pthread_mutex_lock(&transaction_mutex);
+  --t->users;
+  ++t->waiters;
+  while(!t->done) {
+    if(live[0] == t && !t->writing) {
+      // Next to be written: let the threads in it finish, then write it
+      vdisk_close_transaction(t);
+      if(t->users == 0) {
+	vdisk_end_transaction(t);
+	continue;
+      }
+    }
+    pthread_cond_wait(&transaction_changed, &transaction_mutex);
+  }
+  if(--t->waiters == 0) {
+    t->in_use = 0;
+    pthread_cond_broadcast(&transaction_changed);
+  }
+  int ret = t->result;
+  int failed = t->failed;
+  pthread_mutex_unlock(&transaction_mutex);
+
+  if(failed)
+    fprintf(stderr, "vdisk_commit_transaction(): transaction aborted\n");
+  return(ret);
+}
+
+/**
+ * Write the blocks of a transaction to the disk, through the journal when
+ * there is more than one
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_write_transaction(TRANSACTION *t)
+{
+  // Nothing to do
+  if(t->n_entries == 0)
+    return(0);
+
+  // A single block is written atomically by itself, but still made
+  // durable before the commit returns
+  if(t->n_entries == 1)
+    return(vdisk_apply_entries(t->entries, 1));
+
+  char journal_name[VDISK_NAME_LENGTH + 8];
+  vdisk_journal_name(journal_name);
+
+  JOURNAL_HEADER header;
+  header.magic = JOURNAL_MAGIC;
+  header.n_entries = t->n_entries;
+  header.checksum = vdisk_journal_checksum(t->entries, t->n_entries);
+
+  int fd = open(journal_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if(fd < 0) {
+    fprintf(stderr, "vdisk_commit_transaction(): unable to create journal\n");
+    return(-2);
+  }
+  size_t entries_size = t->n_entries * sizeof(JOURNAL_ENTRY);
+  unsigned long start = vdisk_stats_now();
+  if(write(fd, &header, sizeof(header)) != sizeof(header)
+     || write(fd, t->entries, entries_size) != (ssize_t) entries_size
+     || fsync(fd) != 0) {
+    fprintf(stderr, "vdisk_commit_transaction(): journal write failed\n");
+    close(fd);
+    unlink(journal_name);
+    return(-3);
+  }
+  vdisk_stats_sync(start);
+  vdisk_trace(VDISK_TRACE_SYNC, 0, 1);
+  close(fd);
+
+#ifdef OUFS_TEST_HOOKS
+  // ZCRASH=journal stops here, as a crash would, so that the next open's
+  // recovery can be tested.  Only test builds have this hook.
+  char *crash = getenv("ZCRASH");
+  if(crash != NULL && !strcmp(crash, "journal"))
+    _exit(3);
+#endif
+
+  // The transaction is now committed: apply it in place
+  if(vdisk_apply_entries(t->entries, t->n_entries) != 0)
+    return(-4);
+
+  unlink(journal_name);
+  return(0);
+}
+
+/**
+ * Replay a committed journal left behind by an interrupted commit.
+ * An incomplete journal belongs to a transaction that never committed and
+ * is discarded.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_recover_journal()
+{
+  char journal_name[VDISK_NAME_LENGTH + 8];
+  vdisk_journal_name(journal_name);
+
+  // A process committing now still needs its journal
+  if(vdisk_hold_writer() != 0)
+    return(-1);
+  int fd = open(journal_name, O_RDONLY);
+  if(fd < 0) {
+    vdisk_release_writer();
+    return(0);
+  }
+
+  // No transaction is in progress yet: borrow one's buffer
+  JOURNAL_ENTRY *entries = transactions[0].entries;
+  int ret = 0;
+  JOURNAL_HEADER header;
+  if(read(fd, &header, sizeof(header)) == sizeof(header)
+     && header.magic == JOURNAL_MAGIC
+     && header.n_entries <= MAX_TRANSACTION_BLOCKS) {
+    size_t entries_size = header.n_entries * sizeof(JOURNAL_ENTRY);
+    if(read(fd, entries, entries_size) == (ssize_t) entries_size
+       && vdisk_journal_checksum(entries, header.n_entries) == header.checksum) {
+      if(debug)
+        fprintf(stderr, "##Replaying journal (%d blocks)\n", header.n_entries);
+      ret = vdisk_apply_entries(entries, header.n_entries);
+    }
+  }
+  close(fd);
+
+  if(ret == 0)
+    unlink(journal_name);
+  vdisk_release_writer();
+  return(ret);
+}
+
+/**
+ * Take the writer lock for this process, unless it already holds it
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_hold_writer()
+{
+  int ret = 0;
+  pthread_mutex_lock(&writer_mutex);
+  if(writer_holds == 0 && !disk_locked) {
+    ret = vdisk_lock_bytes(WRITER_LOCK, 1, F_WRLCK);
+    if(ret == 0) {
+      pthread_mutex_lock(&io_mutex);
+      vdisk_catch_up();
+      if(disk_replaced)
+	ret = -7;
+      pthread_mutex_unlock(&io_mutex);
+      if(ret != 0)
+	vdisk_lock_bytes(WRITER_LOCK, 1, F_UNLCK);
+    }
+  }
+  if(ret == 0)
+    ++writer_holds;
+  pthread_mutex_unlock(&writer_mutex);
+  return(ret);
+}
+
+/**
+ * Release the writer lock once no transaction or writer of this process
+ * needs it
+ */
+static void vdisk_release_writer()
+{
+  pthread_mutex_lock(&writer_mutex);
+  if(--writer_holds == 0 && !disk_locked && shared != NULL) {
+    // Tell the other processes the disk has changed
+    pthread_mutex_lock(&io_mutex);
+    seen_generation = __atomic_add_fetch(&shared->generation, 1, __ATOMIC_RELEASE);
+    vdisk_store_update_done();
+    pthread_mutex_unlock(&io_mutex);
+    vdisk_lock_bytes(WRITER_LOCK, 1, F_UNLCK);
+  }
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+/**
+ * Lock a slot shared with the other processes that have the disk open.
+ * The slots mean whatever the caller makes them mean (oufs_lock.c uses
+ * one per inode).  The lock belongs to the process: taking a slot it
+ * already holds changes the lock's mode, and one unlock releases it.
+ *
+ * @param slot 0 ... VDISK_N_LOCK_SLOTS - 1
+ * @param exclusive 1 for an exclusive lock; 0 for a shared one
+ * @return 0 on success; <0 on error
+ */
+int vdisk_lock_slot(int slot, int exclusive)
+{
+  if(slot < 0 || slot >= VDISK_N_LOCK_SLOTS) {
+    fprintf(stderr, "vdisk_lock_slot(): bad slot (%d)\n", slot);
+    return(-2);
+  }
+  if(disk_locked)
+    return(0);
+  int ret = vdisk_lock_bytes(FIRST_LOCK_SLOT + slot, 1, exclusive ? F_WRLCK : F_RDLCK);
+  if(ret == 0) {
+    pthread_mutex_lock(&io_mutex);
+    int store_locked = vdisk_store_read_begin();
+    vdisk_catch_up();
+    vdisk_store_read_done(store_locked);
+    pthread_mutex_unlock(&io_mutex);
+  }
+  return(ret);
+}
+
+/**
+ * Release a slot locked by vdisk_lock_slot()
+ */
+void vdisk_unlock_slot(int slot)
+{
+  if(slot >= 0 && slot < VDISK_N_LOCK_SLOTS && !disk_locked)
+    vdisk_lock_bytes(FIRST_LOCK_SLOT + slot, 1, F_UNLCK);
+}
+
+/**
+ * Take the writer lock and every slot until the disk is closed, for tools
+ * that read the whole disk and write it back (oufs_image.c).  Called
+ * before any transaction is started.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_lock_disk()
+{
+  if(vdisk_fd == 0) {
+    fprintf(stderr, "vdisk_lock_disk(): disk not initialized\n");
+    exit(-1);
+  };
+
+  pthread_mutex_lock(&writer_mutex);
+  int ret = 0;
+  if(!disk_locked) {
+    ret = vdisk_lock_bytes(WRITER_LOCK, FIRST_LOCK_SLOT + VDISK_N_LOCK_SLOTS, F_WRLCK);
+    if(ret == 0) {
+      pthread_mutex_lock(&io_mutex);
+      vdisk_catch_up();
+      if(disk_replaced)
+	ret = -7;
+      pthread_mutex_unlock(&io_mutex);
+      if(ret == 0)
+	disk_locked = 1;
+      else
+	vdisk_lock_bytes(WRITER_LOCK, FIRST_LOCK_SLOT + VDISK_N_LOCK_SLOTS, F_UNLCK);
+    }
+  }
+  pthread_mutex_unlock(&writer_mutex);
+  return(ret);
+}
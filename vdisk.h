@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -9,15 +10,184 @@
 
 typedef unsigned short BLOCK_REFERENCE;
 
-// Size of block in bytes
+// Size of block in bytes.  The geometry (this, N_BLOCKS_IN_DISK and
+// oufs.h's N_INODE_BLOCKS) may be chosen at build time with
+// make GEOMETRY="-DBLOCK_SIZE=... ..."; oufs.h checks that it packs.
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 256
+#endif
 
 // Total number of blocks on the virtual disk
+#ifndef N_BLOCKS_IN_DISK
 #define N_BLOCKS_IN_DISK 128
+#endif
+
+// Largest number of distinct blocks one transaction may modify
+#define MAX_TRANSACTION_BLOCKS N_BLOCKS_IN_DISK
+
+// Longest virtual disk file name
+#define VDISK_NAME_LENGTH 256
+
+// Most files a disk name can stripe over ("file0,file1,...[:width]")
+#define VDISK_MAX_STRIPES 8
+
+// Container features chosen when the disk is created.  Any feature turns the
+// disk file into a block store (see vdisk_store.c) instead of a plain image.
+#define VDISK_FEATURE_SNAPSHOTS 0x1
+// Blocks with identical contents share one stored copy
+#define VDISK_FEATURE_DEDUP 0x2
+// Blocks are stored compressed when that saves space
+#define VDISK_FEATURE_COMPRESS 0x4
+// A CRC32C is kept for every stored block and checked on read
+#define VDISK_FEATURE_CHECKSUM 0x8
+// Log-structured: every write is appended to a log of segments, never
+// made in place (vdisk_log_clean())
+#define VDISK_FEATURE_LOG 0x10
+
+// When block checksums are checked (ZVERIFY=all|uncached|none)
+#define VDISK_VERIFY_NONE 0
+// Blocks read from the file; cache hits are trusted (default)
+#define VDISK_VERIFY_UNCACHED 1
+// Cache hits are checked as well
+#define VDISK_VERIFY_ALL 2
 
+// Snapshots of a block store
+#define VDISK_MAX_SNAPSHOTS 8
+#define VDISK_SNAPSHOT_NAME_SIZE 16
+
+typedef struct vdisk_snapshot_info_s
+{
+  char name[VDISK_SNAPSHOT_NAME_SIZE];
+  // Creation time (seconds since the epoch)
+  unsigned int created;
+  // Blocks that only this snapshot references
+  unsigned int n_exclusive_blocks;
+} VDISK_SNAPSHOT_INFO;
+
+int vdisk_disk_create(char *virtual_disk_name, int features);
 int vdisk_disk_open(char *virtual_disk_name);
+int vdisk_disk_features();
+int vdisk_disk_stripes();
 int vdisk_disk_close();
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(BLOCK_REFERENCE first, int count, void *blocks);
+int vdisk_write_blocks(BLOCK_REFERENCE first, int count, void *blocks);
+int vdisk_preload_blocks(BLOCK_REFERENCE first, int count, void *blocks);
+unsigned long vdisk_block_version(BLOCK_REFERENCE block_ref);
+int vdisk_resize(int n_blocks);
+void vdisk_set_verify_mode(int mode);
+
+// Blocks requested through vdisk_read_block(s)/vdisk_write_block(s) since
+// the disk was opened
+void vdisk_io_counts(unsigned long *reads, unsigned long *writes);
+
+// I/O statistics (vdisk_stats.c).  Blocks are counted by the class the
+// file system gives them with vdisk_set_block_class(); data by default.
+#define VDISK_CLASS_MASTER 0
+#define VDISK_CLASS_INODE 1
+#define VDISK_CLASS_DIRECTORY 2
+#define VDISK_CLASS_DATA 3
+#define VDISK_N_CLASSES 4
+
+// Latency histogram in nanoseconds: 16 buckets per power of two, so a
+// value is known to within 1/16 (values below 16 ns exactly)
+#define VDISK_HISTOGRAM_SUB_BUCKETS 16
+#define VDISK_HISTOGRAM_BUCKETS (37 * VDISK_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct vdisk_histogram_s
+{
+  unsigned long count[VDISK_HISTOGRAM_BUCKETS];
+  unsigned long n;
+  unsigned long sum_ns;
+  unsigned long max_ns;
+} VDISK_HISTOGRAM;
+
+typedef struct vdisk_stats_s
+{
+  // Blocks requested by callers
+  unsigned long reads[VDISK_N_CLASSES];
+  unsigned long writes[VDISK_N_CLASSES];
+  // Blocks read from and written to the disk file(s)
+  unsigned long file_reads[VDISK_N_CLASSES];
+  unsigned long file_writes[VDISK_N_CLASSES];
+  // Where requested reads were served from
+  unsigned long cache_hits;
+  unsigned long transaction_hits;
+  unsigned long cache_misses;
+  // One sample per read, write or sync of the disk file(s)
+  VDISK_HISTOGRAM read_latency;
+  VDISK_HISTOGRAM write_latency;
+  VDISK_HISTOGRAM sync_latency;
+} VDISK_STATS;
+
+void vdisk_set_block_class(BLOCK_REFERENCE block_ref, int block_class);
+void vdisk_stats_get(VDISK_STATS *stats, int all_processes);
+void vdisk_stats_reset(int all_processes);
+void vdisk_stats_print(FILE *out, VDISK_STATS *stats);
+unsigned long vdisk_histogram_percentile(VDISK_HISTOGRAM *histogram, double percent);
+
+// Block access trace (vdisk_trace.c).  With ZTRACE=<file> every block
+// access of the process is appended to the file as a VDISK_TRACE_RECORD.
+#define VDISK_TRACE_MAGIC 0x5254554fUL  // "OUTR"
+#define VDISK_TRACE_VERSION 1
+
+// Record types.  A header record (time_ns = magic, block_ref = version)
+// starts the trace; more may follow where other processes appended.
+#define VDISK_TRACE_HEADER 0
+// Blocks requested by callers
+#define VDISK_TRACE_READ 1
+#define VDISK_TRACE_WRITE 2
+// Transactions of the recording thread
+#define VDISK_TRACE_BEGIN 3
+#define VDISK_TRACE_COMMIT 4
+#define VDISK_TRACE_ABORT 5
+// Blocks transferred to or from the disk file(s), and syncs
+#define VDISK_TRACE_FILE_READ 6
+#define VDISK_TRACE_FILE_WRITE 7
+#define VDISK_TRACE_SYNC 8
+
+typedef struct vdisk_trace_record_s
+{
+  // CLOCK_MONOTONIC
+  unsigned long time_ns;
+  // Thread id (system wide, so processes sharing a trace stay apart)
+  unsigned int thread;
+  BLOCK_REFERENCE block_ref;
+  unsigned char type;
+  // Operation of the layer above in progress (vdisk_trace_context())
+  unsigned char context;
+} VDISK_TRACE_RECORD;
+
+int vdisk_trace_context(int context);
+
+// CRC32C checksum (hardware accelerated where available)
+unsigned int vdisk_crc32c(const void *data, size_t len);
+
+// Atomic multi-block updates
+int vdisk_begin_transaction();
+int vdisk_commit_transaction();
+void vdisk_abort_transaction();
+
+// Coordination between processes that have the same disk open.  A slot
+// per block: more than a file system has inodes, whatever the geometry.
+#define VDISK_N_LOCK_SLOTS N_BLOCKS_IN_DISK
+int vdisk_lock_slot(int slot, int exclusive);
+void vdisk_unlock_slot(int slot);
+int vdisk_lock_disk();
+
+// Snapshots (block stores only).  Open "disk@name" to mount a snapshot read-only.
+int vdisk_snapshot_create(char *name);
+int vdisk_snapshot_delete(char *name);
+int vdisk_snapshot_info(int index, VDISK_SNAPSHOT_INFO *info);
+
+// Merge identical blocks of a block store
+int vdisk_dedup_scan(unsigned int *merged);
+
+// Rewrite the open plain image as a block store (closes the disk)
+int vdisk_convert_disk(int features);
+
+// Cleaner of a log-structured block store
+int vdisk_log_clean(unsigned int *cleaned, unsigned int *moved, unsigned int *clean_segments);
 
 #endif
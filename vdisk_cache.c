@@ -0,0 +1,135 @@
+#include <string.h>
+#include <pthread.h>
+#include "vdisk_cache.h"
+/*
+ * Block cache for the virtual disk.
+ *
+ * Holds recently used blocks in the form handed to callers (for a block
+ * store: after decompression).  The cache is write-through: the disk is
+ * always up to date, so entries can be dropped at any time.
+ *
+ * Set-associative: a block can live in any of VDISK_CACHE_WAYS slots of
+ * its set; the least recently used slot of the set is replaced.
+ *
+ * Each set has its own lock, so threads working on different blocks
+ * rarely wait for each other.
+ *
+ * Every entry records the generation of its block when it was read (see
+ * vdisk_lock_slot() in vdisk.c); once another process writes the block
+ * its generation moves on and the entry no longer matches.
+ */
+
+typedef struct cache_slot_s
+{
+  int valid;
+  BLOCK_REFERENCE block_ref;
+  unsigned int last_used;
+  // Generation of the block the data belongs to
+  unsigned int generation;
+  // CRC32C of data, to check cache hits in VDISK_VERIFY_ALL mode
+  unsigned int crc;
+  unsigned char data[BLOCK_SIZE];
+} CACHE_SLOT;
+
+#define N_SETS (VDISK_CACHE_BLOCKS / VDISK_CACHE_WAYS)
+
+static CACHE_SLOT cache[N_SETS][VDISK_CACHE_WAYS];
+static pthread_mutex_t set_lock[N_SETS] = { [0 ... N_SETS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+// Logical clock for LRU replacement (shared by the sets, so updated atomically)
+static unsigned int cache_clock = 0;
+
+/**
+ * Find the slot holding a block.  The caller holds the lock of its set.
+ *
+ * @return The slot; NULL if the block is not cached
+ */
+static CACHE_SLOT *vdisk_cache_find(BLOCK_REFERENCE block_ref)
+{
+  CACHE_SLOT *set = cache[block_ref % N_SETS];
+  for(int i = 0; i < VDISK_CACHE_WAYS; ++i) {
+    if(set[i].valid && set[i].block_ref == block_ref)
+      return(&set[i]);
+  }
+  return(NULL);
+}
+
+/**
+ * Copy a cached block
+ *
+ * @param block_ref Block to look up
+ * @param block Buffer for the contents
+ * @param verify Check the cached copy against its checksum; a damaged
+ *        copy is dropped and reported as a miss
+ * @param generation Current generation of the block; an older copy is
+ *        dropped and reported as a miss
+ * @return 1 if the block was cached; 0 otherwise
+ */
+int vdisk_cache_lookup(BLOCK_REFERENCE block_ref, void *block, int verify, unsigned int generation)
+{
+  pthread_mutex_t *lock = &set_lock[block_ref % N_SETS];
+  pthread_mutex_lock(lock);
+  CACHE_SLOT *slot = vdisk_cache_find(block_ref);
+  if(slot == NULL) {
+    pthread_mutex_unlock(lock);
+    return(0);
+  }
+  if(slot->generation != generation) {
+    slot->valid = 0;
+    pthread_mutex_unlock(lock);
+    return(0);
+  }
+  if(verify && vdisk_crc32c(slot->data, BLOCK_SIZE) != slot->crc) {
+    fprintf(stderr, "vdisk_cache_lookup(): cached block %d is damaged\n", block_ref);
+    slot->valid = 0;
+    pthread_mutex_unlock(lock);
+    return(0);
+  }
+  slot->last_used = __atomic_add_fetch(&cache_clock, 1, __ATOMIC_RELAXED);
+  memcpy(block, slot->data, BLOCK_SIZE);
+  pthread_mutex_unlock(lock);
+  return(1);
+}
+
+/**
+ * Store the current contents of a block
+ *
+ * @param block_ref Block number
+ * @param block Contents of the block
+ * @param generation Generation of the block these contents belong to
+ */
+void vdisk_cache_insert(BLOCK_REFERENCE block_ref, void *block, unsigned int generation)
+{
+  pthread_mutex_t *lock = &set_lock[block_ref % N_SETS];
+  pthread_mutex_lock(lock);
+  CACHE_SLOT *slot = vdisk_cache_find(block_ref);
+  if(slot == NULL) {
+    // Replace the least recently used slot of the set
+    CACHE_SLOT *set = cache[block_ref % N_SETS];
+    slot = &set[0];
+    for(int i = 1; i < VDISK_CACHE_WAYS; ++i) {
+      if(!set[i].valid || (slot->valid && set[i].last_used < slot->last_used))
+	slot = &set[i];
+    }
+  }
+  slot->valid = 1;
+  slot->block_ref = block_ref;
+  slot->generation = generation;
+  slot->last_used = __atomic_add_fetch(&cache_clock, 1, __ATOMIC_RELAXED);
+  memcpy(slot->data, block, BLOCK_SIZE);
+  slot->crc = vdisk_crc32c(slot->data, BLOCK_SIZE);
+  pthread_mutex_unlock(lock);
+}
+
+/**
+ * Drop every cached block
+ */
+void vdisk_cache_invalidate()
+{
+  for(int s = 0; s < N_SETS; ++s) {
+    pthread_mutex_lock(&set_lock[s]);
+    for(int i = 0; i < VDISK_CACHE_WAYS; ++i)
+      cache[s][i].valid = 0;
+    pthread_mutex_unlock(&set_lock[s]);
+  }
+}
@@ -0,0 +1,20 @@
+#ifndef VDISK_CACHE_H
+#define VDISK_CACHE_H
+
+/*
+ * Block cache: private to the vdisk implementation.
+ */
+
+#include "vdisk.h"
+
+// Number of cached blocks
+#define VDISK_CACHE_BLOCKS 64
+
+// Slots per set
+#define VDISK_CACHE_WAYS 4
+
+int vdisk_cache_lookup(BLOCK_REFERENCE block_ref, void *block, int verify, unsigned int generation);
+void vdisk_cache_insert(BLOCK_REFERENCE block_ref, void *block, unsigned int generation);
+void vdisk_cache_invalidate();
+
+#endif
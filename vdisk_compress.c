@@ -0,0 +1,207 @@
+#include <string.h>
+#include "vdisk_store.h"
+/*
+ * Block compression for the block store.
+ *
+ * Uses the LZ4 block format: a sequence of tokens, each giving a run of
+ * literal bytes followed by a copy of earlier output.  Compression is a
+ * single greedy pass with a small hash table of 4-byte sequences, which
+ * is enough for BLOCK_SIZE inputs.
+ */
+
+#define MIN_MATCH 4
+// The last match must start this many bytes before the end of the input
+#define MF_LIMIT 12
+// The last bytes of the input are always literals
+#define LAST_LITERALS 5
+
+#define HASH_BITS 8
+
+static unsigned int read32(const unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return(v);
+}
+
+static unsigned int hash4(const unsigned char *p)
+{
+  return((read32(p) * 2654435761u) >> (32 - HASH_BITS));
+}
+
+/**
+ * Append a length extension (255, 255, ..., remainder)
+ *
+ * @return Next output position; NULL if the output is full
+ */
+static unsigned char *write_length(unsigned char *op, unsigned char *oend, size_t len)
+{
+  for(; len >= 255; len -= 255) {
+    if(op >= oend)
+      return(NULL);
+    *op++ = 255;
+  }
+  if(op >= oend)
+    return(NULL);
+  *op++ = (unsigned char) len;
+  return(op);
+}
+
+/**
+ * Emit one sequence: literals, then (unless last) a match
+ *
+ * @return Next output position; NULL if the output is full
+ */
+static unsigned char *write_sequence(unsigned char *op, unsigned char *oend,
+				     const unsigned char *literals, size_t n_literals,
+				     size_t offset, size_t match_len)
+{
+  if(op >= oend)
+    return(NULL);
+  unsigned char *token = op++;
+  *token = (unsigned char) ((n_literals >= 15 ? 15 : n_literals) << 4);
+  if(n_literals >= 15 && (op = write_length(op, oend, n_literals - 15)) == NULL)
+    return(NULL);
+  if(op + n_literals > oend)
+    return(NULL);
+  memcpy(op, literals, n_literals);
+  op += n_literals;
+
+  if(match_len == 0)
+    return(op);
+
+  if(op + 2 > oend)
+    return(NULL);
+  *op++ = (unsigned char) (offset & 0xff);
+  *op++ = (unsigned char) (offset >> 8);
+  size_t ml = match_len - MIN_MATCH;
+  *token |= (unsigned char) (ml >= 15 ? 15 : ml);
+  if(ml >= 15 && (op = write_length(op, oend, ml - 15)) == NULL)
+    return(NULL);
+  return(op);
+}
+
+/**
+ * Compress a buffer
+ *
+ * @param src Bytes to compress
+ * @param src_len Number of bytes (at most 65535)
+ * @param dst Output buffer
+ * @param dst_capacity Size of the output buffer
+ * @return Compressed length; 0 if the result does not fit in dst
+ */
+size_t vdisk_compress(const void *src, size_t src_len, void *dst, size_t dst_capacity)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = ip + src_len;
+  const unsigned char *anchor = ip;
+  unsigned char *op = dst;
+  unsigned char *oend = op + dst_capacity;
+  unsigned short table[1 << HASH_BITS];
+
+  if(src_len >= MF_LIMIT) {
+    memset(table, 0xff, sizeof(table));
+    const unsigned char *mflimit = iend - MF_LIMIT;
+    const unsigned char *matchlimit = iend - LAST_LITERALS;
+
+    while(ip <= mflimit) {
+      unsigned int h = hash4(ip);
+      unsigned short candidate = table[h];
+      table[h] = (unsigned short) (ip - (const unsigned char *) src);
+
+      const unsigned char *ref = (const unsigned char *) src + candidate;
+      if(candidate == 0xffff || read32(ref) != read32(ip)) {
+	++ip;
+	continue;
+      }
+
+      // Extend the match forward
+      size_t len = MIN_MATCH;
+      while(ip + len < matchlimit && ref[len] == ip[len])
+	++len;
+
+      op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+      if(op == NULL)
+	return(0);
+      ip += len;
+      anchor = ip;
+    }
+  }
+
+  // Remaining bytes are literals
+  op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+  if(op == NULL)
+    return(0);
+  return(op - (unsigned char *) dst);
+}
+
+/**
+ * Decompress a buffer produced by vdisk_compress()
+ *
+ * @param src Compressed bytes
+ * @param src_len Number of compressed bytes
+ * @param dst Output buffer
+ * @param dst_len Expected decompressed length
+ * @return 0 on success; <0 if the input is corrupt
+ */
+int vdisk_decompress(const void *src, size_t src_len, void *dst, size_t dst_len)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = ip + src_len;
+  unsigned char *op = dst;
+  unsigned char *oend = op + dst_len;
+
+  while(ip < iend) {
+    unsigned int token = *ip++;
+
+    // Literals
+    size_t len = token >> 4;
+    if(len == 15) {
+      unsigned int b;
+      do {
+	if(ip >= iend)
+	  return(-1);
+	b = *ip++;
+	len += b;
+      } while(b == 255);
+    }
+    if(ip + len > iend || op + len > oend)
+      return(-1);
+    memcpy(op, ip, len);
+    ip += len;
+    op += len;
+
+    // The last sequence has no match
+    if(ip == iend)
+      break;
+
+    if(ip + 2 > iend)
+      return(-1);
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > (size_t) (op - (unsigned char *) dst))
+      return(-1);
+
+    len = token & 15;
+    if(len == 15) {
+      unsigned int b;
+      do {
+	if(ip >= iend)
+	  return(-1);
+	b = *ip++;
+	len += b;
+      } while(b == 255);
+    }
+    len += MIN_MATCH;
+    if(op + len > oend)
+      return(-1);
+
+    // Byte by byte: the copy may overlap its own output
+    const unsigned char *ref = op - offset;
+    for(size_t i = 0; i < len; ++i)
+      op[i] = ref[i];
+    op += len;
+  }
+
+  return(op == oend ? 0 : -1);
+}
@@ -0,0 +1,123 @@
+#include <string.h>
+#include "vdisk.h"
+/*
+ * CRC32C (Castagnoli) checksums.
+ *
+ * Uses the CRC32 instructions of SSE4.2 (x86-64) or ARMv8 when the CPU
+ * has them, and an 8-table software implementation otherwise.  The
+ * choice is made once, on first use.
+ */
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+static unsigned int crc_table[8][256];
+
+static unsigned int (*crc_update)(unsigned int crc, const unsigned char *p, size_t len) = NULL;
+
+/**
+ * Software CRC32C, 8 bytes per step
+ */
+static unsigned int crc32c_soft(unsigned int crc, const unsigned char *p, size_t len)
+{
+  for(; len >= 8; len -= 8, p += 8) {
+    unsigned int lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff]
+      ^ crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24]
+      ^ crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff]
+      ^ crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+  }
+  for(; len > 0; --len, ++p)
+    crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+  return(crc);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+  unsigned long long c = crc;
+  for(; len >= 8; len -= 8, p += 8) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = (unsigned int) c;
+  for(; len > 0; --len, ++p)
+    crc = _mm_crc32_u8(crc, *p);
+  return(crc);
+}
+
+static int crc32c_hw_available()
+{
+  return(__builtin_cpu_supports("sse4.2"));
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static unsigned int crc32c_hw(unsigned int crc, const unsigned char *p, size_t len)
+{
+  for(; len >= 8; len -= 8, p += 8) {
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+  }
+  for(; len > 0; --len, ++p)
+    crc = __crc32cb(crc, *p);
+  return(crc);
+}
+
+static int crc32c_hw_available()
+{
+  return((getauxval(AT_HWCAP) & HWCAP_CRC32) != 0);
+}
+#else
+#define crc32c_hw crc32c_soft
+
+static int crc32c_hw_available()
+{
+  return(0);
+}
+#endif
+
+/**
+ * Pick the implementation and build the software tables
+ */
+static void crc32c_init()
+{
+  for(int i = 0; i < 256; ++i) {
+    unsigned int crc = i;
+    for(int j = 0; j < 8; ++j)
+      crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+    crc_table[0][i] = crc;
+  }
+  for(int i = 0; i < 256; ++i) {
+    for(int t = 1; t < 8; ++t)
+      crc_table[t][i] = crc_table[0][crc_table[t - 1][i] & 0xff] ^ (crc_table[t - 1][i] >> 8);
+  }
+
+  crc_update = crc32c_hw_available() ? crc32c_hw : crc32c_soft;
+}
+
+/**
+ * CRC32C of a buffer
+ *
+ * @param data Bytes to check
+ * @param len Number of bytes
+ * @return The checksum
+ */
+unsigned int vdisk_crc32c(const void *data, size_t len)
+{
+  if(crc_update == NULL)
+    crc32c_init();
+  return(~crc_update(~0u, data, len));
+}
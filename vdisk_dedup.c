@@ -0,0 +1,157 @@
+#include <string.h>
+#include "vdisk_store.h"
+/*
+ * Content index for block store deduplication.
+ *
+ * Every stored run is hashed with xxHash32.  The index maps a hash to the
+ * runs that have it, so a block being written can be matched against an
+ * existing copy.  Hashes can collide: callers compare the data before
+ * sharing a run.
+ *
+ * Runs are chained through an array indexed by their first chunk, so the
+ * index needs no allocation per entry.
+ */
+
+#define PRIME32_1 2654435761u
+#define PRIME32_2 2246822519u
+#define PRIME32_3 3266489917u
+#define PRIME32_4 668265263u
+#define PRIME32_5 374761393u
+
+// Number of hash buckets (power of 2)
+#define DEDUP_BUCKETS 4096
+
+static unsigned int dedup_bucket[DEDUP_BUCKETS];
+static unsigned int *dedup_next = NULL;
+
+static unsigned int rotl32(unsigned int x, int r)
+{
+  return((x << r) | (x >> (32 - r)));
+}
+
+static unsigned int read32(const unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return(v);
+}
+
+/**
+ * xxHash32 of a buffer
+ *
+ * @param data Bytes to hash
+ * @param len Number of bytes
+ * @param seed Hash seed
+ * @return The hash
+ */
+unsigned int vdisk_dedup_hash(const void *data, size_t len, unsigned int seed)
+{
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  unsigned int h;
+
+  if(len >= 16) {
+    unsigned int v1 = seed + PRIME32_1 + PRIME32_2;
+    unsigned int v2 = seed + PRIME32_2;
+    unsigned int v3 = seed;
+    unsigned int v4 = seed - PRIME32_1;
+    for(; p + 16 <= end; p += 16) {
+      v1 = rotl32(v1 + read32(p) * PRIME32_2, 13) * PRIME32_1;
+      v2 = rotl32(v2 + read32(p + 4) * PRIME32_2, 13) * PRIME32_1;
+      v3 = rotl32(v3 + read32(p + 8) * PRIME32_2, 13) * PRIME32_1;
+      v4 = rotl32(v4 + read32(p + 12) * PRIME32_2, 13) * PRIME32_1;
+    }
+    h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+  }else{
+    h = seed + PRIME32_5;
+  }
+  h += (unsigned int) len;
+
+  for(; p + 4 <= end; p += 4)
+    h = rotl32(h + read32(p) * PRIME32_3, 17) * PRIME32_4;
+  for(; p < end; ++p)
+    h = rotl32(h + (*p) * PRIME32_5, 11) * PRIME32_1;
+
+  h ^= h >> 15;
+  h *= PRIME32_2;
+  h ^= h >> 13;
+  h *= PRIME32_3;
+  h ^= h >> 16;
+  return(h);
+}
+
+/**
+ * Set up an empty index
+ *
+ * @param n_chunks Number of chunks in the store
+ * @return 0 on success; <0 on error
+ */
+int vdisk_dedup_init(unsigned int n_chunks)
+{
+  free(dedup_next);
+  dedup_next = malloc(n_chunks * sizeof(unsigned int));
+  if(dedup_next == NULL)
+    return(-1);
+  for(int i = 0; i < DEDUP_BUCKETS; ++i)
+    dedup_bucket[i] = STORE_NO_CHUNK;
+  return(0);
+}
+
+/**
+ * Release the index
+ */
+void vdisk_dedup_free()
+{
+  free(dedup_next);
+  dedup_next = NULL;
+}
+
+/**
+ * Add a run to the index
+ *
+ * @param chunk First chunk of the run
+ * @param hash Hash of the run's contents
+ */
+void vdisk_dedup_insert(unsigned int chunk, unsigned int hash)
+{
+  unsigned int *bucket = &dedup_bucket[hash & (DEDUP_BUCKETS - 1)];
+  dedup_next[chunk] = *bucket;
+  *bucket = chunk;
+}
+
+/**
+ * Remove a run from the index
+ *
+ * @param chunk First chunk of the run
+ * @param hash Hash the run was inserted with
+ */
+void vdisk_dedup_remove(unsigned int chunk, unsigned int hash)
+{
+  unsigned int *link = &dedup_bucket[hash & (DEDUP_BUCKETS - 1)];
+  while(*link != STORE_NO_CHUNK) {
+    if(*link == chunk) {
+      *link = dedup_next[chunk];
+      return;
+    }
+    link = &dedup_next[*link];
+  }
+}
+
+/**
+ * First run that may have the given hash
+ *
+ * @return First chunk of the run; STORE_NO_CHUNK if none.  Runs in the same
+ *         bucket with other hashes are also returned.
+ */
+unsigned int vdisk_dedup_first(unsigned int hash)
+{
+  return(dedup_bucket[hash & (DEDUP_BUCKETS - 1)]);
+}
+
+/**
+ * Next run after chunk in the same bucket
+ */
+unsigned int vdisk_dedup_next(unsigned int chunk)
+{
+  return(dedup_next[chunk]);
+}
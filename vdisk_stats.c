@@ -0,0 +1,240 @@
+#include <string.h>
+#include <time.h>
+#include "vdisk_stats.h"
+/*
+ * I/O statistics for the virtual disk.
+ *
+ * Always on: every counter is a relaxed atomic add, and the file I/O is
+ * timed with one clock read before and one after.  The block classes
+ * come from the file system above (vdisk_set_block_class()); vdisk only
+ * knows block numbers.
+ *
+ * Latencies go into log-linear histograms (as in HdrHistogram): each
+ * power of two is split into VDISK_HISTOGRAM_SUB_BUCKETS buckets, so any
+ * percentile is accurate to about 6% with a fixed, small table.
+ *
+ * These are the counts of this process since the disk was opened.
+ * vdisk.c adds them to the totals in the disk's lock file when the disk
+ * is closed (vdisk_stats_get()).
+ */
+
+static VDISK_STATS stats;
+static unsigned char block_classes[N_BLOCKS_IN_DISK];
+
+static void vdisk_stats_add(unsigned long *counter, unsigned long n)
+{
+  __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Forget the counts and block classes of the previous disk
+ */
+void vdisk_stats_open()
+{
+  memset(block_classes, VDISK_CLASS_DATA, sizeof(block_classes));
+  vdisk_stats_clear();
+}
+
+/**
+ * Zero this process's counts
+ */
+void vdisk_stats_clear()
+{
+  memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Tell the statistics what a block holds
+ *
+ * @param block_ref Block
+ * @param block_class VDISK_CLASS_*
+ */
+void vdisk_set_block_class(BLOCK_REFERENCE block_ref, int block_class)
+{
+  if(block_ref < N_BLOCKS_IN_DISK && block_class >= 0 && block_class < VDISK_N_CLASSES)
+    block_classes[block_ref] = block_class;
+}
+
+/**
+ * Count blocks requested by a caller
+ *
+ * @param write 1 for writes; 0 for reads
+ */
+void vdisk_stats_request(BLOCK_REFERENCE first, int count, int write)
+{
+  for(int b = first; b < first + count && b < N_BLOCKS_IN_DISK; ++b)
+    vdisk_stats_add(write ? &stats.writes[block_classes[b]] : &stats.reads[block_classes[b]], 1);
+}
+
+/**
+ * Count where requested blocks were read from
+ *
+ * @param source VDISK_READ_*
+ * @param count Number of blocks
+ */
+void vdisk_stats_read_from(int source, int count)
+{
+  if(source == VDISK_READ_CACHE)
+    vdisk_stats_add(&stats.cache_hits, count);
+  else if(source == VDISK_READ_TRANSACTION)
+    vdisk_stats_add(&stats.transaction_hits, count);
+  else
+    vdisk_stats_add(&stats.cache_misses, count);
+}
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+unsigned long vdisk_stats_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return((unsigned long) t.tv_sec * 1000000000UL + t.tv_nsec);
+}
+
+/**
+ * Histogram bucket of a value
+ */
+static int vdisk_histogram_bucket(unsigned long value)
+{
+  if(value < VDISK_HISTOGRAM_SUB_BUCKETS)
+    return(value);
+  int exponent = 63 - __builtin_clzl(value);
+  int bucket = (exponent - 3) * VDISK_HISTOGRAM_SUB_BUCKETS + ((value >> (exponent - 4)) & (VDISK_HISTOGRAM_SUB_BUCKETS - 1));
+  return(bucket < VDISK_HISTOGRAM_BUCKETS ? bucket : VDISK_HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * Largest value that falls in a bucket
+ */
+static unsigned long vdisk_histogram_bucket_top(int bucket)
+{
+  int group = bucket / VDISK_HISTOGRAM_SUB_BUCKETS;
+  unsigned long sub = bucket % VDISK_HISTOGRAM_SUB_BUCKETS;
+  if(group == 0)
+    return(sub);
+  int shift = group - 1;
+  return(((VDISK_HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1);
+}
+
+static void vdisk_histogram_record(VDISK_HISTOGRAM *histogram, unsigned long value)
+{
+  vdisk_stats_add(&histogram->count[vdisk_histogram_bucket(value)], 1);
+  vdisk_stats_add(&histogram->n, 1);
+  vdisk_stats_add(&histogram->sum_ns, value);
+  unsigned long max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+  while(value > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * A percentile of a histogram
+ *
+ * @param percent 0 to 100
+ * @return The value in nanoseconds (the top of its bucket); 0 when empty
+ */
+unsigned long vdisk_histogram_percentile(VDISK_HISTOGRAM *histogram, double percent)
+{
+  if(histogram->n == 0)
+    return(0);
+  unsigned long rank = (unsigned long) (percent / 100 * histogram->n + 0.5);
+  if(rank < 1)
+    rank = 1;
+  unsigned long seen = 0;
+  for(int k = 0; k < VDISK_HISTOGRAM_BUCKETS; ++k) {
+    seen += histogram->count[k];
+    if(seen >= rank) {
+      unsigned long top = vdisk_histogram_bucket_top(k);
+      return(top < histogram->max_ns ? top : histogram->max_ns);
+    }
+  }
+  return(histogram->max_ns);
+}
+
+/**
+ * Count a read or write of the disk file(s)
+ *
+ * @param first First block transferred
+ * @param count Number of blocks
+ * @param write 1 for writes; 0 for reads
+ * @param start vdisk_stats_now() before the transfer
+ */
+void vdisk_stats_file_io(BLOCK_REFERENCE first, int count, int write, unsigned long start)
+{
+  unsigned long latency = vdisk_stats_now() - start;
+  for(int b = first; b < first + count && b < N_BLOCKS_IN_DISK; ++b)
+    vdisk_stats_add(write ? &stats.file_writes[block_classes[b]] : &stats.file_reads[block_classes[b]], 1);
+  vdisk_histogram_record(write ? &stats.write_latency : &stats.read_latency, latency);
+}
+
+/**
+ * Count an fsync of the disk file(s) or the journal
+ *
+ * @param start vdisk_stats_now() before the sync
+ */
+void vdisk_stats_sync(unsigned long start)
+{
+  vdisk_histogram_record(&stats.sync_latency, vdisk_stats_now() - start);
+}
+
+static void vdisk_histogram_merge(VDISK_HISTOGRAM *into, VDISK_HISTOGRAM *from)
+{
+  for(int k = 0; k < VDISK_HISTOGRAM_BUCKETS; ++k) {
+    if(from->count[k])
+      vdisk_stats_add(&into->count[k], from->count[k]);
+  }
+  vdisk_stats_add(&into->n, from->n);
+  vdisk_stats_add(&into->sum_ns, from->sum_ns);
+  unsigned long max = __atomic_load_n(&into->max_ns, __ATOMIC_RELAXED);
+  while(from->max_ns > max && !__atomic_compare_exchange_n(&into->max_ns, &max, from->max_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * Add this process's counts to other counts (atomically, so that several
+ * processes can add to the same shared totals)
+ */
+void vdisk_stats_merge(VDISK_STATS *into)
+{
+  for(int c = 0; c < VDISK_N_CLASSES; ++c) {
+    vdisk_stats_add(&into->reads[c], stats.reads[c]);
+    vdisk_stats_add(&into->writes[c], stats.writes[c]);
+    vdisk_stats_add(&into->file_reads[c], stats.file_reads[c]);
+    vdisk_stats_add(&into->file_writes[c], stats.file_writes[c]);
+  }
+  vdisk_stats_add(&into->cache_hits, stats.cache_hits);
+  vdisk_stats_add(&into->transaction_hits, stats.transaction_hits);
+  vdisk_stats_add(&into->cache_misses, stats.cache_misses);
+  vdisk_histogram_merge(&into->read_latency, &stats.read_latency);
+  vdisk_histogram_merge(&into->write_latency, &stats.write_latency);
+  vdisk_histogram_merge(&into->sync_latency, &stats.sync_latency);
+}
+
+static void vdisk_histogram_print(FILE *out, char *name, VDISK_HISTOGRAM *histogram)
+{
+  fprintf(out, "%-6s %9lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, histogram->n,
+	  histogram->n ? histogram->sum_ns / 1e3 / histogram->n : 0.0,
+	  vdisk_histogram_percentile(histogram, 50) / 1e3, vdisk_histogram_percentile(histogram, 90) / 1e3,
+	  vdisk_histogram_percentile(histogram, 99) / 1e3, vdisk_histogram_percentile(histogram, 99.9) / 1e3,
+	  histogram->max_ns / 1e3);
+}
+
+/**
+ * Print statistics as a table
+ */
+void vdisk_stats_print(FILE *out, VDISK_STATS *s)
+{
+  static char *class_names[VDISK_N_CLASSES] = { "master", "inode", "directory", "data" };
+  fprintf(out, "%-10s %10s %10s %10s %10s\n", "blocks", "reads", "writes", "file_reads", "file_writes");
+  for(int c = 0; c < VDISK_N_CLASSES; ++c)
+    fprintf(out, "%-10s %10lu %10lu %10lu %10lu\n", class_names[c], s->reads[c], s->writes[c], s->file_reads[c], s->file_writes[c]);
+
+  unsigned long total = s->cache_hits + s->transaction_hits + s->cache_misses;
+  fprintf(out, "cache: %lu hits, %lu from transactions, %lu misses (%.1f%% hits)\n", s->cache_hits,
+	  s->transaction_hits, s->cache_misses, total ? 100.0 * (s->cache_hits + s->transaction_hits) / total : 0.0);
+
+  fprintf(out, "%-6s %9s %9s %9s %9s %9s %9s %9s\n", "us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+  vdisk_histogram_print(out, "read", &s->read_latency);
+  vdisk_histogram_print(out, "write", &s->write_latency);
+  vdisk_histogram_print(out, "sync", &s->sync_latency);
+}
@@ -0,0 +1,24 @@
+#ifndef VDISK_STATS_H
+#define VDISK_STATS_H
+
+/*
+ * I/O statistics: private to the vdisk implementation.
+ */
+
+#include "vdisk.h"
+
+// What a read request was served from
+#define VDISK_READ_CACHE 0
+#define VDISK_READ_TRANSACTION 1
+#define VDISK_READ_FILE 2
+
+void vdisk_stats_open();
+void vdisk_stats_clear();
+void vdisk_stats_request(BLOCK_REFERENCE first, int count, int write);
+void vdisk_stats_read_from(int source, int count);
+unsigned long vdisk_stats_now();
+void vdisk_stats_file_io(BLOCK_REFERENCE first, int count, int write, unsigned long start);
+void vdisk_stats_sync(unsigned long start);
+void vdisk_stats_merge(VDISK_STATS *into);
+
+#endif
@@ -0,0 +1,1085 @@
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include "vdisk_store.h"
+/*
+ * Block store implementation.
+ *
+ * On-disk layout:
+ *   header | snapshot table | maps (live + one per snapshot) | chunk
+ *   reference counts | run hashes (optional) | run checksums (optional) |
+ *   chunk data
+ *
+ * The maps and chunk tables are sized for the disk's blocks, so the
+ * metadata of a small disk is small too.  The chunk data area is only as
+ * long as the chunks written so far.
+ *
+ * All tables are held in memory while the store is open and the parts
+ * that changed are written back by vdisk_store_flush().  A write to a
+ * logical block whose chunks are shared with a snapshot goes to a fresh
+ * run of chunks, so taking a snapshot only copies the live map.
+ *
+ * With VDISK_FEATURE_DEDUP, a block whose contents are already stored is
+ * not written again: its map entry shares the existing run instead.
+ *
+ * With VDISK_FEATURE_COMPRESS, a block is stored compressed when that
+ * saves at least one chunk.  The map entry records the stored length.
+ *
+ * With VDISK_FEATURE_CHECKSUM, the CRC32C of every stored run is kept and
+ * checked when the run is read.
+ *
+ * With VDISK_FEATURE_LOG, the chunk data is a log of segments of
+ * STORE_SEGMENT_CHUNKS chunks, and nothing is overwritten in place: every
+ * write goes to the head of the log, so the writes of a transaction (the
+ * master, inode and directory blocks of a mkdir, say) are one sequential
+ * stretch of the file.  The maps are the checkpoint that locates the
+ * latest copy of each block; vdisk_store_flush() writes them, with the
+ * log head.  The log moves on to clean segments only (no live chunks).
+ * The cleaner keeps STORE_LOG_RESERVE of them: after a checkpoint that
+ * leaves fewer, it copies the live runs of the segments with the least
+ * live data to the head of the log, and the next checkpoint frees them.
+ */
+
+// Debug flag
+#define debug 0
+
+// Backing file; 0 when no store is open
+static int store_fd = 0;
+
+// In-memory copy of all store metadata (header through reference counts)
+static unsigned char *store_meta = NULL;
+static STORE_HEADER *store_header;
+static STORE_SNAPSHOT *store_snapshots;
+static STORE_MAP_ENTRY *store_maps;
+static unsigned short *store_refcounts;
+static unsigned int *store_hashes;
+static unsigned int *store_crcs;
+
+// One bit per metadata block that must be written by vdisk_store_flush()
+static unsigned char *store_dirty = NULL;
+
+// One bit per chunk freed since the last flush.  These chunks may still be
+// referenced by the on-disk maps, so they are not reused until then.
+static unsigned char *store_pending_free = NULL;
+
+// Map used for reads and writes; only the live map is writable
+static int store_map_index = STORE_LIVE_MAP;
+
+// Next-fit allocation cursor
+static unsigned int store_cursor = 0;
+
+// Log-structured stores: next chunk of the log, and whether the cleaner
+// is running (it must not be started again from the allocations it makes)
+static unsigned int store_log_head = 0;
+static int store_cleaning = 0;
+
+static unsigned int vdisk_store_log_allocate(unsigned int n);
+static int vdisk_store_clean(unsigned int want, unsigned int max_live, unsigned int *cleaned, unsigned int *moved);
+
+/**
+ * Size of the metadata area for a store with the given geometry
+ */
+static void vdisk_store_layout(STORE_HEADER *header, unsigned int map_capacity, unsigned int n_chunks,
+			       unsigned int features)
+{
+  header->map_capacity = map_capacity;
+  header->n_chunks = n_chunks;
+  header->snapshot_offset = BLOCK_SIZE;
+  header->map_offset = header->snapshot_offset
+    + ((STORE_MAX_SNAPSHOTS * sizeof(STORE_SNAPSHOT) + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+  header->refcount_offset = header->map_offset
+    + (STORE_MAX_SNAPSHOTS + 1) * map_capacity * sizeof(STORE_MAP_ENTRY);
+  header->data_offset = header->refcount_offset
+    + ((n_chunks * sizeof(unsigned short) + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+  header->hash_offset = 0;
+  if(features & VDISK_FEATURE_DEDUP) {
+    header->hash_offset = header->data_offset;
+    header->data_offset = header->hash_offset
+      + ((n_chunks * sizeof(unsigned int) + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+  }
+  header->crc_offset = 0;
+  if(features & VDISK_FEATURE_CHECKSUM) {
+    header->crc_offset = header->data_offset;
+    header->data_offset = header->crc_offset
+      + ((n_chunks * sizeof(unsigned int) + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+  }
+}
+
+/**
+ * Point the table pointers into the metadata buffer
+ */
+static void vdisk_store_bind_tables()
+{
+  store_header = (STORE_HEADER *) store_meta;
+  store_snapshots = (STORE_SNAPSHOT *) (store_meta + store_header->snapshot_offset);
+  store_maps = (STORE_MAP_ENTRY *) (store_meta + store_header->map_offset);
+  store_refcounts = (unsigned short *) (store_meta + store_header->refcount_offset);
+  store_hashes = store_header->hash_offset ? (unsigned int *) (store_meta + store_header->hash_offset) : NULL;
+  store_crcs = store_header->crc_offset ? (unsigned int *) (store_meta + store_header->crc_offset) : NULL;
+}
+
+/**
+ * Record that a range of the metadata buffer has changed
+ */
+static void vdisk_store_mark_dirty(void *ptr, size_t len)
+{
+  size_t first = ((unsigned char *) ptr - store_meta) / BLOCK_SIZE;
+  size_t last = ((unsigned char *) ptr - store_meta + len - 1) / BLOCK_SIZE;
+  for(size_t i = first; i <= last; ++i)
+    store_dirty[i >> 3] |= (1 << (i & 7));
+}
+
+/**
+ * Map entry for a logical block in one of the maps
+ */
+static STORE_MAP_ENTRY *vdisk_store_entry(int map_index, BLOCK_REFERENCE block_ref)
+{
+  return(&store_maps[map_index * store_header->map_capacity + block_ref]);
+}
+
+/**
+ * Number of chunks occupied by a run of the given length
+ */
+static unsigned int vdisk_store_run_chunks(unsigned int length)
+{
+  return((length + STORE_CHUNK_SIZE - 1) / STORE_CHUNK_SIZE);
+}
+
+/**
+ * Add delta to the reference count of every chunk of a run
+ */
+static void vdisk_store_adjust_refcount(STORE_MAP_ENTRY *entry, int delta)
+{
+  if(entry->chunk == STORE_NO_CHUNK)
+    return;
+
+  unsigned int n = vdisk_store_run_chunks(entry->length);
+  for(unsigned int i = entry->chunk; i < entry->chunk + n; ++i) {
+    store_refcounts[i] += delta;
+    if(store_refcounts[i] == 0)
+      store_pending_free[i >> 3] |= (1 << (i & 7));
+  }
+  // A freed run can no longer be shared
+  if(store_refcounts[entry->chunk] == 0 && store_hashes != NULL)
+    vdisk_dedup_remove(entry->chunk, store_hashes[entry->chunk]);
+  vdisk_store_mark_dirty(&store_refcounts[entry->chunk], n * sizeof(unsigned short));
+}
+
+/**
+ * Is a chunk available for allocation?
+ */
+static int vdisk_store_chunk_free(unsigned int chunk)
+{
+  return(store_refcounts[chunk] == 0 && !(store_pending_free[chunk >> 3] & (1 << (chunk & 7))));
+}
+
+/**
+ * Find a run of free chunks (next fit)
+ *
+ * @param n Number of chunks needed
+ * @return First chunk of the run; STORE_NO_CHUNK if the store is full
+ */
+static unsigned int vdisk_store_allocate(unsigned int n)
+{
+  if(store_header->features & VDISK_FEATURE_LOG)
+    return(vdisk_store_log_allocate(n));
+
+  unsigned int n_chunks = store_header->n_chunks;
+  for(unsigned int scanned = 0, start = store_cursor; scanned < n_chunks; ) {
+    if(start + n > n_chunks) {
+      // Wrap around
+      scanned += n_chunks - start;
+      start = 0;
+      continue;
+    }
+    unsigned int len = 0;
+    while(len < n && vdisk_store_chunk_free(start + len))
+      ++len;
+    if(len == n) {
+      store_cursor = start + n;
+      return(start);
+    }
+    scanned += len + 1;
+    start += len + 1;
+  }
+  return(STORE_NO_CHUNK);
+}
+
+/**
+ * Write a fresh store into an empty file
+ *
+ * @param fd File to hold the store
+ * @param n_blocks Number of logical blocks
+ * @param features VDISK_FEATURE_* flags
+ * @return 0 on success; <0 on error
+ */
+int vdisk_store_create(int fd, unsigned int n_blocks, unsigned int features)
+{
+  // A log also needs whole segments, with clean ones in reserve
+  unsigned int n_chunks = n_blocks * (BLOCK_SIZE / STORE_CHUNK_SIZE) * STORE_CHUNK_SLACK;
+  if(features & VDISK_FEATURE_LOG)
+    n_chunks = ((n_chunks + STORE_SEGMENT_CHUNKS - 1) / STORE_SEGMENT_CHUNKS + STORE_LOG_RESERVE + 1)
+      * STORE_SEGMENT_CHUNKS;
+
+  STORE_HEADER header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STORE_MAGIC, sizeof(header.magic));
+  header.version = STORE_VERSION;
+  header.features = features;
+  header.n_blocks = n_blocks;
+  vdisk_store_layout(&header, n_blocks, n_chunks, features);
+
+  unsigned char *meta = calloc(header.data_offset, 1);
+  if(meta == NULL)
+    return(-2);
+  memcpy(meta, &header, sizeof(header));
+
+  // Every map starts out with no blocks
+  STORE_MAP_ENTRY *maps = (STORE_MAP_ENTRY *) (meta + header.map_offset);
+  for(unsigned int i = 0; i < (STORE_MAX_SNAPSHOTS + 1) * header.map_capacity; ++i) {
+    maps[i].chunk = STORE_NO_CHUNK;
+    maps[i].length = 0;
+    maps[i].flags = 0;
+  }
+
+  int ret = 0;
+  if(pwrite(fd, meta, header.data_offset, 0) != header.data_offset || fsync(fd) != 0) {
+    fprintf(stderr, "vdisk_store_create(): write failed\n");
+    ret = -3;
+  }
+  free(meta);
+  return(ret);
+}
+
+/**
+ * Check whether a file holds a block store
+ *
+ * @return 1 if it does; 0 otherwise
+ */
+int vdisk_store_probe(int fd)
+{
+  char magic[8];
+  if(pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+    return(0);
+  return(memcmp(magic, STORE_MAGIC, sizeof(magic)) == 0);
+}
+
+/**
+ * Find a snapshot by name
+ *
+ * @return Snapshot slot (0 ... STORE_MAX_SNAPSHOTS-1); -1 if not found
+ */
+static int vdisk_store_find_snapshot(char *name)
+{
+  for(int i = 0; i < STORE_MAX_SNAPSHOTS; ++i) {
+    if(store_snapshots[i].in_use && !strncmp(store_snapshots[i].name, name, VDISK_SNAPSHOT_NAME_SIZE))
+      return(i);
+  }
+  return(-1);
+}
+
+/**
+ * Call fn for each run referenced by any map, once per run
+ *
+ * @param fn Called with one map entry that references the run
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_store_for_each_run(void (*fn)(STORE_MAP_ENTRY *entry))
+{
+  unsigned char *visited = calloc((store_header->n_chunks + 7) / 8, 1);
+  if(visited == NULL)
+    return(-1);
+
+  for(int m = 0; m <= STORE_MAX_SNAPSHOTS; ++m) {
+    if(m != STORE_LIVE_MAP && !store_snapshots[m - 1].in_use)
+      continue;
+    for(unsigned int i = 0; i < store_header->n_blocks; ++i) {
+      STORE_MAP_ENTRY *entry = vdisk_store_entry(m, i);
+      unsigned int c = entry->chunk;
+      if(c != STORE_NO_CHUNK && !(visited[c >> 3] & (1 << (c & 7)))) {
+	visited[c >> 3] |= (1 << (c & 7));
+	fn(entry);
+      }
+    }
+  }
+  free(visited);
+  return(0);
+}
+
+static void vdisk_store_index_run(STORE_MAP_ENTRY *entry)
+{
+  vdisk_dedup_insert(entry->chunk, store_hashes[entry->chunk]);
+}
+
+/**
+ * Rebuild the in-memory content index from the on-disk run hashes
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_store_build_index()
+{
+  if(vdisk_dedup_init(store_header->n_chunks) != 0)
+    return(-1);
+  return(vdisk_store_for_each_run(vdisk_store_index_run));
+}
+
+/**
+ * Load the store metadata from a file.  The live disk is mounted.
+ *
+ * @param fd File holding the store
+ * @return 0 on success; <0 on error
+ */
+int vdisk_store_open(int fd)
+{
+  STORE_HEADER header;
+  if(pread(fd, &header, sizeof(header), 0) != sizeof(header)
+     || memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) != 0) {
+    fprintf(stderr, "vdisk_store_open(): not a block store\n");
+    return(-1);
+  }
+  if(header.version != STORE_VERSION) {
+    fprintf(stderr, "vdisk_store_open(): unsupported version (%d)\n", header.version);
+    return(-1);
+  }
+
+  store_meta = malloc(header.data_offset);
+  store_dirty = calloc((header.data_offset / BLOCK_SIZE + 7) / 8, 1);
+  store_pending_free = calloc((header.n_chunks + 7) / 8, 1);
+  if(store_meta == NULL || store_dirty == NULL || store_pending_free == NULL) {
+    vdisk_store_close();
+    return(-2);
+  }
+  if(pread(fd, store_meta, header.data_offset, 0) != header.data_offset) {
+    fprintf(stderr, "vdisk_store_open(): read failed\n");
+    vdisk_store_close();
+    return(-3);
+  }
+  vdisk_store_bind_tables();
+
+  store_map_index = STORE_LIVE_MAP;
+  store_fd = fd;
+  store_cursor = 0;
+  store_log_head = store_header->log_head < store_header->n_chunks ? store_header->log_head : 0;
+
+  if(store_hashes != NULL && vdisk_store_build_index() != 0) {
+    vdisk_store_close();
+    return(-2);
+  }
+  return(0);
+}
+
+/**
+ * Read the store metadata again, after another process changed the store.
+ * The mounted map stays mounted.
+ *
+ * @return 0 on success; <0 on error (the store is left closed)
+ */
+int vdisk_store_reload()
+{
+  int fd = store_fd;
+  int map_index = store_map_index;
+  vdisk_store_close();
+  int ret = vdisk_store_open(fd);
+  if(ret == 0)
+    store_map_index = map_index;
+  return(ret);
+}
+
+/**
+ * Switch the open store to a snapshot.  The snapshot is read-only.
+ *
+ * @param snapshot_name Name of the snapshot to mount
+ * @return 0 on success; <0 on error
+ */
+int vdisk_store_mount_snapshot(char *snapshot_name)
+{
+  int slot = vdisk_store_find_snapshot(snapshot_name);
+  if(slot < 0) {
+    fprintf(stderr, "vdisk_store_mount_snapshot(): no snapshot named %s\n", snapshot_name);
+    return(-1);
+  }
+  store_map_index = slot + 1;
+  return(0);
+}
+
+/**
+ * Release the in-memory store metadata (without flushing it)
+ */
+void vdisk_store_close()
+{
+  vdisk_dedup_free();
+  free(store_meta);
+  free(store_dirty);
+  free(store_pending_free);
+  store_meta = NULL;
+  store_dirty = NULL;
+  store_pending_free = NULL;
+  store_fd = 0;
+}
+
+/**
+ * @return 1 if the open disk is a block store
+ */
+int vdisk_store_is_open()
+{
+  return(store_fd != 0);
+}
+
+/**
+ * Read the stored bytes of a run
+ */
+static int vdisk_store_read_run(unsigned int chunk, unsigned int length, void *buffer)
+{
+  off_t offset = store_header->data_offset + (off_t) chunk * STORE_CHUNK_SIZE;
+  if(pread(store_fd, buffer, length, offset) != length)
+    return(-1);
+  return(0);
+}
+
+/**
+ * Read a logical block
+ *
+ * @param block_ref Block to read
+ * @param block Buffer for the contents
+ * @param verify Check the stored checksum (if the store keeps them)
+ * @return 0 on success; <0 on error
+ */
+int vdisk_store_read_block(BLOCK_REFERENCE block_ref, void *block, int verify)
+{
+  if(block_ref >= store_header->n_blocks) {
+    fprintf(stderr, "vdisk_read_block(): bad block_ref(%d)\n", block_ref);
+    return(-2);
+  }
+
+  STORE_MAP_ENTRY *entry = vdisk_store_entry(store_map_index, block_ref);
+  if(entry->chunk == STORE_NO_CHUNK) {
+    // Never written
+    memset(block, 0, BLOCK_SIZE);
+    return(0);
+  }
+
+  // An uncompressed run is read straight into the caller's buffer
+  unsigned char compressed[BLOCK_SIZE];
+  void *stored = (entry->flags & STORE_COMPRESSED) ? compressed : block;
+  if(vdisk_store_read_run(entry->chunk, entry->length, stored) != 0) {
+    fprintf(stderr, "vdisk_read_block(): read failed\n");
+    return(-4);
+  }
+
+  if(verify && store_crcs != NULL
+     && vdisk_crc32c(stored, entry->length) != store_crcs[entry->chunk]) {
+    fprintf(stderr, "vdisk_read_block(): checksum mismatch in block %d\n", block_ref);
+    return(-8);
+  }
+
+  if(stored == compressed && vdisk_decompress(compressed, entry->length, block, BLOCK_SIZE) != 0) {
+    fprintf(stderr, "vdisk_read_block(): block %d is corrupt\n", block_ref);
+    return(-7);
+  }
+  return(0);
+}
+
+/**
+ * Is every byte of a block zero?
+ */
+static int vdisk_store_block_is_zero(unsigned char *block)
+{
+  for(int i = 0; i < BLOCK_SIZE; ++i) {
+    if(block[i] != 0)
+      return(0);
+  }
+  return(1);
+}
+
+/**
+ * Look for a stored run with exactly the given contents
+ *
+ * @param hash Hash of the contents
+ * @param data Contents
+ * @param length Number of bytes
+ * @return First chunk of the run; STORE_NO_CHUNK if there is none
+ */
+static unsigned int vdisk_store_find_duplicate(unsigned int hash, void *data, unsigned int length)
+{
+  unsigned char stored[BLOCK_SIZE];
+  for(unsigned int c = vdisk_dedup_first(hash); c != STORE_NO_CHUNK; c = vdisk_dedup_next(c)) {
+    // A run shared this many times cannot take another reference
+    if(store_hashes[c] != hash || store_refcounts[c] == 0 || store_refcounts[c] == USHRT_MAX)
+      continue;
+    if(vdisk_store_read_run(c, length, stored) == 0 && memcmp(stored, data, length) == 0)
+      return(c);
+  }
+  return(STORE_NO_CHUNK);
+}
+
+/**
+ * Point a map entry at another run
+ */
+static void vdisk_store_remap(STORE_MAP_ENTRY *entry, unsigned int chunk, unsigned int length, unsigned int flags)
+{
+  vdisk_store_adjust_refcount(entry, -1);
+  entry->chunk = chunk;
+  entry->length = length;
+  entry->flags = flags;
+  vdisk_store_adjust_refcount(entry, 1);
+  vdisk_store_mark_dirty(entry, sizeof(*entry));
+}
+
+/**
+ * Hash of a run as stored.  The stored length and flags are mixed in so
+ * that only runs of the same form can match.
+ */
+static unsigned int vdisk_store_run_hash(void *data, unsigned int length, unsigned int flags)
+{
+  return(vdisk_dedup_hash(data, length, length | (flags << 16)));
+}
+
+/**
+ * Write a logical block of the live disk
+ *
+ * A block that no snapshot shares is overwritten in place when its new
+ * form fits; otherwise the new contents go to a fresh run of chunks.
+ * All-zero blocks are not stored at all.  With deduplication, a block
+ * that is already stored shares that copy.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_store_write_block(BLOCK_REFERENCE block_ref, void *block)
+{
+  if(store_map_index != STORE_LIVE_MAP) {
+    fprintf(stderr, "vdisk_write_block(): snapshot is read-only\n");
+    return(-6);
+  }
+  if(block_ref >= store_header->n_blocks) {
+    fprintf(stderr, "vdisk_write_block(): bad block_ref(%d)\n", block_ref);
+    return(-2);
+  }
+
+  STORE_MAP_ENTRY *entry = vdisk_store_entry(STORE_LIVE_MAP, block_ref);
+
+  if(vdisk_store_block_is_zero(block)) {
+    vdisk_store_adjust_refcount(entry, -1);
+    entry->chunk = STORE_NO_CHUNK;
+    entry->length = 0;
+    entry->flags = 0;
+    vdisk_store_mark_dirty(entry, sizeof(*entry));
+    return(0);
+  }
+
+  // Form in which the block is stored
+  void *data = block;
+  unsigned int length = BLOCK_SIZE;
+  unsigned int flags = 0;
+  unsigned char compressed[BLOCK_SIZE];
+  if(store_header->features & VDISK_FEATURE_COMPRESS) {
+    // Only worth it if at least one chunk is saved
+    size_t n = vdisk_compress(block, BLOCK_SIZE, compressed, BLOCK_SIZE - STORE_CHUNK_SIZE);
+    if(n > 0) {
+      data = compressed;
+      length = n;
+      flags = STORE_COMPRESSED;
+    }
+  }
+
+  unsigned int hash = 0;
+  if(store_hashes != NULL) {
+    hash = vdisk_store_run_hash(data, length, flags);
+
+    if(store_header->features & VDISK_FEATURE_DEDUP) {
+      unsigned int duplicate = vdisk_store_find_duplicate(hash, data, length);
+      if(duplicate != STORE_NO_CHUNK) {
+	if(duplicate != entry->chunk) {
+	  if(debug)
+	    fprintf(stderr, "##Block %d shares chunk %d\n", block_ref, duplicate);
+	  vdisk_store_remap(entry, duplicate, length, flags);
+	}
+	return(0);
+      }
+    }
+  }
+
+  unsigned int chunk = entry->chunk;
+  if(chunk == STORE_NO_CHUNK || store_refcounts[chunk] > 1
+     || vdisk_store_run_chunks(entry->length) < vdisk_store_run_chunks(length)
+     || (store_header->features & VDISK_FEATURE_LOG)) {
+    // Unmapped, shared or too small (or a log): copy on write
+    chunk = vdisk_store_allocate(vdisk_store_run_chunks(length));
+    if(chunk == STORE_NO_CHUNK) {
+      fprintf(stderr, "vdisk_write_block(): block store is full\n");
+      return(-5);
+    }
+    if(debug)
+      fprintf(stderr, "##Block %d moves to chunk %d\n", block_ref, chunk);
+  }
+
+  off_t offset = store_header->data_offset + (off_t) chunk * STORE_CHUNK_SIZE;
+  if(pwrite(store_fd, data, length, offset) != length) {
+    fprintf(stderr, "vdisk_write_block(): write failed\n");
+    return(-4);
+  }
+
+  if(chunk != entry->chunk || length != entry->length || flags != entry->flags) {
+    vdisk_store_remap(entry, chunk, length, flags);
+  }else if(store_hashes != NULL) {
+    // Overwritten in place: the old contents are gone
+    vdisk_dedup_remove(chunk, store_hashes[chunk]);
+  }
+
+  if(store_hashes != NULL) {
+    store_hashes[chunk] = hash;
+    vdisk_store_mark_dirty(&store_hashes[chunk], sizeof(unsigned int));
+    vdisk_dedup_insert(chunk, hash);
+  }
+  if(store_crcs != NULL) {
+    store_crcs[chunk] = vdisk_crc32c(data, length);
+    vdisk_store_mark_dirty(&store_crcs[chunk], sizeof(unsigned int));
+  }
+  return(0);
+}
+
+/**
+ * Write the changed metadata blocks back to the file
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_store_flush()
+{
+  if(store_fd == 0)
+    return(0);
+
+  // Chunk data must be durable before the maps that point to it
+  if(fsync(store_fd) != 0) {
+    fprintf(stderr, "vdisk_store_flush(): fsync failed\n");
+    return(-1);
+  }
+
+  int log = store_header->features & VDISK_FEATURE_LOG;
+  if(log && store_header->log_head != store_log_head) {
+    store_header->log_head = store_log_head;
+    vdisk_store_mark_dirty(&store_header->log_head, sizeof(store_header->log_head));
+  }
+
+  int n_meta_blocks = store_header->data_offset / BLOCK_SIZE;
+  int wrote = 0;
+  for(int i = 0; i < n_meta_blocks; ++i) {
+    if(store_dirty[i >> 3] & (1 << (i & 7))) {
+      if(pwrite(store_fd, store_meta + i * BLOCK_SIZE, BLOCK_SIZE, (off_t) i * BLOCK_SIZE) != BLOCK_SIZE) {
+        fprintf(stderr, "vdisk_store_flush(): write failed\n");
+        return(-2);
+      }
+      wrote = 1;
+    }
+  }
+  if(wrote && fsync(store_fd) != 0) {
+    fprintf(stderr, "vdisk_store_flush(): fsync failed\n");
+    return(-1);
+  }
+
+  // Freed chunks are no longer referenced on disk
+  memset(store_dirty, 0, (n_meta_blocks + 7) / 8);
+  memset(store_pending_free, 0, (store_header->n_chunks + 7) / 8);
+
+  // Keep clean segments in reserve for the log.  Only a process that has
+  // just written the store (so holds the writer lock) cleans it.
+  if(log && wrote && !store_cleaning && store_map_index == STORE_LIVE_MAP)
+    return(vdisk_store_clean(STORE_LOG_RESERVE, STORE_SEGMENT_CHUNKS - 1, NULL, NULL));
+  return(0);
+}
+
+/**
+ * Is every chunk of a segment free?
+ */
+static int vdisk_store_segment_clean(unsigned int segment)
+{
+  for(unsigned int c = segment * STORE_SEGMENT_CHUNKS; c < (segment + 1) * STORE_SEGMENT_CHUNKS; ++c) {
+    if(!vdisk_store_chunk_free(c))
+      return(0);
+  }
+  return(1);
+}
+
+/**
+ * Number of clean segments
+ */
+static unsigned int vdisk_store_clean_segments()
+{
+  unsigned int n = 0;
+  for(unsigned int s = 0; s < store_header->n_chunks / STORE_SEGMENT_CHUNKS; ++s)
+    n += vdisk_store_segment_clean(s);
+  return(n);
+}
+
+/**
+ * First clean segment from a segment on (wrapping around)
+ *
+ * @return The segment; -1 if none is clean
+ */
+static int vdisk_store_find_clean_segment(unsigned int from)
+{
+  unsigned int n_segments = store_header->n_chunks / STORE_SEGMENT_CHUNKS;
+  for(unsigned int k = 0; k < n_segments; ++k) {
+    unsigned int segment = (from + k) % n_segments;
+    if(vdisk_store_segment_clean(segment))
+      return(segment);
+  }
+  return(-1);
+}
+
+/**
+ * Allocate a run at the head of the log.  A run does not straddle two
+ * segments: one that does not fit in the rest of the head's segment
+ * starts the next clean one.
+ *
+ * @param n Number of chunks needed
+ * @return First chunk of the run; STORE_NO_CHUNK if the store is full
+ */
+static unsigned int vdisk_store_log_allocate(unsigned int n)
+{
+  unsigned int offset = store_log_head % STORE_SEGMENT_CHUNKS;
+  if(offset == 0 || offset + n > STORE_SEGMENT_CHUNKS) {
+    unsigned int from = store_log_head / STORE_SEGMENT_CHUNKS + (offset != 0);
+    int segment = vdisk_store_find_clean_segment(from);
+    if(segment < 0 && !store_cleaning) {
+      // Chunks freed since the last checkpoint become free with the next
+      // one (which also cleans, if need be)
+      if(vdisk_store_flush() == 0)
+	segment = vdisk_store_find_clean_segment(from);
+    }
+    if(segment < 0)
+      return(STORE_NO_CHUNK);
+    store_log_head = segment * STORE_SEGMENT_CHUNKS;
+  }
+
+  unsigned int chunk = store_log_head;
+  store_log_head = (store_log_head + n) % store_header->n_chunks;
+  return(chunk);
+}
+
+/**
+ * Copy a live run to the head of the log and point every map entry that
+ * references it at the copy.  The old chunks are freed by the next
+ * checkpoint.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_store_move_run(unsigned int chunk, unsigned int length)
+{
+  unsigned char data[BLOCK_SIZE];
+  if(vdisk_store_read_run(chunk, length, data) != 0)
+    return(-4);
+  unsigned int n = vdisk_store_run_chunks(length);
+  unsigned int to = vdisk_store_log_allocate(n);
+  if(to == STORE_NO_CHUNK)
+    return(-5);
+  if(pwrite(store_fd, data, length, store_header->data_offset + (off_t) to * STORE_CHUNK_SIZE) != length)
+    return(-4);
+
+  for(unsigned int k = 0; k < n; ++k) {
+    store_refcounts[to + k] = store_refcounts[chunk + k];
+    store_refcounts[chunk + k] = 0;
+    store_pending_free[(chunk + k) >> 3] |= (1 << ((chunk + k) & 7));
+  }
+  vdisk_store_mark_dirty(&store_refcounts[to], n * sizeof(unsigned short));
+  vdisk_store_mark_dirty(&store_refcounts[chunk], n * sizeof(unsigned short));
+  if(store_hashes != NULL) {
+    vdisk_dedup_remove(chunk, store_hashes[chunk]);
+    store_hashes[to] = store_hashes[chunk];
+    vdisk_store_mark_dirty(&store_hashes[to], sizeof(unsigned int));
+    vdisk_dedup_insert(to, store_hashes[to]);
+  }
+  if(store_crcs != NULL) {
+    store_crcs[to] = store_crcs[chunk];
+    vdisk_store_mark_dirty(&store_crcs[to], sizeof(unsigned int));
+  }
+
+  for(int m = 0; m <= STORE_MAX_SNAPSHOTS; ++m) {
+    if(m != STORE_LIVE_MAP && !store_snapshots[m - 1].in_use)
+      continue;
+    for(unsigned int i = 0; i < store_header->n_blocks; ++i) {
+      STORE_MAP_ENTRY *entry = vdisk_store_entry(m, i);
+      if(entry->chunk == chunk) {
+	entry->chunk = to;
+	vdisk_store_mark_dirty(entry, sizeof(*entry));
+      }
+    }
+  }
+  return(0);
+}
+
+/**
+ * The cleaner: empty the segments with the least live data (greedy)
+ * until enough are clean
+ *
+ * @param want Clean segments wanted
+ * @param max_live Only segments with at most this many live chunks are
+ *        worth cleaning
+ * @param cleaned If not NULL, set to the number of segments emptied
+ * @param moved If not NULL, set to the number of runs moved
+ * @return 0 on success (also when no more segments are worth cleaning,
+ *         or the log has no room left to move runs to); <0 on error
+ */
+static int vdisk_store_clean(unsigned int want, unsigned int max_live, unsigned int *cleaned, unsigned int *moved)
+{
+  unsigned int n_segments = store_header->n_chunks / STORE_SEGMENT_CHUNKS;
+  unsigned int n_cleaned = 0, n_moved = 0;
+  int ret = 0;
+  store_cleaning = 1;
+
+  // Each pass empties a segment, so it takes at most one per segment
+  for(unsigned int pass = 0; pass < n_segments && ret == 0 && vdisk_store_clean_segments() < want; ++pass) {
+    int victim = -1;
+    unsigned int victim_live = max_live + 1;
+    unsigned int head_segment = store_log_head / STORE_SEGMENT_CHUNKS;
+    for(unsigned int segment = 0; segment < n_segments; ++segment) {
+      if(segment == head_segment || vdisk_store_segment_clean(segment))
+	continue;
+      unsigned int live = 0;
+      for(unsigned int c = segment * STORE_SEGMENT_CHUNKS; c < (segment + 1) * STORE_SEGMENT_CHUNKS; ++c)
+	live += store_refcounts[c] != 0;
+      if(live < victim_live) {
+	victim = segment;
+	victim_live = live;
+      }
+    }
+    if(victim < 0)
+      break;
+    if(debug)
+      fprintf(stderr, "##Cleaning segment %d (%d live chunks)\n", victim, victim_live);
+
+    unsigned int first = victim * STORE_SEGMENT_CHUNKS;
+    for(int m = 0; m <= STORE_MAX_SNAPSHOTS && ret == 0; ++m) {
+      if(m != STORE_LIVE_MAP && !store_snapshots[m - 1].in_use)
+	continue;
+      for(unsigned int i = 0; i < store_header->n_blocks && ret == 0; ++i) {
+	STORE_MAP_ENTRY *entry = vdisk_store_entry(m, i);
+	if(entry->chunk != STORE_NO_CHUNK && entry->chunk >= first && entry->chunk < first + STORE_SEGMENT_CHUNKS) {
+	  ret = vdisk_store_move_run(entry->chunk, entry->length);
+	  n_moved += ret == 0;
+	}
+      }
+    }
+    // No room left at the head: what was moved stays moved
+    if(ret == -5) {
+      ret = vdisk_store_flush();
+      break;
+    }
+    // The checkpoint frees the old copies
+    if(ret == 0)
+      ret = vdisk_store_flush();
+    if(ret == 0)
+      ++n_cleaned;
+  }
+
+  store_cleaning = 0;
+  if(cleaned != NULL)
+    *cleaned = n_cleaned;
+  if(moved != NULL)
+    *moved = n_moved;
+  if(ret != 0)
+    fprintf(stderr, "vdisk_store_clean(): cleaning failed\n");
+  return(ret);
+}
+
+/**
+ * Run the cleaner of a log-structured store over every segment that is at
+ * most half live
+ *
+ * @param cleaned Set to the number of segments emptied
+ * @param moved Set to the number of runs moved
+ * @param clean_segments Set to the number of clean segments afterwards
+ * @return 0 on success; <0 on error
+ */
+int vdisk_log_clean(unsigned int *cleaned, unsigned int *moved, unsigned int *clean_segments)
+{
+  if(store_fd == 0 || store_map_index != STORE_LIVE_MAP || !(store_header->features & VDISK_FEATURE_LOG)) {
+    fprintf(stderr, "vdisk_log_clean(): disk is not a writable log-structured block store\n");
+    return(-1);
+  }
+  int ret = vdisk_store_clean(store_header->n_chunks / STORE_SEGMENT_CHUNKS, STORE_SEGMENT_CHUNKS / 2, cleaned, moved);
+  *clean_segments = vdisk_store_clean_segments();
+  return(ret);
+}
+
+/**
+ * Take a snapshot of the live disk
+ *
+ * Only the live map is copied: the snapshot shares every block with the
+ * live disk until one of them is overwritten.
+ *
+ * @param name Name of the new snapshot
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snapshot_create(char *name)
+{
+  if(store_fd == 0 || store_map_index != STORE_LIVE_MAP) {
+    fprintf(stderr, "vdisk_snapshot_create(): disk is not a writable block store\n");
+    return(-1);
+  }
+  if(strlen(name) == 0 || strlen(name) >= VDISK_SNAPSHOT_NAME_SIZE) {
+    fprintf(stderr, "vdisk_snapshot_create(): bad snapshot name\n");
+    return(-1);
+  }
+  if(vdisk_store_find_snapshot(name) >= 0) {
+    fprintf(stderr, "vdisk_snapshot_create(): snapshot %s already exists\n", name);
+    return(-2);
+  }
+
+  int slot;
+  for(slot = 0; slot < STORE_MAX_SNAPSHOTS && store_snapshots[slot].in_use; ++slot)
+    ;
+  if(slot == STORE_MAX_SNAPSHOTS) {
+    fprintf(stderr, "vdisk_snapshot_create(): no free snapshot slots\n");
+    return(-3);
+  }
+
+  unsigned int capacity = store_header->map_capacity;
+  STORE_MAP_ENTRY *live = vdisk_store_entry(STORE_LIVE_MAP, 0);
+  STORE_MAP_ENTRY *snap = vdisk_store_entry(slot + 1, 0);
+  memcpy(snap, live, capacity * sizeof(STORE_MAP_ENTRY));
+  vdisk_store_mark_dirty(snap, capacity * sizeof(STORE_MAP_ENTRY));
+  for(unsigned int i = 0; i < store_header->n_blocks; ++i)
+    vdisk_store_adjust_refcount(&snap[i], 1);
+
+  memset(&store_snapshots[slot], 0, sizeof(STORE_SNAPSHOT));
+  strncpy(store_snapshots[slot].name, name, VDISK_SNAPSHOT_NAME_SIZE - 1);
+  store_snapshots[slot].in_use = 1;
+  store_snapshots[slot].created = (unsigned int) time(NULL);
+  vdisk_store_mark_dirty(&store_snapshots[slot], sizeof(STORE_SNAPSHOT));
+
+  return(vdisk_store_flush());
+}
+
+/**
+ * Delete a snapshot, releasing the blocks only it referenced
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snapshot_delete(char *name)
+{
+  if(store_fd == 0 || store_map_index != STORE_LIVE_MAP) {
+    fprintf(stderr, "vdisk_snapshot_delete(): disk is not a writable block store\n");
+    return(-1);
+  }
+  int slot = vdisk_store_find_snapshot(name);
+  if(slot < 0) {
+    fprintf(stderr, "vdisk_snapshot_delete(): no snapshot named %s\n", name);
+    return(-2);
+  }
+
+  STORE_MAP_ENTRY *snap = vdisk_store_entry(slot + 1, 0);
+  for(unsigned int i = 0; i < store_header->n_blocks; ++i) {
+    vdisk_store_adjust_refcount(&snap[i], -1);
+    snap[i].chunk = STORE_NO_CHUNK;
+    snap[i].length = 0;
+  }
+  vdisk_store_mark_dirty(snap, store_header->n_blocks * sizeof(STORE_MAP_ENTRY));
+
+  store_snapshots[slot].in_use = 0;
+  vdisk_store_mark_dirty(&store_snapshots[slot], sizeof(STORE_SNAPSHOT));
+
+  return(vdisk_store_flush());
+}
+
+/**
+ * Describe one snapshot slot
+ *
+ * @param index Slot number (0 ... VDISK_MAX_SNAPSHOTS-1)
+ * @param info Filled in if the slot holds a snapshot
+ * @return 1 if the slot holds a snapshot; 0 if it is empty; <0 on error
+ */
+int vdisk_snapshot_info(int index, VDISK_SNAPSHOT_INFO *info)
+{
+  if(store_fd == 0 || index < 0 || index >= STORE_MAX_SNAPSHOTS)
+    return(-1);
+  if(!store_snapshots[index].in_use)
+    return(0);
+
+  strncpy(info->name, store_snapshots[index].name, VDISK_SNAPSHOT_NAME_SIZE);
+  info->created = store_snapshots[index].created;
+
+  // Blocks held only by this snapshot are what deleting it would free
+  info->n_exclusive_blocks = 0;
+  STORE_MAP_ENTRY *snap = vdisk_store_entry(index + 1, 0);
+  for(unsigned int i = 0; i < store_header->n_blocks; ++i) {
+    if(snap[i].chunk != STORE_NO_CHUNK && store_refcounts[snap[i].chunk] == 1)
+      ++info->n_exclusive_blocks;
+  }
+  return(1);
+}
+
+/**
+ * @return The VDISK_FEATURE_* flags of the open store
+ */
+unsigned int vdisk_store_features()
+{
+  return(store_fd != 0 ? store_header->features : 0);
+}
+
+// Number of map entries moved onto an existing copy by the current scan
+static unsigned int dedup_merged;
+
+/**
+ * Make a map entry share an identical indexed run, or index its own run
+ */
+static void vdisk_store_merge_run(STORE_MAP_ENTRY *entry)
+{
+  unsigned char data[BLOCK_SIZE];
+  unsigned int c = entry->chunk;
+
+  if(vdisk_store_read_run(c, entry->length, data) == 0) {
+    unsigned int duplicate = vdisk_store_find_duplicate(store_hashes[c], data, entry->length);
+    if(duplicate != STORE_NO_CHUNK) {
+      vdisk_store_remap(entry, duplicate, entry->length, entry->flags);
+      ++dedup_merged;
+      return;
+    }
+  }
+  vdisk_dedup_insert(c, store_hashes[c]);
+}
+
+/**
+ * Offline deduplication pass over every block of the live disk and all
+ * snapshots.  Identical runs are merged into one shared copy.
+ *
+ * @param merged Set to the number of blocks that now share an existing copy
+ * @return 0 on success; <0 on error
+ */
+int vdisk_dedup_scan(unsigned int *merged)
+{
+  if(store_fd == 0 || store_map_index != STORE_LIVE_MAP || store_hashes == NULL) {
+    fprintf(stderr, "vdisk_dedup_scan(): disk is not a writable deduplicating block store\n");
+    return(-1);
+  }
+
+  // Start from an empty index: each run either joins an earlier identical
+  // run or becomes the copy later runs join
+  if(vdisk_dedup_init(store_header->n_chunks) != 0)
+    return(-2);
+  dedup_merged = 0;
+
+  // Every map entry is visited, not just one per run: entries of a merged
+  // run each move to the surviving copy
+  for(int m = 0; m <= STORE_MAX_SNAPSHOTS; ++m) {
+    if(m != STORE_LIVE_MAP && !store_snapshots[m - 1].in_use)
+      continue;
+    for(unsigned int i = 0; i < store_header->n_blocks; ++i) {
+      STORE_MAP_ENTRY *entry = vdisk_store_entry(m, i);
+      if(entry->chunk == STORE_NO_CHUNK)
+	continue;
+      // Already indexed: this run is the surviving copy
+      int indexed = 0;
+      for(unsigned int c = vdisk_dedup_first(store_hashes[entry->chunk]); c != STORE_NO_CHUNK; c = vdisk_dedup_next(c)) {
+	if(c == entry->chunk) {
+	  indexed = 1;
+	  break;
+	}
+      }
+      if(!indexed)
+	vdisk_store_merge_run(entry);
+    }
+  }
+
+  *merged = dedup_merged;
+  return(vdisk_store_flush());
+}
@@ -0,0 +1,116 @@
+#ifndef VDISK_STORE_H
+#define VDISK_STORE_H
+
+/*
+ * Block store: an optional container format for the virtual disk.
+ *
+ * Private to the vdisk implementation.  Logical blocks are mapped onto
+ * runs of physical chunks.  Chunks carry reference counts so that the
+ * live disk and its snapshots can share unmodified blocks.
+ */
+
+#include "vdisk.h"
+
+// Identifies a block store file (plain disks start with the master block)
+#define STORE_MAGIC "OUFSSTOR"
+#define STORE_VERSION 1
+
+// Unit of physical allocation
+#define STORE_CHUNK_SIZE 32
+
+// Number of snapshots a store can hold
+#define STORE_MAX_SNAPSHOTS VDISK_MAX_SNAPSHOTS
+
+// Physical chunks of a new store, per chunk of logical blocks: room for
+// the live disk and one full copy of it held by snapshots
+#define STORE_CHUNK_SLACK 2
+
+// Log-structured stores (VDISK_FEATURE_LOG): chunks per segment, and the
+// clean segments the cleaner keeps in reserve for the log to move into
+#define STORE_SEGMENT_CHUNKS 512
+#define STORE_LOG_RESERVE 4
+
+// Map entry value for a block that has never been written (reads as zeros)
+#define STORE_NO_CHUNK 0xffffffff
+
+// Map index of the live disk; snapshots use 1 ... STORE_MAX_SNAPSHOTS
+#define STORE_LIVE_MAP 0
+
+typedef struct store_header_s
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int features;
+
+  // Number of logical blocks on the disk
+  unsigned int n_blocks;
+  // Number of entries in each map
+  unsigned int map_capacity;
+  // Number of physical chunks
+  unsigned int n_chunks;
+
+  // Byte offsets of the on-disk tables
+  unsigned int snapshot_offset;
+  unsigned int map_offset;
+  unsigned int refcount_offset;
+  unsigned int data_offset;
+
+  // Content hash of each run, indexed by its first chunk (deduplicating
+  // stores only; 0 if absent)
+  unsigned int hash_offset;
+
+  // CRC32C of each stored run, indexed by its first chunk (0 if absent)
+  unsigned int crc_offset;
+
+  // Log-structured stores: next chunk of the log as of the last
+  // checkpoint (vdisk_store_flush())
+  unsigned int log_head;
+} STORE_HEADER;
+
+typedef struct store_snapshot_s
+{
+  char name[VDISK_SNAPSHOT_NAME_SIZE];
+  unsigned int in_use;
+  unsigned int created;
+} STORE_SNAPSHOT;
+
+// Location of one logical block
+typedef struct store_map_entry_s
+{
+  // First chunk of the run; STORE_NO_CHUNK if unmapped
+  unsigned int chunk;
+  // Number of stored bytes
+  unsigned short length;
+  // STORE_* flags
+  unsigned short flags;
+} STORE_MAP_ENTRY;
+
+// The run holds the block in compressed form (vdisk_compress.c)
+#define STORE_COMPRESSED 0x1
+
+int vdisk_store_create(int fd, unsigned int n_blocks, unsigned int features);
+int vdisk_store_probe(int fd);
+int vdisk_store_open(int fd);
+int vdisk_store_reload();
+int vdisk_store_mount_snapshot(char *snapshot_name);
+void vdisk_store_close();
+int vdisk_store_is_open();
+int vdisk_store_read_block(BLOCK_REFERENCE block_ref, void *block, int verify);
+int vdisk_store_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_store_flush();
+unsigned int vdisk_store_features();
+
+// Content index used for deduplication (vdisk_dedup.c)
+unsigned int vdisk_dedup_hash(const void *data, size_t len, unsigned int seed);
+int vdisk_dedup_init(unsigned int n_chunks);
+void vdisk_dedup_free();
+void vdisk_dedup_insert(unsigned int chunk, unsigned int hash);
+void vdisk_dedup_remove(unsigned int chunk, unsigned int hash);
+unsigned int vdisk_dedup_first(unsigned int hash);
+unsigned int vdisk_dedup_next(unsigned int chunk);
+
+// Block compression (vdisk_compress.c)
+size_t vdisk_compress(const void *src, size_t src_len, void *dst, size_t dst_capacity);
+int vdisk_decompress(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+#endif
@@ -0,0 +1,387 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "vdisk_stripe.h"
+/*
+ * Plain disk images.
+ *
+ * A plain image is usually one file, block b at offset b * BLOCK_SIZE.  A
+ * name of the form "file0,file1,...[:width]" stripes the disk over the
+ * listed files (RAID-0): the blocks are dealt out in stripe units of
+ * width consecutive blocks (default 1), unit u going to file u % n.  The
+ * width must be the same every time the disk is opened.
+ *
+ * A range of blocks falls on each file as one contiguous run, so it is
+ * read or written with one preadv()/pwritev() per file; the files are
+ * accessed in parallel, one thread per file beyond the first.
+ *
+ * With vdisk_stripe_direct() the files are read and written with O_DIRECT,
+ * bypassing the kernel's page cache: vdisk's block cache is then the only
+ * copy of the disk in memory.  O_DIRECT transfers must be aligned to
+ * VDISK_DIRECT_ALIGN bytes in the file and in memory, so each file's share
+ * of a range goes through an aligned buffer of the pool (one per file,
+ * since the files are transferred in parallel) as one aligned transfer.
+ * The aligned units at either end that the range only partly covers are
+ * read first when writing.
+ *
+ * The callers serialize all calls (vdisk.c's io_mutex).
+ */
+
+typedef struct stripe_io_s
+{
+  int fd;
+  off_t offset;
+  int iovcnt;
+  struct iovec iov[N_BLOCKS_IN_DISK];
+  // Bytes transferred; < 0 on error
+  ssize_t result;
+} STRIPE_IO;
+
+// Backing files; stripe_fd[0] is also vdisk.c's vdisk_fd
+static int stripe_fd[VDISK_MAX_STRIPES];
+static int n_stripes = 0;
+static int stripe_width = 1;
+
+static STRIPE_IO stripe_io[VDISK_MAX_STRIPES];
+
+// O_DIRECT in use, and its aligned buffers: the most any one file's share
+// of a range can span
+#define DIRECT_BUFFER_SIZE (N_BLOCKS_IN_DISK * BLOCK_SIZE + 2 * VDISK_DIRECT_ALIGN)
+static int stripe_direct = 0;
+static unsigned char *direct_buffer[VDISK_MAX_STRIPES];
+
+/**
+ * Open the backing files
+ *
+ * @param names One file name, or a comma-separated list with an optional
+ *        ":width" suffix (blocks per stripe unit)
+ * @param flags open() flags
+ * @return The file descriptor of the first file; <0 on error
+ */
+int vdisk_stripe_open(char *names, int flags)
+{
+  char list[VDISK_NAME_LENGTH];
+  strncpy(list, names, VDISK_NAME_LENGTH - 1);
+  list[VDISK_NAME_LENGTH - 1] = 0;
+
+  stripe_width = 1;
+  if(strchr(list, ',') != NULL) {
+    char *width = strrchr(list, ':');
+    if(width != NULL) {
+      *width++ = 0;
+      stripe_width = atoi(width);
+      if(stripe_width < 1 || stripe_width > N_BLOCKS_IN_DISK) {
+        fprintf(stderr, "vdisk_stripe_open(): bad stripe width (%s)\n", width);
+        return(-1);
+      }
+    }
+  }
+
+  n_stripes = 0;
+  char *save;
+  for(char *name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+    int fd = -1;
+    if(n_stripes < VDISK_MAX_STRIPES)
+      fd = open(name, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd <= 0) {
+      if(n_stripes >= VDISK_MAX_STRIPES)
+        fprintf(stderr, "vdisk_stripe_open(): more than %d files\n", VDISK_MAX_STRIPES);
+      vdisk_stripe_close();
+      return(-1);
+    }
+    stripe_fd[n_stripes++] = fd;
+  }
+  if(n_stripes == 0)
+    return(-1);
+  return(stripe_fd[0]);
+}
+
+/**
+ * Close the backing files
+ */
+void vdisk_stripe_close()
+{
+  for(int s = 0; s < n_stripes; ++s) {
+    close(stripe_fd[s]);
+    free(direct_buffer[s]);
+    direct_buffer[s] = NULL;
+  }
+  n_stripes = 0;
+  stripe_direct = 0;
+}
+
+/**
+ * Switch the open files to O_DIRECT
+ *
+ * @return 0 on success; -1 if a file system does not support it (the
+ *         files are left as they were)
+ */
+int vdisk_stripe_direct()
+{
+  int s;
+  for(s = 0; s < n_stripes; ++s) {
+    int flags = fcntl(stripe_fd[s], F_GETFL);
+    if(posix_memalign((void **) &direct_buffer[s], VDISK_DIRECT_ALIGN, DIRECT_BUFFER_SIZE) != 0
+       || flags < 0 || fcntl(stripe_fd[s], F_SETFL, flags | O_DIRECT) != 0)
+      break;
+  }
+  if(s == n_stripes) {
+    stripe_direct = 1;
+    return(0);
+  }
+
+  // Undo
+  for(int k = 0; k <= s && k < n_stripes; ++k) {
+    int flags = fcntl(stripe_fd[k], F_GETFL);
+    if(flags >= 0)
+      fcntl(stripe_fd[k], F_SETFL, flags & ~O_DIRECT);
+    free(direct_buffer[k]);
+    direct_buffer[k] = NULL;
+  }
+  return(-1);
+}
+
+/**
+ * Number of backing files (1 for an ordinary image)
+ */
+int vdisk_stripe_count()
+{
+  return(n_stripes);
+}
+
+/**
+ * Where a block is stored
+ *
+ * @param block_ref Block
+ * @param offset Set to the block's offset in its file
+ * @return Index of the file
+ */
+static int vdisk_stripe_locate(BLOCK_REFERENCE block_ref, off_t *offset)
+{
+  int unit = block_ref / stripe_width;
+  *offset = ((off_t) (unit / n_stripes) * stripe_width + block_ref % stripe_width) * BLOCK_SIZE;
+  return(unit % n_stripes);
+}
+
+/**
+ * Read whole aligned units into an aligned buffer; past the end of the
+ * file they read as zeros
+ *
+ * @return 0 on success; -1 on error
+ */
+static int vdisk_stripe_direct_read(int fd, unsigned char *buffer, size_t len, off_t offset)
+{
+  ssize_t n = pread(fd, buffer, len, offset);
+  if(n < 0)
+    return(-1);
+  if((size_t) n < len)
+    memset(buffer + n, 0, len - n);
+  return(0);
+}
+
+/**
+ * Transfer one file's share of a range with O_DIRECT
+ */
+static void vdisk_stripe_direct_transfer(STRIPE_IO *io, int write)
+{
+  unsigned char *buffer = direct_buffer[io - stripe_io];
+  size_t len = 0;
+  for(int k = 0; k < io->iovcnt; ++k)
+    len += io->iov[k].iov_len;
+  off_t start = io->offset & ~(off_t) (VDISK_DIRECT_ALIGN - 1);
+  off_t end = (io->offset + len + VDISK_DIRECT_ALIGN - 1) & ~(off_t) (VDISK_DIRECT_ALIGN - 1);
+  size_t head = io->offset - start;
+  io->result = -1;
+
+  if(!write) {
+    if(vdisk_stripe_direct_read(io->fd, buffer, end - start, start) != 0)
+      return;
+    unsigned char *p = buffer + head;
+    for(int k = 0; k < io->iovcnt; p += io->iov[k].iov_len, ++k)
+      memcpy(io->iov[k].iov_base, p, io->iov[k].iov_len);
+    io->result = len;
+    return;
+  }
+
+  // The rest of the units at either end keeps its contents
+  off_t last = end - VDISK_DIRECT_ALIGN;
+  if(head != 0 && vdisk_stripe_direct_read(io->fd, buffer, VDISK_DIRECT_ALIGN, start) != 0)
+    return;
+  if((off_t) (io->offset + len) != end && (last != start || head == 0)
+     && vdisk_stripe_direct_read(io->fd, buffer + (last - start), VDISK_DIRECT_ALIGN, last) != 0)
+    return;
+  unsigned char *p = buffer + head;
+  for(int k = 0; k < io->iovcnt; p += io->iov[k].iov_len, ++k)
+    memcpy(p, io->iov[k].iov_base, io->iov[k].iov_len);
+  if(pwrite(io->fd, buffer, end - start, start) == end - start)
+    io->result = len;
+}
+
+/**
+ * Transfer one file's share of a range
+ */
+static void vdisk_stripe_transfer(STRIPE_IO *io, int write)
+{
+  if(stripe_direct)
+    vdisk_stripe_direct_transfer(io, write);
+  else if(write)
+    io->result = pwritev(io->fd, io->iov, io->iovcnt, io->offset);
+  else
+    io->result = preadv(io->fd, io->iov, io->iovcnt, io->offset);
+}
+
+static void *vdisk_stripe_read_worker(void *arg)
+{
+  vdisk_stripe_transfer(arg, 0);
+  return(NULL);
+}
+
+static void *vdisk_stripe_write_worker(void *arg)
+{
+  vdisk_stripe_transfer(arg, 1);
+  return(NULL);
+}
+
+/**
+ * Read or write a range of blocks, all files at once
+ *
+ * @param blocks count * BLOCK_SIZE bytes, or NULL to use block_list
+ * @param block_list The address of each block's data
+ * @return 0 on success; -1 on error
+ */
+static int vdisk_stripe_range(BLOCK_REFERENCE first, int count, void *blocks, void **block_list, int write)
+{
+  for(int s = 0; s < n_stripes; ++s)
+    stripe_io[s].iovcnt = 0;
+
+  // Blocks adjacent in a file and in the buffer share one iovec
+  for(int i = 0; i < count; ++i) {
+    off_t offset;
+    STRIPE_IO *io = &stripe_io[vdisk_stripe_locate(first + i, &offset)];
+    unsigned char *data = blocks != NULL ? (unsigned char *) blocks + i * BLOCK_SIZE : block_list[i];
+    if(io->iovcnt == 0) {
+      io->fd = stripe_fd[io - stripe_io];
+      io->offset = offset;
+    }else if((unsigned char *) io->iov[io->iovcnt - 1].iov_base + io->iov[io->iovcnt - 1].iov_len == data) {
+      io->iov[io->iovcnt - 1].iov_len += BLOCK_SIZE;
+      continue;
+    }
+    io->iov[io->iovcnt].iov_base = data;
+    io->iov[io->iovcnt].iov_len = BLOCK_SIZE;
+    ++io->iovcnt;
+  }
+
+  // One thread for each file with work but the first, which this thread
+  // takes (or does all of them if no thread can be started)
+  pthread_t threads[VDISK_MAX_STRIPES];
+  int started[VDISK_MAX_STRIPES];
+  int own = -1;
+  for(int s = 0; s < n_stripes; ++s) {
+    started[s] = 0;
+    if(stripe_io[s].iovcnt == 0)
+      continue;
+    if(own < 0)
+      own = s;
+    else if(pthread_create(&threads[s], NULL, write ? vdisk_stripe_write_worker : vdisk_stripe_read_worker,
+			   &stripe_io[s]) == 0)
+      started[s] = 1;
+    else
+      vdisk_stripe_transfer(&stripe_io[s], write);
+  }
+  if(own >= 0)
+    vdisk_stripe_transfer(&stripe_io[own], write);
+
+  int ret = 0;
+  for(int s = 0; s < n_stripes; ++s) {
+    STRIPE_IO *io = &stripe_io[s];
+    if(started[s])
+      pthread_join(threads[s], NULL);
+    if(io->iovcnt == 0)
+      continue;
+    ssize_t len = 0;
+    for(int k = 0; k < io->iovcnt; ++k)
+      len += io->iov[k].iov_len;
+    if(io->result < 0 || (write && io->result != len)) {
+      ret = -1;
+      continue;
+    }
+    // A disk shrunk by vdisk_resize() reads as zeros past its end
+    ssize_t n = io->result;
+    for(int k = 0; k < io->iovcnt && !write; ++k) {
+      if(n < (ssize_t) io->iov[k].iov_len)
+        memset((unsigned char *) io->iov[k].iov_base + n, 0, io->iov[k].iov_len - n);
+      n = n > (ssize_t) io->iov[k].iov_len ? n - io->iov[k].iov_len : 0;
+    }
+  }
+  return(ret);
+}
+
+/**
+ * Read a range of blocks
+ *
+ * @return 0 on success; -1 on error
+ */
+int vdisk_stripe_read(BLOCK_REFERENCE first, int count, void *blocks)
+{
+  return(vdisk_stripe_range(first, count, blocks, NULL, 0));
+}
+
+/**
+ * Write a range of blocks
+ *
+ * @return 0 on success; -1 on error
+ */
+int vdisk_stripe_write(BLOCK_REFERENCE first, int count, void *blocks)
+{
+  return(vdisk_stripe_range(first, count, blocks, NULL, 1));
+}
+
+/**
+ * Write a range of blocks whose data is not contiguous in memory
+ *
+ * @param blocks The address of each block's data
+ * @return 0 on success; -1 on error
+ */
+int vdisk_stripe_write_list(BLOCK_REFERENCE first, int count, void **blocks)
+{
+  return(vdisk_stripe_range(first, count, NULL, blocks, 1));
+}
+
+/**
+ * Make all writes durable
+ *
+ * @return 0 on success; -1 on error
+ */
+int vdisk_stripe_sync()
+{
+  int ret = 0;
+  for(int s = 0; s < n_stripes; ++s) {
+    if(fsync(stripe_fd[s]) != 0)
+      ret = -1;
+  }
+  return(ret);
+}
+
+/**
+ * Cut or extend the files to hold blocks 0 .. n_blocks - 1
+ *
+ * @return 0 on success; -1 on error
+ */
+int vdisk_stripe_truncate(int n_blocks)
+{
+  // A file's blocks lie in increasing order, so its share is a prefix
+  off_t size[VDISK_MAX_STRIPES];
+  memset(size, 0, sizeof(size));
+  for(int b = 0; b < n_blocks; ++b) {
+    off_t offset;
+    size[vdisk_stripe_locate(b, &offset)] += BLOCK_SIZE;
+  }
+
+  int ret = 0;
+  for(int s = 0; s < n_stripes; ++s) {
+    if(ftruncate(stripe_fd[s], size[s]) != 0)
+      ret = -1;
+  }
+  return(ret);
+}
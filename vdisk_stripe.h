@@ -0,0 +1,25 @@
+#ifndef VDISK_STRIPE_H
+#define VDISK_STRIPE_H
+
+/*
+ * Plain disk images, possibly striped over several files.
+ *
+ * Private to the vdisk implementation.
+ */
+
+#include "vdisk.h"
+
+// Alignment of O_DIRECT transfers, in the file and in memory
+#define VDISK_DIRECT_ALIGN 4096
+
+int vdisk_stripe_open(char *names, int flags);
+void vdisk_stripe_close();
+int vdisk_stripe_direct();
+int vdisk_stripe_count();
+int vdisk_stripe_read(BLOCK_REFERENCE first, int count, void *blocks);
+int vdisk_stripe_write(BLOCK_REFERENCE first, int count, void *blocks);
+int vdisk_stripe_write_list(BLOCK_REFERENCE first, int count, void **blocks);
+int vdisk_stripe_sync();
+int vdisk_stripe_truncate(int n_blocks);
+
+#endif
@@ -0,0 +1,120 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "vdisk_trace.h"
+/*
+ * Block access trace.
+ *
+ * Opening a disk with ZTRACE=<file> set appends every block request,
+ * transaction boundary, file transfer and sync of the process to <file>,
+ * one 16-byte VDISK_TRACE_RECORD each (see vdisk.h; ztrace-replay reads
+ * them).  Records are collected in a buffer and appended a buffer at a
+ * time with O_APPEND, so several processes may record into one file; a
+ * process that crashes loses the records still in its buffer.
+ *
+ * Each record carries the operation of the layer above that was in
+ * progress in its thread, set with vdisk_trace_context().
+ */
+
+int vdisk_trace_fd = -1;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static VDISK_TRACE_RECORD trace_buffer[VDISK_TRACE_BUFFER];
+static int trace_used = 0;
+
+static __thread int trace_context = 0;
+static __thread unsigned int trace_thread = 0;
+
+/**
+ * Start recording if ZTRACE names a file
+ */
+void vdisk_trace_open()
+{
+  char *name = getenv("ZTRACE");
+  if(name == NULL || name[0] == 0)
+    return;
+  vdisk_trace_fd = open(name, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(vdisk_trace_fd < 0) {
+    fprintf(stderr, "vdisk: unable to open trace (%s)\n", name);
+    return;
+  }
+
+  // Every process starts with a header, so that a trace file can be
+  // checked however the processes took turns
+  VDISK_TRACE_RECORD header;
+  memset(&header, 0, sizeof(header));
+  header.time_ns = VDISK_TRACE_MAGIC;
+  header.block_ref = VDISK_TRACE_VERSION;
+  header.type = VDISK_TRACE_HEADER;
+  pthread_mutex_lock(&trace_mutex);
+  trace_buffer[0] = header;
+  trace_used = 1;
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+/**
+ * Write out the buffer.  Called with trace_mutex held.
+ */
+static void vdisk_trace_flush()
+{
+  ssize_t len = trace_used * sizeof(VDISK_TRACE_RECORD);
+  if(len > 0 && write(vdisk_trace_fd, trace_buffer, len) != len)
+    fprintf(stderr, "vdisk: trace write failed\n");
+  trace_used = 0;
+}
+
+/**
+ * Stop recording
+ */
+void vdisk_trace_close()
+{
+  if(vdisk_trace_fd < 0)
+    return;
+  pthread_mutex_lock(&trace_mutex);
+  vdisk_trace_flush();
+  close(vdisk_trace_fd);
+  vdisk_trace_fd = -1;
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+/**
+ * Record an access to a range of blocks (use the vdisk_trace() macro)
+ *
+ * @param type VDISK_TRACE_*
+ * @param first First block (0 for records without one)
+ * @param count Number of blocks: one record each
+ */
+void vdisk_trace_write(int type, BLOCK_REFERENCE first, int count)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  if(trace_thread == 0)
+    trace_thread = syscall(SYS_gettid);
+
+  pthread_mutex_lock(&trace_mutex);
+  for(int i = 0; i < count && vdisk_trace_fd >= 0; ++i) {
+    if(trace_used == VDISK_TRACE_BUFFER)
+      vdisk_trace_flush();
+    VDISK_TRACE_RECORD *record = &trace_buffer[trace_used++];
+    record->time_ns = (unsigned long) t.tv_sec * 1000000000UL + t.tv_nsec;
+    record->thread = trace_thread;
+    record->block_ref = first + i;
+    record->type = type;
+    record->context = trace_context;
+  }
+  pthread_mutex_unlock(&trace_mutex);
+}
+
+/**
+ * Set the operation that this thread's block accesses are part of
+ *
+ * @param context An operation code of the layer above (0: none)
+ * @return The previous context, to restore when the operation ends
+ */
+int vdisk_trace_context(int context)
+{
+  int previous = trace_context;
+  trace_context = context;
+  return(previous);
+}
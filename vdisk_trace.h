@@ -0,0 +1,23 @@
+#ifndef VDISK_TRACE_H
+#define VDISK_TRACE_H
+
+/*
+ * Block access trace: private to the vdisk implementation.
+ */
+
+#include "vdisk.h"
+
+// Records buffered before they are written to the trace file
+#define VDISK_TRACE_BUFFER 256
+
+extern int vdisk_trace_fd;
+
+void vdisk_trace_open();
+void vdisk_trace_close();
+void vdisk_trace_write(int type, BLOCK_REFERENCE first, int count);
+
+// Costs one test while no trace is being recorded
+#define vdisk_trace(type, first, count) \
+  do { if(vdisk_trace_fd >= 0) vdisk_trace_write(type, first, count); } while(0)
+
+#endif
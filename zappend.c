@@ -0,0 +1,52 @@
+/**
+Append stdin to a file in the OU File System, creating it if needed.
+
+Usage: zappend <file>
+
+The data is buffered and the file only gets its blocks when it is closed,
+so it is written to one contiguous run (see oufs_file.c).
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc != 2){
+    fprintf(stderr, "Usage: zappend <file>\n");
+    return -1;
+  }
+
+  if(oufs_mount(disk_name) != 0)
+    return -1;
+  OUFILE *fp = oufs_fopen(cwd, argv[1], "a");
+  if(fp == NULL){
+    oufs_unmount();
+    return -1;
+  }
+
+  //Copy stdin in small pieces; nothing is allocated until the close
+  unsigned char buf[BLOCK_SIZE];
+  int ret = 0;
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), stdin)) > 0){
+    if(oufs_fwrite(fp, buf, n) != (int)n){
+      fprintf(stderr, "ERROR: file too large\n");
+      ret = -1;
+      break;
+    }
+  }
+
+  if(oufs_fflush(fp) != 0)
+    ret = -1;
+  oufs_fclose(fp);
+  oufs_unmount();
+  return ret;
+}
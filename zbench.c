@@ -0,0 +1,383 @@
+/**
+Microbenchmarks for the metadata operations.
+
+Usage: zbench <scratch disk> [rounds]
+
+The scratch disk is formatted again before every benchmark, so never give
+it the name of a disk worth keeping.  Each benchmark prints one line of
+whitespace-separated fields, so that runs of two builds can be diffed:
+
+  name ops ops_per_sec p50_us p90_us p99_us max_us reads_per_op writes_per_op
+
+Reads and writes are the blocks requested from vdisk per operation
+(vdisk_io_counts()), cache hits included.  Lines starting with # are
+comments.  `make bench` builds zbench and runs it on a temporary disk in /tmp.
+
+  mkdir, rmdir        a full root directory (14 entries), created then removed
+  list_<n>            oufs_list() of a directory with n entries
+  lookup_depth_<d>    oufs_find_file() of a path d directories deep
+  lookup_size_<n>     oufs_find_file() of the last entry of a directory
+                      with n entries
+  alloc_clean         write and close a 2-block file on an empty disk
+  alloc_fragmented    the same with the free space cut into 3-block holes
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+// A directory holds DIRECTORY_ENTRIES_PER_BLOCK entries, . and .. included
+#define MKDIR_COUNT ((int) DIRECTORY_ENTRIES_PER_BLOCK - 2)
+#define MAX_DEPTH 16
+#define ALLOC_BLOCKS 2
+#define FILL_BLOCKS 3
+
+static char *disk_name;
+static int rounds = 20;
+
+// Latencies of the operation being measured
+typedef struct samples_s
+{
+  double *latency;
+  int n;
+  double total;
+  unsigned long reads;
+  unsigned long writes;
+  // Start of the current operation
+  double start;
+  unsigned long start_reads;
+  unsigned long start_writes;
+} SAMPLES;
+
+// Functions used later on
+int format();
+double now_us();
+void init_samples(SAMPLES *s, int max);
+void start_op(SAMPLES *s);
+void end_op(SAMPLES *s);
+void report(char *name, SAMPLES *s);
+int bench_mkdir_rmdir();
+int bench_list_lookup();
+int bench_depth();
+int write_file(char *path, int n_blocks);
+int bench_alloc(int fragmented);
+
+int main(int argc, char** argv){
+  if(argc < 2 || argc > 3){
+    fprintf(stderr, "Usage: zbench <scratch disk> [rounds]\n");
+    return -1;
+  }
+  disk_name = argv[1];
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(rounds < 1){
+    fprintf(stderr, "ERROR: at least 1 round\n");
+    return -1;
+  }
+
+  printf("# zbench: %d rounds\n", rounds);
+  printf("# name ops ops_per_sec p50_us p90_us p99_us max_us reads_per_op writes_per_op\n");
+  if(bench_mkdir_rmdir() != 0 || bench_list_lookup() != 0 || bench_depth() != 0
+     || bench_alloc(0) != 0 || bench_alloc(1) != 0){
+    fprintf(stderr, "ERROR: benchmark failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Create the scratch disk with an empty file system, and leave it open
+ *
+ * @return 0 on success; -1 on error
+ */
+int format(){
+  static BLOCK image[N_BLOCKS_IN_DISK];
+  memset(image, 0, sizeof(image));
+
+  //Master block, inode table and root directory allocated; inode 0 is the root
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  for(int b = 0; b <= ROOT_DIRECTORY_BLOCK; ++b)
+    master->block_allocated_flag[b >> 3] |= (1 << (b & 7));
+  master->inode_allocated_flag[0] = 1;
+  master->n_blocks = N_BLOCKS_IN_DISK;
+  oufs_set_geometry(master);
+
+  INODE *root = &image[1].inodes.inode[0];
+  root->type = IT_DIRECTORY;
+  root->n_references = 1;
+  root->size = 2;
+  root->data[0] = ROOT_DIRECTORY_BLOCK;
+  for(int k = 1; k < BLOCKS_PER_INODE; ++k)
+    root->data[k] = UNALLOCATED_BLOCK;
+  for(int i = 1; i < N_INODES; ++i){
+    INODE *inode = &image[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK];
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+      inode->data[k] = UNALLOCATED_BLOCK;
+  }
+  oufs_clean_directory_block(0, 0, &image[ROOT_DIRECTORY_BLOCK]);
+
+  if(vdisk_disk_create(disk_name, 0) != 0)
+    return -1;
+  if(vdisk_write_blocks(0, N_BLOCKS_IN_DISK, image) != 0){
+    vdisk_disk_close();
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Monotonic time in microseconds
+ */
+double now_us(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+/**
+ * Set up an empty set of samples
+ */
+void init_samples(SAMPLES *s, int max){
+  memset(s, 0, sizeof(SAMPLES));
+  s->latency = malloc(max * sizeof(double));
+}
+
+void start_op(SAMPLES *s){
+  vdisk_io_counts(&s->start_reads, &s->start_writes);
+  s->start = now_us();
+}
+
+void end_op(SAMPLES *s){
+  double latency = now_us() - s->start;
+  unsigned long reads, writes;
+  vdisk_io_counts(&reads, &writes);
+  s->latency[s->n++] = latency;
+  s->total += latency;
+  s->reads += reads - s->start_reads;
+  s->writes += writes - s->start_writes;
+}
+
+static int compare_doubles(const void *p, const void *q){
+  double a = *(const double *) p, b = *(const double *) q;
+  return (a > b) - (a < b);
+}
+
+/**
+ * Print one result line and free the samples
+ */
+void report(char *name, SAMPLES *s){
+  if(s->n > 0){
+    qsort(s->latency, s->n, sizeof(double), compare_doubles);
+    printf("%s %d %.0f %.2f %.2f %.2f %.2f %.2f %.2f\n", name, s->n, s->n / (s->total / 1e6),
+           s->latency[s->n / 2], s->latency[s->n * 9 / 10], s->latency[s->n * 99 / 100], s->latency[s->n - 1],
+           (double) s->reads / s->n, (double) s->writes / s->n);
+  }
+  free(s->latency);
+}
+
+int bench_mkdir_rmdir(){
+  SAMPLES mk, rm;
+  init_samples(&mk, rounds * MKDIR_COUNT);
+  init_samples(&rm, rounds * MKDIR_COUNT);
+  if(format() != 0)
+    return -1;
+
+  int ret = 0;
+  for(int r = 0; r < rounds && ret == 0; ++r){
+    char path[MAX_PATH_LENGTH];
+    for(int d = 0; d < MKDIR_COUNT && ret == 0; ++d){
+      snprintf(path, sizeof(path), "/m%d", d);
+      start_op(&mk);
+      ret = oufs_mkdir("/", path);
+      end_op(&mk);
+    }
+    for(int d = MKDIR_COUNT - 1; d >= 0 && ret == 0; --d){
+      snprintf(path, sizeof(path), "/m%d", d);
+      start_op(&rm);
+      ret = oufs_rmdir("/", path);
+      end_op(&rm);
+    }
+  }
+  vdisk_disk_close();
+  report("mkdir", &mk);
+  report("rmdir", &rm);
+  return ret;
+}
+
+int bench_list_lookup(){
+  //Directories with 2, 8 and 16 entries (with . and ..)
+  static int sizes[] = { 2, 8, DIRECTORY_ENTRIES_PER_BLOCK };
+  int n_sizes = sizeof(sizes) / sizeof(sizes[0]);
+  if(format() != 0)
+    return -1;
+  for(int k = 0; k < n_sizes; ++k){
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/s%d", sizes[k]);
+    if(oufs_mkdir("/", path) != 0){
+      vdisk_disk_close();
+      return -1;
+    }
+    for(int e = 2; e < sizes[k]; ++e){
+      snprintf(path, sizeof(path), "/s%d/e%d", sizes[k], e);
+      if(oufs_mkdir("/", path) != 0){
+        vdisk_disk_close();
+        return -1;
+      }
+    }
+  }
+
+  //oufs_list() prints to stdout
+  fflush(stdout);
+  int saved_stdout = dup(1);
+  int null_fd = open("/dev/null", O_WRONLY);
+  SAMPLES list[3];
+  int ret = 0;
+  if(null_fd >= 0)
+    dup2(null_fd, 1);
+  for(int k = 0; k < n_sizes; ++k){
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/s%d", sizes[k]);
+    init_samples(&list[k], rounds * 10);
+    for(int r = 0; r < rounds * 10 && ret == 0; ++r){
+      char copy[MAX_PATH_LENGTH];
+      strcpy(copy, path);
+      start_op(&list[k]);
+      ret = oufs_list("/", copy);
+      end_op(&list[k]);
+    }
+  }
+  fflush(stdout);
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+  if(null_fd >= 0)
+    close(null_fd);
+
+  for(int k = 0; k < n_sizes; ++k){
+    char name[32];
+    snprintf(name, sizeof(name), "list_%d", sizes[k]);
+    report(name, &list[k]);
+  }
+
+  //Lookups of the last entry (directories with at least one child)
+  for(int k = 1; k < n_sizes && ret == 0; ++k){
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "/s%d/e%d", sizes[k], sizes[k] - 1);
+    SAMPLES lookup;
+    init_samples(&lookup, rounds * 10);
+    for(int r = 0; r < rounds * 10 && ret == 0; ++r){
+      INODE_REFERENCE parent, child;
+      char local_name[FILE_NAME_SIZE + 1];
+      start_op(&lookup);
+      ret = oufs_find_file("/", path, &parent, &child, local_name) == 0 && child != UNALLOCATED_INODE ? 0 : -1;
+      end_op(&lookup);
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "lookup_size_%d", sizes[k]);
+    report(name, &lookup);
+  }
+  vdisk_disk_close();
+  return ret;
+}
+
+int bench_depth(){
+  static int depths[] = { 1, 4, MAX_DEPTH };
+  if(format() != 0)
+    return -1;
+
+  //A chain /d/d/.../d, MAX_DEPTH directories deep
+  char path[MAX_PATH_LENGTH] = "";
+  for(int d = 0; d < MAX_DEPTH; ++d){
+    char copy[MAX_PATH_LENGTH];
+    strcat(path, "/d");
+    //oufs_mkdir() cuts up the path it is given
+    strcpy(copy, path);
+    if(oufs_mkdir("/", copy) != 0){
+      vdisk_disk_close();
+      return -1;
+    }
+  }
+
+  int ret = 0;
+  for(int k = 0; k < (int) (sizeof(depths) / sizeof(depths[0])) && ret == 0; ++k){
+    path[depths[k] * 2] = 0;
+    SAMPLES lookup;
+    init_samples(&lookup, rounds * 10);
+    for(int r = 0; r < rounds * 10 && ret == 0; ++r){
+      INODE_REFERENCE parent, child;
+      char local_name[FILE_NAME_SIZE + 1];
+      start_op(&lookup);
+      ret = oufs_find_file("/", path, &parent, &child, local_name) == 0 && child != UNALLOCATED_INODE ? 0 : -1;
+      end_op(&lookup);
+    }
+    path[depths[k] * 2] = '/';
+    char name[32];
+    snprintf(name, sizeof(name), "lookup_depth_%d", depths[k]);
+    report(name, &lookup);
+  }
+  vdisk_disk_close();
+  return ret;
+}
+
+/**
+ * Write a file of n_blocks blocks; 0 truncates it, releasing its blocks
+ *
+ * @return 0 on success; -1 on error
+ */
+int write_file(char *path, int n_blocks){
+  static unsigned char data[BLOCKS_PER_INODE * BLOCK_SIZE];
+  memset(data, 'x', n_blocks * BLOCK_SIZE);
+  OUFILE *fp = oufs_fopen("/", path, "w");
+  if(fp == NULL)
+    return -1;
+  int ret = 0;
+  if(oufs_fwrite(fp, data, n_blocks * BLOCK_SIZE) != n_blocks * BLOCK_SIZE || oufs_fflush(fp) != 0)
+    ret = -1;
+  oufs_fclose(fp);
+  return ret;
+}
+
+/**
+ * Write and truncate a file of ALLOC_BLOCKS blocks, on an empty disk or
+ * one whose free space is cut into holes of FILL_BLOCKS blocks
+ */
+int bench_alloc(int fragmented){
+  if(format() != 0)
+    return -1;
+
+  //Nearly fill the disk with files, MKDIR_COUNT to a directory, then
+  //truncate every other one.  The directories take a block each, and the
+  //ends of the block groups are too short for a run.
+  int ret = 0;
+  int n_files = (N_BLOCKS_IN_DISK - ROOT_DIRECTORY_BLOCK - 1) / FILL_BLOCKS - 2 * N_BLOCK_GROUPS;
+  char path[MAX_PATH_LENGTH];
+  for(int f = 0; f < n_files && fragmented && ret == 0; ++f){
+    if(f % MKDIR_COUNT == 0){
+      snprintf(path, sizeof(path), "/g%d", f / MKDIR_COUNT);
+      ret = oufs_mkdir("/", path);
+    }
+    snprintf(path, sizeof(path), "/g%d/f%d", f / MKDIR_COUNT, f % MKDIR_COUNT);
+    if(ret == 0)
+      ret = write_file(path, FILL_BLOCKS);
+  }
+  for(int f = 0; f < n_files && fragmented && ret == 0; f += 2){
+    snprintf(path, sizeof(path), "/g%d/f%d", f / MKDIR_COUNT, f % MKDIR_COUNT);
+    ret = write_file(path, 0);
+  }
+
+  SAMPLES alloc;
+  init_samples(&alloc, rounds * 10);
+  for(int r = 0; r < rounds * 10 && ret == 0; ++r){
+    start_op(&alloc);
+    ret = write_file("/bench", ALLOC_BLOCKS);
+    end_op(&alloc);
+    if(ret == 0)
+      ret = write_file("/bench", 0);
+  }
+  vdisk_disk_close();
+  report(fragmented ? "alloc_fragmented" : "alloc_clean", &alloc);
+  return ret;
+}
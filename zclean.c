@@ -0,0 +1,36 @@
+/**
+Run the cleaner of a log-structured OU File System disk (zformat -log).
+
+The live runs of every segment that is at most half live are copied to the
+head of the log, which leaves those segments clean for it to move on to.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc != 1) {
+    fprintf(stderr, "Usage: zclean\n");
+    return(-1);
+  }
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return(-1);
+
+  // Other processes keep off the store while its runs are moved
+  unsigned int cleaned, moved, clean_segments;
+  int ret = -1;
+  if(vdisk_lock_disk() == 0 && (ret = vdisk_log_clean(&cleaned, &moved, &clean_segments)) == 0)
+    printf("%d segments cleaned, %d blocks moved, %d clean segments\n", cleaned, moved, clean_segments);
+
+  vdisk_disk_close();
+  return(ret == 0 ? 0 : -1);
+}
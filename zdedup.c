@@ -0,0 +1,55 @@
+/**
+Offline deduplication of an OU File System disk.
+
+A block store is deduplicated in place.  A plain disk image is first
+converted into a block store with deduplication enabled.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc != 1) {
+    fprintf(stderr, "Usage: zdedup\n");
+    return(-1);
+  }
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return(-1);
+
+  // A block store lives in one file
+  if(vdisk_disk_stripes() > 1) {
+    fprintf(stderr, "ERROR: %s is striped and cannot be deduplicated\n", disk_name);
+    vdisk_disk_close();
+    return(-1);
+  }
+
+  if(vdisk_disk_features() == 0) {
+    // Rewritten under the disk lock, so no other process's writes are lost
+    if(vdisk_convert_disk(VDISK_FEATURE_SNAPSHOTS | VDISK_FEATURE_DEDUP) != 0)
+      return(-1);
+    if(vdisk_disk_open(disk_name) != 0)
+      return(-1);
+  }else if(!(vdisk_disk_features() & VDISK_FEATURE_DEDUP)) {
+    // Only a deduplicating store keeps the run hashes
+    fprintf(stderr, "ERROR: %s was not formatted with -dedup\n", disk_name);
+    vdisk_disk_close();
+    return(-1);
+  }
+
+  // Other processes keep off the store while its runs are merged
+  unsigned int merged;
+  if(vdisk_lock_disk() == 0 && vdisk_dedup_scan(&merged) == 0)
+    printf("%d blocks merged\n", merged);
+
+  vdisk_disk_close();
+  return(0);
+}
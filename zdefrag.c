@@ -0,0 +1,291 @@
+/**
+Defragment and compact a disk.
+
+Usage: zdefrag [-n]
+
+Directory entries are packed to the front of their directories (freeing
+directory blocks that become empty), and blocks are moved so that every
+directory and file occupies one contiguous run.  The runs are handed out
+again by the block group allocator, so each inode's data lands in its own
+group, near the inode, as oufs_mkdir() and the file code place it.  Within
+each group the hot metadata comes first: every directory is placed (in
+inode order) before any file data, so the directory blocks that path
+lookups read sit at the front of their group, and the root directory
+right after the inode table.
+
+The new layout is built in memory and the changed blocks are written in
+one transaction, so an interrupted run leaves the disk as it was or fully
+defragmented.  With -n nothing is written.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_image.h"
+
+static OUFS_IMAGE image;
+static BLOCK layout[N_BLOCKS_IN_DISK];
+
+// Functions used later on
+int check_references();
+int count_fragments();
+int pack_directory(INODE_REFERENCE d, DIRECTORY_ENTRY *entries);
+int allocate_run(MASTER_BLOCK *master, INODE_REFERENCE i, int count, BLOCK_REFERENCE *to);
+void place_directory(INODE_REFERENCE d, DIRECTORY_ENTRY *entries, int n_entries, BLOCK_REFERENCE *to);
+void place_file(INODE_REFERENCE f, BLOCK_REFERENCE *to);
+
+static int in_use(INODE_REFERENCE i)
+{
+  INODE *inode = oufs_image_inode(&image, i);
+  return inode->type == IT_DIRECTORY || inode->type == IT_FILE;
+}
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  int dry_run = 0;
+  if(argc == 2 && !strcmp(argv[1], "-n")){
+    dry_run = 1;
+  }
+  else if(argc != 1){
+    fprintf(stderr, "Usage: zdefrag [-n]\n");
+    return -1;
+  }
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return -1;
+  if(oufs_image_load(&image) != 0){
+    fprintf(stderr, "ERROR: unable to read disk\n");
+    vdisk_disk_close();
+    return -1;
+  }
+  //Moving a block that two inodes share would corrupt one of them
+  if(check_references() != 0){
+    fprintf(stderr, "ERROR: the disk is inconsistent, run zfsck -repair first\n");
+    vdisk_disk_close();
+    return -1;
+  }
+
+  int fragments_before = count_fragments();
+  int blocks_before = 0;
+  MASTER_BLOCK *master = &image.block[MASTER_BLOCK_REFERENCE].master;
+  for(int b = ROOT_DIRECTORY_BLOCK; b < oufs_disk_blocks(master); ++b)
+    blocks_before += (master->block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+
+  //Build the new layout in a copy of the disk; the old blocks are read
+  //from the image until the end.  Every block is free again, up to the
+  //end of the disk (see zresize), and is handed out inode by inode.
+  memcpy(layout, image.block, sizeof(layout));
+  MASTER_BLOCK *placed_master = &layout[MASTER_BLOCK_REFERENCE].master;
+  int n_disk_blocks = oufs_disk_blocks(master);
+  for(int b = ROOT_DIRECTORY_BLOCK; b < n_disk_blocks; ++b)
+    placed_master->block_allocated_flag[b >> 3] &= ~(1 << (b & 7));
+  //Directories in the first pass and files in the second: the allocator
+  //fills each group from its start, so directories take the front
+  for(int n = 0; n < 2 * N_INODES; ++n){
+    int i = n % N_INODES;
+    if(!in_use(i) || (oufs_image_inode(&image, i)->type == IT_DIRECTORY) != (n < N_INODES))
+      continue;
+    static DIRECTORY_ENTRY entries[BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK];
+    BLOCK_REFERENCE to[BLOCKS_PER_INODE];
+    int n_entries = 0;
+    int n_blocks = 0;
+    if(oufs_image_inode(&image, i)->type == IT_DIRECTORY){
+      n_entries = pack_directory(i, entries);
+      n_blocks = (n_entries + DIRECTORY_ENTRIES_PER_BLOCK - 1) / DIRECTORY_ENTRIES_PER_BLOCK;
+    }
+    else{
+      for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+        n_blocks += oufs_image_inode(&image, i)->data[k] != UNALLOCATED_BLOCK;
+    }
+    if(allocate_run(placed_master, i, n_blocks, to) != 0){
+      fprintf(stderr, "ERROR: no room for the blocks of inode %d\n", i);
+      vdisk_disk_close();
+      return -1;
+    }
+    if(oufs_image_inode(&image, i)->type == IT_DIRECTORY)
+      place_directory(i, entries, n_entries, to);
+    else
+      place_file(i, to);
+  }
+  int blocks_after = 0;
+  for(int b = ROOT_DIRECTORY_BLOCK; b < n_disk_blocks; ++b)
+    blocks_after += (placed_master->block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+
+  //Only blocks whose contents changed are written
+  int moved = 0;
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b){
+    //Free blocks keep their old contents
+    int allocated = (placed_master->block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+    if(b >= ROOT_DIRECTORY_BLOCK && (!allocated || b >= n_disk_blocks))
+      continue;
+    if(memcmp(&layout[b], &image.block[b], sizeof(BLOCK)) != 0){
+      memcpy(&image.block[b], &layout[b], sizeof(BLOCK));
+      image.dirty[b] = 1;
+      if(b >= ROOT_DIRECTORY_BLOCK)
+        ++moved;
+    }
+  }
+
+  printf("%d blocks rewritten, %d blocks freed, %d fragments before, %d after\n",
+         moved, blocks_before - blocks_after, fragments_before, count_fragments());
+
+  if(!dry_run && oufs_image_write(&image) != 0){
+    fprintf(stderr, "ERROR: unable to write disk\n");
+    vdisk_disk_close();
+    return -1;
+  }
+  vdisk_disk_close();
+  return 0;
+}
+
+/**
+ * Check that every block reference of an inode in use is valid and that no
+ * block is referenced twice
+ *
+ * @return 0 if so; -1 otherwise
+ */
+int check_references(){
+  unsigned char used[N_BLOCKS_IN_DISK];
+  memset(used, 0, sizeof(used));
+  for(int i = 0; i < N_INODES; ++i){
+    if(!in_use(i))
+      continue;
+    INODE *inode = oufs_image_inode(&image, i);
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode->data[k];
+      if(b == UNALLOCATED_BLOCK)
+        continue;
+      if(b < ROOT_DIRECTORY_BLOCK || b >= N_BLOCKS_IN_DISK || used[b])
+        return -1;
+      used[b] = 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Number of breaks between the runs of blocks of the inodes in use
+ */
+int count_fragments(){
+  int fragments = 0;
+  for(int i = 0; i < N_INODES; ++i){
+    if(!in_use(i))
+      continue;
+    INODE *inode = oufs_image_inode(&image, i);
+    BLOCK_REFERENCE last = UNALLOCATED_BLOCK;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode->data[k];
+      if(b == UNALLOCATED_BLOCK)
+        continue;
+      if(last != UNALLOCATED_BLOCK && b != last + 1)
+        ++fragments;
+      last = b;
+    }
+  }
+  return fragments;
+}
+
+/**
+ * Gather the entries of a directory, . and .. first
+ *
+ * @param d The directory
+ * @param entries Filled with the entries
+ * @return The number of entries, with the slots of . and .. (free if missing)
+ */
+int pack_directory(INODE_REFERENCE d, DIRECTORY_ENTRY *entries){
+  INODE *inode = oufs_image_inode(&image, d);
+
+  //. and .. always take the first two slots
+  int n_entries = 2;
+  oufs_clean_directory_entry(&entries[0]);
+  oufs_clean_directory_entry(&entries[1]);
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    BLOCK_REFERENCE b = inode->data[k];
+    if(b == UNALLOCATED_BLOCK)
+      continue;
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+      DIRECTORY_ENTRY *entry = &image.block[b].directory.entry[j];
+      if(entry->inode_reference == UNALLOCATED_INODE)
+        continue;
+      if(!strncmp(entry->name, ".", FILE_NAME_SIZE))
+        entries[0] = *entry;
+      else if(!strncmp(entry->name, "..", FILE_NAME_SIZE))
+        entries[1] = *entry;
+      else
+        entries[n_entries++] = *entry;
+    }
+  }
+  return n_entries;
+}
+
+/**
+ * Take blocks for an inode from the new layout's allocation table: one run
+ * in the inode's group when there is one, otherwise the free blocks nearest
+ * to it one at a time.  The blocks freed by the old layout always suffice.
+ *
+ * @param master Allocation table of the new layout
+ * @param i The inode
+ * @param count Number of blocks
+ * @param to Filled with the blocks, in order
+ * @return 0 on success; -1 if the disk is full (cannot happen)
+ */
+int allocate_run(MASTER_BLOCK *master, INODE_REFERENCE i, int count, BLOCK_REFERENCE *to){
+  if(count == 0)
+    return 0;
+  BLOCK_REFERENCE first = oufs_allocate_blocks_near(master, i, count);
+  for(int k = 0; k < count; ++k){
+    to[k] = first != UNALLOCATED_BLOCK ? first + k : oufs_allocate_blocks_near(master, i, 1);
+    if(to[k] == UNALLOCATED_BLOCK)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Write the packed entries of a directory into the blocks given to it
+ */
+void place_directory(INODE_REFERENCE d, DIRECTORY_ENTRY *entries, int n_entries, BLOCK_REFERENCE *to){
+  INODE *placed = &layout[d / INODES_PER_BLOCK + 1].inodes.inode[d % INODES_PER_BLOCK];
+
+  int n_blocks = (n_entries + DIRECTORY_ENTRIES_PER_BLOCK - 1) / DIRECTORY_ENTRIES_PER_BLOCK;
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    if(k < n_blocks){
+      BLOCK *block = &layout[to[k]];
+      for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+        int e = k * DIRECTORY_ENTRIES_PER_BLOCK + j;
+        if(e < n_entries)
+          block->directory.entry[j] = entries[e];
+        else
+          oufs_clean_directory_entry(&block->directory.entry[j]);
+      }
+      placed->data[k] = to[k];
+    }
+    else{
+      placed->data[k] = UNALLOCATED_BLOCK;
+    }
+  }
+  //Unused . or .. slots (damaged directory) stay free
+  placed->size = n_entries - (entries[0].inode_reference == UNALLOCATED_INODE)
+    - (entries[1].inode_reference == UNALLOCATED_INODE);
+}
+
+/**
+ * Copy a file's blocks into the blocks given to it.  Each block keeps its
+ * position within the file.
+ */
+void place_file(INODE_REFERENCE f, BLOCK_REFERENCE *to){
+  INODE *inode = oufs_image_inode(&image, f);
+  INODE *placed = &layout[f / INODES_PER_BLOCK + 1].inodes.inode[f % INODES_PER_BLOCK];
+  int n = 0;
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    BLOCK_REFERENCE b = inode->data[k];
+    if(b == UNALLOCATED_BLOCK)
+      continue;
+    layout[to[n]] = image.block[b];
+    placed->data[k] = to[n++];
+  }
+}
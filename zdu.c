@@ -0,0 +1,126 @@
+/**
+Report the space used by a tree of the OU File System.
+
+Usage: zdu [path] [-s] [-threads N]
+
+For every directory under path (default: the current directory), path
+itself included, prints the blocks its subtree holds (file and directory
+blocks), the bytes of the files in it, and its path, sorted by path.
+With -s, only path's line is printed.  A file with several links is
+counted once, where it is first found.  The tree is walked by a pool of
+threads (oufs_walk()).
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+// What the walk found, by inode
+typedef struct du_s
+{
+  pthread_mutex_t mutex;
+  unsigned char seen[N_INODES];
+  char type[N_INODES];
+  INODE_REFERENCE parent[N_INODES];
+  char *path[N_INODES];
+  unsigned long blocks[N_INODES];
+  unsigned long bytes[N_INODES];
+} DU;
+
+// Functions used later on
+void du_visit(OUFS_WALK_ENTRY *entry, void *arg);
+int compare_directories(const void *p, const void *q);
+
+static DU du;
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  char *path = "";
+  int summary = 0;
+  int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  for(int i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-s")){
+      summary = 1;
+    }
+    else if(!strcmp(argv[i], "-threads") && i + 1 < argc){
+      n_threads = atoi(argv[++i]);
+    }
+    else if(argv[i][0] != '-' && i == 1){
+      path = argv[i];
+    }
+    else{
+      fprintf(stderr, "Usage: zdu [path] [-s] [-threads N]\n");
+      return -1;
+    }
+  }
+
+  pthread_mutex_init(&du.mutex, NULL);
+  if(oufs_mount(disk_name) != 0)
+    return -1;
+  int ret = oufs_walk(cwd, path, n_threads, du_visit, &du);
+  oufs_unmount();
+  if(ret != 0)
+    return -1;
+
+  //Each inode's own space goes to every directory above it
+  unsigned long total_blocks[N_INODES], total_bytes[N_INODES];
+  INODE_REFERENCE directories[N_INODES];
+  int n_directories = 0;
+  memset(total_blocks, 0, sizeof(total_blocks));
+  memset(total_bytes, 0, sizeof(total_bytes));
+  for(int i = 0; i < N_INODES; ++i){
+    if(!du.seen[i])
+      continue;
+    for(int p = i, depth = 0; p != UNALLOCATED_INODE && depth < N_INODES; p = du.parent[p], ++depth){
+      total_blocks[p] += du.blocks[i];
+      total_bytes[p] += du.bytes[i];
+    }
+    if(du.type[i] == IT_DIRECTORY)
+      directories[n_directories++] = i;
+  }
+
+  qsort(directories, n_directories, sizeof(INODE_REFERENCE), compare_directories);
+  for(int d = 0; d < n_directories; ++d){
+    INODE_REFERENCE i = directories[d];
+    if(!summary || du.parent[i] == UNALLOCATED_INODE)
+      printf("%6lu %8lu %s\n", total_blocks[i], total_bytes[i], du.path[i]);
+  }
+  for(int i = 0; i < N_INODES; ++i)
+    free(du.path[i]);
+  return 0;
+}
+
+/**
+ * Record an inode's own blocks and bytes, the first time it is found
+ */
+void du_visit(OUFS_WALK_ENTRY *entry, void *arg){
+  DU *du = arg;
+  INODE_REFERENCE i = entry->inode_reference;
+  if(i >= N_INODES)
+    return;
+
+  pthread_mutex_lock(&du->mutex);
+  if(!du->seen[i]){
+    du->seen[i] = 1;
+    du->type[i] = entry->inode.type;
+    du->parent[i] = entry->parent;
+    du->path[i] = strdup(entry->path);
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+      du->blocks[i] += entry->inode.data[k] != UNALLOCATED_BLOCK;
+    du->bytes[i] = entry->inode.type == IT_FILE ? entry->inode.size : 0;
+  }
+  pthread_mutex_unlock(&du->mutex);
+}
+
+int compare_directories(const void *p, const void *q){
+  char *a = du.path[*(const INODE_REFERENCE *) p], *b = du.path[*(const INODE_REFERENCE *) q];
+  return strcmp(a ? a : "", b ? b : "");
+}
@@ -0,0 +1,165 @@
+/**
+Write a directory of the disk to stdout as a tar archive.
+
+Usage: zexport [path]
+
+The archive holds the contents of path (default: the current directory),
+with names relative to it.  The whole disk is loaded with a few large
+reads first, so the walk itself does no I/O.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_image.h"
+#include "oufs_tar.h"
+
+// Longest archive path (prefix + '/' + name)
+#define MAX_TAR_PATH 256
+
+static OUFS_IMAGE image;
+static int visited[N_INODES];
+
+// Functions used later on
+int export_directory(INODE_REFERENCE d, char *path);
+int write_header(char *path, char type, unsigned int size);
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc > 2){
+    fprintf(stderr, "Usage: zexport [path]\n");
+    return -1;
+  }
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return -1;
+  if(oufs_image_load(&image) != 0){
+    fprintf(stderr, "ERROR: unable to read disk\n");
+    vdisk_disk_close();
+    return -1;
+  }
+  vdisk_disk_close();
+
+  INODE_REFERENCE d = oufs_image_resolve(&image, cwd, argc == 2 ? argv[1] : ".");
+  if(d == UNALLOCATED_INODE || oufs_image_inode(&image, d)->type != IT_DIRECTORY){
+    fprintf(stderr, "ERROR: not a directory\n");
+    return -1;
+  }
+
+  static char buffer[64 * TAR_BLOCK_SIZE];
+  setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+  visited[d] = 1;
+  int ret = export_directory(d, "");
+
+  //End of archive: two empty records
+  static char zeros[2 * TAR_BLOCK_SIZE];
+  fwrite(zeros, 1, sizeof(zeros), stdout);
+  if(fflush(stdout) != 0){
+    fprintf(stderr, "ERROR: write failed\n");
+    return -1;
+  }
+  return ret;
+}
+
+/**
+ * Write the entries of directory d, each directory followed by its contents
+ *
+ * @param d Directory to export
+ * @param path Archive path of d ("" for the top, otherwise ending in '/')
+ * @return 0 on success; -1 if something was left out
+ */
+int export_directory(INODE_REFERENCE d, char *path){
+  int ret = 0;
+  INODE *inode = oufs_image_inode(&image, d);
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    BLOCK_REFERENCE b = inode->data[k];
+    if(b == UNALLOCATED_BLOCK || b >= N_BLOCKS_IN_DISK)
+      continue;
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+      DIRECTORY_ENTRY *entry = &image.block[b].directory.entry[j];
+      INODE_REFERENCE c = entry->inode_reference;
+      if(c == UNALLOCATED_INODE || !strncmp(entry->name, ".", FILE_NAME_SIZE)
+         || !strncmp(entry->name, "..", FILE_NAME_SIZE))
+        continue;
+
+      char child_path[MAX_TAR_PATH];
+      snprintf(child_path, sizeof(child_path), "%s%.*s", path, (int) FILE_NAME_SIZE, entry->name);
+      if(c >= N_INODES || visited[c]){
+        fprintf(stderr, "ERROR: %s: bad inode %d, skipped\n", child_path, c);
+        ret = -1;
+        continue;
+      }
+      visited[c] = 1;
+
+      INODE *child = oufs_image_inode(&image, c);
+      if(child->type == IT_DIRECTORY){
+        strcat(child_path, "/");
+        if(write_header(child_path, TAR_TYPE_DIRECTORY, 0) != 0 || export_directory(c, child_path) != 0)
+          ret = -1;
+      }
+      else if(child->type == IT_FILE){
+        unsigned int size = MIN(child->size, BLOCKS_PER_INODE * BLOCK_SIZE);
+        if(write_header(child_path, TAR_TYPE_FILE, size) != 0){
+          ret = -1;
+          continue;
+        }
+        //File data, padded to whole records
+        for(unsigned int done = 0; done < size; done += BLOCK_SIZE){
+          BLOCK_REFERENCE fb = child->data[done / BLOCK_SIZE];
+          static BLOCK zero_block;
+          BLOCK *data = fb < N_BLOCKS_IN_DISK ? &image.block[fb] : &zero_block;
+          fwrite(data, 1, MIN(BLOCK_SIZE, size - done), stdout);
+        }
+        static char zeros[TAR_BLOCK_SIZE];
+        fwrite(zeros, 1, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE, stdout);
+      }
+    }
+  }
+  return ret;
+}
+
+/**
+ * Write one ustar header
+ *
+ * @return 0 on success; -1 if the path does not fit in a header
+ */
+int write_header(char *path, char type, unsigned int size){
+  TAR_HEADER header;
+  memset(&header, 0, sizeof(header));
+
+  //Long paths are split at a '/' into prefix and name
+  size_t len = strlen(path);
+  if(len <= sizeof(header.name)){
+    memcpy(header.name, path, len);
+  }
+  else{
+    char *split = path + len - sizeof(header.name) - 1;
+    while(*split != 0 && *split != '/')
+      ++split;
+    if(*split == 0 || split == path + len - 1 || split - path > (long) sizeof(header.prefix)){
+      fprintf(stderr, "ERROR: %s: path too long, skipped\n", path);
+      return -1;
+    }
+    memcpy(header.prefix, path, split - path);
+    memcpy(header.name, split + 1, len - (split - path) - 1);
+  }
+
+  snprintf(header.mode, sizeof(header.mode), "%07o", type == TAR_TYPE_DIRECTORY ? 0755 : 0644);
+  snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+  snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+  snprintf(header.size, sizeof(header.size), "%011o", size);
+  snprintf(header.mtime, sizeof(header.mtime), "%011o", 0);
+  header.type = type;
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", tar_checksum(&header));
+  header.checksum[7] = ' ';
+
+  fwrite(&header, 1, sizeof(header), stdout);
+  return 0;
+}
@@ -11,7 +11,8 @@ int main(int argc, char** argv){
   oufs_get_environment(cwd, diskName);
 
   //Opens the disk for reading
-  vdisk_disk_open(diskName);
+  if(oufs_mount(diskName) != 0)
+    return -1;
 
   //If an argument is provided, list the directories in there
   if(argc == 2)
@@ -24,7 +25,7 @@ int main(int argc, char** argv){
     fprintf(stderr, "ERROR: zfilez only accepts one argument\n");
 
   //Closes the disk after all work is done
-  vdisk_disk_close();
+  oufs_unmount();
 
 
   return 0;
@@ -0,0 +1,126 @@
+/**
+Find files and directories in the OU File System.
+
+Usage: zfind [path] [-name <pattern>] [-type d|f] [-threads N]
+
+Prints the path of every file and directory under path (default: the
+current directory), path itself included, whose name matches the shell
+pattern (fnmatch(3)) and whose type is the one given.  The tree is walked
+by a pool of threads (oufs_walk()); the paths are printed sorted.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+typedef struct find_s
+{
+  char *pattern;
+  char type;
+  // Paths found so far
+  pthread_mutex_t mutex;
+  char **paths;
+  int n_paths;
+  int capacity;
+  int failed;
+} FIND;
+
+// Functions used later on
+void find_visit(OUFS_WALK_ENTRY *entry, void *arg);
+int compare_paths(const void *p, const void *q);
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  FIND find;
+  memset(&find, 0, sizeof(find));
+  pthread_mutex_init(&find.mutex, NULL);
+  char *path = "";
+  int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int usage = 0;
+  for(int i = 1; i < argc && !usage; ++i){
+    if(!strcmp(argv[i], "-name") && i + 1 < argc){
+      find.pattern = argv[++i];
+    }
+    else if(!strcmp(argv[i], "-type") && i + 1 < argc){
+      ++i;
+      if(!strcmp(argv[i], "d"))
+        find.type = IT_DIRECTORY;
+      else if(!strcmp(argv[i], "f"))
+        find.type = IT_FILE;
+      else
+        usage = 1;
+    }
+    else if(!strcmp(argv[i], "-threads") && i + 1 < argc){
+      n_threads = atoi(argv[++i]);
+    }
+    else if(argv[i][0] != '-' && i == 1){
+      path = argv[i];
+    }
+    else{
+      usage = 1;
+    }
+  }
+  if(usage){
+    fprintf(stderr, "Usage: zfind [path] [-name <pattern>] [-type d|f] [-threads N]\n");
+    return -1;
+  }
+
+  if(oufs_mount(disk_name) != 0)
+    return -1;
+  int ret = oufs_walk(cwd, path, n_threads, find_visit, &find);
+  oufs_unmount();
+  if(find.failed){
+    fprintf(stderr, "ERROR: out of memory\n");
+    ret = -1;
+  }
+
+  qsort(find.paths, find.n_paths, sizeof(char *), compare_paths);
+  for(int i = 0; i < find.n_paths; ++i){
+    printf("%s\n", find.paths[i]);
+    free(find.paths[i]);
+  }
+  free(find.paths);
+  return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Keep the path of an entry that passes the filters
+ */
+void find_visit(OUFS_WALK_ENTRY *entry, void *arg){
+  FIND *find = arg;
+  if(find->type && entry->inode.type != find->type)
+    return;
+  if(find->pattern != NULL && fnmatch(find->pattern, entry->name, 0) != 0)
+    return;
+
+  pthread_mutex_lock(&find->mutex);
+  if(find->n_paths == find->capacity){
+    int capacity = find->capacity ? 2 * find->capacity : 64;
+    char **paths = realloc(find->paths, capacity * sizeof(char *));
+    if(paths == NULL){
+      find->failed = 1;
+      pthread_mutex_unlock(&find->mutex);
+      return;
+    }
+    find->paths = paths;
+    find->capacity = capacity;
+  }
+  if((find->paths[find->n_paths] = strdup(entry->path)) != NULL)
+    ++find->n_paths;
+  else
+    find->failed = 1;
+  pthread_mutex_unlock(&find->mutex);
+}
+
+int compare_paths(const void *p, const void *q){
+  return strcmp(*(char * const *) p, *(char * const *) q);
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "oufs_lib.h"
@@ -6,19 +7,58 @@
 
 //Don't want to make a new header file because all of these functions are only used here
 //Functions used later on
-int initialize_disk();
-int initalize_master_block();
+int initialize_disk(char *disk_name, int features, int n_blocks);
+int initalize_master_block(int n_blocks);
 int initialize_first_inode();
 int initialize_first_directory();
 
 int main(int argc, char** argv){
+  //The disk named by ZDISK is formatted
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  //Options select a block store container instead of a plain image, and
+  //a smaller disk that zresize can grow later
+  int features = 0;
+  int n_blocks = N_BLOCKS_IN_DISK;
+  for(int i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-snapshots")){
+      features |= VDISK_FEATURE_SNAPSHOTS;
+    }
+    else if(!strcmp(argv[i], "-dedup")){
+      features |= VDISK_FEATURE_DEDUP;
+    }
+    else if(!strcmp(argv[i], "-compress")){
+      features |= VDISK_FEATURE_COMPRESS;
+    }
+    else if(!strcmp(argv[i], "-checksum")){
+      features |= VDISK_FEATURE_CHECKSUM;
+    }
+    else if(!strcmp(argv[i], "-log")){
+      features |= VDISK_FEATURE_LOG;
+    }
+    else if(!strcmp(argv[i], "-size") && i + 1 < argc){
+      n_blocks = atoi(argv[++i]);
+      if(n_blocks <= ROOT_DIRECTORY_BLOCK || n_blocks > N_BLOCKS_IN_DISK){
+        fprintf(stderr, "ERROR: size must be between %d and %d blocks\n", ROOT_DIRECTORY_BLOCK + 1, N_BLOCKS_IN_DISK);
+        return -1;
+      }
+    }
+    else{
+      fprintf(stderr, "Usage: zformat [-snapshots] [-dedup] [-compress] [-checksum] [-log] [-size n_blocks]\n");
+      return -1;
+    }
+  }
+
   //Write 0s to all bytes in virtual disk
-  if(initialize_disk() == -1){
-    fprintf(stderr, "ERROR WRITING 0s TO DISK");
+  if(initialize_disk(disk_name, features, n_blocks) == -1){
+    fprintf(stderr, "ERROR WRITING 0s TO DISK\n");
+    return -1;
   }
 
   //Marks master block, all inode blocks, and the first data block as allocated
-  if(initalize_master_block() == -1){
+  if(initalize_master_block(n_blocks) == -1){
     fprintf(stderr, "ERROR INITIALIZING MASTER BLOCK");
   }
 
@@ -31,16 +71,19 @@ int main(int argc, char** argv){
   if(initialize_first_directory() == -1){
     fprintf(stderr, "ERROR CREATING FIRST DATA BLOCK");
   }
+
+  //Flushes the disk (block stores keep their tables in memory until now)
+  vdisk_disk_close();
 }
 
-int initialize_disk(){
+int initialize_disk(char *disk_name, int features, int n_blocks){
 
-    // Creates a virtual disk with name 'vdisk1'
-    if(vdisk_disk_open("vdisk1") != 0)
+    // Creates a virtual disk with name 'vdisk1' (or $ZDISK)
+    if(vdisk_disk_create(disk_name, features) != 0)
       return -1;
 
     // Steps through all bytes in disk and sets to 0
-    for(int num_block = 0; num_block < N_BLOCKS_IN_DISK; ++num_block){ //Steps through each block
+    for(int num_block = 0; num_block < n_blocks; ++num_block){ //Steps through each block of the disk
       BLOCK block;
       for(int byte = 0; byte < BLOCK_SIZE; ++byte){ //Steps through each byte in the block
         block.data.data[byte] = 0; //Sets the byte to 0
@@ -52,13 +95,17 @@ int initialize_disk(){
   return 0;
 }
 
-int initalize_master_block(){
+int initalize_master_block(int n_blocks){
       BLOCK masterBlock;
+      memset(&masterBlock, 0, sizeof(masterBlock));
       for(int i = 0; i <= N_INODE_BLOCKS + 1; ++i){ // Steps through master block, inode blocks, and first data block
         //https://stackoverflow.com/questions/6848617/memory-efficient-flag-array-in-c
         masterBlock.master.block_allocated_flag[i/8] |= (1 << (i % 8)); //Marks corresponding bits as allocated
       }
       masterBlock.master.inode_allocated_flag[0] |= (1 << (0)); //Marks first inode as allocated
+      oufs_set_geometry(&masterBlock.master); //Records the geometry of this build
+      if(n_blocks < N_BLOCKS_IN_DISK) //A smaller disk reserves the blocks and inodes past its end
+        oufs_set_disk_size(&masterBlock.master, n_blocks, oufs_inodes_for_blocks(n_blocks));
       if(vdisk_write_block(0, &masterBlock) != 0){ //Writes the block to the disk
         return -1;
       }
@@ -78,6 +125,7 @@ int initialize_first_inode(){
     firstInode.size = 2; //Size of this inode is 2, for '.' and '..'
 
     BLOCK firstInodeBlock;
+    memset(&firstInodeBlock, 0, sizeof(firstInodeBlock)); //The other inodes of the block are free
     firstInodeBlock.inodes.inode[0] = firstInode; //Assigns this inode to an inode block
 
     if(vdisk_write_block(1, &firstInodeBlock) != 0){ //Writes the inode block to block 1, the first block after master
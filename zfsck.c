@@ -0,0 +1,717 @@
+/**
+Check the consistency of an OU File System disk, and optionally repair it.
+
+Usage: zfsck [-repair] [-threads N]
+
+The whole disk is loaded with a few large sequential reads.  The inode
+table is then checked in parallel, after which the directory tree is
+walked from the root and the allocation tables in the master block are
+compared against what the inodes actually use.
+
+Each defect is reported (and counted) once.  With -repair, inodes that
+are in use but not reachable from the root are linked into /lost+found
+(created if need be) as "#<inode>", with everything below them; if that
+is not possible they are left as they are.  Nothing in use is freed.
+
+Exit status: 0 = no problems, 1 = problems found and all repaired,
+4 = problems left unrepaired, 8 = the check could not run
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+
+// Blocks loaded per read
+#define READ_CHUNK_BLOCKS 64
+
+#define MAX_THREADS 16
+
+// In-memory copy of the disk and the blocks changed by repairs
+static BLOCK image[N_BLOCKS_IN_DISK];
+static unsigned char dirty[N_BLOCKS_IN_DISK];
+
+// Findings of the parallel inode pass
+typedef struct inode_report_s
+{
+  // Type is IT_DIRECTORY or IT_FILE
+  int in_use;
+  // Type is not a known inode type
+  int bad_type;
+} INODE_REPORT;
+
+static INODE_REPORT report[N_INODES];
+
+// Lowest inode referencing each block; N_INODES if none.  Updated
+// atomically by the inode threads.
+static int block_owner[N_BLOCKS_IN_DISK];
+
+// Blocks and inodes in use by the disk (see zresize)
+static int n_disk_blocks = N_BLOCKS_IN_DISK;
+static int n_disk_inodes = N_INODES;
+
+// Tree walk: directories still to check, and for each inode whether it
+// has been reached, how many entries link it, and whether it was found
+// unreachable (its reference count is then not checked)
+static int queue[N_INODES];
+static int queue_head = 0;
+static int queue_tail = 0;
+static int visited[N_INODES];
+static int n_links[N_INODES];
+static int orphan[N_INODES];
+
+// Inode of /lost+found; -1 if there is none (yet)
+static int lost_found = -1;
+
+static int repair = 0;
+static int n_problems = 0;
+static int n_repaired = 0;
+
+// Functions used later on
+int load_image();
+void *check_inode_range(void *arg);
+void check_block_references();
+void check_tree();
+void check_allocation_tables();
+int write_repairs();
+
+typedef struct inode_range_s
+{
+  int first;
+  int last;
+} INODE_RANGE;
+
+/**
+ * Inode i inside the in-memory image
+ */
+static INODE *image_inode(int i)
+{
+  return(&image[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK]);
+}
+
+/**
+ * Mark the block holding inode i as changed
+ */
+static void inode_changed(int i)
+{
+  dirty[i / INODES_PER_BLOCK + 1] = 1;
+}
+
+/**
+ * Block k of inode i if it can be read from the image; UNALLOCATED_BLOCK
+ * if unset or out of range (reported by check_block_references())
+ */
+static BLOCK_REFERENCE inode_block(INODE *inode, int k)
+{
+  BLOCK_REFERENCE b = inode->data[k];
+  if(b < ROOT_DIRECTORY_BLOCK || b >= n_disk_blocks)
+    return(UNALLOCATED_BLOCK);
+  return(b);
+}
+
+/**
+ * Whether a directory entry refers to an inode that is in use
+ */
+static int entry_in_use(DIRECTORY_ENTRY *entry)
+{
+  return(entry->inode_reference < N_INODES && report[entry->inode_reference].in_use);
+}
+
+/**
+ * Report a problem, and whether it was repaired
+ */
+static void problem(int repaired, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void problem(int repaired, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf(repaired ? " (repaired)\n" : "\n");
+  ++n_problems;
+  if(repaired)
+    ++n_repaired;
+}
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  for(int i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-repair")){
+      repair = 1;
+    }
+    else if(!strcmp(argv[i], "-threads") && i + 1 < argc){
+      n_threads = atoi(argv[++i]);
+    }
+    else{
+      fprintf(stderr, "Usage: zfsck [-repair] [-threads N]\n");
+      return 8;
+    }
+  }
+  if(n_threads < 1)
+    n_threads = 1;
+  if(n_threads > MAX_THREADS)
+    n_threads = MAX_THREADS;
+  if(n_threads > N_INODES)
+    n_threads = N_INODES;
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return 8;
+  //Other processes wait until the check (and any repair) is done
+  if(vdisk_lock_disk() != 0 || load_image() != 0){
+    fprintf(stderr, "ERROR: unable to read disk\n");
+    vdisk_disk_close();
+    return 8;
+  }
+
+  //A disk of another geometry would be "repaired" into garbage
+  if(oufs_check_geometry(&image[MASTER_BLOCK_REFERENCE].master) != 0){
+    vdisk_disk_close();
+    return 8;
+  }
+  n_disk_blocks = oufs_disk_blocks(&image[MASTER_BLOCK_REFERENCE].master);
+  n_disk_inodes = oufs_disk_inodes(&image[MASTER_BLOCK_REFERENCE].master);
+
+  //Check the inode table in parallel: each thread takes a slice
+  for(int i = 0; i < N_BLOCKS_IN_DISK; ++i)
+    block_owner[i] = N_INODES;
+  pthread_t threads[MAX_THREADS];
+  INODE_RANGE ranges[MAX_THREADS];
+  for(int t = 0; t < n_threads; ++t){
+    ranges[t].first = t * N_INODES / n_threads;
+    ranges[t].last = (t + 1) * N_INODES / n_threads;
+    pthread_create(&threads[t], NULL, check_inode_range, &ranges[t]);
+  }
+  for(int t = 0; t < n_threads; ++t)
+    pthread_join(threads[t], NULL);
+
+  check_block_references();
+  check_tree();
+  check_allocation_tables();
+
+  if(repair && write_repairs() != 0){
+    fprintf(stderr, "ERROR: unable to write repairs\n");
+    vdisk_disk_close();
+    return 8;
+  }
+  vdisk_disk_close();
+
+  printf("%d problems found, %d repaired\n", n_problems, n_repaired);
+  if(n_problems == 0)
+    return 0;
+  return n_problems == n_repaired ? 1 : 4;
+}
+
+/**
+ * Load the whole disk with large sequential reads
+ */
+int load_image(){
+  for(int first = 0; first < N_BLOCKS_IN_DISK; first += READ_CHUNK_BLOCKS){
+    int count = MIN(READ_CHUNK_BLOCKS, N_BLOCKS_IN_DISK - first);
+    if(vdisk_read_blocks(first, count, &image[first]) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * Record that inode i references block b, keeping the lowest inode
+ */
+static void claim_block(int b, int i){
+  int owner = __atomic_load_n(&block_owner[b], __ATOMIC_RELAXED);
+  while(i < owner
+        && !__atomic_compare_exchange_n(&block_owner[b], &owner, i, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * Thread body: classify a slice of the inode table and claim the blocks
+ * its inodes reference
+ */
+void *check_inode_range(void *arg){
+  INODE_RANGE *range = arg;
+  for(int i = range->first; i < range->last; ++i){
+    INODE *inode = image_inode(i);
+    report[i].in_use = (inode->type == IT_DIRECTORY || inode->type == IT_FILE);
+    //zrmdir leaves a type of 0 behind
+    report[i].bad_type = !report[i].in_use && inode->type != IT_NONE && inode->type != 0;
+    if(!report[i].in_use)
+      continue;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode->data[k];
+      if(b != UNALLOCATED_BLOCK && b >= ROOT_DIRECTORY_BLOCK && b < n_disk_blocks)
+        claim_block(b, i);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Drop block references that are out of range or already owned by a
+ * lower inode
+ */
+void check_block_references(){
+  for(int i = 0; i < N_INODES; ++i){
+    if(report[i].bad_type){
+      INODE *inode = image_inode(i);
+      problem(repair, "Inode %d: unknown type 0x%02x", i, (unsigned char) inode->type);
+      if(repair){
+        inode->type = 0;
+        inode->size = 0;
+        inode_changed(i);
+      }
+    }
+    if(!report[i].in_use)
+      continue;
+
+    INODE *inode = image_inode(i);
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode->data[k];
+      if(b == UNALLOCATED_BLOCK)
+        continue;
+      if(b < ROOT_DIRECTORY_BLOCK || b >= n_disk_blocks){
+        problem(repair, "Inode %d: block %d out of range", i, b);
+      }
+      else if(block_owner[b] != i){
+        problem(repair, "Inode %d: block %d also used by inode %d", i, b, block_owner[b]);
+      }
+      else{
+        continue;
+      }
+      if(repair){
+        inode->data[k] = UNALLOCATED_BLOCK;
+        inode_changed(i);
+      }
+    }
+  }
+}
+
+/**
+ * Count the allocated entries of a directory and clean up entries that
+ * point at inodes that are not in use
+ *
+ * @param n_dropped Incremented for each entry cleaned up (or, without
+ *        -repair, that would be)
+ */
+static int check_directory_entries(int d, int *n_dropped){
+  INODE *inode = image_inode(d);
+  int n_entries = 0;
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    BLOCK_REFERENCE b = inode_block(inode, k);
+    if(b == UNALLOCATED_BLOCK)
+      continue;
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+      DIRECTORY_ENTRY *entry = &image[b].directory.entry[j];
+      if(entry->inode_reference == UNALLOCATED_INODE)
+        continue;
+      if(!entry_in_use(entry)){
+        problem(repair, "Directory %d: entry \"%.*s\" refers to unused inode %d",
+                d, (int) FILE_NAME_SIZE, entry->name, entry->inode_reference);
+        if(repair){
+          oufs_clean_directory_entry(entry);
+          dirty[b] = 1;
+        }
+        ++*n_dropped;
+        continue;
+      }
+      ++n_entries;
+    }
+  }
+  return n_entries;
+}
+
+/**
+ * Mark inode i and block b allocated in the master block; b < 0 for none
+ */
+static void mark_allocated(int i, int b){
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  if(i >= 0)
+    master->inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+  if(b >= 0)
+    master->block_allocated_flag[b >> 3] |= (1 << (b & 7));
+  dirty[MASTER_BLOCK_REFERENCE] = 1;
+}
+
+/**
+ * Lowest block that no inode references; -1 if the disk is full
+ */
+static int free_block(){
+  for(int b = ROOT_DIRECTORY_BLOCK; b < n_disk_blocks; ++b){
+    if(block_owner[b] == N_INODES)
+      return(b);
+  }
+  return(-1);
+}
+
+/**
+ * Add an entry to directory d, giving it another block if it is full
+ *
+ * @return 0 on success; -1 if there is no room
+ */
+static int add_entry(int d, const char *name, int c){
+  INODE *inode = image_inode(d);
+  DIRECTORY_ENTRY *entry = NULL;
+  BLOCK_REFERENCE b = UNALLOCATED_BLOCK;
+  for(int k = 0; k < BLOCKS_PER_INODE && !entry; ++k){
+    b = inode_block(inode, k);
+    if(b == UNALLOCATED_BLOCK)
+      continue;
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK && !entry; ++j){
+      if(image[b].directory.entry[j].inode_reference == UNALLOCATED_INODE)
+        entry = &image[b].directory.entry[j];
+    }
+  }
+  for(int k = 0; k < BLOCKS_PER_INODE && !entry; ++k){
+    if(inode->data[k] != UNALLOCATED_BLOCK)
+      continue;
+    int nb = free_block();
+    if(nb < 0)
+      return(-1);
+    b = nb;
+    block_owner[b] = d;
+    mark_allocated(-1, b);
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+      oufs_clean_directory_entry(&image[b].directory.entry[j]);
+    inode->data[k] = b;
+    entry = &image[b].directory.entry[0];
+  }
+  if(!entry)
+    return(-1);
+
+  strncpy(entry->name, name, FILE_NAME_SIZE);
+  entry->inode_reference = c;
+  dirty[b] = 1;
+  ++inode->size;
+  inode_changed(d);
+  return(0);
+}
+
+/**
+ * Directory entry of d with the given name; NULL if there is none
+ *
+ * @param block Set to the block holding the entry, if not NULL
+ */
+static DIRECTORY_ENTRY *find_entry(int d, const char *name, BLOCK_REFERENCE *block){
+  INODE *inode = image_inode(d);
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+    BLOCK_REFERENCE b = inode_block(inode, k);
+    if(b == UNALLOCATED_BLOCK)
+      continue;
+    for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+      DIRECTORY_ENTRY *entry = &image[b].directory.entry[j];
+      if(entry->inode_reference != UNALLOCATED_INODE && !strncmp(entry->name, name, FILE_NAME_SIZE)){
+        if(block)
+          *block = b;
+        return(entry);
+      }
+    }
+  }
+  return(NULL);
+}
+
+/**
+ * Find /lost+found, creating it if there is none
+ *
+ * @return Its inode; -1 if it cannot be created
+ */
+static int get_lost_found(){
+  if(lost_found >= 0)
+    return(lost_found);
+
+  DIRECTORY_ENTRY *entry = find_entry(0, "lost+found", NULL);
+  if(entry){
+    int c = entry->inode_reference;
+    if(entry_in_use(entry) && visited[c] && image_inode(c)->type == IT_DIRECTORY)
+      lost_found = c;
+    return(lost_found);
+  }
+
+  int i = 1;
+  while(i < n_disk_inodes && report[i].in_use)
+    ++i;
+  int b = free_block();
+  if(i >= n_disk_inodes || b < 0)
+    return(-1);
+  //Claimed first so the root cannot take it for a new block
+  block_owner[b] = i;
+  if(add_entry(0, "lost+found", i) != 0){
+    block_owner[b] = N_INODES;
+    return(-1);
+  }
+
+  INODE *inode = image_inode(i);
+  inode->type = IT_DIRECTORY;
+  inode->n_references = 1;
+  inode->data[0] = b;
+  for(int k = 1; k < BLOCKS_PER_INODE; ++k)
+    inode->data[k] = UNALLOCATED_BLOCK;
+  inode->size = 2;
+  inode_changed(i);
+  oufs_clean_directory_block(i, 0, &image[b]);
+  dirty[b] = 1;
+  report[i].in_use = 1;
+  mark_allocated(i, b);
+  visited[i] = 1;
+  n_links[i] = 1;
+  lost_found = i;
+  return(lost_found);
+}
+
+/**
+ * Link an unreachable inode into /lost+found as "#<inode>"
+ *
+ * @param name Set to the name it was given (FILE_NAME_SIZE + 1 bytes)
+ * @return 0 on success; -1 if there is no room
+ */
+static int link_lost(int i, char *name){
+  int lf = get_lost_found();
+  if(lf < 0)
+    return(-1);
+
+  snprintf(name, FILE_NAME_SIZE + 1, "#%d", i);
+  for(int k = 1; find_entry(lf, name, NULL); ++k)
+    snprintf(name, FILE_NAME_SIZE + 1, "#%d.%d", i, k);
+  if(add_entry(lf, name, i) != 0)
+    return(-1);
+
+  BLOCK_REFERENCE b;
+  DIRECTORY_ENTRY *dotdot;
+  if(image_inode(i)->type == IT_DIRECTORY && (dotdot = find_entry(i, "..", &b))){
+    dotdot->inode_reference = lf;
+    dirty[b] = 1;
+  }
+  ++n_links[i];
+  return(0);
+}
+
+/**
+ * Check every directory in the queue and queue the subdirectories they
+ * reach: each must be reachable exactly once, with correct . and ..
+ * entries, size and reference count
+ */
+static void walk(){
+  while(queue_head < queue_tail){
+    int d = queue[queue_head++];
+    INODE *inode = image_inode(d);
+    int n_dropped = 0;
+    int n_entries = check_directory_entries(d, &n_dropped);
+
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode_block(inode, k);
+      if(b == UNALLOCATED_BLOCK)
+        continue;
+      for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+        DIRECTORY_ENTRY *entry = &image[b].directory.entry[j];
+        int c = entry->inode_reference;
+        //Entries to unused inodes were reported by check_directory_entries()
+        if(c == UNALLOCATED_INODE || !entry_in_use(entry))
+          continue;
+
+        if(!strncmp(entry->name, ".", FILE_NAME_SIZE)){
+          if(c != d){
+            problem(repair, "Directory %d: \".\" refers to inode %d", d, c);
+            if(repair){
+              entry->inode_reference = d;
+              dirty[b] = 1;
+            }
+          }
+          continue;
+        }
+        if(!strncmp(entry->name, "..", FILE_NAME_SIZE))
+          continue;
+
+        if(visited[c]){
+          problem(repair, "Directory %d: entry \"%.*s\" links inode %d a second time",
+                  d, (int) FILE_NAME_SIZE, entry->name, c);
+          if(repair){
+            oufs_clean_directory_entry(entry);
+            dirty[b] = 1;
+          }
+          --n_entries;
+          ++n_dropped;
+          continue;
+        }
+        visited[c] = 1;
+        ++n_links[c];
+
+        //A subdirectory's .. must lead back here
+        if(image_inode(c)->type == IT_DIRECTORY){
+          INODE *child = image_inode(c);
+          for(int kk = 0; kk < BLOCKS_PER_INODE; ++kk){
+            BLOCK_REFERENCE cb = inode_block(child, kk);
+            if(cb == UNALLOCATED_BLOCK)
+              continue;
+            for(int jj = 0; jj < DIRECTORY_ENTRIES_PER_BLOCK; ++jj){
+              DIRECTORY_ENTRY *dotdot = &image[cb].directory.entry[jj];
+              if(dotdot->inode_reference != UNALLOCATED_INODE
+                 && !strncmp(dotdot->name, "..", FILE_NAME_SIZE) && dotdot->inode_reference != d){
+                problem(repair, "Directory %d: \"..\" refers to inode %d instead of %d",
+                        c, dotdot->inode_reference, d);
+                if(repair){
+                  dotdot->inode_reference = d;
+                  dirty[cb] = 1;
+                }
+              }
+            }
+          }
+          queue[queue_tail++] = c;
+        }
+      }
+    }
+
+    //Entries dropped above account for their part of the size
+    if(inode->size != (unsigned int) (n_entries + n_dropped))
+      problem(repair, "Directory %d: size is %d but it has %d entries", d, inode->size, n_entries + n_dropped);
+    if(repair && inode->size != (unsigned int) n_entries){
+      inode->size = n_entries;
+      inode_changed(d);
+    }
+  }
+}
+
+/**
+ * The unreachable inode to deal with next: the lowest one that no other
+ * unreachable directory links, so a lost subtree is handled from its top;
+ * the lowest of a cycle otherwise.  -1 if every inode in use is reachable
+ */
+static int next_orphan(){
+  int linked[N_INODES];
+  memset(linked, 0, sizeof(linked));
+  int first = -1;
+  for(int d = 1; d < N_INODES; ++d){
+    if(!report[d].in_use || visited[d])
+      continue;
+    if(first < 0)
+      first = d;
+    if(image_inode(d)->type != IT_DIRECTORY)
+      continue;
+    INODE *inode = image_inode(d);
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode_block(inode, k);
+      if(b == UNALLOCATED_BLOCK)
+        continue;
+      for(int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j){
+        DIRECTORY_ENTRY *entry = &image[b].directory.entry[j];
+        if(entry->inode_reference != UNALLOCATED_INODE && entry_in_use(entry)
+           && entry->inode_reference != d
+           && strncmp(entry->name, ".", FILE_NAME_SIZE) && strncmp(entry->name, "..", FILE_NAME_SIZE))
+          linked[entry->inode_reference] = 1;
+      }
+    }
+  }
+  for(int i = 1; i < N_INODES; ++i){
+    if(report[i].in_use && !visited[i] && !linked[i])
+      return(i);
+  }
+  return(first);
+}
+
+/**
+ * Walk the tree from the root, then deal with whatever it did not reach:
+ * each unreachable subtree is one problem, linked into /lost+found on
+ * repair and otherwise left in place (but still checked)
+ */
+void check_tree(){
+  if(!report[0].in_use || image_inode(0)->type != IT_DIRECTORY){
+    problem(0, "Root inode is not a directory");
+    return;
+  }
+
+  queue[queue_tail++] = 0;
+  visited[0] = 1;
+  walk();
+
+  for(int i = next_orphan(); i >= 0; i = next_orphan()){
+    char name[FILE_NAME_SIZE + 1];
+    int linked = repair && link_lost(i, name) == 0;
+    problem(linked, "Inode %d is in use but not reachable from the root%s%s",
+            i, linked ? "; linked as /lost+found/" : "", linked ? name : "");
+    if(!linked)
+      orphan[i] = 1;
+    visited[i] = 1;
+    if(image_inode(i)->type == IT_DIRECTORY)
+      queue[queue_tail++] = i;
+    walk();
+  }
+
+  //The root has no parent entry; everything else is linked once
+  for(int i = 1; i < N_INODES; ++i){
+    if(!report[i].in_use || orphan[i])
+      continue;
+    INODE *inode = image_inode(i);
+    if(inode->n_references != n_links[i]){
+      problem(repair, "Inode %d: reference count is %d but it has %d links", i, inode->n_references, n_links[i]);
+      if(repair){
+        inode->n_references = n_links[i];
+        inode_changed(i);
+      }
+    }
+  }
+}
+
+/**
+ * Rebuild the allocation tables from the inodes and compare them with the
+ * master block
+ */
+void check_allocation_tables(){
+  MASTER_BLOCK expected;
+  memset(&expected, 0, sizeof(expected));
+
+  //Inodes past the end of a smaller disk are reserved
+  for(int i = 0; i < N_INODES; ++i){
+    if(report[i].in_use || i >= n_disk_inodes)
+      expected.inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+  }
+  //Master block and inode blocks are always allocated
+  for(int b = 0; b < ROOT_DIRECTORY_BLOCK; ++b)
+    expected.block_allocated_flag[b >> 3] |= (1 << (b & 7));
+  for(int b = ROOT_DIRECTORY_BLOCK; b < N_BLOCKS_IN_DISK; ++b){
+    //Blocks past the end of a shrunk disk are reserved
+    if(block_owner[b] < N_INODES || b >= n_disk_blocks)
+      expected.block_allocated_flag[b >> 3] |= (1 << (b & 7));
+  }
+
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  expected.n_blocks = master->n_blocks;
+  expected.n_inodes = master->n_inodes;
+  for(int i = 0; i < N_INODES; ++i){
+    int want = (expected.inode_allocated_flag[i >> 3] >> (i & 7)) & 1;
+    int have = (master->inode_allocated_flag[i >> 3] >> (i & 7)) & 1;
+    if(want != have)
+      problem(repair, "Inode %d is %s but marked %s", i, want ? "in use" : "free", have ? "allocated" : "free");
+  }
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b){
+    int want = (expected.block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+    int have = (master->block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+    if(want != have)
+      problem(repair, "Block %d is %s but marked %s", b, want ? "in use" : "free", have ? "allocated" : "free");
+  }
+
+  if(repair && memcmp(master, &expected, sizeof(expected)) != 0){
+    memcpy(master, &expected, sizeof(expected));
+    dirty[MASTER_BLOCK_REFERENCE] = 1;
+  }
+}
+
+/**
+ * Write every repaired block in one transaction
+ */
+int write_repairs(){
+  if(vdisk_begin_transaction() != 0)
+    return -1;
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b){
+    if(dirty[b] && vdisk_write_block(b, &image[b]) != 0){
+      vdisk_abort_transaction();
+      return -1;
+    }
+  }
+  return vdisk_commit_transaction();
+}
@@ -0,0 +1,227 @@
+/**
+Read a tar archive from stdin into a directory of the disk.
+
+Usage: zimport [path]
+
+Directories and regular files of the archive are created inside path
+(default: the current directory); missing parent directories are created
+as well.  The disk is loaded into memory, every file gets one contiguous
+run of blocks, and all changed blocks are written in one transaction at
+the end: if the disk fills up nothing is written.
+
+The input is checked as it is read.  A record that is not a ustar header
+(magic, checksum or size), input that is not an archive at all, or an
+archive cut short (inside a header or an entry, or before the all-zero
+record that ends it) stops the import with an error and nothing written.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "oufs_image.h"
+#include "oufs_tar.h"
+
+static OUFS_IMAGE image;
+
+// Functions used later on
+int import_entry(INODE_REFERENCE top, TAR_HEADER *header, unsigned long size);
+int skip_data(unsigned long size);
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc > 2){
+    fprintf(stderr, "Usage: zimport [path] < archive.tar\n");
+    return -1;
+  }
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return -1;
+  if(oufs_image_load(&image) != 0){
+    fprintf(stderr, "ERROR: unable to read disk\n");
+    vdisk_disk_close();
+    return -1;
+  }
+
+  INODE_REFERENCE top = oufs_image_resolve(&image, cwd, argc == 2 ? argv[1] : ".");
+  if(top == UNALLOCATED_INODE || oufs_image_inode(&image, top)->type != IT_DIRECTORY){
+    fprintf(stderr, "ERROR: not a directory\n");
+    vdisk_disk_close();
+    return -1;
+  }
+
+  static char buffer[64 * TAR_BLOCK_SIZE];
+  setvbuf(stdin, buffer, _IOFBF, sizeof(buffer));
+
+  int skipped = 0;
+  int n_headers = 0;
+  int ended = 0;
+  size_t n_read;
+  TAR_HEADER header;
+  while((n_read = fread(&header, 1, sizeof(header), stdin)) == sizeof(header)){
+    //An empty record ends the archive
+    if(tar_is_end(&header)){
+      ended = 1;
+      break;
+    }
+
+    unsigned long checksum;
+    unsigned long size;
+    if(memcmp(header.magic, "ustar", 5) != 0
+       || tar_octal(header.checksum, sizeof(header.checksum), &checksum) != 0 || checksum != tar_checksum(&header)
+       || tar_octal(header.size, sizeof(header.size), &size) != 0){
+      if(n_headers == 0)
+        fprintf(stderr, "ERROR: the input is not a tar archive\n");
+      else
+        fprintf(stderr, "ERROR: bad tar header after %d %s\n", n_headers, n_headers == 1 ? "entry" : "entries");
+      vdisk_disk_close();
+      return -1;
+    }
+    ++n_headers;
+
+    int ret = import_entry(top, &header, size);
+    if(ret == -2){
+      //Leave the disk untouched
+      vdisk_disk_close();
+      return -1;
+    }
+    if(ret != 0)
+      ++skipped;
+  }
+  if(!ended){
+    if(n_headers == 0 && n_read == 0)
+      fprintf(stderr, "ERROR: the input is empty, not a tar archive\n");
+    else if(n_headers == 0)
+      fprintf(stderr, "ERROR: the input is not a tar archive\n");
+    else if(n_read > 0)
+      fprintf(stderr, "ERROR: the archive ends inside a header\n");
+    else
+      fprintf(stderr, "ERROR: the archive ends without its end-of-archive record\n");
+    vdisk_disk_close();
+    return -1;
+  }
+
+  if(oufs_image_write(&image) != 0){
+    fprintf(stderr, "ERROR: unable to write disk\n");
+    vdisk_disk_close();
+    return -1;
+  }
+  vdisk_disk_close();
+  return skipped ? 1 : 0;
+}
+
+/**
+ * Create one archive entry, consuming its data
+ *
+ * @param top Directory the archive is extracted into
+ * @param header Header of the entry
+ * @param size Number of data bytes that follow the header
+ * @return 0 on success; -1 if the entry was skipped; -2 if the disk is full or
+ *         the archive is cut short
+ */
+int import_entry(INODE_REFERENCE top, TAR_HEADER *header, unsigned long size){
+  char path[sizeof(header->prefix) + sizeof(header->name) + 2];
+  if(header->prefix[0] != 0)
+    snprintf(path, sizeof(path), "%.*s/%.*s", (int) sizeof(header->prefix), header->prefix,
+             (int) sizeof(header->name), header->name);
+  else
+    snprintf(path, sizeof(path), "%.*s", (int) sizeof(header->name), header->name);
+
+  char type = header->type == 0 ? TAR_TYPE_FILE : header->type;
+  if(type != TAR_TYPE_FILE && type != TAR_TYPE_DIRECTORY){
+    fprintf(stderr, "WARNING: %s: unsupported entry type '%c', skipped\n", path, type);
+    return skip_data(size) == 0 ? -1 : -2;
+  }
+
+  //Walk down the path, creating missing directories
+  INODE_REFERENCE d = top;
+  char *save;
+  char *token = strtok_r(path, "/", &save);
+  while(token != NULL){
+    char *next = strtok_r(NULL, "/", &save);
+    if(!strcmp(token, ".")){
+      token = next;
+      continue;
+    }
+    if(strlen(token) >= FILE_NAME_SIZE || !strcmp(token, "..")){
+      fprintf(stderr, "ERROR: %s: bad name, skipped\n", token);
+      return skip_data(size) == 0 ? -1 : -2;
+    }
+
+    INODE_REFERENCE c = oufs_image_lookup(&image, d, token);
+    int last = (next == NULL);
+    if(last && type == TAR_TYPE_FILE){
+      if(c != UNALLOCATED_INODE){
+        fprintf(stderr, "ERROR: %s already exists, skipped\n", token);
+        return skip_data(size) == 0 ? -1 : -2;
+      }
+      if(size > BLOCKS_PER_INODE * BLOCK_SIZE){
+        fprintf(stderr, "ERROR: %s is too large, skipped\n", token);
+        return skip_data(size) == 0 ? -1 : -2;
+      }
+
+      //The data is read straight into the new file's blocks
+      int n_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+      BLOCK_REFERENCE first = UNALLOCATED_BLOCK;
+      INODE_REFERENCE f = oufs_image_allocate_inode(&image, d, IT_FILE);
+      if(f == UNALLOCATED_INODE
+         || (n_blocks > 0 && (first = oufs_image_allocate_blocks(&image, f, n_blocks)) == UNALLOCATED_BLOCK)
+         || oufs_image_add_entry(&image, d, token, f) != 0){
+        fprintf(stderr, "ERROR: disk full at %s\n", token);
+        return -2;
+      }
+      INODE *inode = oufs_image_inode(&image, f);
+      for(int k = 0; k < n_blocks; ++k)
+        inode->data[k] = first + k;
+      inode->size = size;
+      if(size > 0 && fread(&image.block[first], 1, size, stdin) != size){
+        fprintf(stderr, "ERROR: archive ends inside %s\n", token);
+        return -2;
+      }
+      //Rest of the last record
+      char pad[TAR_BLOCK_SIZE];
+      size_t n_pad = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+      if(fread(pad, 1, n_pad, stdin) != n_pad){
+        fprintf(stderr, "ERROR: archive ends inside %s\n", token);
+        return -2;
+      }
+      return 0;
+    }
+
+    if(c == UNALLOCATED_INODE){
+      c = oufs_image_mkdir(&image, d, token);
+      if(c == UNALLOCATED_INODE){
+        fprintf(stderr, "ERROR: disk full at %s\n", token);
+        return -2;
+      }
+    }
+    else if(oufs_image_inode(&image, c)->type != IT_DIRECTORY){
+      fprintf(stderr, "ERROR: %s is not a directory, skipped\n", token);
+      return skip_data(size) == 0 ? -1 : -2;
+    }
+    d = c;
+    token = next;
+  }
+  return skip_data(size) == 0 ? 0 : -2;
+}
+
+/**
+ * Skip the data of an entry, rounded up to whole records
+ *
+ * @return 0 on success; -1 if the archive ends early
+ */
+int skip_data(unsigned long size){
+  char record[TAR_BLOCK_SIZE];
+  unsigned long n_records = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE;
+  for(unsigned long r = 0; r < n_records; ++r){
+    if(fread(record, 1, TAR_BLOCK_SIZE, stdin) != TAR_BLOCK_SIZE){
+      fprintf(stderr, "ERROR: archive ends early\n");
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -3,6 +3,194 @@
 
 #include "oufs_lib.h"
 
+// Blocks read at a time by -dump
+#define DUMP_READ_BLOCKS 64
+
+#define DUMP_JSON 0
+#define DUMP_CSV 1
+
+/**
+ * Print a name from a directory entry, quoted for JSON or CSV
+ */
+static void dump_name(char *name, int format)
+{
+  int len = strnlen(name, FILE_NAME_SIZE);
+  putchar('"');
+  for(int i = 0; i < len; ++i) {
+    unsigned char c = name[i];
+    if(format == DUMP_CSV) {
+      if(c == '"')
+	putchar('"');
+      putchar(c);
+    }else if(c == '"' || c == '\\') {
+      printf("\\%c", c);
+    }else if(c < ' ' || c > '~') {
+      printf("\\u%04x", c);
+    }else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+/**
+ * Print an allocation table as hex
+ */
+static void dump_bitmap(unsigned char *bits, int n_bytes)
+{
+  for(int i = 0; i < n_bytes; ++i)
+    printf("%02x", bits[i]);
+}
+
+static char *dump_type(char type)
+{
+  return(type == IT_DIRECTORY ? "directory" : type == IT_FILE ? "file" : type == IT_NONE ? "none" : "unknown");
+}
+
+/**
+ * Dump the whole disk as JSON or CSV in one sequential pass: the master
+ * block, every inode that is allocated or in use, every directory block,
+ * then summary counts.  The blocks are read DUMP_READ_BLOCKS at a time;
+ * the master block and inode table come first, so each directory block
+ * is known by the time it is read and is printed straight away.
+ *
+ * @param format DUMP_JSON or DUMP_CSV
+ * @return 0 on success; -1 on error
+ */
+static int dump(int format)
+{
+  // Consistent with itself: no other process writes while it is read
+  if(vdisk_lock_disk() != 0)
+    return(-1);
+  static char out[1 << 16];
+  setvbuf(stdout, out, _IOFBF, sizeof(out));
+
+  static BLOCK blocks[DUMP_READ_BLOCKS];
+  MASTER_BLOCK master;
+  static INODE inodes[N_INODES];
+  INODE_REFERENCE owner[N_BLOCKS_IN_DISK];
+  unsigned long inodes_allocated = 0, inodes_in_use = 0, directories = 0, files = 0, file_bytes = 0;
+  unsigned long blocks_allocated = 0, blocks_referenced = 0, directory_entries = 0, mismatches = 0;
+  int first_inode = 1, first_directory = 1;
+
+  for(int first = 0; first < N_BLOCKS_IN_DISK; first += DUMP_READ_BLOCKS) {
+    int count = N_BLOCKS_IN_DISK - first < DUMP_READ_BLOCKS ? N_BLOCKS_IN_DISK - first : DUMP_READ_BLOCKS;
+    if(vdisk_read_blocks(first, count, blocks) != 0) {
+      fprintf(stderr, "Error reading blocks %d-%d\n", first, first + count - 1);
+      return(-1);
+    }
+
+    if(first == 0) {
+      _Static_assert(N_INODE_BLOCKS < DUMP_READ_BLOCKS, "the inode table must come in the first read");
+      master = blocks[MASTER_BLOCK_REFERENCE].master;
+      if(format == DUMP_JSON) {
+	printf("{\n\"disk\": {\"blocks\": %d, \"block_size\": %d, \"inodes\": %d},\n",
+	       N_BLOCKS_IN_DISK, BLOCK_SIZE, (int) N_INODES);
+	printf("\"master\": {\"inode_allocated\": \"");
+	dump_bitmap(master.inode_allocated_flag, sizeof(master.inode_allocated_flag));
+	printf("\", \"block_allocated\": \"");
+	dump_bitmap(master.block_allocated_flag, sizeof(master.block_allocated_flag));
+	printf("\", \"n_blocks\": %d, \"n_inodes\": %d},\n\"inodes\": [", oufs_disk_blocks(&master), oufs_disk_inodes(&master));
+      }else {
+	printf("record,number,type,n_references,size,blocks,entry,name,inode,value\n");
+	printf("inode_bitmap,,,,,,,,,");
+	dump_bitmap(master.inode_allocated_flag, sizeof(master.inode_allocated_flag));
+	printf("\nblock_bitmap,,,,,,,,,");
+	dump_bitmap(master.block_allocated_flag, sizeof(master.block_allocated_flag));
+	printf("\nn_blocks,,,,,,,,,%d\n", oufs_disk_blocks(&master));
+	printf("n_inodes,,,,,,,,,%d\n", oufs_disk_inodes(&master));
+      }
+
+      for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+	owner[b] = UNALLOCATED_INODE;
+	blocks_allocated += (master.block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+      }
+      for(int i = 0; i < N_INODES; ++i) {
+	INODE *inode = &blocks[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK];
+	inodes[i] = *inode;
+	int allocated = (master.inode_allocated_flag[i >> 3] >> (i & 7)) & 1;
+	int in_use = inode->type == IT_DIRECTORY || inode->type == IT_FILE;
+	inodes_allocated += allocated;
+	inodes_in_use += in_use;
+	mismatches += allocated != in_use;
+	if(!allocated && !in_use)
+	  continue;
+	directories += inode->type == IT_DIRECTORY;
+	files += inode->type == IT_FILE;
+	if(inode->type == IT_FILE)
+	  file_bytes += inode->size;
+
+	if(format == DUMP_JSON)
+	  printf("%s\n {\"inode\": %d, \"allocated\": %s, \"type\": \"%s\", \"n_references\": %d, \"size\": %u, \"blocks\": [",
+		 first_inode ? "" : ",", i, allocated ? "true" : "false", dump_type(inode->type), inode->n_references, inode->size);
+	else
+	  printf("inode,%d,%s,%d,%u,", i, dump_type(inode->type), inode->n_references, inode->size);
+	first_inode = 0;
+	int n = 0;
+	for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+	  BLOCK_REFERENCE b = inode->data[k];
+	  if(b == UNALLOCATED_BLOCK)
+	    continue;
+	  printf("%s%d", n++ == 0 ? "" : format == DUMP_JSON ? ", " : " ", b);
+	  if(in_use && b < N_BLOCKS_IN_DISK) {
+	    owner[b] = i;
+	    ++blocks_referenced;
+	  }
+	}
+	printf(format == DUMP_JSON ? "]}" : ",,,,%s\n", allocated ? "allocated" : "free");
+      }
+      if(format == DUMP_JSON)
+	printf("\n],\n\"directories\": [");
+    }
+
+    // Directory blocks of this read
+    for(int b = first; b < first + count; ++b) {
+      if(owner[b] == UNALLOCATED_INODE || inodes[owner[b]].type != IT_DIRECTORY)
+	continue;
+      DIRECTORY_BLOCK *directory = &blocks[b - first].directory;
+      if(format == DUMP_JSON)
+	printf("%s\n {\"block\": %d, \"inode\": %d, \"entries\": [", first_directory ? "" : ",", b, owner[b]);
+      first_directory = 0;
+      int n = 0;
+      for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+	if(directory->entry[e].inode_reference == UNALLOCATED_INODE)
+	  continue;
+	++directory_entries;
+	if(format == DUMP_JSON) {
+	  printf("%s\n  {\"entry\": %d, \"name\": ", n++ == 0 ? "" : ",", e);
+	  dump_name(directory->entry[e].name, format);
+	  printf(", \"inode\": %d}", directory->entry[e].inode_reference);
+	}else {
+	  printf("entry,%d,,,,,%d,", b, e);
+	  dump_name(directory->entry[e].name, format);
+	  printf(",%d,\n", directory->entry[e].inode_reference);
+	}
+      }
+      if(format == DUMP_JSON)
+	printf("]}");
+    }
+  }
+
+  // Summary
+  char *names[] = { "inodes_allocated", "inodes_in_use", "directories", "files", "file_bytes", "directory_entries",
+		    "blocks_allocated", "blocks_free", "blocks_referenced", "inode_bitmap_mismatches" };
+  unsigned long values[] = { inodes_allocated, inodes_in_use, directories, files, file_bytes, directory_entries,
+			     blocks_allocated, N_BLOCKS_IN_DISK - blocks_allocated, blocks_referenced, mismatches };
+  int n_values = sizeof(values) / sizeof(values[0]);
+  if(format == DUMP_JSON)
+    printf("\n],\n\"summary\": {");
+  for(int k = 0; k < n_values; ++k) {
+    if(format == DUMP_JSON)
+      printf("%s\"%s\": %lu", k == 0 ? "" : ", ", names[k], values[k]);
+    else
+      printf("summary,,,,,,,%s,,%lu\n", names[k], values[k]);
+  }
+  if(format == DUMP_JSON)
+    printf("}\n}\n");
+  fflush(stdout);
+  return(0);
+}
+
 int main(int argc, char** argv) {
   // Get the key environment variables
   char cwd[MAX_PATH_LENGTH];
@@ -13,6 +201,8 @@ int main(int argc, char** argv) {
     return(-1);
   }
 
+  // Exit status: 1 if -verify found errors
+  int status = 0;
   if(argc == 2){
     if(strncmp(argv[1], "-master", 8) == 0) {
       // Master record
@@ -31,6 +221,28 @@ int main(int argc, char** argv) {
 	}
       }
       
+    }else if(strncmp(argv[1], "-verify", 8) == 0) {
+      // Read every block so that block store checksums are checked
+      int errors = 0;
+      for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+	BLOCK block;
+	if(vdisk_read_block(i, &block) != 0)
+	  ++errors;
+      }
+      printf("%d blocks checked, %d errors\n", N_BLOCKS_IN_DISK, errors);
+      if(errors > 0)
+	status = 1;
+
+    }else if(strncmp(argv[1], "-dump", 6) == 0) {
+      // Everything, as JSON
+      dump(DUMP_JSON);
+
+    }else if(strncmp(argv[1], "-stats", 7) == 0) {
+      // I/O of every process that has used the disk (kept in its lock file)
+      VDISK_STATS stats;
+      vdisk_stats_get(&stats, 1);
+      vdisk_stats_print(stdout, &stats);
+
     }else{
       fprintf(stderr, "Unknown argument (%s)\n", argv[1]);
     }
@@ -97,6 +309,20 @@ int main(int argc, char** argv) {
 	  }
 	}
       }
+    }else if(strncmp(argv[1], "-dump", 6) == 0) {
+      if(strncmp(argv[2], "json", 5) == 0) {
+	dump(DUMP_JSON);
+      }else if(strncmp(argv[2], "csv", 4) == 0) {
+	dump(DUMP_CSV);
+      }else{
+	fprintf(stderr, "Unknown argument (-dump %s)\n", argv[2]);
+      }
+    }else if(strncmp(argv[1], "-stats", 7) == 0) {
+      if(strncmp(argv[2], "reset", 6) == 0) {
+	vdisk_stats_reset(1);
+      }else{
+	fprintf(stderr, "Unknown argument (-stats %s)\n", argv[2]);
+      }
     }else if(strncmp(argv[1], "-raw", 4) == 0) {
       // Inspect raw block
       int index;
@@ -120,5 +346,6 @@ int main(int argc, char** argv) {
   }
   
   vdisk_disk_close();
+  return(status);
 }
 
@@ -0,0 +1,335 @@
+/**
+Build a disk from a directory tree on the host.
+
+Usage: zmkimage [-snapshots] [-dedup] [-compress] [-checksum] <host directory>
+
+The disk named by ZDISK is replaced.  The whole layout (inode numbers,
+directory blocks and file blocks) is planned in memory first, then the
+image is written in one sequential pass to "<disk>.mkimage" (one per file
+of a striped disk) and renamed over the disk only once it is complete, so
+a failure leaves the old disk as it was.  Processes that still have the
+old disk open are told to open it again (see vdisk_catch_up()).
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "oufs_lib.h"
+
+// Largest file that fits in one inode
+#define MAX_FILE_SIZE (BLOCKS_PER_INODE * BLOCK_SIZE)
+
+// Host file or directory that becomes one inode
+typedef struct node_s
+{
+  char name[FILE_NAME_SIZE];
+  char type;
+  char host_path[MAX_PATH_LENGTH];
+  // Bytes for a file; entries (with . and ..) for a directory
+  unsigned int size;
+  INODE_REFERENCE parent;
+  // Children are consecutive nodes, in name order
+  int first_child;
+  int n_children;
+  BLOCK_REFERENCE first_block;
+  int n_blocks;
+} NODE;
+
+// Nodes in breadth-first order: the index of a node is its inode number
+static NODE nodes[N_INODES];
+static int n_nodes = 0;
+
+static BLOCK image[N_BLOCKS_IN_DISK];
+
+// Files of the disk, and the temporary files the image is built in
+static char parts[VDISK_MAX_STRIPES][MAX_PATH_LENGTH];
+static char temp_parts[VDISK_MAX_STRIPES][MAX_PATH_LENGTH + 8];
+static int n_parts = 0;
+
+// Functions used later on
+int scan_directory(int d);
+int plan_blocks();
+int fill_image();
+int temp_disk_name(char *disk_name, char *temp_name, int size);
+void remove_temp_disk();
+
+static int compare_nodes(const void *p, const void *q)
+{
+  return strncmp(((const NODE *) p)->name, ((const NODE *) q)->name, FILE_NAME_SIZE);
+}
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  int features = 0;
+  char *host_root = NULL;
+  for(int i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-snapshots")){
+      features |= VDISK_FEATURE_SNAPSHOTS;
+    }
+    else if(!strcmp(argv[i], "-dedup")){
+      features |= VDISK_FEATURE_DEDUP;
+    }
+    else if(!strcmp(argv[i], "-compress")){
+      features |= VDISK_FEATURE_COMPRESS;
+    }
+    else if(!strcmp(argv[i], "-checksum")){
+      features |= VDISK_FEATURE_CHECKSUM;
+    }
+    else if(host_root == NULL && argv[i][0] != '-'){
+      host_root = argv[i];
+    }
+    else{
+      host_root = NULL;
+      break;
+    }
+  }
+  if(host_root == NULL){
+    fprintf(stderr, "Usage: zmkimage [-snapshots] [-dedup] [-compress] [-checksum] <host directory>\n");
+    return -1;
+  }
+
+  //The root is inode 0; directories are scanned in breadth-first order so
+  //each directory's children get consecutive inodes
+  memset(&nodes[0], 0, sizeof(NODE));
+  nodes[0].type = IT_DIRECTORY;
+  nodes[0].parent = 0;
+  strncpy(nodes[0].host_path, host_root, MAX_PATH_LENGTH - 1);
+  n_nodes = 1;
+  for(int d = 0; d < n_nodes; ++d){
+    if(nodes[d].type == IT_DIRECTORY && scan_directory(d) != 0)
+      return -1;
+  }
+
+  if(plan_blocks() != 0 || fill_image() != 0)
+    return -1;
+
+  //One pass over the whole disk, into the temporary files
+  char temp_name[VDISK_NAME_LENGTH];
+  if(temp_disk_name(disk_name, temp_name, sizeof(temp_name)) != 0){
+    fprintf(stderr, "ERROR: disk name too long: %s\n", disk_name);
+    return -1;
+  }
+  if(vdisk_disk_create(temp_name, features) != 0){
+    fprintf(stderr, "ERROR: cannot create %s\n", temp_name);
+    remove_temp_disk();
+    return -1;
+  }
+  if(vdisk_write_blocks(0, N_BLOCKS_IN_DISK, image) != 0){
+    fprintf(stderr, "ERROR: cannot write %s\n", temp_name);
+    vdisk_disk_close();
+    remove_temp_disk();
+    return -1;
+  }
+  vdisk_disk_close();
+
+  //A journal of the old contents must not be replayed onto the new ones
+  char journal_name[MAX_PATH_LENGTH + 8];
+  snprintf(journal_name, sizeof(journal_name), "%s.journal", parts[0]);
+  unlink(journal_name);
+  for(int k = 0; k < n_parts; ++k){
+    if(rename(temp_parts[k], parts[k]) != 0){
+      fprintf(stderr, "ERROR: cannot replace %s\n", parts[k]);
+      remove_temp_disk();
+      return -1;
+    }
+  }
+  remove_temp_disk();
+
+  printf("%d inodes, %d blocks used\n", n_nodes, nodes[n_nodes - 1].first_block + nodes[n_nodes - 1].n_blocks);
+  return 0;
+}
+
+/**
+ * Add the children of directory node d to the end of the node list
+ *
+ * @return 0 on success; -1 if the tree does not fit
+ */
+int scan_directory(int d){
+  DIR *dir = opendir(nodes[d].host_path);
+  if(dir == NULL){
+    fprintf(stderr, "ERROR: cannot open %s\n", nodes[d].host_path);
+    return -1;
+  }
+
+  nodes[d].first_child = n_nodes;
+  struct dirent *de;
+  while((de = readdir(dir)) != NULL){
+    if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+
+    char path[MAX_PATH_LENGTH];
+    if(snprintf(path, sizeof(path), "%s/%s", nodes[d].host_path, de->d_name) >= (int) sizeof(path)){
+      fprintf(stderr, "ERROR: path too long: %s/%s\n", nodes[d].host_path, de->d_name);
+      closedir(dir);
+      return -1;
+    }
+    struct stat st;
+    if(lstat(path, &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))){
+      fprintf(stderr, "WARNING: skipping %s\n", path);
+      continue;
+    }
+    if(strlen(de->d_name) >= FILE_NAME_SIZE){
+      fprintf(stderr, "ERROR: name too long: %s\n", path);
+      closedir(dir);
+      return -1;
+    }
+    if(S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE){
+      fprintf(stderr, "ERROR: file too large: %s\n", path);
+      closedir(dir);
+      return -1;
+    }
+    if(n_nodes >= (int) N_INODES){
+      fprintf(stderr, "ERROR: more than %d files and directories\n", (int) N_INODES);
+      closedir(dir);
+      return -1;
+    }
+
+    NODE *node = &nodes[n_nodes++];
+    memset(node, 0, sizeof(NODE));
+    //The name and its terminator fit: checked above
+    memcpy(node->name, de->d_name, strlen(de->d_name) + 1);
+    strcpy(node->host_path, path);
+    node->type = S_ISDIR(st.st_mode) ? IT_DIRECTORY : IT_FILE;
+    node->size = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+    node->parent = d;
+    ++nodes[d].n_children;
+  }
+  closedir(dir);
+
+  //Sorting keeps the image the same however the host lists the directory.
+  //Children are only scanned after this, so nothing refers to them yet.
+  qsort(&nodes[nodes[d].first_child], nodes[d].n_children, sizeof(NODE), compare_nodes);
+
+  //Each directory block also holds . and .. in its first block
+  nodes[d].size = nodes[d].n_children + 2;
+  if(nodes[d].size > BLOCKS_PER_INODE * DIRECTORY_ENTRIES_PER_BLOCK){
+    fprintf(stderr, "ERROR: too many entries in %s\n", nodes[d].host_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Give every node a contiguous run of blocks, in inode order, starting at
+ * the root directory block
+ *
+ * @return 0 on success; -1 if the disk is too small
+ */
+int plan_blocks(){
+  BLOCK_REFERENCE next = ROOT_DIRECTORY_BLOCK;
+  for(int i = 0; i < n_nodes; ++i){
+    NODE *node = &nodes[i];
+    if(node->type == IT_DIRECTORY)
+      node->n_blocks = (node->size + DIRECTORY_ENTRIES_PER_BLOCK - 1) / DIRECTORY_ENTRIES_PER_BLOCK;
+    else
+      node->n_blocks = (node->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    node->first_block = next;
+    next += node->n_blocks;
+    if(next > N_BLOCKS_IN_DISK){
+      fprintf(stderr, "ERROR: the tree needs more than %d blocks\n", N_BLOCKS_IN_DISK);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Build every block of the disk in memory
+ *
+ * @return 0 on success; -1 if a host file cannot be read
+ */
+int fill_image(){
+  memset(image, 0, sizeof(image));
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  for(int b = 0; b < ROOT_DIRECTORY_BLOCK; ++b)
+    master->block_allocated_flag[b >> 3] |= (1 << (b & 7));
+  oufs_set_geometry(master);
+
+  for(int i = 0; i < n_nodes; ++i){
+    NODE *node = &nodes[i];
+    INODE *inode = &image[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK];
+    inode->type = node->type;
+    inode->n_references = 1;
+    inode->size = node->size;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+      inode->data[k] = k < node->n_blocks ? node->first_block + k : UNALLOCATED_BLOCK;
+
+    master->inode_allocated_flag[i >> 3] |= (1 << (i & 7));
+    for(int k = 0; k < node->n_blocks; ++k){
+      BLOCK_REFERENCE b = node->first_block + k;
+      master->block_allocated_flag[b >> 3] |= (1 << (b & 7));
+    }
+
+    if(node->type == IT_DIRECTORY){
+      //. and .. first, then the children in name order
+      oufs_clean_directory_block(i, node->parent, &image[node->first_block]);
+      for(int k = 1; k < node->n_blocks; ++k)
+        for(int j = 0; j < (int) DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+          oufs_clean_directory_entry(&image[node->first_block + k].directory.entry[j]);
+      for(int c = 0; c < node->n_children; ++c){
+        int slot = c + 2;
+        DIRECTORY_ENTRY *entry = &image[node->first_block + slot / DIRECTORY_ENTRIES_PER_BLOCK].directory.entry[slot % DIRECTORY_ENTRIES_PER_BLOCK];
+        memcpy(entry->name, nodes[node->first_child + c].name, FILE_NAME_SIZE);
+        entry->inode_reference = node->first_child + c;
+      }
+    }
+    else if(node->size > 0){
+      FILE *fp = fopen(node->host_path, "rb");
+      if(fp == NULL || fread(&image[node->first_block], 1, node->size, fp) != node->size){
+        fprintf(stderr, "ERROR: cannot read %s\n", node->host_path);
+        if(fp != NULL)
+          fclose(fp);
+        return -1;
+      }
+      fclose(fp);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Name of the temporary disk: each file of the disk (see vdisk_stripe.c)
+ * with ".mkimage" appended, and the same stripe width
+ *
+ * @return 0 on success; -1 if a name is too long or there are too many files
+ */
+int temp_disk_name(char *disk_name, char *temp_name, int size){
+  char *width = strchr(disk_name, ':');
+  int end = width ? (int) (width - disk_name) : (int) strlen(disk_name);
+  int used = 0;
+  temp_name[0] = 0;
+  for(int start = 0; start <= end; ++n_parts){
+    int len = strcspn(disk_name + start, ",:");
+    if(n_parts == VDISK_MAX_STRIPES || len >= MAX_PATH_LENGTH)
+      return -1;
+    snprintf(parts[n_parts], MAX_PATH_LENGTH, "%.*s", len, disk_name + start);
+    snprintf(temp_parts[n_parts], sizeof(temp_parts[n_parts]), "%s.mkimage", parts[n_parts]);
+    used += snprintf(temp_name + used, size - used, "%s%s", n_parts ? "," : "", temp_parts[n_parts]);
+    if(used >= size)
+      return -1;
+    start += len + 1;
+  }
+  if(width && (used += snprintf(temp_name + used, size - used, "%s", width)) >= size)
+    return -1;
+  return 0;
+}
+
+/**
+ * Remove whatever is left of the temporary disk, with its lock file (named
+ * after the first file, as vdisk_disk_open() does)
+ */
+void remove_temp_disk(){
+  char lock_name[sizeof(temp_parts[0]) + 8];
+  for(int k = 0; k < n_parts; ++k)
+    unlink(temp_parts[k]);
+  snprintf(lock_name, sizeof(lock_name), "%s.lock", temp_parts[0]);
+  unlink(lock_name);
+}
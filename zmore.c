@@ -0,0 +1,42 @@
+/**
+Print a file of the OU File System to stdout.
+
+Usage: zmore <file>
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc != 2){
+    fprintf(stderr, "Usage: zmore <file>\n");
+    return -1;
+  }
+
+  if(oufs_mount(disk_name) != 0)
+    return -1;
+  OUFILE *fp = oufs_fopen(cwd, argv[1], "r");
+  if(fp == NULL){
+    oufs_unmount();
+    return -1;
+  }
+
+  unsigned char buf[BLOCK_SIZE];
+  int n;
+  while((n = oufs_fread(fp, buf, sizeof(buf))) > 0)
+    fwrite(buf, 1, n, stdout);
+  if(n < 0)
+    fprintf(stderr, "ERROR: cannot read %s\n", argv[1]);
+
+  oufs_fclose(fp);
+  oufs_unmount();
+  return n < 0 ? -1 : 0;
+}
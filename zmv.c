@@ -0,0 +1,36 @@
+/**
+Move or rename a file or directory in the OU File System.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 3) {
+    // Open the virtual disk
+    if(oufs_mount(disk_name) != 0)
+      return(-1);
+
+    // Move the entry
+    oufs_rename(cwd, argv[1], argv[2]);
+
+    // Clean up
+    oufs_unmount();
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zmv <src> <dst>\n");
+  }
+
+}
@@ -0,0 +1,157 @@
+/**
+Grow or shrink a disk in place.
+
+Usage: zresize [n_blocks]
+
+Without an argument the current size is printed.  The size can range from
+the blocks in use up to N_BLOCKS_IN_DISK, the largest disk of this build
+(zformat -size makes a smaller one).  The inode table grows and shrinks
+with the disk: it keeps the full table's share of the blocks, and at least
+every inode in use.  Blocks and inodes past the end of the disk are marked
+allocated in the master block, so nothing allocates them.
+
+Shrinking moves the blocks past the new end into free blocks below it
+(only those blocks, the inodes that refer to them and the master block are
+rewritten), commits that in one transaction, then truncates the disk.
+Growing extends the disk first, then releases the new blocks.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "oufs_image.h"
+
+static OUFS_IMAGE image;
+
+// Functions used later on
+int shrink(int old_size, int new_size);
+int grow(int new_size);
+
+int main(int argc, char** argv){
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc > 2){
+    fprintf(stderr, "Usage: zresize [n_blocks]\n");
+    return -1;
+  }
+
+  if(vdisk_disk_open(disk_name) != 0)
+    return -1;
+  if(oufs_image_load(&image) != 0){
+    fprintf(stderr, "ERROR: unable to read disk\n");
+    vdisk_disk_close();
+    return -1;
+  }
+  int old_size = oufs_disk_blocks(&image.block[MASTER_BLOCK_REFERENCE].master);
+
+  if(argc == 1){
+    printf("%d blocks, %d inodes (largest %d, %d)\n", old_size,
+           oufs_disk_inodes(&image.block[MASTER_BLOCK_REFERENCE].master), N_BLOCKS_IN_DISK, (int) N_INODES);
+    vdisk_disk_close();
+    return 0;
+  }
+
+  int new_size = atoi(argv[1]);
+  if(new_size <= ROOT_DIRECTORY_BLOCK || new_size > N_BLOCKS_IN_DISK){
+    fprintf(stderr, "ERROR: size must be between %d and %d blocks\n", ROOT_DIRECTORY_BLOCK + 1, N_BLOCKS_IN_DISK);
+    vdisk_disk_close();
+    return -1;
+  }
+
+  int ret = 0;
+  if(new_size < old_size)
+    ret = shrink(old_size, new_size);
+  else if(new_size > old_size)
+    ret = grow(new_size);
+  vdisk_disk_close();
+
+  if(ret == 0)
+    printf("%d blocks, %d inodes\n", new_size, oufs_disk_inodes(&image.block[MASTER_BLOCK_REFERENCE].master));
+  return ret;
+}
+
+/**
+ * Move the blocks in use past new_size below it, then cut the disk
+ *
+ * @return 0 on success; -1 on error
+ */
+int shrink(int old_size, int new_size){
+  MASTER_BLOCK *master = &image.block[MASTER_BLOCK_REFERENCE].master;
+
+  int n_moving = 0;
+  for(int b = new_size; b < old_size; ++b)
+    n_moving += (master->block_allocated_flag[b >> 3] >> (b & 7)) & 1;
+
+  //Inodes are not renumbered: the table keeps every inode in use
+  int n_inodes = oufs_inodes_for_blocks(new_size);
+  for(int i = n_inodes; i < (int) N_INODES; ++i){
+    INODE *inode = oufs_image_inode(&image, i);
+    if(inode->type == IT_DIRECTORY || inode->type == IT_FILE)
+      n_inodes = i + 1;
+  }
+  n_inodes = MIN(n_inodes, oufs_disk_inodes(master));
+
+  //Blocks past the new end are reserved from here on, so the allocator
+  //only hands out blocks below it
+  oufs_set_disk_size(master, new_size, n_inodes);
+  int n_free = 0;
+  for(int b = ROOT_DIRECTORY_BLOCK; b < new_size; ++b)
+    n_free += !((master->block_allocated_flag[b >> 3] >> (b & 7)) & 1);
+  if(n_moving > n_free){
+    fprintf(stderr, "ERROR: %d blocks past block %d do not fit in the %d free blocks below it\n", n_moving, new_size, n_free);
+    return -1;
+  }
+
+  for(int i = 0; i < (int) N_INODES; ++i){
+    INODE *inode = oufs_image_inode(&image, i);
+    if(inode->type != IT_DIRECTORY && inode->type != IT_FILE)
+      continue;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k){
+      BLOCK_REFERENCE b = inode->data[k];
+      if(b == UNALLOCATED_BLOCK || b < new_size || b >= old_size)
+        continue;
+      BLOCK_REFERENCE to = oufs_image_allocate_blocks(&image, i, 1);
+      if(to == UNALLOCATED_BLOCK){
+        fprintf(stderr, "ERROR: no room for block %d\n", b);
+        return -1;
+      }
+      image.block[to] = image.block[b];
+      inode->data[k] = to;
+      oufs_image_inode_changed(&image, i);
+    }
+  }
+
+  image.dirty[MASTER_BLOCK_REFERENCE] = 1;
+  if(oufs_image_write(&image) != 0){
+    fprintf(stderr, "ERROR: unable to write disk\n");
+    return -1;
+  }
+  //Nothing refers to the cut blocks any more
+  return vdisk_resize(new_size) == 0 ? 0 : -1;
+}
+
+/**
+ * Extend the disk, then release the new blocks and inodes
+ *
+ * @return 0 on success; -1 on error
+ */
+int grow(int new_size){
+  if(vdisk_resize(new_size) != 0)
+    return -1;
+
+  MASTER_BLOCK *master = &image.block[MASTER_BLOCK_REFERENCE].master;
+  int n_inodes = oufs_inodes_for_blocks(new_size);
+  if(n_inodes < oufs_disk_inodes(master))
+    n_inodes = oufs_disk_inodes(master);
+  oufs_set_disk_size(master, new_size, n_inodes);
+  image.dirty[MASTER_BLOCK_REFERENCE] = 1;
+  if(oufs_image_write(&image) != 0){
+    fprintf(stderr, "ERROR: unable to write disk\n");
+    return -1;
+  }
+  return 0;
+}
@@ -12,13 +12,14 @@ int main(int argc, char** argv) {
   // Check arguments
   if(argc == 2) {
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    if(oufs_mount(disk_name) != 0)
+      return(-1);
 
     // Make the specified directory
     oufs_rmdir(cwd, argv[1]);
 
     // Clean up
-    vdisk_disk_close();
+    oufs_unmount();
 
   }else{
     // Wrong number of parameters
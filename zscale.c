@@ -0,0 +1,148 @@
+/**
+Measure how the library scales with threads.
+
+Usage: zscale [max_threads] [rounds]
+
+Each thread works in a directory of its own, /scale<n>: every round it
+rewrites a small file there (open "w", write, close) and reads it back
+three times.  Threads in different directories share no inode locks, and
+their commits are grouped into shared transactions (vdisk.c), so
+throughput should grow close to linearly with the number of threads.
+
+The run is repeated with 1, 2, 4, ... max_threads threads (default 8,
+at most 16), printing operations per second and the speedup over one
+thread.  The directories and files are left on the disk.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+#define MAX_THREADS 16
+#define READS_PER_ROUND 3
+
+static char cwd[MAX_PATH_LENGTH];
+static int rounds = 200;
+
+// Functions used later on
+void *worker(void *arg);
+double run(int n_threads);
+
+int main(int argc, char** argv){
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc > 3){
+    fprintf(stderr, "Usage: zscale [max_threads] [rounds]\n");
+    return -1;
+  }
+  int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(max_threads < 1 || max_threads > MAX_THREADS || rounds < 1){
+    fprintf(stderr, "ERROR: 1 to %d threads, at least 1 round\n", MAX_THREADS);
+    return -1;
+  }
+
+  if(oufs_mount(disk_name) != 0)
+    return -1;
+
+  //Each thread's directory
+  for(int t = 0; t < max_threads; ++t){
+    char path[MAX_PATH_LENGTH];
+    INODE_REFERENCE parent, child;
+    char name[FILE_NAME_SIZE + 1];
+    snprintf(path, sizeof(path), "/scale%d", t);
+    if(oufs_find_file(cwd, path, &parent, &child, name) == 0 && child == UNALLOCATED_INODE
+       && oufs_mkdir(cwd, path) != 0){
+      oufs_unmount();
+      return -1;
+    }
+  }
+
+  printf("threads  ops/s  speedup\n");
+  double base = 0;
+  for(int n = 1; n <= max_threads; n *= 2){
+    double rate = run(n);
+    if(rate < 0){
+      oufs_unmount();
+      return -1;
+    }
+    if(n == 1)
+      base = rate;
+    printf("%7d  %5.0f  %7.2f\n", n, rate, rate / base);
+    //Also measure max_threads when it is not a power of two
+    if(n < max_threads && n * 2 > max_threads)
+      n = max_threads / 2;
+  }
+
+  oufs_unmount();
+  return 0;
+}
+
+/**
+ * Run the workload with n_threads threads
+ *
+ * @return Operations (file writes and reads) per second; -1 on error
+ */
+double run(int n_threads){
+  pthread_t threads[MAX_THREADS];
+  long failed = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(long t = 0; t < n_threads; ++t)
+    pthread_create(&threads[t], NULL, worker, (void *) t);
+  for(int t = 0; t < n_threads; ++t){
+    void *ret;
+    pthread_join(threads[t], &ret);
+    failed |= (long) ret;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if(failed)
+    return -1;
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return (double) n_threads * rounds * (1 + READS_PER_ROUND) / seconds;
+}
+
+/**
+ * Rewrite and read back one file in the thread's own directory
+ *
+ * @param arg Thread number
+ * @return NULL on success; non-NULL if an operation failed
+ */
+void *worker(void *arg){
+  long t = (long) arg;
+  char path[MAX_PATH_LENGTH];
+  snprintf(path, sizeof(path), "/scale%ld/data", t);
+
+  unsigned char data[BLOCK_SIZE - 16];
+  unsigned char check[sizeof(data)];
+  for(int r = 0; r < rounds; ++r){
+    memset(data, 'a' + (t + r) % 26, sizeof(data));
+    OUFILE *fp = oufs_fopen(cwd, path, "w");
+    if(fp == NULL || oufs_fwrite(fp, data, sizeof(data)) != sizeof(data) || oufs_fflush(fp) != 0){
+      oufs_fclose(fp);
+      return (void *) 1;
+    }
+    oufs_fclose(fp);
+
+    for(int k = 0; k < READS_PER_ROUND; ++k){
+      fp = oufs_fopen(cwd, path, "r");
+      if(fp == NULL)
+        return (void *) 1;
+      int n = oufs_fread(fp, check, sizeof(check));
+      oufs_fclose(fp);
+      if(n != sizeof(data) || memcmp(data, check, sizeof(data)) != 0){
+        fprintf(stderr, "ERROR: thread %ld read back wrong data\n", t);
+        return (void *) 1;
+      }
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,53 @@
+/**
+Manage snapshots of an OU File System block store.
+
+A snapshot can be mounted read-only by setting ZDISK to <disk>@<snapshot>.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  if(argc == 2 && !strcmp(argv[1], "-list")) {
+    if(vdisk_disk_open(disk_name) != 0)
+      return(-1);
+
+    // One line per snapshot: name, creation time, blocks only it holds
+    for(int i = 0; i < VDISK_MAX_SNAPSHOTS; ++i) {
+      VDISK_SNAPSHOT_INFO info;
+      if(vdisk_snapshot_info(i, &info) == 1) {
+	time_t created = info.created;
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&created));
+	printf("%s\t%s\t%d\n", info.name, date, info.n_exclusive_blocks);
+      }
+    }
+    vdisk_disk_close();
+
+  }else if(argc == 3 && !strcmp(argv[1], "-create")) {
+    if(vdisk_disk_open(disk_name) != 0 || vdisk_lock_disk() != 0)
+      return(-1);
+    vdisk_snapshot_create(argv[2]);
+    vdisk_disk_close();
+
+  }else if(argc == 3 && !strcmp(argv[1], "-delete")) {
+    if(vdisk_disk_open(disk_name) != 0 || vdisk_lock_disk() != 0)
+      return(-1);
+    vdisk_snapshot_delete(argv[2]);
+    vdisk_disk_close();
+
+  }else{
+    // Wrong parameters
+    fprintf(stderr, "Usage: zsnap -list | -create <name> | -delete <name>\n");
+  }
+
+}
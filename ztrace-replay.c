@@ -0,0 +1,332 @@
+/**
+Analyse and replay a block access trace.
+
+Usage: ztrace-replay [-cache n,n,...] [-disk <disk> [-snapshots] [-dedup] [-compress] [-checksum]] <trace>
+
+A trace is recorded by running any tool with ZTRACE=<trace> (vdisk_trace.c);
+several runs, and several processes, may append to the same trace.  The
+records are put back in time order, then:
+
+ - A summary: blocks read and written by each file system operation.
+ - A simulation of block caches of each size given with -cache (default
+   8,16,32,64,128 blocks): fully associative, least recently used,
+   write-through like vdisk's.  Reads of blocks written by the open
+   transaction are served by the transaction, as in vdisk.
+ - With -disk, a replay: the disk is created afresh with the given
+   features (a stripe set "a,b:width" works too), and every request is
+   made again in order from one thread, with the recorded transactions.
+   The requests per second and the disk's I/O statistics are printed.
+   Written blocks are filled with a pattern; the disk holds no file
+   system afterwards.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+#define MAX_CACHE_SIZES 16
+#define MAX_THREADS 256
+
+static VDISK_TRACE_RECORD *records;
+static int n_records = 0;
+
+static char *op_names[OUFS_N_OPS] = { "other", "mkdir", "rmdir", "list", "lookup", "rename", "fopen", "fread", "fflush" };
+
+// Functions used later on
+int load_trace(char *name);
+void summarize();
+void simulate(int cache_blocks);
+int replay(char *disk_name, int features);
+
+int main(int argc, char** argv){
+  int cache_sizes[MAX_CACHE_SIZES] = { 8, 16, 32, 64, 128 };
+  int n_cache_sizes = 5;
+  char *disk_name = NULL;
+  int features = 0;
+  char *trace_name = NULL;
+
+  for(int i = 1; i < argc; ++i){
+    if(!strcmp(argv[i], "-cache") && i + 1 < argc){
+      n_cache_sizes = 0;
+      char *save;
+      for(char *size = strtok_r(argv[++i], ",", &save); size != NULL && n_cache_sizes < MAX_CACHE_SIZES;
+          size = strtok_r(NULL, ",", &save))
+        cache_sizes[n_cache_sizes++] = atoi(size);
+    }
+    else if(!strcmp(argv[i], "-disk") && i + 1 < argc){
+      disk_name = argv[++i];
+    }
+    else if(!strcmp(argv[i], "-snapshots")){
+      features |= VDISK_FEATURE_SNAPSHOTS;
+    }
+    else if(!strcmp(argv[i], "-dedup")){
+      features |= VDISK_FEATURE_DEDUP;
+    }
+    else if(!strcmp(argv[i], "-compress")){
+      features |= VDISK_FEATURE_COMPRESS;
+    }
+    else if(!strcmp(argv[i], "-checksum")){
+      features |= VDISK_FEATURE_CHECKSUM;
+    }
+    else if(argv[i][0] != '-' && trace_name == NULL){
+      trace_name = argv[i];
+    }
+    else{
+      trace_name = NULL;
+      break;
+    }
+  }
+  if(trace_name == NULL){
+    fprintf(stderr, "Usage: ztrace-replay [-cache n,n,...] [-disk <disk> [-snapshots] [-dedup] [-compress] [-checksum]] <trace>\n");
+    return -1;
+  }
+
+  if(load_trace(trace_name) != 0)
+    return -1;
+  summarize();
+
+  printf("\ncache simulation (LRU, write-through)\n");
+  printf("%8s %10s %10s %10s %9s\n", "blocks", "hits", "in_trans", "misses", "hit_rate");
+  for(int k = 0; k < n_cache_sizes; ++k){
+    if(cache_sizes[k] < 1 || cache_sizes[k] > N_BLOCKS_IN_DISK){
+      fprintf(stderr, "ERROR: cache sizes are 1 to %d blocks\n", N_BLOCKS_IN_DISK);
+      return -1;
+    }
+    simulate(cache_sizes[k]);
+  }
+
+  if(disk_name != NULL && replay(disk_name, features) != 0)
+    return -1;
+  free(records);
+  return 0;
+}
+
+static int compare_records(const void *p, const void *q){
+  const VDISK_TRACE_RECORD *a = p, *b = q;
+  if(a->time_ns != b->time_ns)
+    return a->time_ns < b->time_ns ? -1 : 1;
+  //Same time: keep the order they were recorded in
+  return a < b ? -1 : a > b;
+}
+
+/**
+ * Read a trace, drop its headers and sort it by time
+ *
+ * @return 0 on success; -1 on error
+ */
+int load_trace(char *name){
+  FILE *fp = fopen(name, "rb");
+  if(fp == NULL){
+    fprintf(stderr, "ERROR: cannot open %s\n", name);
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  records = malloc(size > 0 ? size : 1);
+  int n = size / sizeof(VDISK_TRACE_RECORD);
+  if(records == NULL || fread(records, sizeof(VDISK_TRACE_RECORD), n, fp) != (size_t) n){
+    fprintf(stderr, "ERROR: cannot read %s\n", name);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+
+  if(n == 0 || records[0].type != VDISK_TRACE_HEADER || records[0].time_ns != VDISK_TRACE_MAGIC){
+    fprintf(stderr, "ERROR: %s is not a block trace\n", name);
+    return -1;
+  }
+  for(int i = 0; i < n; ++i){
+    if(records[i].type == VDISK_TRACE_HEADER){
+      if(records[i].block_ref != VDISK_TRACE_VERSION){
+        fprintf(stderr, "ERROR: trace version %d is not supported\n", records[i].block_ref);
+        return -1;
+      }
+      continue;
+    }
+    records[n_records++] = records[i];
+  }
+  qsort(records, n_records, sizeof(VDISK_TRACE_RECORD), compare_records);
+  return 0;
+}
+
+/**
+ * Print what the trace holds, by operation
+ */
+void summarize(){
+  unsigned long reads[OUFS_N_OPS], writes[OUFS_N_OPS], file_reads = 0, file_writes = 0, syncs = 0, transactions = 0;
+  memset(reads, 0, sizeof(reads));
+  memset(writes, 0, sizeof(writes));
+  unsigned int threads[MAX_THREADS];
+  int n_threads = 0;
+
+  for(int i = 0; i < n_records; ++i){
+    VDISK_TRACE_RECORD *r = &records[i];
+    int op = r->context < OUFS_N_OPS ? r->context : 0;
+    if(r->type == VDISK_TRACE_READ)
+      ++reads[op];
+    else if(r->type == VDISK_TRACE_WRITE)
+      ++writes[op];
+    else if(r->type == VDISK_TRACE_FILE_READ)
+      ++file_reads;
+    else if(r->type == VDISK_TRACE_FILE_WRITE)
+      ++file_writes;
+    else if(r->type == VDISK_TRACE_SYNC)
+      ++syncs;
+    else if(r->type == VDISK_TRACE_BEGIN)
+      ++transactions;
+
+    int t = 0;
+    while(t < n_threads && threads[t] != r->thread)
+      ++t;
+    if(t == n_threads && n_threads < MAX_THREADS)
+      threads[n_threads++] = r->thread;
+  }
+
+  double span = n_records > 1 ? (records[n_records - 1].time_ns - records[0].time_ns) / 1e9 : 0;
+  printf("%d records from %d threads over %.3f s\n", n_records, n_threads, span);
+  printf("%lu transactions, %lu file reads, %lu file writes, %lu syncs\n", transactions, file_reads, file_writes, syncs);
+  printf("%-8s %10s %10s\n", "op", "reads", "writes");
+  for(int op = 0; op < OUFS_N_OPS; ++op){
+    if(reads[op] || writes[op])
+      printf("%-8s %10lu %10lu\n", op_names[op], reads[op], writes[op]);
+  }
+}
+
+/**
+ * Run the requests through a cache of cache_blocks blocks and print the
+ * hit rate
+ */
+void simulate(int cache_blocks){
+  unsigned long last_used[N_BLOCKS_IN_DISK];
+  unsigned char cached[N_BLOCKS_IN_DISK];
+  unsigned char in_transaction[N_BLOCKS_IN_DISK];
+  memset(cached, 0, sizeof(cached));
+  memset(in_transaction, 0, sizeof(in_transaction));
+  int n_cached = 0;
+  int open_transactions = 0;
+  unsigned long clock = 0, hits = 0, transaction_hits = 0, misses = 0;
+
+  for(int i = 0; i < n_records; ++i){
+    VDISK_TRACE_RECORD *r = &records[i];
+    BLOCK_REFERENCE b = r->block_ref;
+    if(r->type == VDISK_TRACE_BEGIN){
+      ++open_transactions;
+      continue;
+    }
+    if(r->type == VDISK_TRACE_COMMIT || r->type == VDISK_TRACE_ABORT){
+      //Shared transactions are written once the last thread leaves
+      if(open_transactions > 0 && --open_transactions == 0)
+        memset(in_transaction, 0, sizeof(in_transaction));
+      continue;
+    }
+    if((r->type != VDISK_TRACE_READ && r->type != VDISK_TRACE_WRITE) || b >= N_BLOCKS_IN_DISK)
+      continue;
+
+    if(r->type == VDISK_TRACE_WRITE && open_transactions > 0){
+      in_transaction[b] = 1;
+      continue;
+    }
+    if(r->type == VDISK_TRACE_READ){
+      if(in_transaction[b]){
+        ++transaction_hits;
+        continue;
+      }
+      if(cached[b])
+        ++hits;
+      else
+        ++misses;
+    }
+
+    //Reads that missed, and writes, bring the block in
+    if(!cached[b]){
+      if(n_cached == cache_blocks){
+        int victim = -1;
+        for(int k = 0; k < N_BLOCKS_IN_DISK; ++k){
+          if(cached[k] && (victim < 0 || last_used[k] < last_used[victim]))
+            victim = k;
+        }
+        cached[victim] = 0;
+        --n_cached;
+      }
+      cached[b] = 1;
+      ++n_cached;
+    }
+    last_used[b] = ++clock;
+  }
+
+  unsigned long total = hits + transaction_hits + misses;
+  printf("%8d %10lu %10lu %10lu %8.1f%%\n", cache_blocks, hits, transaction_hits, misses,
+         total ? 100.0 * (hits + transaction_hits) / total : 0.0);
+}
+
+/**
+ * Make the requests again on a new disk, and time them
+ *
+ * @return 0 on success; -1 on error
+ */
+int replay(char *disk_name, int features){
+  if(vdisk_disk_create(disk_name, features) != 0)
+    return -1;
+  vdisk_stats_reset(0);
+
+  int open_transactions = 0;
+  int aborted = 0;
+  unsigned long requests = 0;
+  int ret = 0;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(int i = 0; i < n_records && ret == 0; ++i){
+    VDISK_TRACE_RECORD *r = &records[i];
+    BLOCK block;
+    switch(r->type){
+    case VDISK_TRACE_READ:
+      ret = vdisk_read_block(r->block_ref, &block);
+      ++requests;
+      break;
+    case VDISK_TRACE_WRITE:
+      memset(&block, r->block_ref & 0xff, sizeof(block));
+      ret = vdisk_write_block(r->block_ref, &block);
+      ++requests;
+      break;
+    case VDISK_TRACE_BEGIN:
+      //The recorded threads' transactions become one
+      if(open_transactions++ == 0){
+        ret = vdisk_begin_transaction();
+        aborted = 0;
+      }
+      break;
+    case VDISK_TRACE_COMMIT:
+    case VDISK_TRACE_ABORT:
+      aborted |= r->type == VDISK_TRACE_ABORT;
+      if(open_transactions > 0 && --open_transactions == 0){
+        if(aborted)
+          vdisk_abort_transaction();
+        else
+          ret = vdisk_commit_transaction();
+      }
+      break;
+    }
+  }
+  if(open_transactions > 0)
+    vdisk_abort_transaction();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if(ret != 0){
+    fprintf(stderr, "ERROR: replay failed\n");
+    vdisk_disk_close();
+    return -1;
+  }
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("\nreplay on %s: %lu requests in %.3f s, %.0f requests/s\n", disk_name, requests, seconds,
+         seconds > 0 ? requests / seconds : 0.0);
+  VDISK_STATS stats;
+  vdisk_stats_get(&stats, 0);
+  vdisk_stats_print(stdout, &stats);
+  vdisk_disk_close();
+  return 0;
+}